@@ -15,18 +15,15 @@
 #include "app_util_platform.h"
 #include "iot_timer.h"
 #include "ipv6_medium.h"
+#include "ble_gap.h"
+#include "ble_hci.h"
+#include "nrf_soc.h"
 #include "app_pwm.h"
 
 #include "nrf_log.h"
 #include "nrf_log_ctrl.h"
 #include "nrf_log_default_backends.h"
 
-static const uint8_t hexbytes[] =
-        {0x00, 0x01, 0x02, 0x03,
-         0x04, 0x05, 0x06, 0x07,
-         0x08, 0x09, 0x0a, 0x0b,
-         0x0c, 0x0d, 0x0e, 0x0f};
-
 static const char hexdigits[] = "0123456789abcdefABCDEF";
 
 typedef enum
@@ -54,6 +51,23 @@ typedef enum
     LEDS_SUBSCRIBED_TO_TOPIC
 } display_state_t;
 
+typedef enum
+{
+    RECOVERY_STAGE_NONE,
+    RECOVERY_STAGE_MQTT,                /**< Close the MQTT connection and connect again. */
+    RECOVERY_STAGE_TCP,                 /**< Abort the TCP connection and connect again. */
+    RECOVERY_STAGE_MEDIUM,              /**< Drop the BLE link, so the IPv6 medium re-enters connectable mode. */
+    RECOVERY_STAGE_RESET,               /**< Reset the chip. */
+    RECOVERY_STAGE_COUNT
+} recovery_stage_t;
+
+typedef struct
+{
+    const uint16_t *    p_steps;        /**< Durations in ms of alternating on and off phases, starting with on. */
+    uint8_t             step_count;     /**< Number of phases, 0 for a steady level. */
+    uint8_t             steady_on;      /**< Level of a steady pattern. */
+} led_pattern_t;
+
 typedef enum
 {
     LOCK_STATE_UNLOCKED,
@@ -79,12 +93,13 @@ typedef struct
 
 typedef struct {
     mqtt_worker_t *		p_worker;
-    uint8_t				topic_uuid[16];
+    uint8_t				attempts;
 } worker_pub_param_t;
 
 typedef struct {
     mqtt_worker_t *		p_worker;
     uint16_t			message_id;
+    uint8_t				attempts;
 } worker_ack_param_t;
 
 typedef struct {
@@ -100,6 +115,79 @@ typedef struct {
     mqtt_worker_t *		p_worker;
 } worker_discon_param_t;
 
+typedef union {
+    worker_pub_param_t		pub;
+    worker_ack_param_t		ack;
+    worker_con_param_t		con;
+    worker_sub_param_t		sub;
+    worker_discon_param_t	discon;
+} worker_param_t;
+
+typedef struct {
+    uint8_t				topic_uuid[16];
+    uint8_t				dirty;
+    uint8_t				generation;		/**< Bumped by every request merged into the slot. */
+} state_pub_slot_t;
+
+typedef bool (*app_cmd_handler_t)(const mqtt_publish_param_t * p_publish);
+
+typedef struct {
+    const char *		p_name;
+    uint8_t				name_len;
+    uint8_t				min_payload_len;
+    uint8_t				max_payload_len;
+    app_cmd_handler_t	handler;
+} app_cmd_t;
+
+typedef void (*sw_timer_handler_t)(iot_timer_time_in_ms_t wall_clock_value);
+
+typedef struct {
+    sw_timer_handler_t			handler;
+    iot_timer_time_in_ms_t		due_time;
+    uint32_t					period;                 /**< Reload interval in milliseconds, 0 for a one-shot timer. */
+    int16_t						heap_index;             /**< Position in the deadline heap, -1 while stopped. */
+} sw_timer_t;
+
+typedef enum
+{
+    SCHED_PRIO_HIGH,
+    SCHED_PRIO_NORMAL,
+    SCHED_PRIO_COUNT
+} sched_prio_t;
+
+typedef struct {
+    app_sched_event_handler_t	handler;
+    uint16_t					data_size;
+    uint8_t						data[sizeof(worker_param_t)];
+} prio_event_t;
+
+typedef struct {
+    prio_event_t *				p_events;
+    uint8_t						size;
+    uint8_t						head;
+    uint8_t						count;
+    uint8_t						high_water;
+} prio_lane_t;
+
+typedef struct {
+    app_sched_event_handler_t	handler;
+    iot_timer_time_in_ms_t		due_time;
+    uint16_t					data_size;
+    uint8_t						in_use;
+    uint8_t						prio;
+    uint8_t						data[sizeof(worker_param_t)];
+} retry_entry_t;
+
+typedef struct {
+    uint8_t						topic_uuid[16];         /**< Requester the publish went to, all zero for the state topic. */
+    uint8_t *					p_payload;              /**< Payload sent, one of the static lock state strings. */
+    iot_timer_time_in_ms_t		send_time;              /**< Wall clock time of the first transmission. */
+    iot_timer_time_in_ms_t		last_send_time;         /**< Wall clock time of the latest transmission. */
+    uint16_t					message_id;
+    uint8_t						transmits;              /**< Number of transmissions so far. */
+    uint8_t						in_use;
+} inflight_entry_t;
+
 #define LED_DBG                          	BSP_LED_0_MASK
 #define LED_CXN                             BSP_LED_1_MASK
 #define LED_ACCESS_GRANT                    BSP_LED_2_MASK
@@ -117,18 +205,30 @@ typedef struct {
 #define MOTOR_IN2							30
 #define MOTOR_STBY							31
 
-#define LWIP_SYS_TICK_MS                    10
+#define LWIP_SERVICE_MIN_SLEEP_MS           IOT_TIMER_RESOLUTION_IN_MS                              /**< lwIP timeouts are checked against the IoT Timer wall clock, so waking up sooner is useless. */
+#define LWIP_SERVICE_MAX_SLEEP_MS           5000                                                    /**< Upper bound of the time between two lwIP/MQTT servicing passes. */
+#define MQTT_PING_INTERVAL_MS               ((MQTT_KEEPALIVE - 2) * 1000)                           /**< Idle time after which mqtt_live sends a ping request. */
+#define KEEPALIVE_BASE_S                    60                                                      /**< Keepalive of the fixed configuration, which pinged every (KEEPALIVE_BASE_S - 2) seconds. */
+#define KEEPALIVE_BASE_MS                   ((KEEPALIVE_BASE_S - 2) * 1000)                         /**< Ping interval after a connect that followed a stable subscription. */
+#define KEEPALIVE_SHRINK_MAX                2                                                       /**< Number of times the ping interval is halved after disconnects in a row. */
+#define KEEPALIVE_MIN_MS                    (KEEPALIVE_BASE_MS >> KEEPALIVE_SHRINK_MAX)             /**< Shortest ping interval, on a link that keeps dropping. */
+#define KEEPALIVE_MAX_MS                    MQTT_PING_INTERVAL_MS                                   /**< Longest ping interval, within the keepalive announced in CONNECT. */
+#define KEEPALIVE_GROW_MS                   600000                                                  /**< Stable time after which the ping interval doubles. */
+#define KEEPALIVE_RESPONSE_TIMEOUT_MS       15000                                                   /**< Time the broker has to answer a QoS1 publish or a subscribe before the connection is aborted. */
 
 #define LED_BLINK_CXN_MULT1					4
 #define LED_BLINK_CXN_MULT2					2
-#define LED_BLINK_INTERVAL_MS               150 //this is the timeout timer callbacks
+#define LED_BLINK_INTERVAL_MS               150 //this is the base unit of all led patterns
 #define LED_BLINK_CXN_STABLE_MULT			200 //this makes the status light blink twice rapidly every (LED_BLINK_CXN_STABLE_MULT * LED_BLINK_INTERVAL_MS) milliseconds
-#define LED_BLINK_CXN_STABLE_COUNT			2
-#define LED_BLINK_ACCESS_MULT				12
+#define LED_BLINK_ACCESS_MULT				5
 #define AUTOCONNECT_TIMER_INTERVAL_MS       1000
+#define MOTOR_STOP_DELAY_MS                 250
 
 #define STABLE_TIMEOUT_MS					3000
-#define IDLE_RESET_TIMEOUT_MS				120000
+#define RECOVERY_MQTT_TIMEOUT_MS            10000                                                   /**< Time without a subscription before the MQTT connection is closed and reopened. */
+#define RECOVERY_TCP_TIMEOUT_MS             20000                                                   /**< Further time before the TCP connection is aborted. */
+#define RECOVERY_MEDIUM_TIMEOUT_MS          30000                                                   /**< Further time before the BLE link is dropped and the medium re-enters connectable mode. */
+#define RECOVERY_RESET_TIMEOUT_MS           60000                                                   /**< Further time before the chip is reset. */
 
 #define AUTO_PUBLISH_TIMEOUT_MS				300000
 
@@ -137,9 +237,37 @@ typedef struct {
 
 #define UUID_STRLEN							36														/**< Length of UUID (not including \0 ) */
 
-#define SCHED_MAX_EVENT_DATA_SIZE           sizeof(worker_pub_param_t)                              /**< Maximum size of scheduler events. */
+#define SCHED_MAX_EVENT_DATA_SIZE           sizeof(worker_param_t)                                  /**< Maximum size of scheduler events. */
 #define SCHED_QUEUE_SIZE                    128                                                     /**< Maximum number of events in the scheduler queue. */
 
+#ifndef SW_TIMER_MAX
+#define SW_TIMER_MAX                        16                                                      /**< Maximum number of running software timers. Up to 256 is supported. */
+#endif
+
+#define SW_TIMER_DEF(NAME, HANDLER) static sw_timer_t NAME = { .handler = (HANDLER), .heap_index = -1 }
+
+#define SCHED_HIGH_QUEUE_SIZE               8                                                       /**< Maximum number of pending events in the high priority lane. */
+#define SCHED_NORMAL_QUEUE_SIZE             16                                                      /**< Maximum number of pending events in the normal priority lane. */
+
+#define STATE_PUB_SLOT_COUNT                4                                                       /**< Destinations that can have a state publish pending: the state topic plus requesters. */
+
+#define RETRY_QUEUE_SIZE                    8                                                       /**< Maximum number of failed operations waiting for a retry. */
+#define RETRY_MAX_ATTEMPTS                  6                                                       /**< Number of retries after which a failed operation is dropped. */
+#define RETRY_BASE_DELAY_MS                 200                                                     /**< Delay before the first retry, doubled on every further attempt. */
+#define RETRY_MAX_DELAY_MS                  5000                                                    /**< Upper bound of the delay between two retries. */
+
+#define INFLIGHT_TABLE_SIZE                 4                                                       /**< Number of QoS1 publishes that can await their PUBACK at once. */
+#define INFLIGHT_RETRANSMIT_MS              10000                                                   /**< Time after which an unacknowledged publish is sent again with the DUP flag. */
+#define INFLIGHT_MAX_TRANSMITS              4                                                       /**< Number of transmissions after which an unacknowledged publish is dropped. */
+#define PUBACK_LATENCY_BUCKET_COUNT         8                                                       /**< Buckets of the PUBACK latency histogram. */
+#define PUBACK_LATENCY_BUCKET_MS            50                                                      /**< Upper bound of the first latency bucket, doubled for every further bucket. The last bucket has no bound. */
+
+#define RECONNECT_BASE_DELAY_MS             AUTOCONNECT_TIMER_INTERVAL_MS                           /**< Delay after the first connect attempt, doubled on every further attempt. */
+#define RECONNECT_MAX_DELAY_MS              60000                                                   /**< Upper bound of the delay between two connect attempts. */
+#define RECONNECT_JITTER_PERCENT            25                                                      /**< Share of each delay that is random, so devices behind one border router do not retry in step. */
+#define RECONNECT_REJECT_STEPS              4                                                       /**< Extra doublings after the broker refused the client id or credentials. */
+#define RECONNECT_RESET_STABLE_MS           STABLE_TIMEOUT_MS                                       /**< Time a session must stay subscribed before the backoff starts over. */
+
 #define DEAD_BEEF                           0xDEADBEEF                                              /**< Value used as error code on stack dump, can be used to identify stack location on stack unwind. */
 
 #define EUI_48_ADDR_SIZE					6
@@ -163,9 +291,14 @@ typedef struct {
 #define APP_MQTT_BROKER_PORT                1883                                                    /**< Port number of MQTT Broker being used. */
 #define APP_MQTT_BROKER_PORT_SECURE         8883
 #define APP_MQTT_SUBSCRIPTION_PKT_ID        10                                                      /**< Unique identification of subscription, can be any unsigned 16 bit integer value. */
+#define APP_MQTT_PERSISTENT_SESSION         1                                                       /**< Connect with clean_session = 0, so the broker keeps the subscription and queues QoS1 commands while we are offline. */
 
 #define DEVICE_TYPE_ID 						79
 #define DEVICE_ID_SIZE_BIN					7
+#define DEVICE_ID_STRLEN					(DEVICE_ID_SIZE_BIN * 2)								/**< Length of hex encoded device id (not including \0 ) */
+
+#define APP_CMD(NAME, MIN_LEN, MAX_LEN, HANDLER) { (NAME), sizeof(NAME) - 1, (MIN_LEN), (MAX_LEN), (HANDLER) }  /**< Entry of the inbound command table. */
+#define APP_CMD_NAME_MAX_LEN                32                                                      /**< Longest command name the dispatch index holds. */
 
 APP_PWM_INSTANCE(PWM1, 1);
 
@@ -174,28 +307,44 @@ static const char state_unlocked_str[] = "0";
 static const char state_locking_str[] = "1";
 static const char state_unlocking_str[] = "2";
 
-static const wchar_t                        state_topic[] = L"lock/state";
-static const wchar_t                        state_request_topic[] = L"lock/getstate";
-static const wchar_t						m_topic_prefix[] = L"/i/#";
-static const wchar_t						m_pub_prefix[] = L"/o/";
-static char username_utf8_buf[(EUI_48_ADDR_SIZE*8) + (sizeof(DEVICE_TYPE_ID)*8) + 1];
-static char topic_utf8_buf[sizeof(m_topic_prefix) + sizeof(state_topic) + (EUI_48_ADDR_SIZE*8) + (sizeof(DEVICE_TYPE_ID)*8) + 1];
-static char client_id_utf8_buf[(EUI_48_ADDR_SIZE*8) + (sizeof(DEVICE_TYPE_ID)*8) + 1];
-static char pub_utf8_buf[((EUI_48_ADDR_SIZE*8) + (sizeof(DEVICE_TYPE_ID)*8)) + sizeof(m_pub_prefix) + sizeof(state_topic) + 1  + (UUID_STRLEN * 4) + 1];
+static const char                           state_topic_utf8[] = "lock/state";
+static const char                           state_request_topic_utf8[] = "lock/getstate";
+static const char							m_topic_prefix[] = "/i/#";
+static const char							m_pub_prefix[] = "/o/";
 
-static const uint32_t						device_id_strlen = (DEVICE_ID_SIZE_BIN * 2) + ((sizeof(m_topic_prefix)-4) / 4) - 1;
+static const uint32_t						device_id_strlen = DEVICE_ID_STRLEN + sizeof(m_topic_prefix) - 2;
+
+/**@brief Identity strings of this device, built once from the EUI-48 in ip_stack_init.
+ *
+ * @details All topic strings are ASCII, so they are stored directly as UTF-8 and handed to the
+ *          MQTT module as ready slices. pub_topic holds "<id>/o/lock/state" followed by room for
+ *          "/<uuid>", which publish_state fills in place when replying to a requester.
+ */
+typedef struct {
+    char                device_id[DEVICE_ID_STRLEN + 1];
+    char                sub_filter[DEVICE_ID_STRLEN + sizeof(m_topic_prefix)];
+    char                pub_topic[DEVICE_ID_STRLEN + sizeof(m_pub_prefix) + sizeof(state_topic_utf8) + UUID_STRLEN];
+    mqtt_utf8_t         client_id;
+    mqtt_utf8_t         sub_topic;
+    mqtt_utf8_t         pub_prefix;
+} device_identity_t;
 
-APP_TIMER_DEF(m_iot_timer_tick_src_id);                                                             /**< System Timer used to service CoAP and LWIP periodically. */
+static device_identity_t                    m_identity;
 
-APP_TIMER_DEF(m_pwm_timer_src_id);																	/**< Timer used to provide timeout for PWM actions. */
+APP_TIMER_DEF(m_iot_timer_tick_src_id);                                                             /**< Timer armed for the earliest software timer deadline. Also advances the IoT Timer wall clock. */
 
 eui64_t                                     eui64_local_iid;                                        /**< Local EUI64 value that is used as the IID for*/
 eui48_t                   					ipv6_medium_eui48;
 static ipv6_medium_instance_t               m_ipv6_medium;
 static mqtt_client_t                        m_sub_mqtt_client;                                      /**< MQTT Client instance reference provided by the MQTT module. */
-static display_state_t						m_prev_display_state = LEDS_INACTIVE;
 static display_state_t                      m_display_state = LEDS_INACTIVE;                        /**< Board LED display state. */
+static bool                                 m_display_apply_queued = false;                         /**< A display_state_apply event is in the scheduler queue. */
+static bool                                 m_led_access_granted = false;                           /**< Access LED the next led_access_apply lights. */
+static bool                                 m_led_access_queued = false;                            /**< A led_access_apply event is in the scheduler queue. */
+static const led_pattern_t *                mp_led_pattern = NULL;                                  /**< Pattern being played on LED_CXN. */
+static uint8_t                              m_led_pattern_step = 0;
 static app_ipv6_state_t                     m_ipv6_state = APP_IPV6_IF_DOWN;
+static uint16_t                             m_conn_handle = BLE_CONN_HANDLE_INVALID;                /**< Handle of the BLE link carrying the IPv6 medium, if it is up. */
 
 static lock_state_t                         m_lock_state;
 static lock_direction_t						m_lock_direction;
@@ -204,15 +353,70 @@ static lock_state_t							m_pending_lock_state;
 
 static uint16_t                             m_message_counter = 1;
 
+static prio_event_t                         m_sched_high_events[SCHED_HIGH_QUEUE_SIZE];
+static prio_event_t                         m_sched_normal_events[SCHED_NORMAL_QUEUE_SIZE];
+
+static prio_lane_t                          m_sched_lanes[SCHED_PRIO_COUNT] =                       /**< Scheduler lanes, indexed by sched_prio_t. high_water records the deepest backlog seen. */
+        {
+                {.p_events = m_sched_high_events,   .size = SCHED_HIGH_QUEUE_SIZE},
+                {.p_events = m_sched_normal_events, .size = SCHED_NORMAL_QUEUE_SIZE}
+        };
+
+static state_pub_slot_t                     m_state_pub_slots[STATE_PUB_SLOT_COUNT];                /**< Pending state publishes. Slot 0 is the state topic itself, the others are requester topics. */
+static bool                                 m_state_pub_flush_queued = false;                       /**< A publish_state event is in the scheduler queue or waiting for a retry. */
+static uint32_t                             m_state_pub_coalesced_count = 0;                        /**< Number of state publish requests merged into one already pending. */
+static uint32_t                             m_state_pub_drop_count = 0;                             /**< Number of requester publishes dropped because all slots were pending. */
+
+static iot_timer_time_in_ms_t               m_mqtt_last_tx_time = 0;                                /**< Wall clock time of the last packet sent to the broker. */
+static iot_timer_time_in_ms_t               m_mqtt_last_rx_time = 0;                                /**< Wall clock time of the last packet received from the broker. */
+static bool                                 m_mqtt_rx_wait = false;                                 /**< A packet the broker has to answer was sent and nothing was received since. */
+static iot_timer_time_in_ms_t               m_mqtt_rx_wait_time = 0;                                /**< Wall clock time m_mqtt_rx_wait was set. */
+static iot_timer_time_in_ms_t               m_subscribed_time = 0;                                  /**< Wall clock time the current subscription was made. */
+static uint32_t                             m_keepalive_shrink = 0;                                 /**< Number of halvings of the ping interval owed to recent disconnects. */
+static uint32_t                             m_mqtt_rx_seq = 0;                                      /**< rcv_nxt of the TCP connection at CONNACK, or when mqtt_rx_poll last saw it move. */
+static uint32_t                             m_keepalive_ping_count = 0;                             /**< Number of ping requests sent. */
+static uint32_t                             m_keepalive_dead_count = 0;                             /**< Number of connections aborted because the broker did not answer. */
+
+static bool                                 m_session_subscribed = false;                           /**< The broker session holds our subscription, set on SUBACK and cleared when a CONNACK reports no session. */
+static uint32_t                             m_session_resume_count = 0;                             /**< Number of reconnects that resumed the session and skipped the SUBSCRIBE round trip. */
+
+static retry_entry_t                        m_retry_queue[RETRY_QUEUE_SIZE];                        /**< Failed operations waiting for their next attempt. */
+static uint32_t                             m_retry_count = 0;                                      /**< Number of retries issued. */
+static uint32_t                             m_retry_drop_count = 0;                                 /**< Number of operations dropped after RETRY_MAX_ATTEMPTS or with a full queue. */
+
+static inflight_entry_t                     m_inflight_table[INFLIGHT_TABLE_SIZE];                  /**< QoS1 publishes awaiting their PUBACK. */
+static uint32_t                             m_inflight_retransmit_count = 0;                        /**< Number of publishes sent again with the DUP flag. */
+static uint32_t                             m_inflight_drop_count = 0;                              /**< Number of publishes dropped after INFLIGHT_MAX_TRANSMITS. */
+static uint32_t                             m_inflight_full_count = 0;                              /**< Number of publishes deferred because the table was full. */
+static uint32_t                             m_inflight_superseded_count = 0;                        /**< Number of entries replaced by a newer publish to the same topic. */
+static uint32_t                             m_puback_unknown_count = 0;                             /**< Number of PUBACKs for no publish in the table, e.g. for a retransmitted one. */
+static uint32_t                             m_puback_drop_count = 0;                                /**< Number of PUBACKs dropped because the high scheduler lane was full. */
+static uint32_t                             m_puback_latency_hist[PUBACK_LATENCY_BUCKET_COUNT];     /**< PUBACKs by time since the first transmission, see PUBACK_LATENCY_BUCKET_MS. */
+
+static uint8_t                              m_reconnect_step = 0;                                   /**< Number of doublings applied to the next reconnect delay. */
+static bool                                 m_reconnect_wait = false;                               /**< m_reconnect_due_time holds back the next connect attempt. */
+static iot_timer_time_in_ms_t               m_reconnect_due_time = 0;                               /**< Wall clock time before which no connect is attempted. */
+static uint32_t                             m_reconnect_attempt_count = 0;                          /**< Number of connect attempts issued. */
+static uint32_t                             m_reconnect_reject_count = 0;                           /**< Number of CONNACKs that refused the connection. */
+
+static recovery_stage_t                     m_recovery_stage = RECOVERY_STAGE_NONE;                 /**< Last recovery stage taken since the subscription was lost. */
+static iot_timer_time_in_ms_t               m_recovery_stage_time = 0;                              /**< Wall clock time m_recovery_stage was entered. */
+static uint32_t                             m_recovery_count[RECOVERY_STAGE_COUNT];                 /**< Number of times each recovery stage was taken. */
+
+static const uint32_t                       m_recovery_timeout_ms[RECOVERY_STAGE_COUNT] =          /**< Time spent in the previous stage before each stage is taken. */
+        {
+                0,
+                RECOVERY_MQTT_TIMEOUT_MS,
+                RECOVERY_TCP_TIMEOUT_MS,
+                RECOVERY_MEDIUM_TIMEOUT_MS,
+                RECOVERY_RESET_TIMEOUT_MS
+        };
+
 static uint32_t 							idle_time = 0;
 static uint32_t 							idle_start_time = 0;
 static uint32_t								stable_time = 0;
 static uint32_t								stable_start_time = 0;
-static uint32_t								led_cxn_blink_count = 0;
-static uint16_t								led_cxn_stable_blink_count = 0;
 static bool									led_cxn_stable = false;
-static bool									led_cxn_stable_blinkon = false;
-static int8_t								led_access_blink_count = 0;
 eui48_t 									ipv6_medium_eui48;
 
 static ipv6_addr_t ipv6_broker_addr =
@@ -220,8 +424,6 @@ static ipv6_addr_t ipv6_broker_addr =
                   0x00, 0x00, 0x00, 0x00,
                   0x00, 0x00, 0x00, 0x00,
                   0x00, 0x00, 0x00, 0x00, } };
-
-static bool									led_dbg_on = false;
 //#define FAR_SECURE_ENABLED 0
 #if (FAR_SECURE_ENABLED == 1)
 
@@ -304,8 +506,8 @@ static nrf_tls_key_settings_t m_tls_keys;
 static mqtt_worker_t m_subscriber = {
         .p_client = &m_sub_mqtt_client,
         .state = APP_MQTT_STATE_IDLE,
-        .p_utf8_name = client_id_utf8_buf,
-        .utf8_name_len = DEVICE_ID_SIZE_BIN * 2,
+        .p_utf8_name = (uint8_t *)m_identity.device_id,
+        .utf8_name_len = DEVICE_ID_STRLEN,
         .subscriber = 1
 };
 
@@ -316,6 +518,33 @@ static iot_interface_t * p_iot_interface;
 
 void app_mqtt_evt_handler(mqtt_client_t * const p_client, const mqtt_evt_t * p_evt);
 
+static void led_pattern_timeout_handler(iot_timer_time_in_ms_t wall_clock_value);
+static void led_access_timeout_handler(iot_timer_time_in_ms_t wall_clock_value);
+static void autoconnect_timeout_handler(iot_timer_time_in_ms_t wall_clock_value);
+static void retry_timeout_handler(iot_timer_time_in_ms_t wall_clock_value);
+static void inflight_timeout_handler(iot_timer_time_in_ms_t wall_clock_value);
+static void lwip_timeout_handler(iot_timer_time_in_ms_t wall_clock_value);
+static void pwm_timeout_handler(iot_timer_time_in_ms_t wall_clock_value);
+static void connectable_mode_enter(void);
+static void keepalive_connection_lost(iot_timer_time_in_ms_t now);
+static void commands_init(void);
+static void publish_state(void * p_event_data, uint16_t event_size);
+static uint32_t prio_sched_event_put(sched_prio_t prio, const void * p_data, uint16_t data_size, app_sched_event_handler_t handler);
+
+static sw_timer_t *                         m_sw_timer_heap[SW_TIMER_MAX];                          /**< Running software timers, as a binary min-heap on due_time. */
+static uint16_t                             m_sw_timer_count = 0;
+static bool                                 m_sw_timer_armed = false;
+static iot_timer_time_in_ms_t               m_sw_timer_armed_due = 0;                               /**< Deadline m_iot_timer_tick_src_id is armed for. */
+static uint32_t                             m_wall_clock_ref_ticks = 0;                             /**< RTC counter value the IoT Timer wall clock was last advanced to. */
+
+SW_TIMER_DEF(m_led_pattern_timer, led_pattern_timeout_handler);
+SW_TIMER_DEF(m_led_access_timer,  led_access_timeout_handler);
+SW_TIMER_DEF(m_autoconnect_timer, autoconnect_timeout_handler);
+SW_TIMER_DEF(m_retry_timer,       retry_timeout_handler);
+SW_TIMER_DEF(m_inflight_timer,    inflight_timeout_handler);
+SW_TIMER_DEF(m_lwip_timer,        lwip_timeout_handler);
+SW_TIMER_DEF(m_pwm_timer,         pwm_timeout_handler);
+
 /**@brief Callback function for asserts in the SoftDevice.
  *
  * @details This function will be called in case of an assert in the SoftDevice.
@@ -333,283 +562,788 @@ void assert_nrf_callback(uint16_t line_num, const uint8_t * p_file_name)
 }
 
 
-/**@brief Function for the LEDs initialization.
+/**@brief Function for bringing the IoT Timer wall clock up to date with the RTC.
  *
- * @details Initializes all LEDs used by this application.
+ * @details The wall clock is no longer ticked periodically. Whole IOT_TIMER_RESOLUTION_IN_MS
+ *          periods elapsed since the last call are added on every wakeup instead, so LwIP and MQTT
+ *          see the same clock without the CPU waking up for each period. MQTT event handlers
+ *          read the clock too, so the update runs in a critical region.
  */
-static void leds_init(void)
+static void wall_clock_sync(void)
 {
-    // Configure application LED pins.
-    LEDS_CONFIGURE(ALL_APP_LED);
+    const uint32_t period_ticks = APP_TIMER_TICKS(IOT_TIMER_RESOLUTION_IN_MS);
 
-    // Turn off all LED on initialization.
-    LEDS_OFF(ALL_APP_LED);
+    CRITICAL_REGION_ENTER();
+    uint32_t elapsed = app_timer_cnt_diff_compute(app_timer_cnt_get(), m_wall_clock_ref_ticks);
+
+    while (elapsed >= period_ticks)
+    {
+        UNUSED_VARIABLE(iot_timer_update());
+        elapsed -= period_ticks;
+        m_wall_clock_ref_ticks = (m_wall_clock_ref_ticks + period_ticks) & APP_TIMER_MAX_CNT_VAL;
+    }
+    CRITICAL_REGION_EXIT();
 }
 
+static bool sw_timer_before(const sw_timer_t * p_a, const sw_timer_t * p_b)
+{
+    return (int32_t)(p_a->due_time - p_b->due_time) < 0;
+}
 
-/**@brief Timer callback used for controlling board LEDs to represent application state.
- *
- * @param[in]   wall_clock_value   The value of the wall clock that triggered the callback.
- */
-static void blink_timeout_handler(iot_timer_time_in_ms_t wall_clock_value)
+static void sw_timer_heap_set(uint16_t index, sw_timer_t * p_timer)
 {
-    UNUSED_PARAMETER(wall_clock_value);
+    m_sw_timer_heap[index] = p_timer;
+    p_timer->heap_index = index;
+}
+
+static void sw_timer_sift_up(uint16_t index)
+{
+    sw_timer_t * p_timer = m_sw_timer_heap[index];
 
-    if (m_display_state != m_prev_display_state)
+    while (index > 0)
     {
-        led_cxn_blink_count = 0;
-    }
+        uint16_t parent = (index - 1) / 2;
 
-    m_prev_display_state = m_display_state;
+        if (!sw_timer_before(p_timer, m_sw_timer_heap[parent]))
+        {
+            break;
+        }
 
-    if (m_display_state == LEDS_CONNECTABLE_MODE || m_display_state == LEDS_IPV6_IF_UP || m_display_state == LEDS_SUBSCRIBED_TO_TOPIC)
-    {
-        led_cxn_blink_count++;
-    }
-    else
-    {
-        led_cxn_blink_count = 0;
+        sw_timer_heap_set(index, m_sw_timer_heap[parent]);
+        index = parent;
     }
 
-    if (led_dbg_on > 0)
-    {
-        LEDS_ON(LED_DBG);
-    }
-    else
-    {
-        LEDS_OFF(LED_DBG);
-    }
+    sw_timer_heap_set(index, p_timer);
+}
+
+static void sw_timer_sift_down(uint16_t index)
+{
+    sw_timer_t * p_timer = m_sw_timer_heap[index];
 
-    switch (m_display_state)
+    for (;;)
     {
-        case LEDS_INACTIVE:
-        {
-            LEDS_OFF(ALL_APP_LED);
-            break;
-        }
-        case LEDS_CONNECTABLE_MODE:
-        {
-            if (led_cxn_blink_count >= LED_BLINK_CXN_MULT1)
-            {
-                LEDS_INVERT(LED_CXN);
-                led_cxn_blink_count = 0;
-            }
-            break;
-        }
-        case LEDS_IPV6_IF_DOWN:
-        {
-            LEDS_OFF(ALL_APP_LED);
-            break;
-        }
-        case LEDS_IPV6_IF_UP:
-        {
-            if (led_cxn_blink_count >= LED_BLINK_CXN_MULT2)
-            {
-                LEDS_INVERT(LED_CXN);
-                led_cxn_blink_count = 0;
-            }
-            break;
-        }
-        case LEDS_CONNECTED_TO_BROKER:
+        uint16_t child = (2 * index) + 1;
+
+        if (child >= m_sw_timer_count)
         {
-            LEDS_INVERT(LED_CXN);
             break;
         }
-        case LEDS_SUBSCRIBED_TO_TOPIC:
+
+        if ((child + 1 < m_sw_timer_count) && sw_timer_before(m_sw_timer_heap[child + 1], m_sw_timer_heap[child]))
         {
-            if (led_cxn_stable > 0)
-            {
-                if (led_cxn_blink_count >= LED_BLINK_CXN_STABLE_MULT)
-                {
-                    if (led_cxn_stable_blinkon)
-                    {
-                        LEDS_OFF(LED_CXN);
-                        led_cxn_stable_blinkon = false;
-                        if (led_cxn_stable_blink_count == LED_BLINK_CXN_STABLE_COUNT)
-                        {
-                            led_cxn_blink_count = 0;
-                            led_cxn_stable_blink_count = 0;
-                        }
-                        else
-                        {
-                            led_cxn_blink_count--;
-                        }
-                    }
-                    else
-                    {
-                        LEDS_ON(LED_CXN);
-                        led_cxn_stable_blinkon = true;
-                        led_cxn_stable_blink_count++;
-                        led_cxn_blink_count--;
-                    }
-                }
-            }
-            else
-            {
-                LEDS_ON(LED_CXN);
-            }
-            break;
+            child++;
         }
-        default:
+
+        if (!sw_timer_before(m_sw_timer_heap[child], p_timer))
         {
             break;
         }
-    }
 
-    if (led_access_blink_count != 0)
-    {
-        if (led_access_blink_count > 0)
-        {
-            LEDS_ON(LED_ACCESS_GRANT);
-            LEDS_OFF(LED_ACCESS_REJECT);
-            led_access_blink_count--;
-        }
-        else
-        {
-            LEDS_OFF(LED_ACCESS_GRANT);
-            LEDS_ON(LED_ACCESS_REJECT);
-            led_access_blink_count++;
-        }
+        sw_timer_heap_set(index, m_sw_timer_heap[child]);
+        index = child;
     }
-    else
+
+    sw_timer_heap_set(index, p_timer);
+}
+
+static void sw_timer_heap_remove(sw_timer_t * p_timer)
+{
+    uint16_t index = p_timer->heap_index;
+
+    p_timer->heap_index = -1;
+    m_sw_timer_count--;
+
+    if (index < m_sw_timer_count)
     {
-        LEDS_OFF(LED_ACCESS_GRANT);
-        LEDS_OFF(LED_ACCESS_REJECT);
+        sw_timer_t * p_last = m_sw_timer_heap[m_sw_timer_count];
+
+        sw_timer_heap_set(index, p_last);
+        sw_timer_sift_up(index);
+        sw_timer_sift_down(p_last->heap_index);
     }
 }
 
-static void bin_to_hex_str(char * to, const uint8_t * from, const uint32_t size) {
-    uint8_t j = 0;
-    for (uint8_t i = 0; i < size; i++) {
-        to[j++] = hexdigits[from[i] >> 4];
-        to[j++] = hexdigits[from[i] & 0xf];
-    }
-    to[j] = '\0';
+static void sw_timer_heap_insert(sw_timer_t * p_timer)
+{
+    sw_timer_heap_set(m_sw_timer_count, p_timer);
+    m_sw_timer_count++;
+    sw_timer_sift_up(p_timer->heap_index);
 }
 
-static void connect_to_broker(void * p_event_data, uint16_t event_size) {
-    worker_con_param_t con_param = *((worker_con_param_t *)p_event_data);
-    if (con_param.p_worker->state == APP_MQTT_STATE_IDLE)
+/**@brief Function for arming the tick source for the earliest software timer deadline.
+ *
+ * @details Deadlines are on the wall clock, which advances IOT_TIMER_RESOLUTION_IN_MS per
+ *          APP_TIMER_TICKS(IOT_TIMER_RESOLUTION_IN_MS) ticks. The delay is therefore counted in
+ *          whole wall clock periods from the last one wall_clock_sync accounted for. Converting
+ *          milliseconds with APP_TIMER_TICKS would round differently and fire late.
+ */
+static void sw_timer_rearm(void)
+{
+    if (m_sw_timer_count == 0)
     {
-        mqtt_client_t * client = con_param.p_worker->p_client;
-        mqtt_client_init(client);
+        UNUSED_VARIABLE(app_timer_stop(m_iot_timer_tick_src_id));
+        m_sw_timer_armed = false;
+        return;
+    }
 
-        uint8_t deviceIdBin[DEVICE_ID_SIZE_BIN];
+    iot_timer_time_in_ms_t due = m_sw_timer_heap[0]->due_time;
 
-        deviceIdBin[0] = DEVICE_TYPE_ID;
+    if (m_sw_timer_armed && (due == m_sw_timer_armed_due))
+    {
+        return;
+    }
 
-        for (uint8_t i = 0; i < sizeof(eui48_t); i++) {
-            deviceIdBin[DEVICE_ID_SIZE_BIN-1-i] = ipv6_medium_eui48.identifier[i];
-        }
+    iot_timer_time_in_ms_t now;
 
-        char usernameStr[(sizeof(deviceIdBin)*2)+1];
+    wall_clock_sync();
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
 
-        bin_to_hex_str(usernameStr, deviceIdBin, sizeof(deviceIdBin));
+    const uint32_t period_ticks = APP_TIMER_TICKS(IOT_TIMER_RESOLUTION_IN_MS);
+    int32_t delay = (int32_t)(due - now);
+    uint32_t periods = (delay > 0) ? CEIL_DIV((uint32_t)delay, IOT_TIMER_RESOLUTION_IN_MS) : 1;
+    uint32_t elapsed = app_timer_cnt_diff_compute(app_timer_cnt_get(), m_wall_clock_ref_ticks);
+    uint32_t ticks = (periods * period_ticks) - elapsed;
 
-        wchar_t username_wcs[sizeof(usernameStr)];
+    UNUSED_VARIABLE(app_timer_stop(m_iot_timer_tick_src_id));
 
-        mbstowcs(username_wcs, usernameStr, sizeof(usernameStr));
+    uint32_t err_code = app_timer_start(m_iot_timer_tick_src_id,
+                                        MAX(ticks, APP_TIMER_MIN_TIMEOUT_TICKS),
+                                        NULL);
+    APP_ERROR_CHECK(err_code);
 
-        u8_toutf8(username_utf8_buf, sizeof(username_utf8_buf), username_wcs, -1);
+    m_sw_timer_armed = true;
+    m_sw_timer_armed_due = due;
+}
 
-        m_user.p_utf_str = (uint8_t *)username_utf8_buf;
-        m_user.utf_strlen = wcslen(username_wcs);
+/**@brief Function for starting or restarting a software timer.
+ *
+ * @param[in]   p_timer     Timer, declared with SW_TIMER_DEF.
+ * @param[in]   delay_ms    Time until the first expiry.
+ * @param[in]   period_ms   Reload interval, or 0 for a one-shot timer.
+ */
+static void sw_timer_start(sw_timer_t * p_timer, uint32_t delay_ms, uint32_t period_ms)
+{
+    iot_timer_time_in_ms_t now;
 
-        m_pass.p_utf_str = (uint8_t *)username_utf8_buf;
-        m_pass.utf_strlen = wcslen(username_wcs);
+    if (p_timer->heap_index >= 0)
+    {
+        sw_timer_heap_remove(p_timer);
+    }
+    else if (m_sw_timer_count >= SW_TIMER_MAX)
+    {
+        APP_ERROR_CHECK(NRF_ERROR_NO_MEM);
+        return;
+    }
 
-        memset(ipv6_broker_addr.u8 + 2, 0, 14);
+    wall_clock_sync();
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
 
-        if (p_iot_interface) {
+    p_timer->due_time = now + delay_ms;
+    p_timer->period = period_ms;
 
-            memcpy(ipv6_broker_addr.u8 + EUI_64_ADDR_SIZE, p_iot_interface->peer_addr.identifier, EUI_64_ADDR_SIZE);
+    sw_timer_heap_insert(p_timer);
+    sw_timer_rearm();
+}
 
-#if (BLE_6LOWPAN_LEGACY_MODE == 1)
-            ipv6_broker_addr.u8[EUI_64_ADDR_SIZE] |= 0x02;
-#endif
+static void sw_timer_stop(sw_timer_t * p_timer)
+{
+    if (p_timer->heap_index >= 0)
+    {
+        sw_timer_heap_remove(p_timer);
+        sw_timer_rearm();
+    }
+}
 
-            memcpy(client->broker_addr.u8, ipv6_broker_addr.u8, IPV6_ADDR_SIZE);
+static bool sw_timer_is_running(const sw_timer_t * p_timer)
+{
+    return p_timer->heap_index >= 0;
+}
 
-            client->protocol_version = MQTT_VERSION_3_1_1;
+/**@brief Timer callback used for expiring due software timers.
+ *
+ * @details Periodic timers are reloaded before their handler runs, so a handler may stop or
+ *          restart its own timer.
+ *
+ * @param[in]   p_context   Pointer used for passing context. No context used in this application.
+ */
+static void sw_timer_tick_callback(void * p_context)
+{
+    UNUSED_VARIABLE(p_context);
 
-#if defined(FAR_SECURE_ENABLED)
+    iot_timer_time_in_ms_t now;
 
-            mq_certificate.p_certificate = &tls_cert[0];
-            mq_certificate.certificate_len = strlen(tls_cert) + 1;
-            mq_certificate.p_private_key = &tls_key[0];
-            mq_certificate.private_key_len = strlen(tls_key) + 1;
+    m_sw_timer_armed = false;
 
-            m_tls_keys.p_own_certificate = &mq_certificate;
-            m_tls_keys.p_ca_cert_pem = &ca_cert[0];
-            m_tls_keys.ca_cert_pem_len = strlen(ca_cert) + 1;
-            m_tls_keys.p_psk = NULL;
-            m_tls_keys.p_raw_key = NULL;
+    wall_clock_sync();
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
 
-            client->broker_port = APP_MQTT_BROKER_PORT_SECURE;
-            client->transport_type = MQTT_TRANSPORT_SECURE;
-            client->p_security_settings = &m_tls_keys;
-#else
-            client->broker_port = APP_MQTT_BROKER_PORT;
-            client->transport_type = MQTT_TRANSPORT_NON_SECURE;
-            client->p_security_settings = NULL;
-#endif
-            client->evt_cb = app_mqtt_evt_handler;
-            client->client_id.p_utf_str = con_param.p_worker->p_utf8_name;
-            client->client_id.utf_strlen = con_param.p_worker->utf8_name_len;
-            client->p_user_name = &m_user;
-            client->p_password = &m_pass;
-            client->clean_session = con_param.clean_session;
+    while ((m_sw_timer_count > 0) && ((int32_t)(now - m_sw_timer_heap[0]->due_time) >= 0))
+    {
+        sw_timer_t * p_timer = m_sw_timer_heap[0];
 
-            uint32_t err_code = mqtt_connect(client);
+        sw_timer_heap_remove(p_timer);
 
-            if (err_code == NRF_SUCCESS) {
-                APPL_LOG("[APPL]: CONNECTING - %d", err_code);
+        if (p_timer->period > 0)
+        {
+            p_timer->due_time += p_timer->period;
 
-                con_param.p_worker->state = APP_MQTT_STATE_CONNECTING;
-            } else {
-                APPL_LOG("[APPL]: ERROR CONNECTING - %d", err_code);
+            if ((int32_t)(now - p_timer->due_time) >= 0)
+            {
+                p_timer->due_time = now + p_timer->period;
             }
-        } else {
-
-            APPL_LOG("[APPL]: ERROR CONNECTING - no interface");
 
+            sw_timer_heap_insert(p_timer);
         }
+
+        p_timer->handler(now);
     }
+
+    sw_timer_rearm();
 }
 
-static void subscribe_to_topic(void * p_event_data, uint16_t event_size) {
-    worker_sub_param_t sub_param = *((worker_sub_param_t *)p_event_data);
-    if (sub_param.p_worker->state == APP_MQTT_STATE_CONNECTED)
-    {
-        uint8_t deviceIdBin[DEVICE_ID_SIZE_BIN];
 
-        deviceIdBin[0] = DEVICE_TYPE_ID;
+/**@brief Function for the LEDs initialization.
+ *
+ * @details Initializes all LEDs used by this application.
+ */
+static void leds_init(void)
+{
+    // Configure application LED pins.
+    LEDS_CONFIGURE(ALL_APP_LED);
 
-        for (uint8_t i = 0; i < sizeof(eui48_t); i++) {
-            deviceIdBin[DEVICE_ID_SIZE_BIN-1-i] = ipv6_medium_eui48.identifier[i];
-        }
+    // Turn off all LED on initialization.
+    LEDS_OFF(ALL_APP_LED);
+}
 
-        char topicStr[(sizeof(deviceIdBin)*2)+1];
 
-        bin_to_hex_str(topicStr, deviceIdBin, sizeof(deviceIdBin));
+static const uint16_t m_led_connectable_steps[] =
+        {LED_BLINK_CXN_MULT1 * LED_BLINK_INTERVAL_MS, LED_BLINK_CXN_MULT1 * LED_BLINK_INTERVAL_MS};
 
-        wchar_t topic_wcs[sizeof(topicStr) + wcslen(m_topic_prefix)];
+static const uint16_t m_led_ipv6_up_steps[] =
+        {LED_BLINK_CXN_MULT2 * LED_BLINK_INTERVAL_MS, LED_BLINK_CXN_MULT2 * LED_BLINK_INTERVAL_MS};
 
-        mbstowcs(topic_wcs, topicStr, sizeof(topicStr));
+static const uint16_t m_led_connected_steps[] =
+        {LED_BLINK_INTERVAL_MS, LED_BLINK_INTERVAL_MS};
 
-        wcscat(topic_wcs, m_topic_prefix);
+static const uint16_t m_led_stable_steps[] =
+        {LED_BLINK_INTERVAL_MS, LED_BLINK_INTERVAL_MS,
+         LED_BLINK_INTERVAL_MS, LED_BLINK_CXN_STABLE_MULT * LED_BLINK_INTERVAL_MS};
 
-        u8_toutf8(topic_utf8_buf, sizeof(topic_utf8_buf), topic_wcs, -1);
+static const led_pattern_t m_led_off_pattern         = {NULL, 0, 0};
+static const led_pattern_t m_led_on_pattern          = {NULL, 0, 1};
+static const led_pattern_t m_led_connectable_pattern = {m_led_connectable_steps, ARRAY_SIZE(m_led_connectable_steps), 0};
+static const led_pattern_t m_led_ipv6_up_pattern     = {m_led_ipv6_up_steps, ARRAY_SIZE(m_led_ipv6_up_steps), 0};
+static const led_pattern_t m_led_connected_pattern   = {m_led_connected_steps, ARRAY_SIZE(m_led_connected_steps), 0};
+static const led_pattern_t m_led_stable_pattern      = {m_led_stable_steps, ARRAY_SIZE(m_led_stable_steps), 0};
 
-        mqtt_utf8_t topic_utf8 = { .p_utf_str = (uint8_t *)topic_utf8_buf, .utf_strlen = wcslen(topic_wcs) };
+static void led_cxn_set(bool on)
+{
+    if (on)
+    {
+        LEDS_ON(LED_CXN);
+    }
+    else
+    {
+        LEDS_OFF(LED_CXN);
+    }
+}
 
-        mqtt_topic_t topic =
-                {
-                        .topic = topic_utf8,
-                        .qos = MQTT_QoS_1_ATLEAST_ONCE
-                };
+/**@brief Timer callback used for advancing the connection LED pattern to its next phase.
+ *
+ * @param[in]   wall_clock_value   The value of the wall clock that triggered the callback.
+ */
+static void led_pattern_timeout_handler(iot_timer_time_in_ms_t wall_clock_value)
+{
+    UNUSED_PARAMETER(wall_clock_value);
 
-        const mqtt_subscription_list_t subscription_list =
+    m_led_pattern_step = (m_led_pattern_step + 1) % mp_led_pattern->step_count;
+
+    led_cxn_set((m_led_pattern_step & 1) == 0);
+
+    sw_timer_start(&m_led_pattern_timer, mp_led_pattern->p_steps[m_led_pattern_step], 0);
+}
+
+/**@brief Function for showing the recorded display state on the connection LED.
+ *
+ * @details Each state maps to a pattern of on and off phases. The LED timer only runs while a
+ *          blinking pattern plays, and wakes up at the next edge only. Steady patterns leave it
+ *          stopped. Setting the state that is already shown does not restart the pattern. Runs
+ *          from the scheduler, so the software timers are only touched in main context.
+ *
+ * @param[in]   p_event_data   Unused.
+ * @param[in]   event_size     Unused.
+ */
+static void display_state_apply(void * p_event_data, uint16_t event_size)
+{
+    UNUSED_PARAMETER(p_event_data);
+    UNUSED_PARAMETER(event_size);
+
+    const led_pattern_t * p_pattern;
+    display_state_t state = LEDS_INACTIVE;
+
+    CRITICAL_REGION_ENTER();
+    state = m_display_state;
+    m_display_apply_queued = false;
+    CRITICAL_REGION_EXIT();
+
+    switch (state)
+    {
+        case LEDS_CONNECTABLE_MODE:
+            p_pattern = &m_led_connectable_pattern;
+            break;
+        case LEDS_IPV6_IF_UP:
+            p_pattern = &m_led_ipv6_up_pattern;
+            break;
+        case LEDS_CONNECTED_TO_BROKER:
+            p_pattern = &m_led_connected_pattern;
+            break;
+        case LEDS_SUBSCRIBED_TO_TOPIC:
+            p_pattern = led_cxn_stable ? &m_led_stable_pattern : &m_led_on_pattern;
+            break;
+        case LEDS_INACTIVE:
+        case LEDS_IPV6_IF_DOWN:
+        default:
+            p_pattern = &m_led_off_pattern;
+            break;
+    }
+
+    if (p_pattern == mp_led_pattern)
+    {
+        return;
+    }
+
+    mp_led_pattern = p_pattern;
+    m_led_pattern_step = 0;
+
+    if (p_pattern->step_count > 0)
+    {
+        led_cxn_set(true);
+        sw_timer_start(&m_led_pattern_timer, p_pattern->p_steps[0], 0);
+    }
+    else
+    {
+        led_cxn_set(p_pattern->steady_on);
+        sw_timer_stop(&m_led_pattern_timer);
+    }
+}
+
+/**@brief Function for setting the application state shown on the connection LED.
+ *
+ * @details Safe from the MQTT and IPv6 medium event handlers, which run in interrupt context. Only
+ *          the state is recorded here; display_state_apply picks up the latest one from the
+ *          scheduler, and several changes before it runs cost one pass.
+ *
+ * @param[in]   state   New display state.
+ */
+static void display_state_set(display_state_t state)
+{
+    CRITICAL_REGION_ENTER();
+
+    m_display_state = state;
+
+    if (!m_display_apply_queued)
+    {
+        m_display_apply_queued = (prio_sched_event_put(SCHED_PRIO_NORMAL, NULL, 0, display_state_apply) == NRF_SUCCESS);
+    }
+
+    CRITICAL_REGION_EXIT();
+}
+
+static void led_dbg_set(bool on)
+{
+    if (on)
+    {
+        LEDS_ON(LED_DBG);
+    }
+    else
+    {
+        LEDS_OFF(LED_DBG);
+    }
+}
+
+/**@brief Function for lighting the recorded access LED and starting the timer that turns it off.
+ *
+ * @details Runs from the scheduler, so the software timers are only touched in main context.
+ *
+ * @param[in]   p_event_data   Unused.
+ * @param[in]   event_size     Unused.
+ */
+static void led_access_apply(void * p_event_data, uint16_t event_size)
+{
+    UNUSED_PARAMETER(p_event_data);
+    UNUSED_PARAMETER(event_size);
+
+    bool granted = false;
+
+    CRITICAL_REGION_ENTER();
+    granted = m_led_access_granted;
+    m_led_access_queued = false;
+    CRITICAL_REGION_EXIT();
+
+    LEDS_OFF(LED_ACCESS_GRANT | LED_ACCESS_REJECT);
+    LEDS_ON(granted ? LED_ACCESS_GRANT : LED_ACCESS_REJECT);
+
+    sw_timer_start(&m_led_access_timer, LED_BLINK_ACCESS_MULT * LED_BLINK_INTERVAL_MS, 0);
+}
+
+/**@brief Function for lighting the access grant or reject LED for a short time.
+ *
+ * @details Safe from the MQTT event handler, which runs lock commands in interrupt context. Like
+ *          display_state_set, only the request is recorded here and led_access_apply lights the
+ *          LED from the scheduler.
+ *
+ * @param[in]   granted   Light LED_ACCESS_GRANT if true, LED_ACCESS_REJECT otherwise.
+ */
+static void led_access_flash(bool granted)
+{
+    CRITICAL_REGION_ENTER();
+
+    m_led_access_granted = granted;
+
+    if (!m_led_access_queued)
+    {
+        m_led_access_queued = (prio_sched_event_put(SCHED_PRIO_NORMAL, NULL, 0, led_access_apply) == NRF_SUCCESS);
+    }
+
+    CRITICAL_REGION_EXIT();
+}
+
+static void led_access_timeout_handler(iot_timer_time_in_ms_t wall_clock_value)
+{
+    UNUSED_PARAMETER(wall_clock_value);
+
+    LEDS_OFF(LED_ACCESS_GRANT | LED_ACCESS_REJECT);
+}
+
+static void bin_to_hex_str(char * to, const uint8_t * from, const uint32_t size) {
+    uint8_t j = 0;
+    for (uint8_t i = 0; i < size; i++) {
+        to[j++] = hexdigits[from[i] >> 4];
+        to[j++] = hexdigits[from[i] & 0xf];
+    }
+    to[j] = '\0';
+}
+
+/**@brief Function for recording that a packet was sent to the broker, which restarts the keepalive. */
+static void mqtt_tx_activity(void)
+{
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&m_mqtt_last_tx_time));
+}
+
+/**@brief Function for recording that the broker has to answer the packet just sent.
+ *
+ * @details The MQTT module does not report PINGRESP, so a ping is answered by whatever
+ *          mqtt_rx_poll finds lwIP received on the TCP connection after it was sent.
+ */
+static void mqtt_rx_expect(void)
+{
+    if (!m_mqtt_rx_wait)
+    {
+        m_mqtt_rx_wait = true;
+        UNUSED_VARIABLE(iot_timer_wall_clock_get(&m_mqtt_rx_wait_time));
+    }
+}
+
+/**@brief Function for recording that a packet was received from the broker, which proves the link alive. */
+static void mqtt_rx_activity(void)
+{
+    m_mqtt_rx_wait = false;
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&m_mqtt_last_rx_time));
+}
+
+/**@brief Function for recording data lwIP received on the TCP connection since the last poll.
+ *
+ * @details This covers the packets the MQTT module takes without an event, such as PINGRESP.
+ *          The connection is closed, and its pcb freed, in interrupt context, so the state
+ *          check and the read of the pcb are one critical region. m_mqtt_rx_seq starts from
+ *          the pcb at CONNACK, so nothing received before it counts.
+ */
+static void mqtt_rx_poll(void)
+{
+    bool received = false;
+
+    CRITICAL_REGION_ENTER();
+    if ((m_subscriber.state >= APP_MQTT_STATE_CONNECTED) &&
+        (m_sub_mqtt_client.tcp_id != NULL) &&
+        (m_sub_mqtt_client.tcp_id->rcv_nxt != m_mqtt_rx_seq))
+    {
+        m_mqtt_rx_seq = m_sub_mqtt_client.tcp_id->rcv_nxt;
+        received = true;
+    }
+    CRITICAL_REGION_EXIT();
+
+    if (received)
+    {
+        mqtt_rx_activity();
+    }
+}
+
+/**@brief Scheduler handler that runs the oldest event of the highest priority non-empty lane.
+ *
+ * @details One prio_sched_pump event is queued in app_scheduler for every event put in a lane,
+ *          so each pump finds at least one event. Events in the high lane therefore run at the
+ *          next pump, ahead of any backlog in the normal lane. The event is taken out of its lane
+ *          inside a critical region, since MQTT events put new ones from interrupt context.
+ */
+static void prio_sched_pump(void * p_event_data, uint16_t event_size)
+{
+    UNUSED_PARAMETER(p_event_data);
+    UNUSED_PARAMETER(event_size);
+
+    prio_event_t event;
+    bool found = false;
+
+    CRITICAL_REGION_ENTER();
+
+    for (uint32_t i = 0; i < SCHED_PRIO_COUNT; i++)
+    {
+        prio_lane_t * p_lane = &m_sched_lanes[i];
+
+        if (p_lane->count > 0)
+        {
+            event = p_lane->p_events[p_lane->head];
+
+            p_lane->head = (p_lane->head + 1) % p_lane->size;
+            p_lane->count--;
+            found = true;
+            break;
+        }
+    }
+
+    CRITICAL_REGION_EXIT();
+
+    if (found)
+    {
+        event.handler(event.data, event.data_size);
+    }
+}
+
+/**@brief Function for putting an event in one of the scheduler lanes.
+ *
+ * @details Same contract as app_sched_event_put, and safe to call from interrupt context. Lock
+ *          command acknowledgements go in the high lane, connection management and state
+ *          publishes in the normal lane. Events from app_timer are still put directly in the
+ *          app_scheduler queue.
+ *
+ *          The event is written to its lane before the pump is queued, and both happen in one
+ *          critical region, so a pump never runs ahead of its event.
+ */
+static uint32_t prio_sched_event_put(sched_prio_t prio, const void * p_data, uint16_t data_size, app_sched_event_handler_t handler)
+{
+    prio_lane_t * p_lane = &m_sched_lanes[prio];
+    uint32_t err_code = NRF_ERROR_NO_MEM;
+
+    if (data_size > sizeof(worker_param_t))
+    {
+        return NRF_ERROR_NO_MEM;
+    }
+
+    CRITICAL_REGION_ENTER();
+
+    if (p_lane->count < p_lane->size)
+    {
+        prio_event_t * p_event = &p_lane->p_events[(p_lane->head + p_lane->count) % p_lane->size];
+
+        p_event->handler = handler;
+        p_event->data_size = data_size;
+        memcpy(p_event->data, p_data, data_size);
+
+        p_lane->count++;
+
+        err_code = app_sched_event_put(NULL, 0, prio_sched_pump);
+
+        if (err_code != NRF_SUCCESS)
+        {
+            p_lane->count--;
+        }
+        else if (p_lane->count > p_lane->high_water)
+        {
+            p_lane->high_water = p_lane->count;
+        }
+    }
+
+    CRITICAL_REGION_EXIT();
+
+    return err_code;
+}
+
+/**@brief Function for scheduling a failed operation for another attempt.
+ *
+ * @details The operation is re-posted to the scheduler by retry_timeout_handler once its delay
+ *          has elapsed. The delay doubles with each attempt, from RETRY_BASE_DELAY_MS up to
+ *          RETRY_MAX_DELAY_MS. The operation is dropped after RETRY_MAX_ATTEMPTS.
+ *
+ * @param[in]   prio        Scheduler lane the operation is re-posted to.
+ * @param[in]   handler     Scheduler handler that performs the operation.
+ * @param[in]   p_data      Event data passed to the handler. Copied.
+ * @param[in]   data_size   Size of the event data.
+ * @param[in]   attempts    Number of attempts that have failed so far, including this one.
+ *
+ * @return true if the operation will be retried, false if it was dropped.
+ */
+static bool retry_schedule(sched_prio_t prio, app_sched_event_handler_t handler, const void * p_data, uint16_t data_size, uint8_t attempts)
+{
+    if (attempts > RETRY_MAX_ATTEMPTS)
+    {
+        APPL_LOG("[APPL]: retry budget exhausted, dropping operation");
+        m_retry_drop_count++;
+        return false;
+    }
+
+    for (uint32_t i = 0; i < RETRY_QUEUE_SIZE; i++)
+    {
+        retry_entry_t * p_entry = &m_retry_queue[i];
+
+        if (p_entry->in_use == 0)
+        {
+            uint32_t delay = RETRY_BASE_DELAY_MS << (attempts - 1);
+            iot_timer_time_in_ms_t now;
+
+            UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+
+            p_entry->handler   = handler;
+            p_entry->due_time  = now + MIN(delay, RETRY_MAX_DELAY_MS);
+            p_entry->data_size = data_size;
+            p_entry->in_use    = 1;
+            p_entry->prio      = prio;
+            memcpy(p_entry->data, p_data, data_size);
+
+            if (!sw_timer_is_running(&m_retry_timer) ||
+                ((int32_t)(p_entry->due_time - m_retry_timer.due_time) < 0))
+            {
+                sw_timer_start(&m_retry_timer, MIN(delay, RETRY_MAX_DELAY_MS), 0);
+            }
+            return true;
+        }
+    }
+
+    APPL_LOG("[APPL]: retry queue full, dropping operation");
+    m_retry_drop_count++;
+    return false;
+}
+
+/**@brief Timer callback used for re-posting failed operations whose delay has elapsed.
+ *
+ * @details The timer is re-armed for the earliest remaining entry.
+ *
+ * @param[in]   wall_clock_value   The value of the wall clock that triggered the callback.
+ */
+static void retry_timeout_handler(iot_timer_time_in_ms_t wall_clock_value)
+{
+    retry_entry_t * p_next = NULL;
+
+    for (uint32_t i = 0; i < RETRY_QUEUE_SIZE; i++)
+    {
+        retry_entry_t * p_entry = &m_retry_queue[i];
+
+        if (p_entry->in_use == 0)
+        {
+            continue;
+        }
+
+        if (((int32_t)(wall_clock_value - p_entry->due_time) >= 0) &&
+            (prio_sched_event_put(p_entry->prio, p_entry->data, p_entry->data_size, p_entry->handler) == NRF_SUCCESS))
+        {
+            p_entry->in_use = 0;
+            m_retry_count++;
+            continue;
+        }
+
+        if ((p_next == NULL) || ((int32_t)(p_entry->due_time - p_next->due_time) < 0))
+        {
+            p_next = p_entry;
+        }
+    }
+
+    if (p_next != NULL)
+    {
+        int32_t delay = (int32_t)(p_next->due_time - wall_clock_value);
+
+        sw_timer_start(&m_retry_timer, MAX(delay, RETRY_BASE_DELAY_MS), 0);
+    }
+}
+
+static void connect_to_broker(void * p_event_data, uint16_t event_size) {
+    worker_con_param_t con_param = *((worker_con_param_t *)p_event_data);
+    if (con_param.p_worker->state == APP_MQTT_STATE_IDLE)
+    {
+        mqtt_client_t * client = con_param.p_worker->p_client;
+        mqtt_client_init(client);
+
+        m_user = m_identity.client_id;
+        m_pass = m_identity.client_id;
+
+        memset(ipv6_broker_addr.u8 + 2, 0, 14);
+
+        if (p_iot_interface) {
+
+            memcpy(ipv6_broker_addr.u8 + EUI_64_ADDR_SIZE, p_iot_interface->peer_addr.identifier, EUI_64_ADDR_SIZE);
+
+#if (BLE_6LOWPAN_LEGACY_MODE == 1)
+            ipv6_broker_addr.u8[EUI_64_ADDR_SIZE] |= 0x02;
+#endif
+
+            memcpy(client->broker_addr.u8, ipv6_broker_addr.u8, IPV6_ADDR_SIZE);
+
+            client->protocol_version = MQTT_VERSION_3_1_1;
+
+#if defined(FAR_SECURE_ENABLED)
+
+            mq_certificate.p_certificate = &tls_cert[0];
+            mq_certificate.certificate_len = strlen(tls_cert) + 1;
+            mq_certificate.p_private_key = &tls_key[0];
+            mq_certificate.private_key_len = strlen(tls_key) + 1;
+
+            m_tls_keys.p_own_certificate = &mq_certificate;
+            m_tls_keys.p_ca_cert_pem = &ca_cert[0];
+            m_tls_keys.ca_cert_pem_len = strlen(ca_cert) + 1;
+            m_tls_keys.p_psk = NULL;
+            m_tls_keys.p_raw_key = NULL;
+
+            client->broker_port = APP_MQTT_BROKER_PORT_SECURE;
+            client->transport_type = MQTT_TRANSPORT_SECURE;
+            client->p_security_settings = &m_tls_keys;
+#else
+            client->broker_port = APP_MQTT_BROKER_PORT;
+            client->transport_type = MQTT_TRANSPORT_NON_SECURE;
+            client->p_security_settings = NULL;
+#endif
+            client->evt_cb = app_mqtt_evt_handler;
+            client->client_id.p_utf_str = con_param.p_worker->p_utf8_name;
+            client->client_id.utf_strlen = con_param.p_worker->utf8_name_len;
+            client->p_user_name = &m_user;
+            client->p_password = &m_pass;
+            client->clean_session = con_param.clean_session;
+
+            uint32_t err_code = mqtt_connect(client);
+
+            if (err_code == NRF_SUCCESS) {
+                APPL_LOG("[APPL]: CONNECTING - %d", err_code);
+                mqtt_tx_activity();
+
+                con_param.p_worker->state = APP_MQTT_STATE_CONNECTING;
+            } else {
+                APPL_LOG("[APPL]: ERROR CONNECTING - %d", err_code);
+            }
+        } else {
+
+            APPL_LOG("[APPL]: ERROR CONNECTING - no interface");
+
+        }
+    }
+}
+
+static void subscribe_to_topic(void * p_event_data, uint16_t event_size) {
+    worker_sub_param_t sub_param = *((worker_sub_param_t *)p_event_data);
+    if (sub_param.p_worker->state == APP_MQTT_STATE_CONNECTED)
+    {
+        mqtt_topic_t topic =
+                {
+                        .topic = m_identity.sub_topic,
+                        .qos = MQTT_QoS_1_ATLEAST_ONCE
+                };
+
+        const mqtt_subscription_list_t subscription_list =
                 {
                         .p_list     = &topic,
                         .list_count = 1,
@@ -619,6 +1353,8 @@ static void subscribe_to_topic(void * p_event_data, uint16_t event_size) {
         uint32_t err_code = mqtt_subscribe(sub_param.p_worker->p_client, &subscription_list);
         if (err_code == NRF_SUCCESS) {
             APPL_LOG("[APPL]: SUBSCRIBING");
+            mqtt_tx_activity();
+            mqtt_rx_expect();
             sub_param.p_worker->state = APP_MQTT_STATE_SUBSCRIBING;
         } else {
             APPL_LOG("[APPL]: ERROR SUBSCRIBING - %d", err_code);
@@ -662,100 +1398,361 @@ static uint8_t * get_lock_state_str()
     return state_locked_str;
 }
 
-static uint8_t is_empty_uuid(wchar_t * p_uuid) {
-    wchar_t * c = p_uuid;
-    while (*c) {
-        if (*c != L'0' && *c != L'-') {
+static uint8_t is_empty_uuid(const uint8_t * p_uuid) {
+    for (uint8_t i = 0; i < 16; i++) {
+        if (p_uuid[i] != 0) {
             return 0;
         }
-        c++;
     }
     return 1;
 }
 
-static void publish_state(void * p_event_data, uint16_t event_size)
+/**@brief Function for sending a lock state publish.
+ *
+ * @param[in]   p_worker        Worker to publish with.
+ * @param[in]   p_topic_uuid    UUID of the requester to publish to, all zero for the state topic.
+ * @param[in]   p_msg           Payload, a NUL-terminated static string.
+ * @param[in]   message_id      Message identifier.
+ * @param[in]   dup_flag        1 if this is a retransmission.
+ */
+static uint32_t publish_send(mqtt_worker_t * p_worker, const uint8_t * p_topic_uuid, uint8_t * p_msg, uint16_t message_id, uint8_t dup_flag)
 {
-    worker_pub_param_t pub_param = *((worker_pub_param_t *)p_event_data);
+    mqtt_publish_param_t param;
 
-    APPL_LOG("[APPL] publish_state %d", pub_param.p_worker->state)
+    param.message.topic.topic = m_identity.pub_prefix;
 
-    if (pub_param.p_worker->state == APP_MQTT_STATE_CONNECTED
-        || pub_param.p_worker->state == APP_MQTT_STATE_SUBSCRIBED) {
+    if (is_empty_uuid(p_topic_uuid) == 0) {
+        char * p_suffix = &m_identity.pub_topic[m_identity.pub_prefix.utf_strlen];
+        *p_suffix = '/';
+        bin_to_uuid_str(p_suffix + 1, p_topic_uuid, 16);
+        param.message.topic.topic.utf_strlen += UUID_STRLEN + 1;
+    }
+
+    param.message.topic.qos              = MQTT_QoS_1_ATLEAST_ONCE;
+    param.message.payload.p_bin_str      = p_msg;
+    param.message.payload.bin_strlen     = strlen(p_msg);
+    param.message_id                     = message_id;
+    param.dup_flag                       = dup_flag;
+    param.retain_flag                    = 0;
+
+    uint32_t err_code = mqtt_publish(p_worker->p_client, &param);
+
+    if (err_code == NRF_SUCCESS) {
+        mqtt_tx_activity();
+        mqtt_rx_expect();
+    }
+
+    return err_code;
+}
+
+/**@brief Function for arming the in-flight timer for the earliest retransmission, or stopping it
+ *        once the table is empty.
+ *
+ * @param[in]   now     Current wall clock time.
+ */
+static void inflight_timer_arm(iot_timer_time_in_ms_t now)
+{
+    inflight_entry_t * p_next = NULL;
+
+    for (uint32_t i = 0; i < INFLIGHT_TABLE_SIZE; i++)
+    {
+        inflight_entry_t * p_entry = &m_inflight_table[i];
+
+        if ((p_entry->in_use != 0) &&
+            ((p_next == NULL) || ((int32_t)(p_entry->last_send_time - p_next->last_send_time) < 0)))
+        {
+            p_next = p_entry;
+        }
+    }
+
+    if (p_next == NULL)
+    {
+        sw_timer_stop(&m_inflight_timer);
+        return;
+    }
+
+    int32_t delay = (int32_t)(p_next->last_send_time + INFLIGHT_RETRANSMIT_MS - now);
+
+    sw_timer_start(&m_inflight_timer, (uint32_t)MAX(delay, 0), 0);
+}
+
+/**@brief Function for finding the in-flight entry for a new publish.
+ *
+ * @details A pending publish to the same topic carries an older lock state, so its entry is
+ *          reused. Retransmitting it after the newer state would deliver the states out of order.
+ *
+ * @param[in]   p_topic_uuid    UUID of the requester, all zero for the state topic.
+ *
+ * @return Entry to use, or NULL if the table is full.
+ */
+static inflight_entry_t * inflight_entry_get(const uint8_t * p_topic_uuid)
+{
+    inflight_entry_t * p_free = NULL;
+
+    for (uint32_t i = 0; i < INFLIGHT_TABLE_SIZE; i++)
+    {
+        inflight_entry_t * p_entry = &m_inflight_table[i];
+
+        if (p_entry->in_use == 0)
+        {
+            if (p_free == NULL)
+            {
+                p_free = p_entry;
+            }
+        }
+        else if (memcmp(p_entry->topic_uuid, p_topic_uuid, 16) == 0)
+        {
+            return p_entry;
+        }
+    }
+
+    return p_free;
+}
+
+/**@brief Function for retiring the in-flight entry a PUBACK acknowledges.
+ *
+ * @details The latency is counted from the first transmission, so retransmissions show up in the
+ *          upper buckets of the histogram. Like the rest of the in-flight table, this runs in main
+ *          context only.
+ *
+ * @param[in]   message_id  Message identifier of the PUBACK.
+ */
+static void inflight_acknowledge(uint16_t message_id)
+{
+    for (uint32_t i = 0; i < INFLIGHT_TABLE_SIZE; i++)
+    {
+        inflight_entry_t * p_entry = &m_inflight_table[i];
+
+        if ((p_entry->in_use != 0) && (p_entry->message_id == message_id))
+        {
+            iot_timer_time_in_ms_t now;
+            uint32_t bucket = 0;
+
+            wall_clock_sync();
+            UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
 
-        uint8_t * msg = get_lock_state_str();
+            while ((bucket < PUBACK_LATENCY_BUCKET_COUNT - 1) &&
+                   ((uint32_t)(now - p_entry->send_time) >= ((uint32_t)PUBACK_LATENCY_BUCKET_MS << bucket)))
+            {
+                bucket++;
+            }
+            m_puback_latency_hist[bucket]++;
+
+            p_entry->in_use = 0;
+            inflight_timer_arm(now);
+            return;
+        }
+    }
+
+    m_puback_unknown_count++;
+}
 
-        mqtt_publish_param_t param;
+/**@brief Scheduler handler retiring the in-flight entry of a PUBACK event.
+ *
+ * @details The MQTT events run in interrupt context, where the in-flight table could be in the
+ *          middle of an update or a retransmission, so the event only records the message
+ *          identifier.
+ */
+static void inflight_acknowledge_handler(void * p_event_data, uint16_t event_size)
+{
+    UNUSED_PARAMETER(event_size);
 
-        char topic[UUID_STRLEN + 1];
+    mqtt_puback_param_t puback = *((mqtt_puback_param_t *)p_event_data);
 
-        bin_to_uuid_str(topic, pub_param.topic_uuid, 16);
+    inflight_acknowledge(puback.message_id);
+}
 
-        wchar_t uuidStr[UUID_STRLEN + 1];
+/**@brief Timer callback used for retransmitting publishes whose PUBACK is overdue.
+ *
+ * @details Overdue publishes are sent again with the DUP flag and their original message
+ *          identifier. While the worker is not connected they are held, and are sent once the
+ *          connection is back. A publish is dropped after INFLIGHT_MAX_TRANSMITS.
+ *
+ * @param[in]   wall_clock_value   The value of the wall clock that triggered the callback.
+ */
+static void inflight_timeout_handler(iot_timer_time_in_ms_t wall_clock_value)
+{
+    bool connected = (m_subscriber.state == APP_MQTT_STATE_CONNECTED) ||
+                     (m_subscriber.state == APP_MQTT_STATE_SUBSCRIBED);
 
-        mbstowcs(uuidStr, topic, UUID_STRLEN + 1);
+    for (uint32_t i = 0; i < INFLIGHT_TABLE_SIZE; i++)
+    {
+        inflight_entry_t * p_entry = &m_inflight_table[i];
 
-        uint8_t deviceIdBin[DEVICE_ID_SIZE_BIN];
+        if ((p_entry->in_use == 0) ||
+            ((int32_t)(wall_clock_value - (p_entry->last_send_time + INFLIGHT_RETRANSMIT_MS)) < 0))
+        {
+            continue;
+        }
 
-        deviceIdBin[0] = DEVICE_TYPE_ID;
+        if (connected)
+        {
+            if (p_entry->transmits >= INFLIGHT_MAX_TRANSMITS)
+            {
+                APPL_LOG("[APPL]: no PUBACK for message %d, dropping it", p_entry->message_id);
+                m_inflight_drop_count++;
+                p_entry->in_use = 0;
+                continue;
+            }
 
-        for (uint32_t i = 0; i < sizeof(eui48_t); i++) {
-            deviceIdBin[DEVICE_ID_SIZE_BIN-1-i] = ipv6_medium_eui48.identifier[i];
+            if (publish_send(&m_subscriber, p_entry->topic_uuid, p_entry->p_payload, p_entry->message_id, 1) == NRF_SUCCESS)
+            {
+                APPL_LOG("[APPL]: retransmitted message %d", p_entry->message_id);
+                m_inflight_retransmit_count++;
+                p_entry->transmits++;
+            }
         }
 
-        char topicStr[(sizeof(deviceIdBin)*2)+1];
+        p_entry->last_send_time = wall_clock_value;
+    }
+
+    inflight_timer_arm(wall_clock_value);
+}
+
+/**@brief Function for publishing the lock state and tracking it until its PUBACK.
+ *
+ * @return NRF_ERROR_NO_MEM if the in-flight table is full, otherwise the result of mqtt_publish.
+ */
+static uint32_t publish_state_to(mqtt_worker_t * p_worker, const uint8_t * p_topic_uuid)
+{
+    uint8_t * msg = get_lock_state_str();
+    inflight_entry_t * p_entry = inflight_entry_get(p_topic_uuid);
 
-        bin_to_hex_str(topicStr, deviceIdBin, sizeof(deviceIdBin));
+    if (p_entry == NULL) {
+        APPL_LOG("in-flight table full, deferring publish");
+        m_inflight_full_count++;
+        return NRF_ERROR_NO_MEM;
+    }
 
-        wchar_t topic_wcs[sizeof(topicStr)];
+    uint32_t err_code = publish_send(p_worker, p_topic_uuid, msg, m_message_counter, 0);
 
-        mbstowcs(topic_wcs, topicStr, sizeof(topicStr));
+    if (err_code == NRF_SUCCESS) {
+        APPL_LOG("successful publish");
 
-        int resp_topic_len = wcslen(topic_wcs) + wcslen(m_pub_prefix) + wcslen(state_topic);
+        if (p_entry->in_use != 0) {
+            m_inflight_superseded_count++;
+        }
 
-        if (is_empty_uuid(uuidStr) == 0) {
-            resp_topic_len += (wcslen(uuidStr) + 1);
+        wall_clock_sync();
+        UNUSED_VARIABLE(iot_timer_wall_clock_get(&p_entry->send_time));
+        memcpy(p_entry->topic_uuid, p_topic_uuid, 16);
+        p_entry->p_payload      = msg;
+        p_entry->last_send_time = p_entry->send_time;
+        p_entry->message_id     = m_message_counter;
+        p_entry->transmits      = 1;
+        p_entry->in_use         = 1;
+
+        if (!sw_timer_is_running(&m_inflight_timer)) {
+            inflight_timer_arm(p_entry->send_time);
         }
 
-        wchar_t response_topic[resp_topic_len + 1]; // +1 for the \0
+        // Message identifier 0 is not allowed.
+        m_message_counter = (m_message_counter == UINT16_MAX) ? 1 : m_message_counter + 1;
+    } else {
+        APPL_LOG("unsuccessful publish err_code = %d", err_code);
+    }
+
+    return err_code;
+}
+
+/**@brief Function for ending a flush of the pending state publishes.
+ *
+ * @details Requests merged in while the flush ran stay pending. If the worker is connected they
+ *          get a new flush, otherwise they wait for the next one after the link is up.
+ */
+static void state_pub_flush_done(mqtt_worker_t * p_worker)
+{
+    bool pending = false;
 
-        wcscpy(response_topic, topic_wcs);
-        wcscat(response_topic, m_pub_prefix);
-        wcscat(response_topic, state_topic);
+    CRITICAL_REGION_ENTER();
 
-        if (is_empty_uuid(uuidStr) == 0) {
-            wcscat(response_topic, L"/");
-            wcscat(response_topic, uuidStr);
+    if (p_worker->state == APP_MQTT_STATE_CONNECTED
+        || p_worker->state == APP_MQTT_STATE_SUBSCRIBED) {
+        for (uint32_t i = 0; i < STATE_PUB_SLOT_COUNT; i++) {
+            if (m_state_pub_slots[i].dirty != 0) {
+                pending = true;
+            }
         }
+    }
 
-        u8_toutf8(pub_utf8_buf, sizeof(pub_utf8_buf), response_topic, -1);
+    if (pending) {
+        worker_pub_param_t pub_param = {
+                .p_worker = p_worker,
+                .attempts = 0
+        };
 
-        param.message.topic.qos              = MQTT_QoS_1_ATLEAST_ONCE;
-        param.message.topic.topic.p_utf_str  = (uint8_t *)pub_utf8_buf;
-        param.message.topic.topic.utf_strlen = wcslen(response_topic);
-        param.message.payload.p_bin_str      = msg,
-                param.message.payload.bin_strlen     = strlen(msg);
-        param.message_id                     = m_message_counter;
-        param.dup_flag                       = 0;
-        param.retain_flag                    = 0;
+        pending = (prio_sched_event_put(SCHED_PRIO_NORMAL, &pub_param, sizeof(worker_pub_param_t), publish_state) == NRF_SUCCESS);
+    }
+    m_state_pub_flush_queued = pending;
 
-        uint32_t err_code = mqtt_publish(pub_param.p_worker->p_client, &param);
+    CRITICAL_REGION_EXIT();
+}
 
-        if (err_code == NRF_SUCCESS) {
-            APPL_LOG("successful publish");
-            m_message_counter += 1;
-        } else {
-            APPL_LOG("unsuccessful publish err_code = %d", err_code);
-            app_sched_event_put(&pub_param, sizeof(worker_pub_param_t), publish_state);
+/**@brief Scheduler handler that sends the current lock state to every pending destination.
+ *
+ * @details Destinations stay pending while the worker is not connected, and are sent once the
+ *          next publish_state runs after the link is up. A failed publish leaves the remaining
+ *          destinations pending and is retried with backoff. m_state_pub_flush_queued stays set
+ *          until the retry runs, so new requests do not start a flush with a fresh budget.
+ *
+ *          Requests are queued from interrupt context. A slot is read and cleared inside a
+ *          critical region, and only cleared if no request was merged into it meanwhile.
+ */
+static void publish_state(void * p_event_data, uint16_t event_size)
+{
+    worker_pub_param_t pub_param = *((worker_pub_param_t *)p_event_data);
+
+    APPL_LOG("[APPL] publish_state %d", pub_param.p_worker->state)
+
+    if (pub_param.p_worker->state == APP_MQTT_STATE_CONNECTED
+        || pub_param.p_worker->state == APP_MQTT_STATE_SUBSCRIBED) {
+
+        for (uint32_t i = 0; i < STATE_PUB_SLOT_COUNT; i++) {
+            state_pub_slot_t * p_slot = &m_state_pub_slots[i];
+            uint8_t topic_uuid[16];
+            uint8_t generation;
+            bool dirty;
+
+            CRITICAL_REGION_ENTER();
+            dirty = (p_slot->dirty != 0);
+            generation = p_slot->generation;
+            memcpy(topic_uuid, p_slot->topic_uuid, 16);
+            CRITICAL_REGION_EXIT();
+
+            if (!dirty) {
+                continue;
+            }
+
+            if (publish_state_to(pub_param.p_worker, topic_uuid) != NRF_SUCCESS) {
+                pub_param.attempts++;
+                if (!retry_schedule(SCHED_PRIO_NORMAL, publish_state, &pub_param, sizeof(worker_pub_param_t), pub_param.attempts)) {
+                    CRITICAL_REGION_ENTER();
+                    m_state_pub_flush_queued = false;
+                    CRITICAL_REGION_EXIT();
+                }
+                return;
+            }
+
+            CRITICAL_REGION_ENTER();
+            if (p_slot->generation == generation) {
+                p_slot->dirty = 0;
+            }
+            CRITICAL_REGION_EXIT();
         }
     }
+
+    state_pub_flush_done(pub_param.p_worker);
 }
 
 static void acknowledge_message(void * p_event_data, uint16_t event_size) {
     worker_ack_param_t ack_param = *((worker_ack_param_t *)p_event_data);
 
     uint32_t err_code = mqtt_publish_ack(ack_param.p_worker->p_client, (mqtt_puback_param_t * )&ack_param.message_id);
-    if (err_code != NRF_SUCCESS) {
-        app_sched_event_put(&ack_param, sizeof(worker_ack_param_t), acknowledge_message);
+    if (err_code == NRF_SUCCESS) {
+        mqtt_tx_activity();
+    } else {
+        ack_param.attempts++;
+        retry_schedule(SCHED_PRIO_HIGH, acknowledge_message, &ack_param, sizeof(worker_ack_param_t), ack_param.attempts);
     }
 }
 
@@ -768,17 +1765,137 @@ static void acknowledge_message(void * p_event_data, uint16_t event_size) {
 //    }
 //}
 
-static void queue_state_publish() {
+/**@brief Function for requesting a publish of the lock state.
+ *
+ * @details Requests for a destination that is already pending are merged, so a burst of switch
+ *          edges within one scheduler pass results in a single publish carrying the latest state.
+ *          Called from interrupt context as well as from the main loop.
+ *
+ * @param[in]   p_topic_uuid   UUID of the requester to reply to, or NULL for the state topic.
+ */
+static void queue_state_publish(const uint8_t * p_topic_uuid) {
 
     APPL_LOG("[APPL] queue_state_publish()")
 
-    worker_pub_param_t pub_param;
+    state_pub_slot_t * p_slot = NULL;
+
+    CRITICAL_REGION_ENTER();
+
+    if ((p_topic_uuid == NULL) || is_empty_uuid(p_topic_uuid)) {
+        p_slot = &m_state_pub_slots[0];
+    } else {
+        for (uint32_t i = 1; i < STATE_PUB_SLOT_COUNT; i++) {
+            if (m_state_pub_slots[i].dirty != 0 &&
+                memcmp(m_state_pub_slots[i].topic_uuid, p_topic_uuid, 16) == 0) {
+                p_slot = &m_state_pub_slots[i];
+                break;
+            }
+            if (p_slot == NULL && m_state_pub_slots[i].dirty == 0) {
+                p_slot = &m_state_pub_slots[i];
+            }
+        }
+    }
+
+    if (p_slot == NULL) {
+        m_state_pub_drop_count++;
+    } else {
+        if (p_slot->dirty != 0) {
+            m_state_pub_coalesced_count++;
+        } else {
+            if (p_topic_uuid != NULL) {
+                memcpy(p_slot->topic_uuid, p_topic_uuid, 16);
+            } else {
+                memset(p_slot->topic_uuid, 0, 16);
+            }
+            p_slot->dirty = 1;
+        }
+        p_slot->generation++;
+
+        if (!m_state_pub_flush_queued) {
+            worker_pub_param_t pub_param = {
+                    .p_worker = &m_subscriber,
+                    .attempts = 0
+            };
+
+            m_state_pub_flush_queued = (prio_sched_event_put(SCHED_PRIO_NORMAL, &pub_param, sizeof(worker_pub_param_t), publish_state) == NRF_SUCCESS);
+        }
+    }
+
+    CRITICAL_REGION_EXIT();
+
+    if (p_slot == NULL) {
+        APPL_LOG("[APPL] no free state publish slot");
+    }
+}
+
+/**@brief Function for computing the delay before the next connect attempt.
+ *
+ * @details The delay doubles with every step, from RECONNECT_BASE_DELAY_MS up to
+ *          RECONNECT_MAX_DELAY_MS. Up to RECONNECT_JITTER_PERCENT of it is randomly taken off, so
+ *          the cap is never exceeded. Without random numbers from the SoftDevice the full delay
+ *          is used.
+ */
+static uint32_t reconnect_delay_get(void)
+{
+    uint32_t delay = RECONNECT_BASE_DELAY_MS;
+    uint32_t rnd;
+
+    for (uint8_t i = 0; (i < m_reconnect_step) && (delay < RECONNECT_MAX_DELAY_MS); i++)
+    {
+        delay <<= 1;
+    }
+    delay = MIN(delay, RECONNECT_MAX_DELAY_MS);
+
+    uint32_t jitter = delay / 100 * RECONNECT_JITTER_PERCENT;
+
+    if ((jitter > 0) && (sd_rand_application_vector_get((uint8_t *)&rnd, sizeof(rnd)) == NRF_SUCCESS))
+    {
+        delay -= rnd % (jitter + 1);
+    }
+
+    return delay;
+}
+
+/**@brief Function for recording a connect attempt and holding back the next one.
+ *
+ * @param[in]   now     Wall clock time of the attempt.
+ */
+static void reconnect_attempt(iot_timer_time_in_ms_t now)
+{
+    m_reconnect_due_time = now + reconnect_delay_get();
+    m_reconnect_wait = true;
+    m_reconnect_attempt_count++;
+
+    if (m_reconnect_step < UINT8_MAX)
+    {
+        m_reconnect_step++;
+    }
+}
+
+/**@brief Function for feeding a refused CONNACK into the reconnect backoff.
+ *
+ * @details MQTT_SERVER_UNAVAILABLE is transient and keeps the normal backoff. A refused client id,
+ *          protocol version or credentials will not fix itself within seconds, so the next attempt
+ *          is pushed back by RECONNECT_REJECT_STEPS extra doublings.
+ *
+ * @param[in]   result  Return code of the CONNACK.
+ */
+static void reconnect_rejected(uint32_t result)
+{
+    iot_timer_time_in_ms_t now;
 
-    pub_param.p_worker = &m_subscriber;
+    m_reconnect_reject_count++;
 
-    memset(pub_param.topic_uuid, 0, 16);
+    if (result != MQTT_SERVER_UNAVAILABLE)
+    {
+        m_reconnect_step = MIN(m_reconnect_step + RECONNECT_REJECT_STEPS, UINT8_MAX);
 
-    app_sched_event_put(&pub_param, sizeof(worker_pub_param_t), publish_state);
+        // The wall clock only advances when synced, and this runs from the CONNACK event.
+        wall_clock_sync();
+        UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+        m_reconnect_due_time = now + reconnect_delay_get();
+        m_reconnect_wait = true;
+    }
 }
 
 static void autoconnect_handler(mqtt_worker_t * worker, char * label_str) {
@@ -786,12 +1903,21 @@ static void autoconnect_handler(mqtt_worker_t * worker, char * label_str) {
         switch(worker->state) {
             case APP_MQTT_STATE_IDLE:
             {
+                iot_timer_time_in_ms_t now;
+
+                UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+
+                if (m_reconnect_wait && ((int32_t)(now - m_reconnect_due_time) < 0)) {
+                    break;
+                }
+
                 APPL_LOG ("[APPL]: autoconnect_timeout_handler [%s] MQTT STATE IDLE\r\n", label_str);
+                reconnect_attempt(now);
                 worker_con_param_t con_param = {
                         .p_worker = worker,
-                        .clean_session = 1
+                        .clean_session = (APP_MQTT_PERSISTENT_SESSION == 0)
                 };
-                app_sched_event_put(&con_param, sizeof(worker_con_param_t), connect_to_broker);
+                prio_sched_event_put(SCHED_PRIO_NORMAL, &con_param, sizeof(worker_con_param_t), connect_to_broker);
                 break;
             }
             case APP_MQTT_STATE_CONNECTED:
@@ -801,7 +1927,7 @@ static void autoconnect_handler(mqtt_worker_t * worker, char * label_str) {
                     worker_sub_param_t sub_param = {
                             .p_worker = worker
                     };
-                    app_sched_event_put(&sub_param, sizeof(worker_sub_param_t), subscribe_to_topic);
+                    prio_sched_event_put(SCHED_PRIO_NORMAL, &sub_param, sizeof(worker_sub_param_t), subscribe_to_topic);
                 }
                 break;
             }
@@ -815,25 +1941,161 @@ static void set_display_state(void) {
             case APP_MQTT_STATE_IDLE:
             case APP_MQTT_STATE_CONNECTING:
             {
-                m_display_state = LEDS_IPV6_IF_UP;
+                display_state_set(LEDS_IPV6_IF_UP);
                 break;
             }
             case APP_MQTT_STATE_CONNECTED:
             case APP_MQTT_STATE_SUBSCRIBING:
             {
-                m_display_state = LEDS_CONNECTED_TO_BROKER;
+                display_state_set(LEDS_CONNECTED_TO_BROKER);
                 break;
             }
             case APP_MQTT_STATE_SUBSCRIBED:
             {
-                m_display_state = LEDS_SUBSCRIBED_TO_TOPIC;
-                break;
+                display_state_set(LEDS_SUBSCRIBED_TO_TOPIC);
+                break;
+            }
+            default:
+            {
+                display_state_set(LEDS_IPV6_IF_UP);
+                break;
+            }
+        }
+    }
+}
+
+/**@brief Function for starting a subscribed session.
+ *
+ * @details Scheduled on SUBACK, or on CONNACK when the broker resumed a session that holds the
+ *          subscription, so the initial state is published without waiting for the next
+ *          autoconnect tick. The tick calls it as well if a session was never started.
+ */
+static void subscribed_enter(void)
+{
+    iot_timer_time_in_ms_t now;
+
+    wall_clock_sync();
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+
+    idle_start_time = 0;
+    stable_start_time = (now != 0) ? now : 1;
+    m_subscribed_time = now;
+    queue_state_publish(NULL);
+    set_display_state();
+}
+
+/**@brief Scheduler handler starting the subscribed session reported by an MQTT event.
+ *
+ * @details The MQTT events run in interrupt context. A session that went away before this runs is
+ *          left to the autoconnect tick.
+ */
+static void subscribed_enter_handler(void * p_event_data, uint16_t event_size)
+{
+    UNUSED_PARAMETER(p_event_data);
+    UNUSED_PARAMETER(event_size);
+
+    if (m_subscriber.state == APP_MQTT_STATE_SUBSCRIBED)
+    {
+        subscribed_enter();
+    }
+}
+
+/**@brief Function for taking the next recovery stage once the current one has timed out.
+ *
+ * @details While the subscriber is not subscribed, the stages are taken in order, each after its
+ *          own timeout: the MQTT connection is closed, then the TCP connection is aborted, then
+ *          the BLE link is dropped so the IPv6 medium re-enters connectable mode, and only then is
+ *          the chip reset. Every stage but the last lets the next autoconnect tick connect without
+ *          waiting for the reconnect backoff. The ladder starts over from the first stage once a
+ *          subscription is made.
+ *
+ * @param[in]   wall_clock_value   Current wall clock time.
+ */
+static void recovery_step(iot_timer_time_in_ms_t wall_clock_value)
+{
+    iot_timer_time_in_ms_t since = (m_recovery_stage == RECOVERY_STAGE_NONE) ? idle_start_time : m_recovery_stage_time;
+
+    if ((m_recovery_stage + 1 >= RECOVERY_STAGE_COUNT) ||
+        ((uint32_t)(wall_clock_value - since) < m_recovery_timeout_ms[m_recovery_stage + 1]))
+    {
+        return;
+    }
+
+    m_recovery_stage++;
+    m_recovery_stage_time = wall_clock_value;
+    m_recovery_count[m_recovery_stage]++;
+    m_reconnect_wait = false;
+
+    switch (m_recovery_stage)
+    {
+        case RECOVERY_STAGE_MQTT:
+        {
+            APPL_LOG("[APPL]: recovery: closing MQTT connection");
+            // A connection that got as far as CONNACK is closed with a DISCONNECT, and the
+            // DISCONNECT event makes the worker idle. Nothing else can be closed cleanly.
+            if ((m_subscriber.state == APP_MQTT_STATE_CONNECTED) ||
+                (m_subscriber.state == APP_MQTT_STATE_SUBSCRIBING))
+            {
+                if (mqtt_disconnect(m_subscriber.p_client) == NRF_SUCCESS)
+                {
+                    break;
+                }
+            }
+            if (m_subscriber.state != APP_MQTT_STATE_IDLE)
+            {
+                UNUSED_VARIABLE(mqtt_abort(m_subscriber.p_client));
+                m_subscriber.state = APP_MQTT_STATE_IDLE;
+            }
+            break;
+        }
+        case RECOVERY_STAGE_TCP:
+        {
+            APPL_LOG("[APPL]: recovery: aborting TCP connection");
+            if (m_subscriber.state != APP_MQTT_STATE_IDLE)
+            {
+                UNUSED_VARIABLE(mqtt_abort(m_subscriber.p_client));
+                m_subscriber.state = APP_MQTT_STATE_IDLE;
+            }
+            break;
+        }
+        case RECOVERY_STAGE_MEDIUM:
+        {
+            APPL_LOG("[APPL]: recovery: cycling the IPv6 medium");
+            if (m_subscriber.state != APP_MQTT_STATE_IDLE)
+            {
+                UNUSED_VARIABLE(mqtt_abort(m_subscriber.p_client));
+                m_subscriber.state = APP_MQTT_STATE_IDLE;
+            }
+            // Connectable mode cannot be entered while the link is up. Drop the link, and
+            // CONN_DOWN enters connectable mode. Without a link the medium should be advertising
+            // already, in which case the SoftDevice reports NRF_ERROR_INVALID_STATE.
+            if (m_conn_handle != BLE_CONN_HANDLE_INVALID)
+            {
+                uint32_t err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+                if (err_code != NRF_SUCCESS)
+                {
+                    APPL_LOG("[APPL]: recovery: disconnect failed %d", err_code);
+                }
             }
-            default:
+            else
             {
-                m_display_state = LEDS_IPV6_IF_UP;
-                break;
+                uint32_t err_code = ipv6_medium_connectable_mode_enter(m_ipv6_medium.ipv6_medium_instance_id);
+                if (err_code == NRF_SUCCESS)
+                {
+                    display_state_set(LEDS_CONNECTABLE_MODE);
+                }
+                else if (err_code != NRF_ERROR_INVALID_STATE)
+                {
+                    APP_ERROR_CHECK(err_code);
+                }
             }
+            break;
+        }
+        default:
+        {
+            APPL_LOG("[APPL]: recovery: issuing system reset");
+            NVIC_SystemReset();
+            break;
         }
     }
 }
@@ -842,49 +2104,43 @@ static void autoconnect_timeout_handler(iot_timer_time_in_ms_t wall_clock_value)
 {
     if (m_subscriber.state != APP_MQTT_STATE_SUBSCRIBED)
     {
+        if (stable_start_time != 0) keepalive_connection_lost(wall_clock_value);
         stable_time = 0;
         stable_start_time = 0;
         if (idle_start_time == 0) idle_start_time = wall_clock_value;
         idle_time = wall_clock_value - idle_start_time;
         led_cxn_stable = false;
+
+        recovery_step(wall_clock_value);
     } else {
         idle_time = 0;
         idle_start_time = 0;
+        m_recovery_stage = RECOVERY_STAGE_NONE;
         if (stable_start_time == 0) {
-            stable_start_time = wall_clock_value;
-            queue_state_publish();
+            subscribed_enter();
         }
         stable_time = wall_clock_value - stable_start_time;
+
+        if (stable_time >= RECONNECT_RESET_STABLE_MS) {
+            m_reconnect_step = 0;
+            m_reconnect_wait = false;
+        }
     }
 
-    if (idle_time <= IDLE_RESET_TIMEOUT_MS)
-    {
-        autoconnect_handler(&m_subscriber, "SUB");
+    autoconnect_handler(&m_subscriber, "SUB");
 
-        if (stable_time >= STABLE_TIMEOUT_MS)
-        {
-            if (led_cxn_stable <= 0)
-            {
-                led_cxn_stable_blinkon = false;
-                LEDS_OFF(LED_CXN);
-                led_cxn_blink_count = LED_BLINK_CXN_STABLE_MULT;
-            }
-            led_cxn_stable = true;
+    if (stable_time >= STABLE_TIMEOUT_MS)
+    {
+        led_cxn_stable = true;
 
-            if (stable_time >= AUTO_PUBLISH_TIMEOUT_MS) {
-                stable_start_time = wall_clock_value - STABLE_TIMEOUT_MS;
-                queue_state_publish();
-            }
-        }
-        else
-        {
-            led_cxn_stable = false;
+        if (stable_time >= AUTO_PUBLISH_TIMEOUT_MS) {
+            stable_start_time = wall_clock_value - STABLE_TIMEOUT_MS;
+            queue_state_publish(NULL);
         }
     }
     else
     {
-        APPL_LOG("Idle for too long, issuing system reset.");
-        NVIC_SystemReset();
+        led_cxn_stable = false;
     }
 
     set_display_state();
@@ -919,7 +2175,7 @@ static void lock()
     if (m_lock_state == LOCK_STATE_UNLOCKED)
     {
         APPL_LOG("commencing lock operation");
-        led_access_blink_count = 5;
+        led_access_flash(true);
         m_lock_state = LOCK_STATE_LOCKING;
         m_pending_lock_state = LOCK_STATE_LOCKED;
         actuate_motor(100, m_lock_direction);
@@ -931,7 +2187,7 @@ static void lock()
     {
         APPL_LOG("aborting lock operation");
     }
-    led_dbg_on = true;
+    led_dbg_set(true);
 }
 
 static void unlock()
@@ -940,7 +2196,7 @@ static void unlock()
     if (m_lock_state == LOCK_STATE_LOCKED)
     {
         APPL_LOG("commencing unlock operation");
-        led_access_blink_count = 5;
+        led_access_flash(true);
         m_lock_state = LOCK_STATE_UNLOCKING;
         m_pending_lock_state = LOCK_STATE_UNLOCKED;
         actuate_motor(100, m_lock_direction == LOCK_DIRECTION_LEFT ? LOCK_DIRECTION_RIGHT : LOCK_DIRECTION_LEFT);
@@ -952,7 +2208,7 @@ static void unlock()
     {
         APPL_LOG("aborting unlock operation");
     }
-    led_dbg_on = false;
+    led_dbg_set(false);
 }
 
 static void set_lock_state_from_pos_switch(void)
@@ -963,13 +2219,13 @@ static void set_lock_state_from_pos_switch(void)
         {
             APPL_LOG("set lock state = locked");
             m_lock_state = LOCK_STATE_LOCKED;
-            led_dbg_on = true;
+            led_dbg_set(true);
         }
         else
         {
             APPL_LOG("set lock state = unlocked");
             m_lock_state = LOCK_STATE_UNLOCKED;
-            led_dbg_on = false;
+            led_dbg_set(false);
         }
     }
     else
@@ -978,13 +2234,13 @@ static void set_lock_state_from_pos_switch(void)
         {
             APPL_LOG("set lock state = unlocked");
             m_lock_state = LOCK_STATE_UNLOCKED;
-            led_dbg_on = false;
+            led_dbg_set(false);
         }
         else
         {
             APPL_LOG("set lock state = locked");
             m_lock_state = LOCK_STATE_LOCKED;
-            led_dbg_on = true;
+            led_dbg_set(true);
         }
     }
 }
@@ -999,13 +2255,13 @@ static void button_event_handler(uint8_t pin_no, uint8_t button_action)
             case BTN_DBG:
             {
                 APPL_LOG("dbg button pushed");
-                led_dbg_on = true;
+                led_dbg_set(true);
                 break;
             }
             case BTN_PRG:
             {
                 APPL_LOG("prg button pushed");
-                led_access_blink_count = 5;
+                led_access_flash(true);
                 break;
             }
             case SW_LOCK_DIR:
@@ -1019,9 +2275,7 @@ static void button_event_handler(uint8_t pin_no, uint8_t button_action)
             {
                 APPL_LOG("lock position switch on");
                 if (m_lock_state == LOCK_STATE_LOCKING || m_lock_state == LOCK_STATE_UNLOCKING) {
-                    app_timer_start(m_pwm_timer_src_id,
-                                    APP_TIMER_TICKS(250),
-                                    &m_pending_lock_state);
+                    sw_timer_start(&m_pwm_timer, MOTOR_STOP_DELAY_MS, 0);
                 }
                 if (m_lock_direction == LOCK_DIRECTION_LEFT)
                 {
@@ -1046,8 +2300,8 @@ static void button_event_handler(uint8_t pin_no, uint8_t button_action)
             case BTN_DBG:
             {
                 APPL_LOG("dbg button released");
-                led_dbg_on = false;
-                queue_state_publish();
+                led_dbg_set(false);
+                queue_state_publish(NULL);
                 break;
             }
             case BTN_PRG:
@@ -1066,9 +2320,7 @@ static void button_event_handler(uint8_t pin_no, uint8_t button_action)
             {
                 APPL_LOG("lock position switch off");
                 if (m_lock_state == LOCK_STATE_LOCKING || m_lock_state == LOCK_STATE_UNLOCKING) {
-                    app_timer_start(m_pwm_timer_src_id,
-                                    APP_TIMER_TICKS(250),
-                                    &m_pending_lock_state);
+                    sw_timer_start(&m_pwm_timer, MOTOR_STOP_DELAY_MS, 0);
                 }
                 if (m_lock_direction == LOCK_DIRECTION_LEFT)
                 {
@@ -1088,7 +2340,7 @@ static void button_event_handler(uint8_t pin_no, uint8_t button_action)
     }
 
     if (m_lock_state != old_state) {
-        queue_state_publish();
+        queue_state_publish(NULL);
     }
 }
 
@@ -1125,21 +2377,14 @@ static void button_init(void)
     set_lock_state_from_pos_switch();
 }
 
-/**@brief Function for initializing IP stack.
+/**@brief Function for building the identity strings of this device.
  *
- * @details Initialize the IP Stack and its driver.
+ * @details The device id is DEVICE_TYPE_ID followed by the EUI-48 in reverse byte order, hex
+ *          encoded. It is used as client id, username and password, and as the root of every
+ *          topic, so it is built here once instead of on every connect, subscribe and publish.
  */
-static void ip_stack_init(void)
+static void identity_init(void)
 {
-    uint32_t err_code;
-
-    err_code = ipv6_medium_eui64_get(m_ipv6_medium.ipv6_medium_instance_id,
-                                     &eui64_local_iid);
-    APP_ERROR_CHECK(err_code);
-
-    err_code = ipv6_medium_eui48_get(m_ipv6_medium.ipv6_medium_instance_id,
-                                     &ipv6_medium_eui48);
-
     uint8_t deviceIdBin[DEVICE_ID_SIZE_BIN];
 
     deviceIdBin[0] = DEVICE_TYPE_ID;
@@ -1148,18 +2393,48 @@ static void ip_stack_init(void)
         deviceIdBin[DEVICE_ID_SIZE_BIN-1-i] = ipv6_medium_eui48.identifier[i];
     }
 
-    char clientIdStr[(sizeof(deviceIdBin)*2)+1];
+    bin_to_hex_str(m_identity.device_id, deviceIdBin, sizeof(deviceIdBin));
 
-    bin_to_hex_str(clientIdStr, deviceIdBin, sizeof(deviceIdBin));
+    m_identity.client_id.p_utf_str = (uint8_t *)m_identity.device_id;
+    m_identity.client_id.utf_strlen = DEVICE_ID_STRLEN;
 
-    wchar_t clientId_wcs[sizeof(clientIdStr)];
+    memcpy(m_identity.sub_filter, m_identity.device_id, DEVICE_ID_STRLEN);
+    memcpy(&m_identity.sub_filter[DEVICE_ID_STRLEN], m_topic_prefix, sizeof(m_topic_prefix));
+
+    m_identity.sub_topic.p_utf_str = (uint8_t *)m_identity.sub_filter;
+    m_identity.sub_topic.utf_strlen = DEVICE_ID_STRLEN + sizeof(m_topic_prefix) - 1;
+
+    char * p_pub = m_identity.pub_topic;
+    memcpy(p_pub, m_identity.device_id, DEVICE_ID_STRLEN);
+    p_pub += DEVICE_ID_STRLEN;
+    memcpy(p_pub, m_pub_prefix, sizeof(m_pub_prefix) - 1);
+    p_pub += sizeof(m_pub_prefix) - 1;
+    memcpy(p_pub, state_topic_utf8, sizeof(state_topic_utf8));
+
+    m_identity.pub_prefix.p_utf_str = (uint8_t *)m_identity.pub_topic;
+    m_identity.pub_prefix.utf_strlen = DEVICE_ID_STRLEN + sizeof(m_pub_prefix) - 1 + sizeof(state_topic_utf8) - 1;
+}
+
+/**@brief Function for initializing IP stack.
+ *
+ * @details Initialize the IP Stack and its driver.
+ */
+static void ip_stack_init(void)
+{
+    uint32_t err_code;
 
-    mbstowcs(clientId_wcs, clientIdStr, sizeof(clientIdStr));
+    err_code = ipv6_medium_eui64_get(m_ipv6_medium.ipv6_medium_instance_id,
+                                     &eui64_local_iid);
+    APP_ERROR_CHECK(err_code);
 
-    u8_toutf8(client_id_utf8_buf, sizeof(client_id_utf8_buf), clientId_wcs, -1);
+    err_code = ipv6_medium_eui48_get(m_ipv6_medium.ipv6_medium_instance_id,
+                                     &ipv6_medium_eui48);
 
     APP_ERROR_CHECK(err_code);
 
+    identity_init();
+    commands_init();
+
     err_code = nrf_mem_init();
     APP_ERROR_CHECK(err_code);
 
@@ -1176,38 +2451,180 @@ static void ip_stack_init(void)
 }
 
 
-/**@brief Timer callback used for periodic servicing of LwIP protocol timers.
- *        This trigger is also used in the example to trigger sending TCP Connection.
+/**@brief Function for getting the number of KEEPALIVE_GROW_MS periods the subscription has lasted.
+ *
+ * @details stable_time cannot be used for this, as the periodic state publish restarts it.
+ */
+static uint32_t keepalive_steps_get(iot_timer_time_in_ms_t now)
+{
+    if (m_subscriber.state != APP_MQTT_STATE_SUBSCRIBED)
+    {
+        return 0;
+    }
+
+    return (now - m_subscribed_time) / KEEPALIVE_GROW_MS;
+}
+
+/**@brief Function for getting the current ping interval.
+ *
+ * @details The interval is KEEPALIVE_BASE_MS after a connect, halved once for each disconnect
+ *          recorded in m_keepalive_shrink. Every KEEPALIVE_GROW_MS the subscription lasts first
+ *          pays back one halving and then doubles the interval, up to KEEPALIVE_MAX_MS.
+ *
+ * @param[in]   now     Current wall clock time.
+ */
+static uint32_t keepalive_interval_get(iot_timer_time_in_ms_t now)
+{
+    uint32_t steps = keepalive_steps_get(now);
+    uint32_t interval = KEEPALIVE_BASE_MS;
+
+    if (steps < m_keepalive_shrink)
+    {
+        return MAX(KEEPALIVE_BASE_MS >> (m_keepalive_shrink - steps), KEEPALIVE_MIN_MS);
+    }
+
+    for (steps -= m_keepalive_shrink; (steps > 0) && (interval < KEEPALIVE_MAX_MS); steps--)
+    {
+        interval <<= 1;
+    }
+
+    return MIN(interval, KEEPALIVE_MAX_MS);
+}
+
+/**@brief Function for shrinking the ping interval after a subscription was lost.
  *
- * @details Timer callback used for periodic servicing of LwIP protocol timers.
+ * @details Called from the autoconnect tick once the subscription is gone, whether the broker
+ *          dropped it or the keepalive aborted it. The halvings the subscription has not paid back
+ *          carry over, so disconnects in a row bring the interval down to KEEPALIVE_MIN_MS.
  *
- * @param[in]   wall_clock_value   The value of the wall clock that triggered the callback.
+ * @param[in]   now     Current wall clock time.
  */
-static void system_timer_callback(iot_timer_time_in_ms_t wall_clock_value)
+static void keepalive_connection_lost(iot_timer_time_in_ms_t now)
 {
-    UNUSED_VARIABLE(wall_clock_value);
+    uint32_t steps = (now - m_subscribed_time) / KEEPALIVE_GROW_MS;
+    uint32_t shrink = (steps < m_keepalive_shrink) ? (m_keepalive_shrink - steps) : 0;
 
-    sys_check_timeouts();
-    UNUSED_VARIABLE(mqtt_live());
+    m_keepalive_shrink = MIN(shrink + 1, KEEPALIVE_SHRINK_MAX);
 }
 
+/**@brief Function for getting the time until the next keepalive action.
+ *
+ * @details A ping is due one interval after the last packet sent, so application traffic such as
+ *          the periodic state publish makes pings unnecessary. An unanswered publish or subscribe
+ *          is due KEEPALIVE_RESPONSE_TIMEOUT_MS after it was sent.
+ */
+static int32_t keepalive_due_in(iot_timer_time_in_ms_t now)
+{
+    int32_t due_in = (int32_t)(m_mqtt_last_tx_time + keepalive_interval_get(now) - now);
+
+    if (m_mqtt_rx_wait)
+    {
+        due_in = MIN(due_in, (int32_t)(m_mqtt_rx_wait_time + KEEPALIVE_RESPONSE_TIMEOUT_MS - now));
+    }
+
+    return due_in;
+}
 
-/**@brief Function for updating the wall clock of the IoT Timer module.
+/**@brief Function for sending a ping when one is due, and for aborting a connection the broker no
+ *        longer answers.
  *
- * @param[in]   p_context   Pointer used for passing context. No context used in this application.
+ * @param[in]   now     Current wall clock time.
  */
-static void iot_timer_tick_callback(void * p_context)
+static void keepalive_service(iot_timer_time_in_ms_t now)
 {
-    UNUSED_VARIABLE(p_context);
+    if (m_subscriber.state < APP_MQTT_STATE_CONNECTED)
+    {
+        m_mqtt_rx_wait = false;
+        return;
+    }
 
-    uint32_t err_code = iot_timer_update();
+    mqtt_rx_poll();
 
-    APP_ERROR_CHECK(err_code);
+    if (m_mqtt_rx_wait && ((int32_t)(now - (m_mqtt_rx_wait_time + KEEPALIVE_RESPONSE_TIMEOUT_MS)) >= 0))
+    {
+        APPL_LOG("[APPL]: no answer from broker, aborting connection");
+        m_keepalive_dead_count++;
+        m_mqtt_rx_wait = false;
+        UNUSED_VARIABLE(mqtt_abort(m_subscriber.p_client));
+        m_subscriber.state = APP_MQTT_STATE_IDLE;
+        return;
+    }
+
+    if ((int32_t)(now - (m_mqtt_last_tx_time + keepalive_interval_get(now))) >= 0)
+    {
+        if (mqtt_ping(m_subscriber.p_client) == NRF_SUCCESS)
+        {
+            m_keepalive_ping_count++;
+            mqtt_tx_activity();
+            mqtt_rx_expect();
+        }
+    }
 }
 
-static void pwm_timer_callback(void * p_context)
+/**@brief Function for arming the LwIP service timer for the nearest LwIP or MQTT deadline.
+ *
+ * @details The nearest deadline is the next LwIP timeout, or the next keepalive action while
+ *          connected.
+ *
+ * @param[in]   only_if_earlier   Keep a running timer unless the new deadline is before it.
+ */
+static void lwip_service_arm(bool only_if_earlier)
 {
-    UNUSED_VARIABLE(p_context);
+    iot_timer_time_in_ms_t now;
+    uint32_t sleep_ms = sys_timeouts_sleeptime();
+
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+
+#if (MQTT_KEEPALIVE > 0)
+    if (m_subscriber.state >= APP_MQTT_STATE_CONNECTED)
+    {
+        sleep_ms = MIN(sleep_ms, (uint32_t)MAX(keepalive_due_in(now), 0));
+    }
+#endif
+
+    sleep_ms = MAX(MIN(sleep_ms, LWIP_SERVICE_MAX_SLEEP_MS), LWIP_SERVICE_MIN_SLEEP_MS);
+
+    if (only_if_earlier && sw_timer_is_running(&m_lwip_timer) &&
+        ((int32_t)(now + sleep_ms - m_lwip_timer.due_time) >= 0))
+    {
+        return;
+    }
+
+    sw_timer_start(&m_lwip_timer, sleep_ms, 0);
+}
+
+
+/**@brief Timer callback used for servicing LwIP protocol timers and the MQTT keepalive.
+ *
+ * @details Instead of polling every tick, the timer is armed for the nearest deadline only. It is
+ *          pulled in from the main loop when RX/TX activity schedules an earlier LwIP timeout.
+ *
+ * @param[in]   wall_clock_value   The value of the wall clock that triggered the callback.
+ */
+static void lwip_timeout_handler(iot_timer_time_in_ms_t wall_clock_value)
+{
+    iot_timer_time_in_ms_t now = wall_clock_value;
+
+    sys_check_timeouts();
+    UNUSED_VARIABLE(mqtt_live());
+
+#if (MQTT_KEEPALIVE > 0)
+    keepalive_service(now);
+
+    // mqtt_live has sent a ping if the connection was idle for too long.
+    if ((int32_t)(now - (m_mqtt_last_tx_time + MQTT_PING_INTERVAL_MS)) >= 0)
+    {
+        m_mqtt_last_tx_time = now;
+    }
+#endif
+
+    lwip_service_arm(false);
+}
+
+
+static void pwm_timeout_handler(iot_timer_time_in_ms_t wall_clock_value)
+{
+    UNUSED_PARAMETER(wall_clock_value);
 
     APPL_LOG("stopping motor operation");
 
@@ -1227,50 +2644,27 @@ static void timers_init(void)
     // Initialize timer module.
     APP_ERROR_CHECK(app_timer_init());
 
-    // Create a sys timer.
+    // Create the tick source of the software timers.
     err_code = app_timer_create(&m_iot_timer_tick_src_id,
-                                APP_TIMER_MODE_REPEATED,
-                                iot_timer_tick_callback);
-
-    APP_ERROR_CHECK(err_code);
-
-    //Create PWM timer
-    err_code = app_timer_create(&m_pwm_timer_src_id,
                                 APP_TIMER_MODE_SINGLE_SHOT,
-                                pwm_timer_callback);
+                                sw_timer_tick_callback);
 
     APP_ERROR_CHECK(err_code);
 }
 
 
-/**@brief Function for initializing the IoT Timer. */
+/**@brief Function for initializing the IoT Timer.
+ *
+ * @details The IoT Timer only provides the wall clock used by LwIP and MQTT. Periodic work runs
+ *          from software timers, which wake the CPU at their deadlines only.
+ */
 static void iot_timer_init(void)
 {
-    uint32_t err_code;
-
-    static const iot_timer_client_t list_of_clients[] =
-            {
-                    {system_timer_callback,      	LWIP_SYS_TICK_MS},
-                    {blink_timeout_handler,      	LED_BLINK_INTERVAL_MS},
-                    {autoconnect_timeout_handler,  	AUTOCONNECT_TIMER_INTERVAL_MS}
-            };
+    m_wall_clock_ref_ticks = app_timer_cnt_get();
 
-    // The list of IoT Timer clients is declared as a constant.
-    static const iot_timer_clients_list_t iot_timer_clients =
-            {
-                    (sizeof(list_of_clients) / sizeof(iot_timer_client_t)),
-                    &(list_of_clients[0]),
-            };
-
-    // Passing the list of clients to the IoT Timer module.
-    err_code = iot_timer_client_list_set(&iot_timer_clients);
-    APP_ERROR_CHECK(err_code);
+    sw_timer_start(&m_autoconnect_timer, AUTOCONNECT_TIMER_INTERVAL_MS, AUTOCONNECT_TIMER_INTERVAL_MS);
 
-    // Starting the app timer instance that is the tick source for the IoT Timer.
-    err_code = app_timer_start(m_iot_timer_tick_src_id,
-                               APP_TIMER_TICKS(IOT_TIMER_RESOLUTION_IN_MS),
-                               NULL);
-    APP_ERROR_CHECK(err_code);
+    lwip_service_arm(false);
 }
 
 /**@brief Function for the Event Scheduler initialization.
@@ -1319,7 +2713,7 @@ void nrf_driver_interface_up(iot_interface_t const * p_interface)
 
     sys_check_timeouts();
 
-    m_display_state = LEDS_IPV6_IF_UP;
+    display_state_set(LEDS_IPV6_IF_UP);
 
     p_iot_interface = p_interface;
 }
@@ -1334,21 +2728,42 @@ void nrf_driver_interface_down(iot_interface_t const * p_interface)
 
     p_iot_interface = NULL;
 
-    m_display_state = LEDS_IPV6_IF_DOWN;
+    display_state_set(LEDS_IPV6_IF_DOWN);
     m_subscriber.state = APP_MQTT_STATE_IDLE;
 }
 
-static void uuid_str_to_bin(uint8_t * to, const char * from) {
+static int8_t hex_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**@brief Function for decoding a requester UUID in its 8-4-4-4-12 string form.
+ *
+ * @details The string comes straight from a publish payload, so its layout is checked before
+ *          it is trusted: UUID_STRLEN bytes with dashes at offsets 8, 13, 18 and 23 and hex
+ *          digits of either case everywhere else. Nothing past UUID_STRLEN bytes is read.
+ *
+ * @param[out]  to      16 bytes for the binary UUID. Undefined if the string is malformed.
+ * @param[in]   from    UUID string, at least UUID_STRLEN bytes.
+ *
+ * @return true if the string is a well-formed UUID.
+ */
+static bool uuid_str_to_bin(uint8_t * to, const char * from) {
     uint8_t j = 0;
     for (uint8_t i = 0; i < 16; i++) {
-        if (from[j] == '-') j++;
-        int h = (int)(strchr(hexdigits, from[j]) - hexdigits);
-        int l = (int)(strchr(hexdigits, from[j+1]) - hexdigits);
-        if (h > 15) h -= 6;
-        if (l > 15) l -= 6;
-        *(to+i) = (hexbytes[h] << 4) | hexbytes[l];
+        if (j == 8 || j == 13 || j == 18 || j == 23) {
+            if (from[j] != '-') return false;
+            j++;
+        }
+        int8_t h = hex_nibble(from[j]);
+        int8_t l = hex_nibble(from[j+1]);
+        if (h < 0 || l < 0) return false;
+        *(to+i) = (uint8_t)((h << 4) | l);
         j+=2;
     }
+    return true;
 }
 
 static void log_mqtt_connack_result(const uint32_t result, char * label) {
@@ -1386,7 +2801,157 @@ static void log_mqtt_connack_result(const uint32_t result, char * label) {
     }
 }
 
+/**@brief Function for locating the command part of an inbound topic.
+ *
+ * @details Inbound topics have the form "<device id>/i/<command>". The subscription filter is
+ *          "<device id>/i/#", so its literal "<device id>/i/" prefix is all there is to match and
+ *          a single memcmp does it. The command is the rest of the topic.
+ *
+ * @param[in]   p_topic     Topic of the received publish.
+ * @param[out]  p_cmd_len   Length of the command in bytes.
+ *
+ * @return Pointer to the first byte of the command, or NULL if the topic is not addressed to us.
+ */
+static const uint8_t * inbound_topic_command(const mqtt_utf8_t * p_topic, uint32_t * p_cmd_len)
+{
+    if ((p_topic->p_utf_str == NULL) ||
+        (p_topic->utf_strlen <= device_id_strlen) ||
+        (memcmp(p_topic->p_utf_str, m_identity.sub_filter, device_id_strlen) != 0))
+    {
+        return NULL;
+    }
+
+    *p_cmd_len = p_topic->utf_strlen - device_id_strlen;
+
+    return p_topic->p_utf_str + device_id_strlen;
+}
+
+static bool cmd_state_handler(const mqtt_publish_param_t * p_publish)
+{
+    // Accept binary or ASCII 0 and 1.
+    if((p_publish->message.payload.p_bin_str[0] == 0) ||
+       (p_publish->message.payload.p_bin_str[0] == 0x30))
+    {
+        unlock();
+    }
+    else if((p_publish->message.payload.p_bin_str[0] == 1) ||
+            (p_publish->message.payload.p_bin_str[0] == 0x31))
+    {
+        lock();
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static bool cmd_state_request_handler(const mqtt_publish_param_t * p_publish)
+{
+    uint8_t topic_uuid[16];
+
+    if (((p_publish->message.payload.bin_strlen > UUID_STRLEN) &&
+         (p_publish->message.payload.p_bin_str[UUID_STRLEN] != '\0')) ||
+        !uuid_str_to_bin(topic_uuid, (const char *)p_publish->message.payload.p_bin_str))
+    {
+        return false;
+    }
+
+    queue_state_publish(topic_uuid);
+    return true;
+}
+
+/**@brief Commands accepted under "<device id>/i/".
+ *
+ * @details To add a command, add a handler and an entry here. Publishes whose payload length is
+ *          outside [min_payload_len, max_payload_len] are rejected before the handler is called,
+ *          and a handler rejects a payload it cannot parse by returning false. The requester UUID
+ *          of lock/getstate may carry a trailing NUL.
+ */
+static const app_cmd_t m_commands[] =
+        {
+                APP_CMD(state_topic_utf8,           1,              1,                  cmd_state_handler),
+                APP_CMD(state_request_topic_utf8,   UUID_STRLEN,    UUID_STRLEN + 1,    cmd_state_request_handler)
+        };
+
+static uint32_t                             m_cmd_dispatch_count[ARRAY_SIZE(m_commands)];           /**< Number of publishes routed to each entry of m_commands. */
+static uint32_t                             m_cmd_reject_count;                                     /**< Number of publishes that matched no command or failed its payload constraints. */
+static uint8_t                              m_cmd_by_len[APP_CMD_NAME_MAX_LEN + 1];                 /**< 1 + index in m_commands of the first command of each name length, 0 for none. */
+static uint8_t                              m_cmd_next[ARRAY_SIZE(m_commands)];                     /**< 1 + index of the next command with the same name length, 0 for none. */
+
+/**@brief Function for indexing m_commands on the name length.
+ *
+ * @details All command names share the "lock/" prefix, so the length is what tells them apart.
+ *          Commands of equal length are chained in table order.
+ */
+static void commands_init(void)
+{
+    for (uint32_t i = ARRAY_SIZE(m_commands); i-- > 0;)
+    {
+        uint8_t name_len = m_commands[i].name_len;
+
+        if (name_len > APP_CMD_NAME_MAX_LEN)
+        {
+            APP_ERROR_CHECK(NRF_ERROR_INVALID_LENGTH);
+            continue;
+        }
+
+        m_cmd_next[i] = m_cmd_by_len[name_len];
+        m_cmd_by_len[name_len] = (uint8_t)(i + 1);
+    }
+}
+
+/**@brief Function for routing an inbound publish to its command handler.
+ *
+ * @details The command length selects the candidates through m_cmd_by_len, so a lookup costs one
+ *          memcmp per command of that length, and adding a command of another length costs the
+ *          other routes nothing.
+ */
+static void dispatch_command(const mqtt_publish_param_t * p_publish)
+{
+    uint32_t cmd_len;
+    const uint8_t * p_cmd = inbound_topic_command(&p_publish->message.topic.topic, &cmd_len);
+
+    // Topic names must be well-formed UTF-8, reject anything else before matching on it.
+    if ((p_cmd != NULL) && (cmd_len <= APP_CMD_NAME_MAX_LEN) && u8_validate((char *)p_cmd, cmd_len))
+    {
+        for (uint32_t i = m_cmd_by_len[cmd_len]; i != 0; i = m_cmd_next[i - 1])
+        {
+            const app_cmd_t * p_entry = &m_commands[i - 1];
+
+            if (memcmp(p_cmd, p_entry->p_name, cmd_len) != 0)
+            {
+                continue;
+            }
+
+            if ((p_publish->message.payload.bin_strlen < p_entry->min_payload_len) ||
+                (p_publish->message.payload.bin_strlen > p_entry->max_payload_len))
+            {
+                APPL_LOG ("[APPL]: >> [SUB] bad payload length %d\r\n", p_publish->message.payload.bin_strlen);
+                break;
+            }
+
+            if (!p_entry->handler(p_publish))
+            {
+                APPL_LOG ("[APPL]: >> [SUB] malformed payload\r\n");
+                break;
+            }
+
+            m_cmd_dispatch_count[i - 1]++;
+            return;
+        }
+    }
+
+    APPL_LOG ("[APPL]: >> [SUB] publish rejected\r\n");
+    m_cmd_reject_count++;
+}
+
 void app_mqtt_evt_handler(mqtt_client_t * const p_client, const mqtt_evt_t * p_evt) {
+    if (p_evt->id != MQTT_EVT_DISCONNECT)
+    {
+        mqtt_rx_activity();
+    }
+
     switch(p_evt->id)
     {
         case MQTT_EVT_CONNACK:
@@ -1396,9 +2961,35 @@ void app_mqtt_evt_handler(mqtt_client_t * const p_client, const mqtt_evt_t * p_e
             {
                 APPL_LOG ("[APPL]: >> [SUB] MQTT_CONNECTION_ACCEPTED\r\n");
                 m_subscriber.state = APP_MQTT_STATE_CONNECTED;
+                if (p_client->tcp_id != NULL)
+                {
+                    m_mqtt_rx_seq = p_client->tcp_id->rcv_nxt;
+                }
+
+                if (!p_evt->param.connack.session_present_flag) {
+                    m_session_subscribed = false;
+                }
+
+                // A resumed session still holds the subscription, and the commands queued while
+                // we were offline follow this CONNACK. Otherwise subscribe right away instead of
+                // waiting for the next autoconnect tick, which only retries if this request could
+                // not be sent.
+                if (m_session_subscribed) {
+                    APPL_LOG ("[APPL]: >> [SUB] session resumed\r\n");
+                    m_session_resume_count++;
+                    m_subscriber.state = APP_MQTT_STATE_SUBSCRIBED;
+                    prio_sched_event_put(SCHED_PRIO_NORMAL, NULL, 0, subscribed_enter_handler);
+                } else if (m_subscriber.subscriber > 0) {
+                    worker_sub_param_t sub_param = {
+                            .p_worker = &m_subscriber
+                    };
+                    prio_sched_event_put(SCHED_PRIO_NORMAL, &sub_param, sizeof(worker_sub_param_t), subscribe_to_topic);
+                }
+                set_display_state();
             } else {
                 m_subscriber.state = APP_MQTT_STATE_IDLE;
                 log_mqtt_connack_result(p_evt->result, "SUB");
+                reconnect_rejected(p_evt->result);
             }
             break;
         }
@@ -1411,42 +3002,10 @@ void app_mqtt_evt_handler(mqtt_client_t * const p_client, const mqtt_evt_t * p_e
                         .p_worker = &m_subscriber,
                         .message_id = p_evt->param.publish.message_id
                 };
-                app_sched_event_put(&ack_param, sizeof(worker_ack_param_t), acknowledge_message);
-            }
-
-            int topicSz = p_evt->param.publish.message.topic.topic.utf_strlen;
-
-            wchar_t topicStr[topicSz+1];
-
-            UNUSED_VARIABLE(u8_toucs(topicStr, topicSz+1, p_evt->param.publish.message.topic.topic.p_utf_str, -1));
-
-            if (wcscmp(&topicStr[device_id_strlen], state_topic) == 0)
-            {
-                if (p_evt->param.publish.message.payload.bin_strlen == 1)
-                {
-                    // Accept binary or ASCII 0 and 1.
-                    if((p_evt->param.publish.message.payload.p_bin_str[0] == 0) ||
-                       (p_evt->param.publish.message.payload.p_bin_str[0] == 0x30))
-                    {
-                        unlock();
-                    }
-                    else if((p_evt->param.publish.message.payload.p_bin_str[0] == 1) ||
-                            (p_evt->param.publish.message.payload.p_bin_str[0] == 0x31))
-                    {
-                        lock();
-                    }
-                }
+                prio_sched_event_put(SCHED_PRIO_HIGH, &ack_param, sizeof(worker_ack_param_t), acknowledge_message);
             }
-            else if (wcscmp(&topicStr[device_id_strlen], state_request_topic) == 0)
-            {
-                worker_pub_param_t pub_param;
-
-                pub_param.p_worker = &m_subscriber;
 
-                uuid_str_to_bin(pub_param.topic_uuid, p_evt->param.publish.message.payload.p_bin_str);
-
-                app_sched_event_put(&pub_param, sizeof(worker_pub_param_t), publish_state);
-            }
+            dispatch_command(&p_evt->param.publish);
             break;
         }
         case MQTT_EVT_DISCONNECT:
@@ -1458,6 +3017,13 @@ void app_mqtt_evt_handler(mqtt_client_t * const p_client, const mqtt_evt_t * p_e
         case MQTT_EVT_PUBACK:
         {
             APPL_LOG ("[APPL]: >> [SUB] MQTT_EVT_PUBACK\r\n");
+            // With the high lane full the entry stays in flight. It is retransmitted with the DUP
+            // flag, and the PUBACK for the retransmission retires it.
+            if (prio_sched_event_put(SCHED_PRIO_HIGH, &p_evt->param.puback, sizeof(mqtt_puback_param_t), inflight_acknowledge_handler) != NRF_SUCCESS)
+            {
+                APPL_LOG ("[APPL]: >> [SUB] no room for PUBACK %d, waiting for the retransmission\r\n", p_evt->param.puback.message_id);
+                m_puback_drop_count++;
+            }
             break;
         }
         case MQTT_EVT_SUBACK:
@@ -1465,6 +3031,8 @@ void app_mqtt_evt_handler(mqtt_client_t * const p_client, const mqtt_evt_t * p_e
             APPL_LOG ("[APPL]: >> [SUB] MQTT_EVT_SUBACK\r\n");
             if (p_evt->result == NRF_SUCCESS) {
                 m_subscriber.state = APP_MQTT_STATE_SUBSCRIBED;
+                m_session_subscribed = true;
+                prio_sched_event_put(SCHED_PRIO_NORMAL, NULL, 0, subscribed_enter_handler);
             }
             break;
         }
@@ -1490,7 +3058,7 @@ static void connectable_mode_enter(void)
     APP_ERROR_CHECK(err_code);
 
     APPL_LOG("Physical layer in connectable mode.");
-    m_display_state = LEDS_CONNECTABLE_MODE;
+    display_state_set(LEDS_CONNECTABLE_MODE);
     m_subscriber.state = APP_MQTT_STATE_IDLE;
 }
 
@@ -1502,13 +3070,18 @@ static void on_ipv6_medium_evt(ipv6_medium_evt_t * p_ipv6_medium_evt)
         case IPV6_MEDIUM_EVT_CONN_UP:
         {
             APPL_LOG("Physical layer: connected.");
+            if (p_ipv6_medium_evt->medium_specific.ble.p_ble_evt != NULL)
+            {
+                m_conn_handle = p_ipv6_medium_evt->medium_specific.ble.p_ble_evt->evt.gap_evt.conn_handle;
+            }
             m_ipv6_state = APP_IPV6_IF_UP;
-            m_display_state = LEDS_IPV6_IF_UP;
+            display_state_set(LEDS_IPV6_IF_UP);
             break;
         }
         case IPV6_MEDIUM_EVT_CONN_DOWN:
         {
             APPL_LOG("Physical layer: disconnected.");
+            m_conn_handle = BLE_CONN_HANDLE_INVALID;
             m_ipv6_state = APP_IPV6_IF_DOWN;
             connectable_mode_enter();
             break;
@@ -1583,8 +3156,13 @@ int main(void)
     // Enter main loop.
     for (;;)
     {
+        wall_clock_sync();
+
         app_sched_execute();
 
+        // RX/TX activity may have scheduled an LwIP timeout before the armed one.
+        lwip_service_arm(true);
+
         if (NRF_LOG_PROCESS() == false)
         {
             // Sleep waiting for an application event.
@@ -6485,7 +6485,7 @@
 
 
 #ifndef MQTT_KEEPALIVE
-#define MQTT_KEEPALIVE 60
+#define MQTT_KEEPALIVE 600
 #endif
 
 // <o> MQTT_MAX_PACKET_LENGTH - Maximum MQTT packet size that can be sent (including the fixed and variable header).  <5-268435460> 
@@ -0,0 +1,170 @@
+/*
+ * Builds farlock.c into a host test and drives it through sim.c.
+ *
+ * The firmware is included as a source file so the tests can reach its static functions and
+ * state. Its main() is renamed; fl_boot runs the same initialization and fl_loop one pass of the
+ * main loop.
+ */
+#ifndef FARLOCK_TEST_H__
+#define FARLOCK_TEST_H__
+
+#define main farlock_main
+#include "../farlock.c"
+#undef main
+
+#include "sim.h"
+#include "unit.h"
+
+static iot_interface_t fl_interface;
+
+/* With fl_broker set, every QoS 1 publish that goes out is answered with a PUBACK on the next
+ * pass of the main loop. */
+static bool     fl_broker;
+static uint16_t fl_broker_pubacks[32];
+static uint32_t fl_broker_pending;
+
+static uint32_t fl_broker_publish(const mqtt_publish_param_t * p_param)
+{
+    if (fl_broker && p_param->message.topic.qos == MQTT_QoS_1_ATLEAST_ONCE &&
+        fl_broker_pending < ARRAY_SIZE(fl_broker_pubacks))
+        fl_broker_pubacks[fl_broker_pending++] = p_param->message_id;
+    return NRF_SUCCESS;
+}
+
+static void fl_loop(void)
+{
+    wall_clock_sync();
+    app_sched_execute();
+    while (fl_broker && fl_broker_pending > 0)
+    {
+        mqtt_evt_t evt;
+        memset(&evt, 0, sizeof(evt));
+        evt.id = MQTT_EVT_PUBACK;
+        evt.param.puback.message_id = fl_broker_pubacks[--fl_broker_pending];
+        app_mqtt_evt_handler(m_subscriber.p_client, &evt);
+        app_sched_execute();
+    }
+    lwip_service_arm(true);
+}
+
+static void fl_boot(void)
+{
+    sim_idle_hook = fl_loop;
+    sim_publish_hook = fl_broker_publish;
+    pwm_init();
+    motor_init();
+    scheduler_init();
+    leds_init();
+    timers_init();
+    iot_timer_init();
+    button_init();
+    ipv6_medium_eui48 = sim_eui48;
+    ipv6_medium_eui48.identifier[EUI_48_SIZE - 1] = 0x00;
+    ip_stack_init();
+    connectable_mode_enter();
+    fl_loop();
+}
+
+static void fl_evt(mqtt_evt_id_t id, uint32_t result)
+{
+    mqtt_evt_t evt;
+    memset(&evt, 0, sizeof(evt));
+    evt.id = id;
+    evt.result = result;
+    app_mqtt_evt_handler(m_subscriber.p_client, &evt);
+    fl_loop();
+}
+
+static void fl_connack(uint8_t session_present, uint32_t return_code)
+{
+    mqtt_evt_t evt;
+    memset(&evt, 0, sizeof(evt));
+    evt.id = MQTT_EVT_CONNACK;
+    evt.result = return_code;
+    evt.param.connack.session_present_flag = session_present;
+    evt.param.connack.return_code = return_code;
+    if (m_subscriber.p_client->tcp_id != NULL)
+        m_subscriber.p_client->tcp_id->rcv_nxt += 4;
+    app_mqtt_evt_handler(m_subscriber.p_client, &evt);
+    fl_loop();
+}
+
+static void fl_puback(uint16_t message_id)
+{
+    mqtt_evt_t evt;
+    memset(&evt, 0, sizeof(evt));
+    evt.id = MQTT_EVT_PUBACK;
+    evt.param.puback.message_id = message_id;
+    app_mqtt_evt_handler(m_subscriber.p_client, &evt);
+    fl_loop();
+}
+
+/* Delivers an inbound QoS 1 publish without running the main loop after it, as from the MQTT
+ * event in interrupt context. */
+static void fl_publish_in_irq(const char * p_topic, const void * p_payload, uint32_t payload_len, uint16_t message_id)
+{
+    mqtt_evt_t evt;
+    memset(&evt, 0, sizeof(evt));
+    evt.id = MQTT_EVT_PUBLISH;
+    evt.param.publish.message.topic.topic.p_utf_str = (uint8_t *)p_topic;
+    evt.param.publish.message.topic.topic.utf_strlen = strlen(p_topic);
+    evt.param.publish.message.topic.qos = MQTT_QoS_1_ATLEAST_ONCE;
+    evt.param.publish.message.payload.p_bin_str = (uint8_t *)p_payload;
+    evt.param.publish.message.payload.bin_strlen = payload_len;
+    evt.param.publish.message_id = message_id;
+    app_mqtt_evt_handler(m_subscriber.p_client, &evt);
+}
+
+static void fl_publish_in(const char * p_topic, const void * p_payload, uint32_t payload_len, uint16_t message_id)
+{
+    fl_publish_in_irq(p_topic, p_payload, payload_len, message_id);
+    fl_loop();
+}
+
+#define FL_CONN_HANDLE  0x0010
+
+/* Delivers a medium event, bringing the simulated BLE link up or down with it. */
+static void fl_medium_evt(ipv6_medium_evt_id_t id)
+{
+    static ble_evt_t ble_evt;
+    ipv6_medium_evt_t evt;
+    memset(&evt, 0, sizeof(evt));
+    evt.ipv6_medium_evt_id = id;
+    if (id == IPV6_MEDIUM_EVT_CONN_UP)
+    {
+        sim_ble_conn_handle = FL_CONN_HANDLE;
+        sim_ble_advertising = false;
+        ble_evt.evt.gap_evt.conn_handle = FL_CONN_HANDLE;
+        evt.medium_specific.ble.p_ble_evt = &ble_evt;
+    }
+    else if (id == IPV6_MEDIUM_EVT_CONN_DOWN)
+    {
+        sim_ble_conn_handle = BLE_CONN_HANDLE_INVALID;
+    }
+    on_ipv6_medium_evt(&evt);
+    fl_loop();
+}
+
+/* Brings the BLE link and the interface up and lets the autoconnect tick issue the connect. */
+static void fl_link_up(void)
+{
+    if (m_ipv6_state != APP_IPV6_IF_UP)
+        fl_medium_evt(IPV6_MEDIUM_EVT_CONN_UP);
+    nrf_driver_interface_up(&fl_interface);
+    fl_loop();
+    uint32_t connects = sim_mqtt.connect;
+    for (int i = 0; i < 600 && sim_mqtt.connect == connects; i++)
+        sim_run_ms(100);
+}
+
+/* Brings the link up and answers CONNACK and SUBACK until the worker is subscribed. */
+static void fl_subscribe(void)
+{
+    if (m_subscriber.state == APP_MQTT_STATE_IDLE)
+        fl_link_up();
+    fl_connack(0, MQTT_CONNECTION_ACCEPTED);
+    if (m_subscriber.state != APP_MQTT_STATE_SUBSCRIBED)
+        fl_evt(MQTT_EVT_SUBACK, NRF_SUCCESS);
+}
+
+#endif // FARLOCK_TEST_H__
@@ -0,0 +1,34 @@
+/*
+ * The pre-optimization utf8.c functions, renamed ref_*. See ref_utf8.c.
+ */
+#ifndef REF_UTF8_H__
+#define REF_UTF8_H__
+
+#include <sys/types.h>
+#include <stddef.h>
+
+#ifndef isutf
+#define isutf(c) (((c)&0xC0)!=0x80)
+#endif
+
+int ref_u8_seqlen(char *s);
+int ref_u8_toucs(u_int32_t *dest, int sz, char *src, int srcsz);
+int ref_u8_toutf8(char *dest, int sz, u_int32_t *src, int srcsz);
+int ref_u8_wc_toutf8(char *dest, u_int32_t ch);
+int ref_u8_offset(char *str, int charnum);
+int ref_u8_charnum(char *s, int offset);
+int ref_u8_strlen(char *s);
+u_int32_t ref_u8_nextchar(char *s, int *i);
+void ref_u8_inc(char *s, int *i);
+void ref_u8_dec(char *s, int *i);
+int ref_octal_digit(char c);
+int ref_hex_digit(char c);
+int ref_u8_read_escape_sequence(char *str, u_int32_t *dest);
+int ref_u8_unescape(char *buf, int sz, char *src);
+int ref_u8_escape_wchar(char *buf, int sz, u_int32_t ch);
+int ref_u8_escape(char *buf, int sz, char *src, int escape_quotes);
+char *ref_u8_strchr(char *s, u_int32_t ch, int *charn);
+char *ref_u8_memchr(char *s, u_int32_t ch, size_t sz, int *charn);
+int ref_u8_is_locale_utf8(char *locale);
+
+#endif // REF_UTF8_H__
@@ -0,0 +1,524 @@
+/*
+ * Host simulation of the SDK services farlock.c runs on. See sim.h.
+ */
+#include <stdio.h>
+#include "sim.h"
+
+#define SIM_TIMER_COUNT     4
+#define SIM_SCHED_SIZE      256
+#define SIM_SCHED_DATA_MAX  64
+
+typedef struct
+{
+    app_timer_t                 * p_id;
+    app_timer_timeout_handler_t   handler;
+    app_timer_mode_t              mode;
+    bool                          running;
+    uint32_t                      due;
+    uint32_t                      interval;
+    void                        * p_context;
+} sim_timer_t;
+
+typedef struct
+{
+    app_sched_event_handler_t handler;
+    uint16_t                  size;
+    uint8_t                   data[SIM_SCHED_DATA_MAX];
+} sim_event_t;
+
+uint32_t sim_rtc;
+uint32_t sim_wakeups;
+void (*sim_idle_hook)(void);
+
+uint32_t sim_sched_puts;
+uint32_t sim_sched_high_water;
+void (*sim_sched_put_hook)(app_sched_event_handler_t handler);
+
+sim_mqtt_t sim_mqtt;
+uint32_t (*sim_publish_hook)(const mqtt_publish_param_t * p_param);
+uint32_t (*sim_live_hook)(void);
+
+eui48_t  sim_eui48 = {{ 0x10, 0x11, 0x12, 0x13, 0x14, 0x15 }};
+uint32_t sim_connectable_count;
+uint32_t sim_connectable_err;
+uint16_t sim_ble_conn_handle = BLE_CONN_HANDLE_INVALID;
+bool     sim_ble_advertising;
+uint32_t sim_ble_disconnect_count;
+uint32_t sim_lwip_sleeptime = 0xFFFFFFFF;
+uint32_t sim_lwip_checks;
+uint32_t sim_lwip_period_ms;
+uint32_t sim_lwip_late_max_ms;
+uint32_t sim_reset_count;
+uint32_t sim_app_error_count;
+uint32_t sim_app_error_last;
+uint32_t sim_leds;
+
+uint32_t sim_critical_depth;
+
+static void       (*m_irq_pending[SIM_IRQ_PENDING_MAX])(void);
+static uint32_t     m_irq_pending_count;
+static sim_timer_t  m_timers[SIM_TIMER_COUNT];
+static sim_event_t  m_queue[SIM_SCHED_SIZE];
+static uint32_t     m_queue_head;
+static uint32_t     m_queue_tail;
+
+uint32_t sim_now_ms(void)
+{
+    return SIM_TICKS_TO_MS(sim_rtc);
+}
+
+/* Interrupts */
+
+void sim_irq_raise(void (*handler)(void))
+{
+    if (sim_critical_depth == 0)
+        handler();
+    else if (m_irq_pending_count < SIM_IRQ_PENDING_MAX)
+        m_irq_pending[m_irq_pending_count++] = handler;
+}
+
+void sim_critical_exit(void)
+{
+    if (--sim_critical_depth > 0)
+        return;
+    while (m_irq_pending_count > 0)
+    {
+        void (*handler)(void) = m_irq_pending[0];
+        m_irq_pending_count--;
+        memmove(&m_irq_pending[0], &m_irq_pending[1], m_irq_pending_count * sizeof(m_irq_pending[0]));
+        handler();
+    }
+}
+
+/* Clock and timers */
+
+static sim_timer_t * timer_get(app_timer_t * p_id)
+{
+    for (int i = 0; i < SIM_TIMER_COUNT; i++)
+        if (m_timers[i].p_id == p_id)
+            return &m_timers[i];
+    return NULL;
+}
+
+static sim_timer_t * timer_next(void)
+{
+    sim_timer_t * p_next = NULL;
+    for (int i = 0; i < SIM_TIMER_COUNT; i++)
+        if (m_timers[i].running && (p_next == NULL || m_timers[i].due < p_next->due))
+            p_next = &m_timers[i];
+    return p_next;
+}
+
+bool sim_timer_pending(uint32_t * p_due)
+{
+    sim_timer_t * p_next = timer_next();
+    if (p_next != NULL && p_due != NULL)
+        *p_due = p_next->due;
+    return p_next != NULL;
+}
+
+void sim_run_until(uint32_t rtc)
+{
+    sim_timer_t * p_next;
+
+    while ((p_next = timer_next()) != NULL && p_next->due <= rtc)
+    {
+        sim_rtc = p_next->due;
+        if (p_next->mode == APP_TIMER_MODE_REPEATED)
+            p_next->due += p_next->interval;
+        else
+            p_next->running = false;
+        sim_wakeups++;
+        p_next->handler(p_next->p_context);
+        app_sched_execute();
+        if (sim_idle_hook != NULL)
+            sim_idle_hook();
+    }
+    sim_rtc = rtc;
+}
+
+void sim_run_ms(uint32_t ms)
+{
+    sim_run_until(sim_rtc + APP_TIMER_TICKS(ms));
+}
+
+uint32_t app_timer_init(void)
+{
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_create(app_timer_id_t const * p_timer_id, app_timer_mode_t mode,
+                          app_timer_timeout_handler_t timeout_handler)
+{
+    sim_timer_t * p_timer = timer_get(*p_timer_id);
+    if (p_timer == NULL)
+        p_timer = timer_get(NULL);
+    if (p_timer == NULL)
+        return NRF_ERROR_NO_MEM;
+    memset(p_timer, 0, sizeof(*p_timer));
+    p_timer->p_id = *p_timer_id;
+    p_timer->handler = timeout_handler;
+    p_timer->mode = mode;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void * p_context)
+{
+    sim_timer_t * p_timer = timer_get(timer_id);
+    if (p_timer == NULL || timeout_ticks < APP_TIMER_MIN_TIMEOUT_TICKS)
+        return NRF_ERROR_INVALID_STATE;
+    p_timer->running = true;
+    p_timer->due = sim_rtc + timeout_ticks;
+    p_timer->interval = timeout_ticks;
+    p_timer->p_context = p_context;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_stop(app_timer_id_t timer_id)
+{
+    sim_timer_t * p_timer = timer_get(timer_id);
+    if (p_timer != NULL)
+        p_timer->running = false;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_cnt_get(void)
+{
+    return sim_rtc & APP_TIMER_MAX_CNT_VAL;
+}
+
+uint32_t app_timer_cnt_diff_compute(uint32_t ticks_to, uint32_t ticks_from)
+{
+    return (ticks_to - ticks_from) & APP_TIMER_MAX_CNT_VAL;
+}
+
+/* Scheduler */
+
+uint32_t app_sched_event_put(void const * p_event_data, uint16_t event_size, app_sched_event_handler_t handler)
+{
+    if (((m_queue_tail + 1) % SIM_SCHED_SIZE) == m_queue_head || event_size > SIM_SCHED_DATA_MAX)
+        return NRF_ERROR_NO_MEM;
+    if (sim_sched_put_hook != NULL)
+        sim_sched_put_hook(handler);
+
+    sim_event_t * p_event = &m_queue[m_queue_tail];
+    p_event->handler = handler;
+    p_event->size = event_size;
+    if (event_size > 0)
+        memcpy(p_event->data, p_event_data, event_size);
+    m_queue_tail = (m_queue_tail + 1) % SIM_SCHED_SIZE;
+
+    sim_sched_puts++;
+    uint32_t depth = (m_queue_tail + SIM_SCHED_SIZE - m_queue_head) % SIM_SCHED_SIZE;
+    if (depth > sim_sched_high_water)
+        sim_sched_high_water = depth;
+    return NRF_SUCCESS;
+}
+
+void app_sched_execute(void)
+{
+    while (m_queue_head != m_queue_tail)
+    {
+        sim_event_t event = m_queue[m_queue_head];
+        m_queue_head = (m_queue_head + 1) % SIM_SCHED_SIZE;
+        event.handler(event.data, event.size);
+    }
+}
+
+uint16_t app_sched_queue_space_get(void)
+{
+    return SIM_SCHED_SIZE - 1 - (m_queue_tail + SIM_SCHED_SIZE - m_queue_head) % SIM_SCHED_SIZE;
+}
+
+/* MQTT client. Like the SDK, mqtt_live pings a connection that sent nothing for MQTT_KEEPALIVE.
+   The broker answers a ping at once, which moves rcv_nxt of the TCP connection on. Every
+   connection starts rcv_nxt at a sequence number of its own, and fl_connack moves it over the
+   CONNACK. */
+
+static bool                   m_mqtt_open;
+static struct tcp_pcb         m_tcp_pcb;
+static iot_timer_time_in_ms_t m_mqtt_last_activity;
+static iot_timer_time_in_ms_t m_wall_clock;
+
+static void mqtt_activity(void)
+{
+    if (m_mqtt_open)
+        sim_mqtt.max_idle_ms = MAX(sim_mqtt.max_idle_ms, m_wall_clock - m_mqtt_last_activity);
+    m_mqtt_last_activity = m_wall_clock;
+}
+
+void mqtt_client_init(mqtt_client_t * p_client)
+{
+    memset(p_client, 0, sizeof(*p_client));
+}
+
+uint32_t mqtt_init(void)
+{
+    return NRF_SUCCESS;
+}
+
+uint32_t mqtt_connect(mqtt_client_t * p_client)
+{
+    sim_mqtt.connect++;
+    sim_mqtt.p_last_connect = p_client;
+    p_client->tcp_id = &m_tcp_pcb;
+    m_tcp_pcb.rcv_nxt = sim_mqtt.connect * 0x10000u;
+    m_mqtt_open = false;
+    mqtt_activity();
+    m_mqtt_open = true;
+    return NRF_SUCCESS;
+}
+
+uint32_t mqtt_disconnect(mqtt_client_t * p_client)
+{
+    sim_mqtt.disconnect++;
+    p_client->tcp_id = NULL;
+    m_mqtt_open = false;
+    return NRF_SUCCESS;
+}
+
+uint32_t mqtt_abort(mqtt_client_t * p_client)
+{
+    sim_mqtt.abort++;
+    p_client->tcp_id = NULL;
+    m_mqtt_open = false;
+    return NRF_SUCCESS;
+}
+
+uint32_t mqtt_ping(mqtt_client_t * p_client)
+{
+    sim_mqtt.ping++;
+    mqtt_activity();
+    if (!sim_mqtt.silent)
+        m_tcp_pcb.rcv_nxt += 2;
+    return NRF_SUCCESS;
+}
+
+uint32_t mqtt_subscribe(mqtt_client_t * p_client, const mqtt_subscription_list_t * p_param)
+{
+    const mqtt_utf8_t * p_topic = &p_param->p_list[0].topic;
+    sim_mqtt.subscribe++;
+    mqtt_activity();
+    memcpy(sim_mqtt.last_subscribe, p_topic->p_utf_str, p_topic->utf_strlen);
+    sim_mqtt.last_subscribe[p_topic->utf_strlen] = '\0';
+    return NRF_SUCCESS;
+}
+
+uint32_t mqtt_publish(mqtt_client_t * p_client, const mqtt_publish_param_t * p_param)
+{
+    const mqtt_utf8_t   * p_topic = &p_param->message.topic.topic;
+    const mqtt_binstr_t * p_payload = &p_param->message.payload;
+
+    if (sim_mqtt.fail_publish > 0)
+    {
+        sim_mqtt.fail_publish--;
+        return NRF_ERROR_NO_MEM;
+    }
+    if (sim_publish_hook != NULL)
+    {
+        uint32_t err_code = sim_publish_hook(p_param);
+        if (err_code != NRF_SUCCESS)
+            return err_code;
+    }
+
+    sim_mqtt.publish++;
+    mqtt_activity();
+    sim_mqtt.last_message_id = p_param->message_id;
+    sim_mqtt.last_dup = p_param->dup_flag;
+    memcpy(sim_mqtt.last_topic, p_topic->p_utf_str, p_topic->utf_strlen);
+    sim_mqtt.last_topic[p_topic->utf_strlen] = '\0';
+    memcpy(sim_mqtt.last_payload, p_payload->p_bin_str, MIN(p_payload->bin_strlen, sizeof(sim_mqtt.last_payload) - 1));
+    sim_mqtt.last_payload[MIN(p_payload->bin_strlen, sizeof(sim_mqtt.last_payload) - 1)] = '\0';
+    return NRF_SUCCESS;
+}
+
+uint32_t mqtt_publish_ack(mqtt_client_t * p_client, const mqtt_puback_param_t * p_param)
+{
+    if (sim_mqtt.fail_ack > 0)
+    {
+        sim_mqtt.fail_ack--;
+        return NRF_ERROR_NO_MEM;
+    }
+    sim_mqtt.publish_ack++;
+    mqtt_activity();
+    return NRF_SUCCESS;
+}
+
+uint32_t mqtt_live(void)
+{
+    sim_mqtt.live++;
+    if (m_mqtt_open && MQTT_KEEPALIVE > 0 &&
+        (int32_t)(m_wall_clock - (m_mqtt_last_activity + MQTT_KEEPALIVE * 1000)) >= 0)
+    {
+        sim_mqtt.live_ping++;
+        mqtt_activity();
+    }
+    return (sim_live_hook != NULL) ? sim_live_hook() : NRF_SUCCESS;
+}
+
+/* IoT Timer: the wall clock advances one resolution period per update, as in the SDK. */
+
+uint32_t iot_timer_update(void)
+{
+    m_wall_clock += IOT_TIMER_RESOLUTION_IN_MS;
+    return NRF_SUCCESS;
+}
+
+uint32_t iot_timer_wall_clock_get(iot_timer_time_in_ms_t * p_elapsed_time)
+{
+    *p_elapsed_time = m_wall_clock;
+    return NRF_SUCCESS;
+}
+
+/* IPv6 medium, IoT platform, LwIP */
+
+uint32_t ipv6_medium_init(ipv6_medium_init_params_t * p_init_param, uint8_t type, ipv6_medium_instance_t * p_instance)
+{
+    return NRF_SUCCESS;
+}
+
+uint32_t ipv6_medium_eui48_get(ipv6_medium_instance_id_t id, eui48_t * p_eui48)
+{
+    *p_eui48 = sim_eui48;
+    return NRF_SUCCESS;
+}
+
+uint32_t ipv6_medium_eui48_set(ipv6_medium_instance_id_t id, eui48_t * p_eui48)
+{
+    return NRF_SUCCESS;
+}
+
+uint32_t ipv6_medium_eui64_get(ipv6_medium_instance_id_t id, eui64_t * p_eui64)
+{
+    memset(p_eui64, 0, sizeof(*p_eui64));
+    return NRF_SUCCESS;
+}
+
+uint32_t ipv6_medium_connectable_mode_enter(ipv6_medium_instance_id_t id)
+{
+    sim_connectable_count++;
+    if (sim_connectable_err != NRF_SUCCESS)
+        return sim_connectable_err;
+    /* Advertising cannot start while it runs already or while the link is up. */
+    if (sim_ble_advertising || sim_ble_conn_handle != BLE_CONN_HANDLE_INVALID)
+        return NRF_ERROR_INVALID_STATE;
+    sim_ble_advertising = true;
+    return NRF_SUCCESS;
+}
+
+/* The link goes down when the test delivers IPV6_MEDIUM_EVT_CONN_DOWN. */
+uint32_t sd_ble_gap_disconnect(uint16_t conn_handle, uint8_t hci_status_code)
+{
+    sim_ble_disconnect_count++;
+    if (conn_handle == BLE_CONN_HANDLE_INVALID || conn_handle != sim_ble_conn_handle)
+        return NRF_ERROR_INVALID_STATE;
+    return NRF_SUCCESS;
+}
+
+uint32_t nrf_mem_init(void)
+{
+    return NRF_SUCCESS;
+}
+
+uint32_t nrf_driver_init(void)
+{
+    return NRF_SUCCESS;
+}
+
+void lwip_init(void)
+{
+}
+
+static iot_timer_time_in_ms_t m_lwip_due;
+
+void sys_check_timeouts(void)
+{
+    sim_lwip_checks++;
+    if (sim_lwip_period_ms == 0)
+        return;
+    if (m_lwip_due == 0)
+        m_lwip_due = m_wall_clock + sim_lwip_period_ms;
+    while ((int32_t)(m_wall_clock - m_lwip_due) >= 0)
+    {
+        sim_lwip_late_max_ms = MAX(sim_lwip_late_max_ms, m_wall_clock - m_lwip_due);
+        m_lwip_due += sim_lwip_period_ms;
+    }
+}
+
+uint32_t sys_timeouts_sleeptime(void)
+{
+    if (sim_lwip_period_ms == 0)
+    {
+        m_lwip_due = 0;
+        return sim_lwip_sleeptime;
+    }
+    if (m_lwip_due == 0)
+        m_lwip_due = m_wall_clock + sim_lwip_period_ms;
+    return ((int32_t)(m_lwip_due - m_wall_clock) > 0) ? m_lwip_due - m_wall_clock : 0;
+}
+
+/* SoftDevice, board, error handling */
+
+uint32_t sd_app_evt_wait(void)
+{
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_rand_application_vector_get(uint8_t * p_buff, uint8_t length)
+{
+    for (uint8_t i = 0; i < length; i++)
+        p_buff[i] = (uint8_t)rand();
+    return NRF_SUCCESS;
+}
+
+void NVIC_SystemReset(void)
+{
+    sim_reset_count++;
+}
+
+void app_error_handler(uint32_t error_code, uint32_t line_num, const uint8_t * p_file_name)
+{
+    sim_app_error_count++;
+    sim_app_error_last = error_code;
+}
+
+uint32_t app_button_init(app_button_cfg_t const * p_buttons, uint8_t button_count, uint32_t detection_delay)
+{
+    return NRF_SUCCESS;
+}
+
+uint32_t app_button_enable(void)
+{
+    return NRF_SUCCESS;
+}
+
+bool app_button_is_pushed(uint8_t button_id)
+{
+    return false;
+}
+
+uint32_t app_pwm_init(app_pwm_t const * p_instance, app_pwm_config_t const * p_config, void (*callback)(uint32_t))
+{
+    return NRF_SUCCESS;
+}
+
+void app_pwm_enable(app_pwm_t const * p_instance)
+{
+}
+
+uint32_t app_pwm_channel_duty_set(app_pwm_t const * p_instance, uint8_t channel, uint32_t duty)
+{
+    return NRF_SUCCESS;
+}
+
+void nrf_gpio_pin_set(uint32_t pin_number)
+{
+}
+
+void nrf_gpio_pin_clear(uint32_t pin_number)
+{
+}
+
+void nrf_gpio_cfg_output(uint32_t pin_number)
+{
+}
@@ -0,0 +1,79 @@
+/*
+ * Host simulation of the SDK services farlock.c runs on.
+ *
+ * Time is a virtual RTC counting app_timer ticks (1024 Hz with the board configs). Nothing runs
+ * by itself: sim_run_until delivers app_timer expiries in deadline order and runs the scheduler
+ * after each one, the way APP_TIMER_CONFIG_USE_SCHEDULER does on target. MQTT, the IPv6 medium,
+ * LwIP and the random number generator are reduced to counters and knobs the tests read and set.
+ */
+#ifndef SIM_H__
+#define SIM_H__
+
+#include "sdk_stub.h"
+#include "mqtt.h"
+
+#define SIM_TICKS_TO_MS(ticks)  ((uint32_t)(((uint64_t)(ticks) * 1000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1)) / APP_TIMER_CLOCK_FREQ))
+
+/* Clock and timers. */
+extern uint32_t sim_rtc;                /**< Ticks since start, not wrapped to the RTC width. */
+extern uint32_t sim_wakeups;            /**< app_timer expiries delivered so far. */
+extern void (*sim_idle_hook)(void);     /**< Called after every wakeup, like the body of the main loop. */
+
+uint32_t sim_now_ms(void);
+bool sim_timer_pending(uint32_t * p_due);
+void sim_run_until(uint32_t rtc);
+void sim_run_ms(uint32_t ms);
+
+/* Scheduler. */
+extern uint32_t sim_sched_puts;
+extern uint32_t sim_sched_high_water;
+extern void (*sim_sched_put_hook)(app_sched_event_handler_t handler);
+
+/* Interrupts: a raised handler runs at once, or when the outermost critical region exits. */
+#define SIM_IRQ_PENDING_MAX 8
+void sim_irq_raise(void (*handler)(void));
+
+/* MQTT client. */
+typedef struct
+{
+    uint32_t connect;
+    uint32_t disconnect;
+    uint32_t abort;
+    uint32_t ping;
+    uint32_t live_ping;                 /**< Pings mqtt_live sent by itself after MQTT_KEEPALIVE seconds without traffic. */
+    uint32_t max_idle_ms;               /**< Longest time an open connection went without sending, reset by the tests. */
+    uint32_t subscribe;
+    uint32_t publish;
+    uint32_t publish_ack;
+    uint32_t live;
+    uint32_t fail_publish;              /**< Number of upcoming mqtt_publish calls to fail with NRF_ERROR_NO_MEM. */
+    uint32_t fail_ack;                  /**< Number of upcoming mqtt_publish_ack calls to fail. */
+    bool     silent;                    /**< The broker sends nothing back on the TCP connection, not even PINGRESP. */
+    uint16_t last_message_id;
+    uint8_t  last_dup;
+    char     last_topic[128];
+    char     last_payload[8];
+    char     last_subscribe[128];
+    mqtt_client_t const * p_last_connect;
+} sim_mqtt_t;
+extern sim_mqtt_t sim_mqtt;
+extern uint32_t (*sim_publish_hook)(const mqtt_publish_param_t * p_param);
+extern uint32_t (*sim_live_hook)(void);
+
+/* IPv6 medium, LwIP, SoftDevice, board. */
+extern eui48_t  sim_eui48;
+extern uint32_t sim_connectable_count;
+extern uint32_t sim_connectable_err;    /**< If set, returned by ipv6_medium_connectable_mode_enter. */
+extern uint16_t sim_ble_conn_handle;    /**< Handle of the BLE link, BLE_CONN_HANDLE_INVALID while it is down. */
+extern bool     sim_ble_advertising;
+extern uint32_t sim_ble_disconnect_count;
+extern uint32_t sim_lwip_sleeptime;     /**< Returned by sys_timeouts_sleeptime, 0xFFFFFFFF for none. */
+extern uint32_t sim_lwip_checks;
+extern uint32_t sim_lwip_period_ms;     /**< If set, a periodic LwIP timeout on the wall clock, like tcp_tmr. */
+extern uint32_t sim_lwip_late_max_ms;   /**< Latest a periodic timeout was serviced after it was due. */
+extern uint32_t sim_reset_count;
+extern uint32_t sim_app_error_count;
+extern uint32_t sim_app_error_last;
+extern uint32_t sim_leds;
+
+#endif // SIM_H__
@@ -0,0 +1,63 @@
+/*
+ * Host emulation of the ACLE SIMD32 intrinsics utf8.c uses with UTF8_USE_DSP, one byte lane at a
+ * time. The GE flags __usub8 sets are kept for the next __sel, as on the Cortex-M4.
+ */
+#ifndef ARM_ACLE_H__
+#define ARM_ACLE_H__
+
+#include <stdint.h>
+
+static uint32_t acle_ge;
+
+static inline uint32_t __usub8(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+
+    acle_ge = 0;
+    for (int k = 0; k < 4; k++)
+    {
+        uint32_t x = (a >> (8 * k)) & 0xFF, y = (b >> (8 * k)) & 0xFF;
+        if (x >= y)
+            acle_ge |= 1u << k;
+        r |= ((x - y) & 0xFF) << (8 * k);
+    }
+    return r;
+}
+
+static inline uint32_t __sel(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+
+    for (int k = 0; k < 4; k++)
+    {
+        uint32_t m = 0xFFu << (8 * k);
+        r |= ((acle_ge >> k) & 1) ? (a & m) : (b & m);
+    }
+    return r;
+}
+
+static inline uint32_t __usad8(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+
+    for (int k = 0; k < 4; k++)
+    {
+        int x = (a >> (8 * k)) & 0xFF, y = (b >> (8 * k)) & 0xFF;
+        r += (x > y) ? x - y : y - x;
+    }
+    return r;
+}
+
+static inline uint32_t __uqsub8(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+
+    for (int k = 0; k < 4; k++)
+    {
+        int x = (a >> (8 * k)) & 0xFF, y = (b >> (8 * k)) & 0xFF;
+        r |= (uint32_t)((x > y) ? x - y : 0) << (8 * k);
+    }
+    return r;
+}
+
+#endif // ARM_ACLE_H__
@@ -0,0 +1,102 @@
+/*
+ * Host stand-in for the nRF5 SDK MQTT client API. sim.c implements the calls as counters so the
+ * tests can see what farlock.c sent; events are injected by calling app_mqtt_evt_handler.
+ */
+#ifndef MQTT_H__
+#define MQTT_H__
+
+#include "sdk_stub.h"
+
+typedef struct { uint8_t * p_utf_str; uint32_t utf_strlen; } mqtt_utf8_t;
+typedef struct { uint8_t * p_bin_str; uint32_t bin_strlen; } mqtt_binstr_t;
+typedef mqtt_utf8_t mqtt_username_t;
+typedef mqtt_utf8_t mqtt_password_t;
+
+typedef enum
+{
+    MQTT_QoS_0_AT_MOST_ONCE,
+    MQTT_QoS_1_ATLEAST_ONCE,
+    MQTT_QoS_2_EACTLY_ONCE
+} mqtt_qos_t;
+
+typedef struct { mqtt_utf8_t topic; uint8_t qos; } mqtt_topic_t;
+typedef struct { mqtt_topic_t topic; mqtt_binstr_t payload; } mqtt_message_t;
+
+typedef struct
+{
+    mqtt_message_t message;
+    uint16_t       message_id;
+    uint8_t        dup_flag : 1;
+    uint8_t        retain_flag : 1;
+} mqtt_publish_param_t;
+
+typedef struct { uint16_t message_id; } mqtt_puback_param_t;
+typedef struct { mqtt_topic_t * p_list; uint32_t list_count; uint16_t message_id; } mqtt_subscription_list_t;
+typedef struct { uint8_t session_present_flag; uint32_t return_code; } mqtt_connack_param_t;
+
+typedef union
+{
+    mqtt_connack_param_t connack;
+    mqtt_publish_param_t publish;
+    mqtt_puback_param_t  puback;
+} mqtt_evt_param_t;
+
+typedef enum
+{
+    MQTT_EVT_CONNACK,
+    MQTT_EVT_DISCONNECT,
+    MQTT_EVT_PUBLISH,
+    MQTT_EVT_PUBACK,
+    MQTT_EVT_PUBREC,
+    MQTT_EVT_PUBREL,
+    MQTT_EVT_PUBCOMP,
+    MQTT_EVT_SUBACK,
+    MQTT_EVT_UNSUBACK
+} mqtt_evt_id_t;
+
+typedef struct { mqtt_evt_id_t id; mqtt_evt_param_t param; uint32_t result; } mqtt_evt_t;
+
+enum
+{
+    MQTT_CONNECTION_ACCEPTED,
+    MQTT_UNACCEPTABLE_PROTOCOL_VERSION,
+    MQTT_IDENTIFIER_REJECTED,
+    MQTT_SERVER_UNAVAILABLE,
+    MQTT_BAD_USER_NAME_OR_PASSWORD,
+    MQTT_NOT_AUTHORIZED
+};
+
+#define MQTT_VERSION_3_1_1              4
+#define MQTT_TRANSPORT_NON_SECURE       0
+#define MQTT_TRANSPORT_SECURE           1
+
+typedef struct mqtt_client_t mqtt_client_t;
+typedef void (*mqtt_evt_cb_t)(mqtt_client_t * const p_client, const mqtt_evt_t * p_evt);
+
+struct mqtt_client_t
+{
+    ipv6_addr_t       broker_addr;
+    uint16_t          broker_port;
+    uint8_t           transport_type;
+    void            * p_security_settings;
+    mqtt_evt_cb_t     evt_cb;
+    mqtt_utf8_t       client_id;
+    mqtt_username_t * p_user_name;
+    mqtt_password_t * p_password;
+    uint8_t           clean_session : 1;
+    uint8_t           protocol_version;
+    struct tcp_pcb  * tcp_id;
+};
+
+void mqtt_client_init(mqtt_client_t * p_client);
+uint32_t mqtt_init(void);
+uint32_t mqtt_connect(mqtt_client_t * p_client);
+uint32_t mqtt_disconnect(mqtt_client_t * p_client);
+uint32_t mqtt_abort(mqtt_client_t * p_client);
+uint32_t mqtt_ping(mqtt_client_t * p_client);
+uint32_t mqtt_subscribe(mqtt_client_t * p_client, const mqtt_subscription_list_t * p_param);
+uint32_t mqtt_publish(mqtt_client_t * p_client, const mqtt_publish_param_t * p_param);
+uint32_t mqtt_publish_ack(mqtt_client_t * p_client, const mqtt_puback_param_t * p_param);
+uint32_t mqtt_live(void);
+
+#endif // MQTT_H__
@@ -0,0 +1,228 @@
+/*
+ * Host stand-ins for the nRF5 SDK declarations farlock.c uses.
+ *
+ * Every SDK header farlock.c includes is a one-line wrapper around this file, so the firmware
+ * source builds unmodified on the host. Only the types, constants and prototypes the
+ * application touches are declared; sim.c provides the behaviour.
+ */
+#ifndef SDK_STUB_H__
+#define SDK_STUB_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* nordic_common.h, sdk_errors.h */
+#define NRF_SUCCESS                     0
+#define NRF_ERROR_NO_MEM                4
+#define NRF_ERROR_INVALID_STATE         8
+#define NRF_ERROR_INVALID_LENGTH        9
+#define NRF_ERROR_CONN_COUNT            18
+
+typedef uint32_t ret_code_t;
+
+#define UNUSED_PARAMETER(x)             (void)(x)
+#define UNUSED_VARIABLE(x)              (void)(x)
+#define ARRAY_SIZE(a)                   (sizeof(a) / sizeof((a)[0]))
+#define MIN(a, b)                       ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                       ((a) > (b) ? (a) : (b))
+#define ROUNDED_DIV(a, b)               (((a) + ((b) / 2)) / (b))
+#define CEIL_DIV(A, B)                  (((A) + (B) - 1) / (B))
+
+/* app_error.h: a failed check is recorded instead of resetting. */
+void app_error_handler(uint32_t error_code, uint32_t line_num, const uint8_t * p_file_name);
+#define APP_ERROR_CHECK(err)                                                \
+    do {                                                                    \
+        const uint32_t local_err = (err);                                   \
+        if (local_err != NRF_SUCCESS)                                       \
+            app_error_handler(local_err, __LINE__, (const uint8_t *)__FILE__); \
+    } while (0)
+
+/* app_util_platform.h: opens a block like the SDK macro. An interrupt raised inside the region
+ * with sim_irq_raise is held until the outermost region exits. */
+extern uint32_t sim_critical_depth;
+void sim_critical_exit(void);
+#define CRITICAL_REGION_ENTER() { sim_critical_depth++;
+#define CRITICAL_REGION_EXIT()  sim_critical_exit(); }
+
+/* nrf.h */
+void NVIC_SystemReset(void);
+
+/* boards.h */
+#define BSP_LED_0_MASK                  (1 << 0)
+#define BSP_LED_1_MASK                  (1 << 1)
+#define BSP_LED_2_MASK                  (1 << 2)
+#define BSP_LED_3_MASK                  (1 << 3)
+#define BUTTON_1                        1
+#define BUTTON_2                        2
+#define BUTTON_3                        3
+#define BUTTON_4                        4
+#define BUTTON_PULL                     1
+
+extern uint32_t sim_leds;
+#define LEDS_CONFIGURE(mask)            ((void)(mask))
+#define LEDS_OFF(mask)                  (sim_leds &= ~(uint32_t)(mask))
+#define LEDS_ON(mask)                   (sim_leds |= (uint32_t)(mask))
+#define LEDS_INVERT(mask)               (sim_leds ^= (uint32_t)(mask))
+
+/* app_scheduler.h */
+typedef void (*app_sched_event_handler_t)(void * p_event_data, uint16_t event_size);
+uint32_t app_sched_event_put(void const * p_event_data, uint16_t event_size, app_sched_event_handler_t handler);
+void app_sched_execute(void);
+uint16_t app_sched_queue_space_get(void);
+#define APP_SCHED_INIT(event_size, queue_size) ((void)(event_size), (void)(queue_size))
+
+/* sdk_config.h, as set in the board configs */
+#define MQTT_KEEPALIVE                  600
+#define APP_TIMER_CONFIG_RTC_FREQUENCY  31
+
+/* app_timer.h */
+#define APP_TIMER_CLOCK_FREQ            32768
+#define APP_TIMER_MIN_TIMEOUT_TICKS     5
+#define APP_TIMER_MAX_CNT_VAL           0x00FFFFFF
+#define APP_TIMER_TICKS(MS)                                                 \
+    ((uint32_t)ROUNDED_DIV((MS) * (uint64_t)APP_TIMER_CLOCK_FREQ,           \
+                           1000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1)))
+
+typedef struct { int unused; } app_timer_t;
+typedef app_timer_t * app_timer_id_t;
+#define APP_TIMER_DEF(id)                                                   \
+    static app_timer_t id##_data;                                           \
+    static const app_timer_id_t id = &id##_data
+
+typedef void (*app_timer_timeout_handler_t)(void * p_context);
+typedef enum
+{
+    APP_TIMER_MODE_SINGLE_SHOT,
+    APP_TIMER_MODE_REPEATED
+} app_timer_mode_t;
+
+uint32_t app_timer_init(void);
+uint32_t app_timer_create(app_timer_id_t const * p_timer_id, app_timer_mode_t mode,
+                          app_timer_timeout_handler_t timeout_handler);
+uint32_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void * p_context);
+uint32_t app_timer_stop(app_timer_id_t timer_id);
+uint32_t app_timer_cnt_get(void);
+uint32_t app_timer_cnt_diff_compute(uint32_t ticks_to, uint32_t ticks_from);
+
+/* app_button.h */
+typedef void (*app_button_handler_t)(uint8_t pin_no, uint8_t button_action);
+typedef struct
+{
+    uint8_t              pin_no;
+    uint8_t              active_state;
+    uint8_t              pull_cfg;
+    app_button_handler_t button_handler;
+} app_button_cfg_t;
+#define APP_BUTTON_RELEASE              0
+#define APP_BUTTON_PUSH                 1
+uint32_t app_button_init(app_button_cfg_t const * p_buttons, uint8_t button_count, uint32_t detection_delay);
+uint32_t app_button_enable(void);
+bool app_button_is_pushed(uint8_t button_id);
+
+/* iot_timer.h */
+#define IOT_TIMER_RESOLUTION_IN_MS      10
+typedef uint32_t iot_timer_time_in_ms_t;
+uint32_t iot_timer_update(void);
+uint32_t iot_timer_wall_clock_get(iot_timer_time_in_ms_t * p_elapsed_time);
+
+/* ble.h, ble_gap.h, ble_hci.h */
+#define BLE_CONN_HANDLE_INVALID         0xFFFF
+#define BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION 0x13
+typedef struct { uint16_t conn_handle; } ble_gap_evt_t;
+typedef struct
+{
+    struct { uint16_t evt_id; uint16_t evt_len; } header;
+    union { ble_gap_evt_t gap_evt; } evt;
+} ble_evt_t;
+uint32_t sd_ble_gap_disconnect(uint16_t conn_handle, uint8_t hci_status_code);
+
+/* ipv6_medium.h, ipv6_medium_ble.h */
+typedef struct { ble_evt_t * p_ble_evt; } ipv6_medium_ble_cb_evt_t;
+#define EUI_48_SIZE                     6
+#define EUI_64_ADDR_SIZE                8
+#define IPV6_ADDR_SIZE                  16
+#define IPV6_MEDIUM_ID_BLE              0
+typedef struct { uint8_t identifier[EUI_48_SIZE]; } eui48_t;
+typedef struct { uint8_t identifier[8]; } eui64_t;
+typedef struct { uint8_t u8[16]; } ipv6_addr_t;
+typedef uint32_t ipv6_medium_instance_id_t;
+typedef struct
+{
+    ipv6_medium_instance_id_t ipv6_medium_instance_id;
+    uint8_t                   ipv6_medium_instance_type;
+} ipv6_medium_instance_t;
+typedef enum
+{
+    IPV6_MEDIUM_EVT_CONN_DOWN,
+    IPV6_MEDIUM_EVT_CONN_UP,
+    IPV6_MEDIUM_EVT_CONNECTABLE_MODE_ENTER,
+    IPV6_MEDIUM_EVT_CONNECTABLE_MODE_EXIT,
+    IPV6_MEDIUM_EVT_PHY_SPECIFIC
+} ipv6_medium_evt_id_t;
+typedef struct
+{
+    ipv6_medium_instance_t ipv6_medium_instance_id;
+    ipv6_medium_evt_id_t   ipv6_medium_evt_id;
+    union
+    {
+        ipv6_medium_ble_cb_evt_t ble;
+    } medium_specific;
+} ipv6_medium_evt_t;
+typedef struct
+{
+    ipv6_medium_instance_t ipv6_medium_instance_id;
+    uint32_t               error_label;
+} ipv6_medium_error_t;
+typedef void (*ipv6_medium_evt_handler_t)(ipv6_medium_evt_t * p_ipv6_medium_evt);
+typedef void (*ipv6_medium_error_handler_t)(ipv6_medium_error_t * p_ipv6_medium_error);
+typedef struct
+{
+    ipv6_medium_evt_handler_t   ipv6_medium_evt_handler;
+    ipv6_medium_error_handler_t ipv6_medium_error_handler;
+} ipv6_medium_init_params_t;
+uint32_t ipv6_medium_init(ipv6_medium_init_params_t * p_init_param, uint8_t type, ipv6_medium_instance_t * p_instance);
+uint32_t ipv6_medium_eui48_get(ipv6_medium_instance_id_t id, eui48_t * p_eui48);
+uint32_t ipv6_medium_eui48_set(ipv6_medium_instance_id_t id, eui48_t * p_eui48);
+uint32_t ipv6_medium_eui64_get(ipv6_medium_instance_id_t id, eui64_t * p_eui64);
+uint32_t ipv6_medium_connectable_mode_enter(ipv6_medium_instance_id_t id);
+
+/* nrf_platform_port.h, iot_common.h */
+typedef struct { eui64_t local_addr; eui64_t peer_addr; } iot_interface_t;
+uint32_t nrf_mem_init(void);
+uint32_t nrf_driver_init(void);
+
+/* lwip */
+struct tcp_pcb { uint32_t rcv_nxt; };
+void lwip_init(void);
+void sys_check_timeouts(void);
+uint32_t sys_timeouts_sleeptime(void);
+
+/* nrf_soc.h */
+uint32_t sd_app_evt_wait(void);
+uint32_t sd_rand_application_vector_get(uint8_t * p_buff, uint8_t length);
+
+/* app_pwm.h, nrf_gpio.h */
+typedef struct { int unused; } app_pwm_t;
+#define APP_PWM_INSTANCE(name, num)     static app_pwm_t name
+typedef struct { int pin_polarity[2]; } app_pwm_config_t;
+#define APP_PWM_DEFAULT_CONFIG_1CH(period_in_us, pin) { { 0, 0 } }
+#define APP_PWM_POLARITY_ACTIVE_HIGH    1
+uint32_t app_pwm_init(app_pwm_t const * p_instance, app_pwm_config_t const * p_config, void (*callback)(uint32_t));
+void app_pwm_enable(app_pwm_t const * p_instance);
+uint32_t app_pwm_channel_duty_set(app_pwm_t const * p_instance, uint8_t channel, uint32_t duty);
+void nrf_gpio_pin_set(uint32_t pin_number);
+void nrf_gpio_pin_clear(uint32_t pin_number);
+void nrf_gpio_cfg_output(uint32_t pin_number);
+
+/* nrf_log.h */
+#define NRF_LOG_INFO(...)               { }
+#define NRF_LOG_RAW_HEXDUMP_INFO(...)   do { } while (0)
+#define NRF_LOG_INIT(timestamp_func)    NRF_SUCCESS
+#define NRF_LOG_DEFAULT_BACKENDS_INIT() do { } while (0)
+#define NRF_LOG_PROCESS()               false
+#define IPV6_ADDRESS_LOG(...)           do { } while (0)
+
+#endif // SDK_STUB_H__
@@ -0,0 +1,305 @@
+/*
+ * Inbound topic dispatch on the raw UTF-8 bytes (user-002) and the command table (user-003).
+ *
+ * Checks which topics reach a command and which are rejected, that the length index holds every
+ * command exactly once, and that lock/getstate only accepts a well-formed UUID. A synthetic stream of 100k publishes goes through the router and
+ * the benchmark reports the cost of each route. It also compares the cost and the peak stack of
+ * routing one publish with the old path, which decoded the topic into a topic-sized wchar_t VLA
+ * with u8_toucs and compared it with wcscmp.
+ */
+#include <ctype.h>
+#include <wchar.h>
+#include "farlock_test.h"
+
+static char m_topic[256];
+
+static const char * topic(const char * p_suffix)
+{
+    snprintf(m_topic, sizeof(m_topic), "%s%s", m_identity.device_id, p_suffix);
+    return m_topic;
+}
+
+static mqtt_publish_param_t publish_param(const char * p_topic, const char * p_payload, uint32_t payload_len)
+{
+    mqtt_publish_param_t param;
+    memset(&param, 0, sizeof(param));
+    param.message.topic.topic.p_utf_str = (uint8_t *)p_topic;
+    param.message.topic.topic.utf_strlen = strlen(p_topic);
+    param.message.topic.qos = MQTT_QoS_1_ATLEAST_ONCE;
+    param.message.payload.p_bin_str = (uint8_t *)p_payload;
+    param.message.payload.bin_strlen = payload_len;
+    return param;
+}
+
+/* Returns the index of the command a publish was routed to, or -1 if it was rejected. */
+static int routed(const char * p_topic, const char * p_payload, uint32_t payload_len)
+{
+    uint32_t before[ARRAY_SIZE(m_commands)];
+    uint32_t rejects = m_cmd_reject_count;
+    mqtt_publish_param_t param = publish_param(p_topic, p_payload, payload_len);
+
+    memcpy(before, m_cmd_dispatch_count, sizeof(before));
+    dispatch_command(&param);
+    app_sched_execute();
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(m_commands); i++)
+        if (m_cmd_dispatch_count[i] != before[i])
+            return (int)i;
+    CHECK_EQ(m_cmd_reject_count, rejects + 1);
+    return -1;
+}
+
+static const char m_uuid[] = "0123abcd-4567-89ef-0123-456789abcdef";
+
+static void test_routing(void)
+{
+    CHECK_EQ(routed(topic("/i/lock/state"), "1", 1), 0);
+    CHECK_EQ(routed(topic("/i/lock/state"), "0", 1), 0);
+    CHECK_EQ(routed(topic("/i/lock/getstate"), m_uuid, UUID_STRLEN), 1);
+    CHECK_EQ(routed(topic("/i/lock/getstate"), m_uuid, UUID_STRLEN + 1), 1);
+
+    /* Not addressed to this device, or not an inbound topic. */
+    CHECK_EQ(routed("4f000000000000/i/lock/state", "1", 1), -1);
+    CHECK_EQ(routed(topic("/o/lock/state"), "1", 1), -1);
+    CHECK_EQ(routed(topic("/i/"), "1", 1), -1);
+    CHECK_EQ(routed(m_identity.device_id, "1", 1), -1);
+    CHECK_EQ(routed("", "1", 1), -1);
+
+    /* Command names must match exactly. */
+    CHECK_EQ(routed(topic("/i/lock/statex"), "1", 1), -1);
+    CHECK_EQ(routed(topic("/i/lock/stat"), "1", 1), -1);
+    CHECK_EQ(routed(topic("/i/lock/state/x"), "1", 1), -1);
+    CHECK_EQ(routed(topic("/i/lock/st\xc3\xa4te"), "1", 1), -1);
+}
+
+/* Each command sits in the chain of its name length, once, and no chain holds another length. */
+static void test_index(void)
+{
+    uint32_t seen[ARRAY_SIZE(m_commands)] = { 0 };
+    uint32_t chained = 0;
+
+    for (uint32_t len = 0; len <= APP_CMD_NAME_MAX_LEN; len++)
+    {
+        for (uint32_t i = m_cmd_by_len[len]; i != 0 && chained <= ARRAY_SIZE(m_commands); i = m_cmd_next[i - 1])
+        {
+            CHECK_EQ(m_commands[i - 1].name_len, len);
+            seen[i - 1]++;
+            chained++;
+        }
+    }
+    CHECK_EQ(chained, ARRAY_SIZE(m_commands));
+    for (uint32_t i = 0; i < ARRAY_SIZE(m_commands); i++)
+        CHECK_EQ(seen[i], 1);
+
+    /* Longer than any indexed name. */
+    char name[APP_CMD_NAME_MAX_LEN + 8];
+    memset(name, 'x', sizeof(name) - 1);
+    memcpy(name, "/i/", 3);
+    name[sizeof(name) - 1] = '\0';
+    CHECK_EQ(routed(topic(name), "1", 1), -1);
+}
+
+/* A reference for the 8-4-4-4-12 layout, written independently of uuid_str_to_bin. */
+static bool ref_uuid_valid(const char * p_str)
+{
+    for (int i = 0; i < UUID_STRLEN; i++)
+    {
+        bool dash = (i == 8 || i == 13 || i == 18 || i == 23);
+        if (dash ? (p_str[i] != '-') : !isxdigit((unsigned char)p_str[i]))
+            return false;
+    }
+    return true;
+}
+
+static void test_uuid_payload(void)
+{
+    char payload[UUID_STRLEN + 1];
+    char expected[128];
+
+    /* A valid UUID reaches the requester topic, upper case digits decoded too. */
+    CHECK_EQ(routed(topic("/i/lock/getstate"), "0123ABCD-4567-89EF-0123-456789ABCDEF", UUID_STRLEN), 1);
+    app_sched_execute();
+    snprintf(expected, sizeof(expected), "%s/o/lock/state/%s", m_identity.device_id, m_uuid);
+    CHECK_STR(sim_mqtt.last_topic, expected);
+
+    /* The optional 37th byte must be the terminator. */
+    memcpy(payload, m_uuid, UUID_STRLEN);
+    payload[UUID_STRLEN] = 'x';
+    CHECK_EQ(routed(topic("/i/lock/getstate"), payload, UUID_STRLEN + 1), -1);
+
+    /* Misplaced dashes, and a bad character at every position. */
+    CHECK_EQ(routed(topic("/i/lock/getstate"), "0123abc-d4567-89ef-0123-456789abcdef", UUID_STRLEN), -1);
+    CHECK_EQ(routed(topic("/i/lock/getstate"), "0123abcd4567-89ef-0123-456789abcdef-", UUID_STRLEN), -1);
+    CHECK_EQ(routed(topic("/i/lock/getstate"), "------------------------------------", UUID_STRLEN), -1);
+    CHECK_EQ(routed(topic("/i/lock/getstate"), "0123abcd-4567-89ef-0123-456789abcde\0", UUID_STRLEN), -1);
+    for (int i = 0; i < UUID_STRLEN; i++)
+    {
+        const char bad[] = { 'g', 'G', ' ', '\0', '\xff', '-', '0' };
+        for (unsigned b = 0; b < sizeof(bad); b++)
+        {
+            memcpy(payload, m_uuid, UUID_STRLEN);
+            if (payload[i] == bad[b])
+                continue;
+            payload[i] = bad[b];
+            CHECK_EQ(routed(topic("/i/lock/getstate"), payload, UUID_STRLEN) == 1, ref_uuid_valid(payload));
+        }
+    }
+
+    /* Random mutations against the reference. */
+    for (int n = 0; n < 100000; n++)
+    {
+        memcpy(payload, m_uuid, UUID_STRLEN);
+        for (int k = rand() % 3; k >= 0; k--)
+            payload[rand() % UUID_STRLEN] = "0123456789abcdefABCDEF-gz \x80"[rand() % 27];
+        bool valid = ref_uuid_valid(payload);
+        uint8_t bin[16];
+        CHECK_EQ(uuid_str_to_bin(bin, payload), valid);
+    }
+}
+
+/* A synthetic stream of publishes, one route per kind. */
+
+typedef struct
+{
+    const char * p_name;
+    const char * p_topic_suffix;
+    const char * p_payload;
+    uint32_t     payload_len;
+    int          route;
+} stream_route_t;
+
+static const stream_route_t m_routes[] =
+{
+    { "lock/state",              "/i/lock/state",    "1",    1,           0  },
+    { "lock/getstate",           "/i/lock/getstate", m_uuid, UUID_STRLEN, 1  },
+    { "unknown command",         "/i/lock/open",     "1",    1,           -1 },
+    { "other device",            NULL,               "1",    1,           -1 },
+    { "bad payload length",      "/i/lock/state",    "11",   2,           -1 },
+    { "malformed uuid",          "/i/lock/getstate", "0123abcd-4567-89ef-0123-456789abcdeg", UUID_STRLEN, -1 },
+};
+
+static void test_stream(void)
+{
+    enum { STREAM_LENGTH = 100000 };
+    const int kinds = ARRAY_SIZE(m_routes);
+    static mqtt_publish_param_t params[ARRAY_SIZE(m_routes)];
+    static char topics[ARRAY_SIZE(m_routes)][64];
+    uint64_t cycles[ARRAY_SIZE(m_routes)] = { 0 };
+    uint32_t count[ARRAY_SIZE(m_routes)] = { 0 };
+    uint32_t dispatched[ARRAY_SIZE(m_commands)];
+    uint32_t rejects = m_cmd_reject_count;
+
+    for (int k = 0; k < kinds; k++)
+    {
+        if (m_routes[k].p_topic_suffix != NULL)
+            snprintf(topics[k], sizeof(topics[k]), "%s%s", m_identity.device_id, m_routes[k].p_topic_suffix);
+        else
+            snprintf(topics[k], sizeof(topics[k]), "4f0102030405ff/i/lock/state");
+        params[k] = publish_param(topics[k], m_routes[k].p_payload, m_routes[k].payload_len);
+    }
+
+    memcpy(dispatched, m_cmd_dispatch_count, sizeof(dispatched));
+    for (int n = 0; n < STREAM_LENGTH; n++)
+    {
+        int k = rand() % kinds;
+        uint64_t t0 = unit_cycles();
+        dispatch_command(&params[k]);
+        cycles[k] += unit_cycles() - t0;
+        count[k]++;
+        app_sched_execute();
+    }
+
+    uint32_t expected_rejects = 0;
+    for (int k = 0; k < kinds; k++)
+    {
+        if (m_routes[k].route < 0)
+            expected_rejects += count[k];
+        else
+            CHECK_EQ(m_cmd_dispatch_count[m_routes[k].route] - dispatched[m_routes[k].route], count[k]);
+    }
+    CHECK_EQ(m_cmd_reject_count - rejects, expected_rejects);
+
+    if (unit_bench)
+    {
+        printf("%d publishes routed, %s per route (handlers included)\n", STREAM_LENGTH, UNIT_CYCLES_UNIT);
+        for (int k = 0; k < kinds; k++)
+            printf("  %-20s %6u publishes %7.0f\n", m_routes[k].p_name, count[k], (double)cycles[k] / count[k]);
+    }
+}
+
+/* The old path: decode the whole topic into a VLA and compare past the device id. */
+
+static const wchar_t ref_state_topic[] = L"lock/state";
+static const wchar_t ref_state_request_topic[] = L"lock/getstate";
+
+static __attribute__((noinline)) int ref_route(const mqtt_publish_param_t * p_publish)
+{
+    int topic_len = p_publish->message.topic.topic.utf_strlen;
+    wchar_t topic_wcs[topic_len + 1];
+
+    /* The old code passed -1 and read up to a NUL past the topic; the length is used here. */
+    u8_toucs((u_int32_t *)topic_wcs, topic_len + 1, (char *)p_publish->message.topic.topic.p_utf_str, topic_len);
+
+    if (wcscmp(&topic_wcs[device_id_strlen], ref_state_topic) == 0)
+        return 0;
+    if (wcscmp(&topic_wcs[device_id_strlen], ref_state_request_topic) == 0)
+        return 1;
+    return -1;
+}
+
+static void ref_route_call(void * p_publish)
+{
+    unit_sink += ref_route(p_publish);
+}
+
+static void new_route_call(void * p_publish)
+{
+    dispatch_command(p_publish);
+}
+
+static void bench_route(void)
+{
+    const int rounds = 1000000;
+    static char long_topic[241];
+    const char * topics[3];
+
+    memset(long_topic, 'x', sizeof(long_topic) - 1);
+    memcpy(long_topic, topic("/i/"), device_id_strlen);
+    topics[0] = strdup(topic("/i/lock/state"));
+    topics[1] = strdup(topic("/i/lock/getstate"));
+    topics[2] = long_topic;
+
+    printf("routing one publish, %s per call and peak stack in bytes\n", UNIT_CYCLES_UNIT);
+    printf("  (payload length out of range, so the handler is not run)\n");
+    for (int t = 0; t < 3; t++)
+    {
+        mqtt_publish_param_t param = publish_param(topics[t], "", 0);
+
+        uint64_t t0 = unit_cycles();
+        for (int i = 0; i < rounds; i++)
+            unit_sink += ref_route(&param);
+        uint64_t t1 = unit_cycles();
+        for (int i = 0; i < rounds; i++)
+            dispatch_command(&param);
+        uint64_t t2 = unit_cycles();
+
+        printf("  %3u-byte topic  old %5.0f cycles %5d bytes   new %5.0f cycles %5d bytes\n",
+               (unsigned)strlen(topics[t]),
+               (double)(t1 - t0) / rounds, unit_stack_peak(ref_route_call, &param),
+               (double)(t2 - t1) / rounds, unit_stack_peak(new_route_call, &param));
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    fl_subscribe();
+    test_routing();
+    test_index();
+    test_uuid_payload();
+    test_stream();
+    if (unit_bench)
+        bench_route();
+    return unit_done("test_dispatch");
+}
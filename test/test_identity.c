@@ -0,0 +1,254 @@
+/*
+ * Identity strings built once in identity_init (user-001).
+ *
+ * Checks the client id, credentials, subscribe filter and publish topics against the strings the
+ * firmware used to build on every connect, subscribe and publish (bin_to_hex_str, mbstowcs and
+ * u8_toutf8 over wchar_t), byte for byte and for many EUI-48 values. The benchmark compares the
+ * topic work of one state publish on the old and the new path, and reports the static RAM of the
+ * old guessed buffers against u8_measure of the strings they held and the identity strings.
+ */
+#include <wchar.h>
+#include "farlock_test.h"
+
+/* The strings as the firmware built them before the identity arena. */
+
+static const wchar_t ref_state_topic[] = L"lock/state";
+static const wchar_t ref_topic_prefix[] = L"/i/#";
+static const wchar_t ref_pub_prefix[] = L"/o/";
+static char ref_utf8_buf[DEVICE_ID_STRLEN + sizeof(m_pub_prefix) + sizeof(state_topic_utf8) + 1 + (UUID_STRLEN * 4) + 1];
+
+static void ref_device_id(char * to)
+{
+    uint8_t device_id_bin[DEVICE_ID_SIZE_BIN];
+
+    device_id_bin[0] = DEVICE_TYPE_ID;
+    for (uint8_t i = 0; i < sizeof(eui48_t); i++)
+        device_id_bin[DEVICE_ID_SIZE_BIN - 1 - i] = ipv6_medium_eui48.identifier[i];
+    bin_to_hex_str(to, device_id_bin, sizeof(device_id_bin));
+}
+
+static int ref_client_id(char * to)
+{
+    char id_str[DEVICE_ID_STRLEN + 1];
+    wchar_t id_wcs[sizeof(id_str)];
+
+    ref_device_id(id_str);
+    mbstowcs(id_wcs, id_str, sizeof(id_str));
+    u8_toutf8(to, DEVICE_ID_STRLEN * 4 + 1, (u_int32_t *)id_wcs, -1);
+    return wcslen(id_wcs);
+}
+
+static int ref_sub_filter(char * to)
+{
+    char id_str[DEVICE_ID_STRLEN + 1];
+    wchar_t topic_wcs[sizeof(id_str) + 4];
+
+    ref_device_id(id_str);
+    mbstowcs(topic_wcs, id_str, sizeof(id_str));
+    wcscat(topic_wcs, ref_topic_prefix);
+    u8_toutf8(to, sizeof(ref_utf8_buf), (u_int32_t *)topic_wcs, -1);
+    return wcslen(topic_wcs);
+}
+
+static int ref_pub_topic(char * to, const uint8_t * p_uuid)
+{
+    char uuid_str[UUID_STRLEN + 1];
+    wchar_t uuid_wcs[UUID_STRLEN + 1];
+    char id_str[DEVICE_ID_STRLEN + 1];
+    wchar_t id_wcs[sizeof(id_str)];
+
+    bin_to_uuid_str(uuid_str, p_uuid, 16);
+    mbstowcs(uuid_wcs, uuid_str, UUID_STRLEN + 1);
+    ref_device_id(id_str);
+    mbstowcs(id_wcs, id_str, sizeof(id_str));
+
+    int len = wcslen(id_wcs) + wcslen(ref_pub_prefix) + wcslen(ref_state_topic);
+    if (!is_empty_uuid(p_uuid))
+        len += wcslen(uuid_wcs) + 1;
+
+    wchar_t response_topic[len + 1];
+    wcscpy(response_topic, id_wcs);
+    wcscat(response_topic, ref_pub_prefix);
+    wcscat(response_topic, ref_state_topic);
+    if (!is_empty_uuid(p_uuid))
+    {
+        wcscat(response_topic, L"/");
+        wcscat(response_topic, uuid_wcs);
+    }
+    u8_toutf8(to, sizeof(ref_utf8_buf), (u_int32_t *)response_topic, -1);
+    return wcslen(response_topic);
+}
+
+static void check_slice(const mqtt_utf8_t * p_slice, const char * p_ref, int ref_len)
+{
+    CHECK_EQ(p_slice->utf_strlen, ref_len);
+    CHECK(memcmp(p_slice->p_utf_str, p_ref, ref_len) == 0);
+}
+
+static void check_identity(void)
+{
+    char ref[sizeof(ref_utf8_buf)];
+    uint8_t uuid[16];
+    int len;
+
+    len = ref_client_id(ref);
+    check_slice(&m_identity.client_id, ref, len);
+    CHECK_STR(m_identity.device_id, ref);
+
+    len = ref_sub_filter(ref);
+    check_slice(&m_identity.sub_topic, ref, len);
+
+    memset(uuid, 0, sizeof(uuid));
+    len = ref_pub_topic(ref, uuid);
+    CHECK_EQ(publish_send(&m_subscriber, uuid, (uint8_t *)state_locked_str, 1, 0), NRF_SUCCESS);
+    CHECK_STR(sim_mqtt.last_topic, ref);
+    CHECK_EQ(strlen(sim_mqtt.last_topic), len);
+
+    for (int i = 0; i < 16; i++)
+        uuid[i] = (uint8_t)rand();
+    len = ref_pub_topic(ref, uuid);
+    CHECK_EQ(publish_send(&m_subscriber, uuid, (uint8_t *)state_locked_str, 2, 0), NRF_SUCCESS);
+    CHECK_STR(sim_mqtt.last_topic, ref);
+    CHECK_EQ(strlen(sim_mqtt.last_topic), len);
+
+    /* A requester reply must not leave its suffix on the next state topic publish. */
+    memset(uuid, 0, sizeof(uuid));
+    len = ref_pub_topic(ref, uuid);
+    CHECK_EQ(publish_send(&m_subscriber, uuid, (uint8_t *)state_locked_str, 3, 0), NRF_SUCCESS);
+    CHECK_STR(sim_mqtt.last_topic, ref);
+}
+
+static void test_connect_and_subscribe_strings(void)
+{
+    char ref[sizeof(ref_utf8_buf)];
+    int len;
+
+    fl_boot();
+    fl_link_up();
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_CONNECTING);
+
+    len = ref_client_id(ref);
+    check_slice(&m_sub_mqtt_client.client_id, ref, len);
+    check_slice(&m_user, ref, len);
+    check_slice(&m_pass, ref, len);
+
+    fl_connack(0, MQTT_CONNECTION_ACCEPTED);
+    len = ref_sub_filter(ref);
+    CHECK_STR(sim_mqtt.last_subscribe, ref);
+    CHECK_EQ(strlen(sim_mqtt.last_subscribe), len);
+}
+
+static void test_many_eui48(void)
+{
+    for (int n = 0; n < 1000; n++)
+    {
+        for (int i = 0; i < EUI_48_SIZE; i++)
+            ipv6_medium_eui48.identifier[i] = (uint8_t)rand();
+        identity_init();
+        check_identity();
+    }
+}
+
+/* Topic work of one state publish: the old per-publish string building, and the new path. */
+
+static uint32_t ref_publish(const uint8_t * p_uuid)
+{
+    mqtt_publish_param_t param;
+    int len = ref_pub_topic(ref_utf8_buf, p_uuid);
+
+    param.message.topic.qos = MQTT_QoS_1_ATLEAST_ONCE;
+    param.message.topic.topic.p_utf_str = (uint8_t *)ref_utf8_buf;
+    param.message.topic.topic.utf_strlen = len;
+    param.message.payload.p_bin_str = (uint8_t *)state_locked_str;
+    param.message.payload.bin_strlen = 1;
+    param.message_id = 1;
+    param.dup_flag = 0;
+    param.retain_flag = 0;
+    return mqtt_publish(m_subscriber.p_client, &param);
+}
+
+static void bench_publish(void)
+{
+    const int rounds = 200000;
+    uint8_t uuids[2][16];
+
+    memset(uuids[0], 0, 16);
+    for (int i = 0; i < 16; i++)
+        uuids[1][i] = (uint8_t)rand();
+
+    printf("cost of one state publish, %s per call (stubbed mqtt_publish)\n", UNIT_CYCLES_UNIT);
+    for (int u = 0; u < 2; u++)
+    {
+        uint64_t t0 = unit_cycles();
+        for (int i = 0; i < rounds; i++)
+            unit_sink += ref_publish(uuids[u]);
+        uint64_t t1 = unit_cycles();
+        for (int i = 0; i < rounds; i++)
+            unit_sink += publish_send(&m_subscriber, uuids[u], (uint8_t *)state_locked_str, 1, 0);
+        uint64_t t2 = unit_cycles();
+
+        double old_cost = (double)(t1 - t0) / rounds;
+        double new_cost = (double)(t2 - t1) / rounds;
+        printf("  %-18s old %7.0f  new %7.0f  saved %7.0f\n", u ? "requester topic" : "state topic",
+               old_cost, new_cost, old_cost - new_cost);
+    }
+}
+
+/* Static RAM: the buffers sized from wchar_t arithmetic, what the strings in them measure, and
+   the identity strings that replaced them. */
+static void report_ram(void)
+{
+    static const struct
+    {
+        const char * p_name;
+        size_t       guessed;
+    } bufs[] =
+    {
+        { "username", (EUI_48_ADDR_SIZE * 8) + (sizeof(DEVICE_TYPE_ID) * 8) + 1 },
+        { "subscribe topic", sizeof(ref_topic_prefix) + sizeof(ref_state_topic) + (EUI_48_ADDR_SIZE * 8) + (sizeof(DEVICE_TYPE_ID) * 8) + 1 },
+        { "client id", (EUI_48_ADDR_SIZE * 8) + (sizeof(DEVICE_TYPE_ID) * 8) + 1 },
+        { "publish topic", ((EUI_48_ADDR_SIZE * 8) + (sizeof(DEVICE_TYPE_ID) * 8)) + sizeof(ref_pub_prefix) + sizeof(ref_state_topic) + 1 + (UUID_STRLEN * 4) + 1 },
+    };
+    char ref[sizeof(ref_utf8_buf)];
+    wchar_t wcs[sizeof(ref_utf8_buf)];
+    uint8_t uuid[16];
+    size_t measured[4], guessed = 0, exact = 0;
+    size_t strings = sizeof(m_identity.device_id) + sizeof(m_identity.sub_filter) + sizeof(m_identity.pub_topic);
+
+    memset(uuid, 0xA5, sizeof(uuid));
+    ref_client_id(ref);
+    mbstowcs(wcs, ref, sizeof(ref));
+    measured[0] = measured[2] = u8_measure((u_int32_t *)wcs, -1) + 1;
+    ref_sub_filter(ref);
+    mbstowcs(wcs, ref, sizeof(ref));
+    measured[1] = u8_measure((u_int32_t *)wcs, -1) + 1;
+    ref_pub_topic(ref, uuid);
+    mbstowcs(wcs, ref, sizeof(ref));
+    measured[3] = u8_measure((u_int32_t *)wcs, -1) + 1;
+    CHECK_EQ(measured[3], sizeof(m_identity.pub_topic));
+
+    printf("static RAM for the identity strings, bytes\n");
+    for (int i = 0; i < 4; i++)
+    {
+        printf("  %-16s guessed %4zu  measured %4zu\n", bufs[i].p_name, bufs[i].guessed, measured[i]);
+        guessed += bufs[i].guessed;
+        exact += measured[i];
+    }
+    printf("  %-16s guessed %4zu  measured %4zu\n", "total", guessed, exact);
+    printf("  m_identity %zu: strings %zu, 3 slices of %zu (%zu-byte pointers on this host), %zu reclaimed\n",
+           sizeof(m_identity), strings, sizeof(mqtt_utf8_t), sizeof(void *), guessed - sizeof(m_identity));
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    test_connect_and_subscribe_strings();
+    check_identity();
+    test_many_eui48();
+    if (unit_bench)
+    {
+        bench_publish();
+        report_ram();
+    }
+    return unit_done("test_identity");
+}
@@ -0,0 +1,194 @@
+/*
+ * In-flight QoS 1 publishes (user-025).
+ *
+ * The PUBACK event runs in interrupt context and only records the message identifier; the entry
+ * is retired, and the latency counted, by the scheduler in main context. The checks cover PUBACKs
+ * in another order than the publishes, an unknown PUBACK, the retransmission with the DUP flag,
+ * the publish deferred while the table is full, and a PUBACK that finds the high scheduler lane
+ * full, which is counted and left to the retransmission.
+ */
+#include "farlock_test.h"
+
+static const uint8_t m_requesters[INFLIGHT_TABLE_SIZE][16] =
+{
+    { 0x01 }, { 0x02 }, { 0x03 }, { 0x04 },
+};
+
+static uint32_t inflight_count(void)
+{
+    uint32_t count = 0;
+
+    for (int i = 0; i < INFLIGHT_TABLE_SIZE; i++)
+        count += m_inflight_table[i].in_use;
+    return count;
+}
+
+static uint32_t latency_count(void)
+{
+    uint32_t count = 0;
+
+    for (int i = 0; i < PUBACK_LATENCY_BUCKET_COUNT; i++)
+        count += m_puback_latency_hist[i];
+    return count;
+}
+
+/* Delivers a PUBACK event without running the scheduler after it. */
+static void puback_evt(uint16_t message_id)
+{
+    mqtt_evt_t evt;
+    memset(&evt, 0, sizeof(evt));
+    evt.id = MQTT_EVT_PUBACK;
+    evt.param.puback.message_id = message_id;
+    app_mqtt_evt_handler(m_subscriber.p_client, &evt);
+}
+
+/* Publishes to the state topic and to count - 1 requesters; returns the first message id. */
+static uint16_t publish(uint32_t count)
+{
+    uint32_t publishes = sim_mqtt.publish;
+
+    queue_state_publish(NULL);
+    for (uint32_t r = 0; r + 1 < count; r++)
+        queue_state_publish(m_requesters[r]);
+    fl_loop();
+    CHECK_EQ(sim_mqtt.publish - publishes, count);
+    return (uint16_t)(sim_mqtt.last_message_id - (count - 1));
+}
+
+static void test_main_context(void)
+{
+    uint32_t latencies = latency_count();
+    uint16_t id = publish(1);
+
+    puback_evt(id);
+    CHECK_EQ(inflight_count(), 1);
+    CHECK_EQ(latency_count(), latencies);
+
+    app_sched_execute();
+    CHECK_EQ(inflight_count(), 0);
+    CHECK_EQ(latency_count() - latencies, 1);
+    CHECK(!sw_timer_is_running(&m_inflight_timer));
+}
+
+static void test_out_of_order(void)
+{
+    static const uint16_t order[INFLIGHT_TABLE_SIZE] = { 2, 0, 3, 1 };
+    uint32_t unknown = m_puback_unknown_count;
+    uint32_t latencies = latency_count();
+    uint16_t id = publish(INFLIGHT_TABLE_SIZE);
+
+    CHECK_EQ(inflight_count(), INFLIGHT_TABLE_SIZE);
+    for (int i = 0; i < INFLIGHT_TABLE_SIZE; i++)
+        puback_evt((uint16_t)(id + order[i]));
+    CHECK_EQ(inflight_count(), INFLIGHT_TABLE_SIZE);
+    app_sched_execute();
+    CHECK_EQ(inflight_count(), 0);
+    CHECK_EQ(latency_count() - latencies, INFLIGHT_TABLE_SIZE);
+    CHECK_EQ(m_puback_unknown_count, unknown);
+
+    /* A second PUBACK for the same publish finds nothing. */
+    puback_evt(id);
+    app_sched_execute();
+    CHECK_EQ(m_puback_unknown_count - unknown, 1);
+}
+
+static void test_retransmit(void)
+{
+    uint32_t retransmits = m_inflight_retransmit_count;
+    uint32_t late = m_puback_latency_hist[PUBACK_LATENCY_BUCKET_COUNT - 1];
+    uint16_t id = publish(1);
+
+    CHECK_EQ(sim_mqtt.last_dup, 0);
+    sim_run_ms(INFLIGHT_RETRANSMIT_MS + AUTOCONNECT_TIMER_INTERVAL_MS);
+    CHECK_EQ(m_inflight_retransmit_count - retransmits, 1);
+    CHECK_EQ(sim_mqtt.last_message_id, id);
+    CHECK_EQ(sim_mqtt.last_dup, 1);
+
+    /* Counted from the first transmission, so it lands in the last bucket. */
+    puback_evt(id);
+    app_sched_execute();
+    CHECK_EQ(inflight_count(), 0);
+    CHECK_EQ(m_puback_latency_hist[PUBACK_LATENCY_BUCKET_COUNT - 1] - late, 1);
+}
+
+static void test_table_full(void)
+{
+    uint32_t full = m_inflight_full_count;
+    uint32_t publishes;
+    bool found = false;
+    uint16_t id = publish(INFLIGHT_TABLE_SIZE);
+
+    /* A fifth destination finds no entry and is deferred... */
+    publishes = sim_mqtt.publish;
+    queue_state_publish(m_requesters[INFLIGHT_TABLE_SIZE - 1]);
+    fl_loop();
+    CHECK_EQ(m_inflight_full_count - full, 1);
+    CHECK_EQ(sim_mqtt.publish, publishes);
+
+    /* ...until a PUBACK frees one, once the scheduler has run it. */
+    puback_evt(id);
+    app_sched_execute();
+    CHECK_EQ(inflight_count(), INFLIGHT_TABLE_SIZE - 1);
+    for (int i = 0; i < 500 && sim_mqtt.publish == publishes; i++)
+        sim_run_ms(10);
+    CHECK_EQ(sim_mqtt.publish - publishes, 1);
+    CHECK_EQ(inflight_count(), INFLIGHT_TABLE_SIZE);
+    for (int i = 0; i < INFLIGHT_TABLE_SIZE; i++)
+        found |= (m_inflight_table[i].message_id == sim_mqtt.last_message_id) &&
+                 (memcmp(m_inflight_table[i].topic_uuid, m_requesters[INFLIGHT_TABLE_SIZE - 1], 16) == 0);
+    CHECK(found);
+
+    for (int i = 1; i < INFLIGHT_TABLE_SIZE; i++)
+        puback_evt((uint16_t)(id + i));
+    puback_evt(sim_mqtt.last_message_id);
+    app_sched_execute();
+    CHECK_EQ(inflight_count(), 0);
+}
+
+static void test_lane_full(void)
+{
+    uint32_t drops = m_puback_drop_count;
+    uint32_t unknown = m_puback_unknown_count;
+    uint32_t retransmits = m_inflight_retransmit_count;
+    uint16_t id = publish(1);
+
+    /* PUBACKs for nothing in the table fill the lane before the real one comes. */
+    CHECK_EQ(m_sched_lanes[SCHED_PRIO_HIGH].count, 0);
+    for (int i = 0; i < SCHED_HIGH_QUEUE_SIZE; i++)
+        puback_evt((uint16_t)(id + 100 + i));
+    CHECK_EQ(m_sched_lanes[SCHED_PRIO_HIGH].count, SCHED_HIGH_QUEUE_SIZE);
+    puback_evt(id);
+    CHECK_EQ(m_puback_drop_count - drops, 1);
+
+    app_sched_execute();
+    CHECK_EQ(m_puback_unknown_count - unknown, SCHED_HIGH_QUEUE_SIZE);
+    CHECK_EQ(inflight_count(), 1);
+
+    /* The retransmission gets its own PUBACK, which retires the entry. */
+    sim_run_ms(INFLIGHT_RETRANSMIT_MS + AUTOCONNECT_TIMER_INTERVAL_MS);
+    CHECK_EQ(m_inflight_retransmit_count - retransmits, 1);
+    CHECK_EQ(sim_mqtt.last_message_id, id);
+    CHECK_EQ(sim_mqtt.last_dup, 1);
+    puback_evt(id);
+    app_sched_execute();
+    CHECK_EQ(inflight_count(), 0);
+    CHECK_EQ(m_puback_drop_count - drops, 1);
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    fl_subscribe();
+    fl_loop();
+    if (sim_mqtt.last_message_id != 0)
+        fl_puback(sim_mqtt.last_message_id);
+    CHECK_EQ(inflight_count(), 0);
+
+    test_main_context();
+    test_out_of_order();
+    test_retransmit();
+    test_table_full();
+    test_lane_full();
+    return unit_done("test_inflight");
+}
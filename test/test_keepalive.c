@@ -0,0 +1,278 @@
+/*
+ * Adaptive keepalive (user-024).
+ *
+ * The ping interval starts at KEEPALIVE_BASE_MS, the fixed keepalive it replaced, doubles while
+ * the subscription lasts and is halved for every disconnect that came before the subscription
+ * could pay it back. A ping has to be answered like a QoS 1 publish: the sim broker answers it on
+ * the TCP connection, and a silent broker gets the connection aborted after
+ * KEEPALIVE_RESPONSE_TIMEOUT_MS. The link patterns below measure the time from the broker going
+ * silent to the abort, and the pings per day, against the fixed keepalive, which pinged every
+ * KEEPALIVE_BASE_MS and left a dead link to TCP. A SUBSCRIBE waits for its SUBACK the same way,
+ * and the bytes of the new connection up to the CONNACK must not count as its answer.
+ */
+#include "farlock_test.h"
+
+#define DAY_MS          (24u * 3600u * 1000u)
+#define DETECT_SLACK_MS (2 * IOT_TIMER_RESOLUTION_IN_MS)
+
+static iot_timer_time_in_ms_t wall_now(void)
+{
+    iot_timer_time_in_ms_t now;
+
+    wall_clock_sync();
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+    return now;
+}
+
+/* Runs for ms with the recovery ladder, which has a test of its own, held off. */
+static void run_ms(uint32_t ms)
+{
+    for (uint32_t t = 0; t < ms; t += 10)
+    {
+        sim_run_ms(10);
+        idle_start_time = 0;
+    }
+}
+
+/* The broker answers again, including the connect that may be waiting for it. */
+static void revive(void)
+{
+    sim_mqtt.silent = false;
+    fl_broker = true;
+    for (int i = 0; i < 12000 && m_subscriber.state != APP_MQTT_STATE_SUBSCRIBED; i++)
+    {
+        run_ms(10);
+        if (m_subscriber.state == APP_MQTT_STATE_CONNECTING)
+            fl_connack(0, MQTT_CONNECTION_ACCEPTED);
+        if (m_subscriber.state == APP_MQTT_STATE_SUBSCRIBING)
+            fl_evt(MQTT_EVT_SUBACK, NRF_SUCCESS);
+    }
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+}
+
+/* The broker goes silent; returns the wall clock time until the connection is given up. */
+static uint32_t die(uint32_t limit_ms)
+{
+    iot_timer_time_in_ms_t death = wall_now();
+
+    sim_mqtt.silent = true;
+    fl_broker = false;
+    for (uint32_t t = 0; t < limit_ms && m_subscriber.state == APP_MQTT_STATE_SUBSCRIBED; t += 10)
+        run_ms(10);
+    CHECK(m_subscriber.state != APP_MQTT_STATE_SUBSCRIBED);
+    return wall_now() - death;
+}
+
+static void test_interval(void)
+{
+    iot_timer_time_in_ms_t now = wall_now();
+    iot_timer_time_in_ms_t subscribed_time = m_subscribed_time;
+    uint32_t shrink = m_keepalive_shrink;
+
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    CHECK_EQ(KEEPALIVE_BASE_MS, 58000);
+    CHECK(KEEPALIVE_MIN_MS < KEEPALIVE_BASE_MS);
+    m_subscribed_time = now;
+
+    /* Grows from the base while the subscription lasts. */
+    m_keepalive_shrink = 0;
+    CHECK_EQ(keepalive_interval_get(now), KEEPALIVE_BASE_MS);
+    CHECK_EQ(keepalive_interval_get(now + KEEPALIVE_GROW_MS), 2 * KEEPALIVE_BASE_MS);
+    CHECK_EQ(keepalive_interval_get(now + 10 * KEEPALIVE_GROW_MS), KEEPALIVE_MAX_MS);
+
+    /* Disconnects in a row halve it, down to the minimum. */
+    keepalive_connection_lost(now + KEEPALIVE_GROW_MS / 2);
+    CHECK_EQ(keepalive_interval_get(now), KEEPALIVE_BASE_MS / 2);
+    keepalive_connection_lost(now + KEEPALIVE_GROW_MS / 2);
+    CHECK_EQ(keepalive_interval_get(now), KEEPALIVE_MIN_MS);
+    keepalive_connection_lost(now + KEEPALIVE_GROW_MS / 2);
+    CHECK_EQ(keepalive_interval_get(now), KEEPALIVE_MIN_MS);
+
+    /* A lasting subscription pays the halvings back before it grows. */
+    CHECK_EQ(keepalive_interval_get(now + KEEPALIVE_GROW_MS), KEEPALIVE_BASE_MS / 2);
+    CHECK_EQ(keepalive_interval_get(now + 2 * KEEPALIVE_GROW_MS), KEEPALIVE_BASE_MS);
+    CHECK_EQ(keepalive_interval_get(now + 3 * KEEPALIVE_GROW_MS), 2 * KEEPALIVE_BASE_MS);
+    keepalive_connection_lost(now + KEEPALIVE_GROW_MS);
+    CHECK_EQ(m_keepalive_shrink, KEEPALIVE_SHRINK_MAX);
+    keepalive_connection_lost(now + 3 * KEEPALIVE_GROW_MS);
+    CHECK_EQ(m_keepalive_shrink, 1);
+
+    m_subscribed_time = subscribed_time;
+    m_keepalive_shrink = shrink;
+}
+
+/* A ping waits for its answer, which the MQTT module only shows in the TCP connection. */
+static void test_ping_answer(void)
+{
+    uint32_t dead = m_keepalive_dead_count;
+    uint32_t aborts = sim_mqtt.abort;
+    uint32_t pings = sim_mqtt.ping;
+    iot_timer_time_in_ms_t ping_time;
+
+    for (int i = 0; i < 100000 && sim_mqtt.ping == pings; i++)
+        sim_run_ms(10);
+    CHECK_EQ(sim_mqtt.ping - pings, 1);
+    run_ms(KEEPALIVE_RESPONSE_TIMEOUT_MS + 1000);
+    CHECK(!m_mqtt_rx_wait);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    CHECK_EQ(m_keepalive_dead_count, dead);
+
+    sim_mqtt.silent = true;
+    fl_broker = false;
+    pings = sim_mqtt.ping;
+    for (int i = 0; i < 100000 && sim_mqtt.ping == pings; i++)
+        sim_run_ms(10);
+    ping_time = wall_now();
+    CHECK(m_mqtt_rx_wait);
+    CHECK((int32_t)(ping_time - m_mqtt_rx_wait_time) <= (int32_t)DETECT_SLACK_MS);
+    for (int i = 0; i < 10000 && m_subscriber.state == APP_MQTT_STATE_SUBSCRIBED; i++)
+        run_ms(10);
+    CHECK(wall_now() - ping_time <= KEEPALIVE_RESPONSE_TIMEOUT_MS + DETECT_SLACK_MS);
+    CHECK_EQ(m_keepalive_dead_count - dead, 1);
+    CHECK_EQ(sim_mqtt.abort - aborts, 1);
+
+    revive();
+}
+
+/* The broker takes the connection but answers nothing after the CONNACK, the SUBSCRIBE included. */
+static void test_suback_lost(void)
+{
+    uint32_t dead = m_keepalive_dead_count;
+    uint32_t aborts = sim_mqtt.abort;
+    uint32_t shrink = m_keepalive_shrink;
+    iot_timer_time_in_ms_t subscribe_time;
+
+    fl_evt(MQTT_EVT_DISCONNECT, NRF_SUCCESS);
+    m_sub_mqtt_client.tcp_id = NULL;
+    for (int i = 0; i < 12000 && m_subscriber.state != APP_MQTT_STATE_CONNECTING; i++)
+        run_ms(10);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_CONNECTING);
+
+    /* The new connection starts from another sequence number than the one polled last. */
+    CHECK(m_sub_mqtt_client.tcp_id->rcv_nxt != m_mqtt_rx_seq);
+    sim_mqtt.silent = true;
+    fl_broker = false;
+    fl_connack(0, MQTT_CONNECTION_ACCEPTED);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBING);
+    CHECK(m_mqtt_rx_wait);
+    subscribe_time = wall_now();
+
+    run_ms(KEEPALIVE_RESPONSE_TIMEOUT_MS / 2);
+    CHECK(m_mqtt_rx_wait);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBING);
+
+    for (int i = 0; i < 10000 && m_subscriber.state == APP_MQTT_STATE_SUBSCRIBING; i++)
+        run_ms(10);
+    CHECK(m_subscriber.state != APP_MQTT_STATE_SUBSCRIBING);
+    CHECK(wall_now() - subscribe_time <= KEEPALIVE_RESPONSE_TIMEOUT_MS + DETECT_SLACK_MS);
+    CHECK_EQ(m_keepalive_dead_count - dead, 1);
+    CHECK_EQ(sim_mqtt.abort - aborts, 1);
+
+    revive();
+    m_keepalive_shrink = shrink;
+}
+
+typedef struct
+{
+    const char * p_name;
+    uint32_t     up_ms;                 /**< Time the broker answers after each subscription. */
+    uint32_t     down_ms;               /**< Time the broker stays silent. */
+    uint32_t     cycles;
+} pattern_t;
+
+typedef struct
+{
+    uint32_t pings;
+    uint32_t detect_first_ms;
+    uint32_t detect_last_ms;
+    uint32_t detect_max_ms;             /**< Longest detection after the first, which follows whatever ran before. */
+    uint32_t detect_sum_ms;
+    uint32_t run_ms;
+} pattern_result_t;
+
+static pattern_result_t run_pattern(const pattern_t * p_pattern)
+{
+    pattern_result_t r = { 0 };
+    uint32_t pings = sim_mqtt.ping + sim_mqtt.live_ping;
+    uint32_t start = sim_now_ms();
+
+    for (uint32_t c = 0; c < p_pattern->cycles; c++)
+    {
+        run_ms(p_pattern->up_ms);
+        CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+
+        uint32_t detect = die(p_pattern->up_ms + KEEPALIVE_MAX_MS);
+        if (c == 0)
+            r.detect_first_ms = detect;
+        else
+            r.detect_max_ms = MAX(r.detect_max_ms, detect);
+        r.detect_last_ms = detect;
+        r.detect_sum_ms += detect;
+        if (detect < p_pattern->down_ms)
+            run_ms(p_pattern->down_ms - detect);
+        revive();
+    }
+
+    r.pings = sim_mqtt.ping + sim_mqtt.live_ping - pings;
+    r.run_ms = sim_now_ms() - start;
+    return r;
+}
+
+static void report(const pattern_t * p_pattern, pattern_result_t r)
+{
+    if (unit_bench)
+        printf("  %-28s detected after %5.1f s, then %5.1f s at most, %5.1f s on average   %5.0f pings/day\n",
+               p_pattern->p_name, r.detect_first_ms / 1000.0, r.detect_max_ms / 1000.0,
+               r.detect_sum_ms / 1000.0 / p_pattern->cycles,
+               (double)r.pings * DAY_MS / r.run_ms);
+}
+
+static void test_patterns(void)
+{
+    static const pattern_t flaky = { "drops 2 min after connect", 2 * 60000, 30000, 6 };
+    static const pattern_t hourly = { "drops after 1 h", 3600000, 60000, 4 };
+    pattern_result_t r;
+    uint32_t pings;
+
+    if (unit_bench)
+        printf("broker going silent (fixed keepalive: a ping every %u s, %u pings/day, "
+               "a dead link left to TCP)\n", KEEPALIVE_BASE_MS / 1000, DAY_MS / KEEPALIVE_BASE_MS);
+
+    /* A day without drops: pings give way to the state publishes. */
+    pings = sim_mqtt.ping + sim_mqtt.live_ping;
+    run_ms(DAY_MS);
+    pings = sim_mqtt.ping + sim_mqtt.live_ping - pings;
+    CHECK(pings * 10 <= DAY_MS / KEEPALIVE_BASE_MS);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    if (unit_bench)
+        printf("  %-28s %u pings/day\n", "stable", pings);
+
+    /* A flaky link: the first drop after the stable day is left to the state publish, the next
+       ones are found by the pings, which come sooner with every drop. */
+    r = run_pattern(&flaky);
+    CHECK(r.detect_max_ms <= KEEPALIVE_BASE_MS + KEEPALIVE_RESPONSE_TIMEOUT_MS + DETECT_SLACK_MS);
+    CHECK(r.detect_last_ms <= KEEPALIVE_MIN_MS + KEEPALIVE_RESPONSE_TIMEOUT_MS + DETECT_SLACK_MS);
+    CHECK_EQ(m_keepalive_shrink, KEEPALIVE_SHRINK_MAX);
+    report(&flaky, r);
+
+    /* A stable link: an hour pays the halvings back; the state publish finds the drop. */
+    r = run_pattern(&hourly);
+    CHECK(r.detect_max_ms <= AUTO_PUBLISH_TIMEOUT_MS + AUTOCONNECT_TIMER_INTERVAL_MS +
+                             KEEPALIVE_RESPONSE_TIMEOUT_MS + DETECT_SLACK_MS);
+    CHECK_EQ(m_keepalive_shrink, 1);
+    CHECK(r.pings < r.run_ms / KEEPALIVE_BASE_MS);
+    report(&hourly, r);
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    fl_broker = true;
+    fl_subscribe();
+    test_interval();
+    test_ping_answer();
+    test_suback_lost();
+    test_patterns();
+    return unit_done("test_keepalive");
+}
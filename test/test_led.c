@@ -0,0 +1,135 @@
+/*
+ * Connection LED display state (user-009).
+ *
+ * The MQTT and IPv6 medium events run in interrupt context. A display state set there must only
+ * be recorded: the pattern and its software timer change when the scheduler runs the apply in
+ * main context. Several changes before that cost one apply, which shows the latest state. A lock
+ * command from the MQTT event flashes the access LED the same way.
+ */
+#include "farlock_test.h"
+
+static void medium_evt_irq(ipv6_medium_evt_id_t id)
+{
+    ipv6_medium_evt_t evt;
+    memset(&evt, 0, sizeof(evt));
+    evt.ipv6_medium_evt_id = id;
+    on_ipv6_medium_evt(&evt);
+}
+
+static void test_deferred(void)
+{
+    const led_pattern_t * p_before = mp_led_pattern;
+    int16_t heap_index = m_led_pattern_timer.heap_index;
+    iot_timer_time_in_ms_t due_time = m_led_pattern_timer.due_time;
+    uint16_t timers = m_sw_timer_count;
+
+    CHECK(p_before == &m_led_connectable_pattern);
+
+    /* From the event: state recorded, LED and timer untouched. */
+    medium_evt_irq(IPV6_MEDIUM_EVT_CONN_UP);
+    CHECK_EQ(m_display_state, LEDS_IPV6_IF_UP);
+    CHECK(m_display_apply_queued);
+    CHECK(mp_led_pattern == p_before);
+    CHECK_EQ(m_led_pattern_timer.heap_index, heap_index);
+    CHECK_EQ(m_led_pattern_timer.due_time, due_time);
+    CHECK_EQ(m_sw_timer_count, timers);
+
+    /* From the scheduler: pattern applied. */
+    app_sched_execute();
+    CHECK(!m_display_apply_queued);
+    CHECK(mp_led_pattern == &m_led_ipv6_up_pattern);
+    CHECK(sw_timer_is_running(&m_led_pattern_timer));
+}
+
+static void test_coalesced(void)
+{
+    uint32_t queued = m_sched_lanes[SCHED_PRIO_NORMAL].count;
+
+    nrf_driver_interface_down(&fl_interface);
+    display_state_set(LEDS_CONNECTED_TO_BROKER);
+    display_state_set(LEDS_SUBSCRIBED_TO_TOPIC);
+    CHECK_EQ(m_sched_lanes[SCHED_PRIO_NORMAL].count - queued, 1);
+
+    led_cxn_stable = false;
+    app_sched_execute();
+    CHECK(mp_led_pattern == &m_led_on_pattern);
+    CHECK(!sw_timer_is_running(&m_led_pattern_timer));
+
+    /* Back to a blinking pattern, then off. */
+    display_state_set(LEDS_CONNECTABLE_MODE);
+    app_sched_execute();
+    CHECK(mp_led_pattern == &m_led_connectable_pattern);
+    CHECK(sw_timer_is_running(&m_led_pattern_timer));
+    display_state_set(LEDS_IPV6_IF_DOWN);
+    app_sched_execute();
+    CHECK(mp_led_pattern == &m_led_off_pattern);
+    CHECK(!sw_timer_is_running(&m_led_pattern_timer));
+}
+
+/* An event raised while the main loop sets a state, within its critical region: the later state wins. */
+
+static void irq_subscribed(void)
+{
+    display_state_set(LEDS_SUBSCRIBED_TO_TOPIC);
+}
+
+static void test_set_during_apply(void)
+{
+    display_state_set(LEDS_IPV6_IF_UP);
+    CRITICAL_REGION_ENTER();
+    sim_irq_raise(irq_subscribed);
+    CRITICAL_REGION_EXIT();
+    app_sched_execute();
+    CHECK(!m_display_apply_queued);
+    CHECK(mp_led_pattern == &m_led_on_pattern);
+}
+
+/* A lock command arriving in the MQTT event, in interrupt context. */
+
+static char m_lock_topic[64];
+
+static void irq_lock_command(void)
+{
+    fl_publish_in_irq(m_lock_topic, "1", 1, 1);
+}
+
+static void test_access_flash_deferred(void)
+{
+    sw_timer_t * heap[SW_TIMER_MAX];
+    uint16_t timers = m_sw_timer_count;
+    uint32_t leds = sim_leds & (LED_ACCESS_GRANT | LED_ACCESS_REJECT);
+
+    snprintf(m_lock_topic, sizeof(m_lock_topic), "%s/i/lock/state", m_identity.device_id);
+    m_lock_state = LOCK_STATE_UNLOCKED;
+    CHECK(!sw_timer_is_running(&m_led_access_timer));
+    memcpy(heap, m_sw_timer_heap, sizeof(heap));
+
+    sim_irq_raise(irq_lock_command);
+    CHECK_EQ(m_lock_state, LOCK_STATE_LOCKING);
+    CHECK(m_led_access_queued);
+    CHECK_EQ(m_sw_timer_count, timers);
+    CHECK(memcmp(heap, m_sw_timer_heap, sizeof(heap)) == 0);
+    CHECK(!sw_timer_is_running(&m_led_access_timer));
+    CHECK_EQ(sim_leds & (LED_ACCESS_GRANT | LED_ACCESS_REJECT), leds);
+
+    app_sched_execute();
+    CHECK(!m_led_access_queued);
+    CHECK(sw_timer_is_running(&m_led_access_timer));
+    CHECK_EQ(m_sw_timer_count, timers + 1);
+    CHECK_EQ(sim_leds & (LED_ACCESS_GRANT | LED_ACCESS_REJECT), LED_ACCESS_GRANT);
+
+    sim_run_ms(LED_BLINK_ACCESS_MULT * LED_BLINK_INTERVAL_MS + IOT_TIMER_RESOLUTION_IN_MS);
+    CHECK(!sw_timer_is_running(&m_led_access_timer));
+    CHECK_EQ(sim_leds & (LED_ACCESS_GRANT | LED_ACCESS_REJECT), 0);
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    test_deferred();
+    test_coalesced();
+    test_set_during_apply();
+    test_access_flash_deferred();
+    return unit_done("test_led");
+}
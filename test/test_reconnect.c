@@ -0,0 +1,170 @@
+/*
+ * Reconnect backoff with jitter (user-022).
+ *
+ * Simulates a 10 minute broker outage three ways: the TCP connect refused after 100 ms, and a
+ * CONNACK refusing the client (MQTT_NOT_AUTHORIZED) or reporting the server unavailable after
+ * 200 ms. It counts the connect attempts and the time the radio spends on them, and checks the
+ * spacing of the attempts, the reconnect once the broker is back and the reset of the backoff
+ * after a stable session. The old autoconnect tick tried every AUTOCONNECT_TIMER_INTERVAL_MS.
+ * A refused CONNACK also has to back off from the current time, even when the wall clock has not
+ * been synced since the connect went out.
+ */
+#include "farlock_test.h"
+
+#define OUTAGE_MS   (10u * 60u * 1000u)
+
+typedef enum
+{
+    OUTAGE_TCP_REFUSED,
+    OUTAGE_NOT_AUTHORIZED,
+    OUTAGE_SERVER_UNAVAILABLE,
+} outage_t;
+
+static const char *     m_outage_names[] = { "TCP refused", "NOT_AUTHORIZED", "SERVER_UNAVAILABLE" };
+static const uint32_t   m_outage_rtt_ms[] = { 100, 200, 200 };
+
+typedef struct
+{
+    uint32_t attempts;
+    uint32_t radio_ms;
+    uint32_t max_gap_ms;
+    uint32_t back_after_ms;             /**< Time from the end of the outage to the subscription. */
+} outage_result_t;
+
+static outage_result_t run_outage(outage_t kind)
+{
+    outage_result_t r = { 0 };
+    uint32_t start = sim_now_ms();
+    uint32_t connects = sim_mqtt.connect;
+    uint32_t answer_at = 0, last_attempt = 0;
+
+    fl_evt(MQTT_EVT_DISCONNECT, 0);
+
+    while (m_subscriber.state != APP_MQTT_STATE_SUBSCRIBED && sim_now_ms() - start < 2 * OUTAGE_MS)
+    {
+        sim_run_ms(10);
+
+        /* The recovery ladder has a test of its own; it is held off here. */
+        idle_start_time = 0;
+
+        uint32_t now = sim_now_ms() - start;
+        if (sim_mqtt.connect != connects)
+        {
+            connects = sim_mqtt.connect;
+            answer_at = now + m_outage_rtt_ms[kind];
+            if (now < OUTAGE_MS)
+            {
+                if (r.attempts > 0)
+                    r.max_gap_ms = MAX(r.max_gap_ms, now - last_attempt);
+                last_attempt = now;
+                r.attempts++;
+                r.radio_ms += m_outage_rtt_ms[kind];
+            }
+        }
+        if (answer_at != 0 && now >= answer_at)
+        {
+            answer_at = 0;
+            if (now < OUTAGE_MS)
+            {
+                if (kind == OUTAGE_TCP_REFUSED)
+                    fl_evt(MQTT_EVT_DISCONNECT, 0);
+                else
+                    fl_connack(0, (kind == OUTAGE_NOT_AUTHORIZED) ? MQTT_NOT_AUTHORIZED : MQTT_SERVER_UNAVAILABLE);
+            }
+            else
+            {
+                fl_connack(0, MQTT_CONNECTION_ACCEPTED);
+                fl_evt(MQTT_EVT_SUBACK, NRF_SUCCESS);
+                r.back_after_ms = now - OUTAGE_MS;
+            }
+        }
+    }
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    return r;
+}
+
+/* Stays subscribed until the backoff starts over. */
+static void settle(void)
+{
+    sim_run_ms(RECONNECT_RESET_STABLE_MS + 2 * AUTOCONNECT_TIMER_INTERVAL_MS);
+    CHECK_EQ(m_reconnect_step, 0);
+}
+
+static void test_outages(void)
+{
+    outage_result_t r[3];
+
+    if (unit_bench)
+        printf("10 minute broker outage (old: %u attempts, one per autoconnect tick)\n",
+               OUTAGE_MS / AUTOCONNECT_TIMER_INTERVAL_MS);
+
+    for (int kind = 0; kind < 3; kind++)
+    {
+        r[kind] = run_outage((outage_t)kind);
+        settle();
+
+        CHECK(r[kind].attempts >= OUTAGE_MS / RECONNECT_MAX_DELAY_MS);
+        CHECK(r[kind].attempts * 10 <= OUTAGE_MS / AUTOCONNECT_TIMER_INTERVAL_MS);
+        CHECK(r[kind].max_gap_ms <= RECONNECT_MAX_DELAY_MS + AUTOCONNECT_TIMER_INTERVAL_MS + 2 * IOT_TIMER_RESOLUTION_IN_MS);
+        CHECK(r[kind].back_after_ms <= RECONNECT_MAX_DELAY_MS + AUTOCONNECT_TIMER_INTERVAL_MS + 2 * IOT_TIMER_RESOLUTION_IN_MS + 200);
+
+        if (unit_bench)
+            printf("  %-20s %4u attempts  radio %5.1f s  longest gap %5.1f s  back %5.1f s after the outage\n",
+                   m_outage_names[kind], r[kind].attempts, r[kind].radio_ms / 1000.0,
+                   r[kind].max_gap_ms / 1000.0, r[kind].back_after_ms / 1000.0);
+    }
+
+    /* A refused client backs off harder than a broker that is briefly unavailable. */
+    CHECK(r[OUTAGE_NOT_AUTHORIZED].attempts < r[OUTAGE_SERVER_UNAVAILABLE].attempts);
+}
+
+/* With the backoff reset, a dropped session is back on the next tick. */
+static void test_reset_on_success(void)
+{
+    uint32_t connects = sim_mqtt.connect;
+
+    fl_evt(MQTT_EVT_DISCONNECT, 0);
+    sim_run_ms(AUTOCONNECT_TIMER_INTERVAL_MS + 2 * IOT_TIMER_RESOLUTION_IN_MS);
+    CHECK_EQ(sim_mqtt.connect - connects, 1);
+    fl_subscribe();
+}
+
+/* A CONNACK refusing the client, the wall clock last synced a minute before it arrived. */
+static void test_rejected_stale_clock(void)
+{
+    uint32_t connects = sim_mqtt.connect;
+    iot_timer_time_in_ms_t now;
+
+    fl_evt(MQTT_EVT_DISCONNECT, 0);
+    for (int i = 0; i < 6000 && sim_mqtt.connect == connects; i++)
+        sim_run_ms(10);
+    CHECK(sim_mqtt.connect != connects);
+
+    sim_rtc += APP_TIMER_TICKS(RECONNECT_MAX_DELAY_MS);
+
+    mqtt_evt_t evt;
+    memset(&evt, 0, sizeof(evt));
+    evt.id = MQTT_EVT_CONNACK;
+    evt.result = MQTT_NOT_AUTHORIZED;
+    app_mqtt_evt_handler(m_subscriber.p_client, &evt);
+
+    wall_clock_sync();
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+    uint32_t least = MIN(RECONNECT_BASE_DELAY_MS << RECONNECT_REJECT_STEPS, RECONNECT_MAX_DELAY_MS);
+    least -= least / 100 * RECONNECT_JITTER_PERCENT;
+    CHECK(m_reconnect_wait);
+    CHECK((int32_t)(m_reconnect_due_time - now) >= (int32_t)(least - IOT_TIMER_RESOLUTION_IN_MS));
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    fl_broker = true;
+    fl_subscribe();
+    settle();
+    test_outages();
+    test_reset_on_success();
+    test_rejected_stale_clock();
+    return unit_done("test_reconnect");
+}
@@ -0,0 +1,180 @@
+/*
+ * Staged recovery ladder (user-023).
+ *
+ * A broker that stops answering drives the ladder through every stage. Each stage has to be
+ * taken once, after its own timeout, and do its own thing: the MQTT connection is closed, the
+ * TCP connection aborted, the BLE link dropped so that CONN_DOWN puts the medium back in
+ * connectable mode, and only then the chip reset. The medium stage is also run with the link
+ * already down, advertising or not, and the ladder has to start over once a subscription is made.
+ * The benchmark reports the recovery time after a broker blip, which used to end in a reset once
+ * IDLE_RESET_TIMEOUT_MS had passed.
+ */
+#include "farlock_test.h"
+
+/* Runs until the ladder reaches a stage, or for limit_ms at most. */
+static bool run_until_stage(recovery_stage_t stage, uint32_t limit_ms)
+{
+    uint32_t start = sim_now_ms();
+
+    while (m_recovery_stage != stage)
+    {
+        if (sim_now_ms() - start > limit_ms)
+            return false;
+        sim_run_ms(10);
+    }
+    return true;
+}
+
+/* A stage is taken on the first autoconnect tick after its timeout, on the wall clock. */
+static void check_stage_time(iot_timer_time_in_ms_t since, uint32_t timeout)
+{
+    uint32_t elapsed = m_recovery_stage_time - since;
+
+    CHECK(elapsed >= timeout);
+    CHECK(elapsed <= timeout + AUTOCONNECT_TIMER_INTERVAL_MS + IOT_TIMER_RESOLUTION_IN_MS);
+}
+
+/* Link up, the broker answering, until the subscription is made. */
+static void link_up_and_subscribe(void)
+{
+    fl_medium_evt(IPV6_MEDIUM_EVT_CONN_UP);
+    fl_subscribe();
+    sim_run_ms(2 * AUTOCONNECT_TIMER_INTERVAL_MS);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    CHECK_EQ(m_recovery_stage, RECOVERY_STAGE_NONE);
+}
+
+static void test_ladder(void)
+{
+    uint32_t counts[RECOVERY_STAGE_COUNT];
+    uint32_t errors = sim_app_error_count;
+    uint32_t connectable = sim_connectable_count;
+    uint32_t disconnects, aborts, connects, ble_disconnects, resets;
+    iot_timer_time_in_ms_t since;
+
+    memcpy(counts, m_recovery_count, sizeof(counts));
+
+    /* The broker goes quiet: the connect after the drop is never answered. */
+    fl_evt(MQTT_EVT_DISCONNECT, 0);
+
+    /* Each of the first three stages connects again on the same tick, without the backoff. */
+    aborts = sim_mqtt.abort;
+    connects = sim_mqtt.connect;
+    CHECK(run_until_stage(RECOVERY_STAGE_MQTT, 60000));
+    check_stage_time(idle_start_time, RECOVERY_MQTT_TIMEOUT_MS);
+    CHECK_EQ(m_recovery_count[RECOVERY_STAGE_MQTT] - counts[RECOVERY_STAGE_MQTT], 1);
+    CHECK_EQ(sim_mqtt.abort - aborts, 1);
+    CHECK_EQ(sim_mqtt.connect - connects, 2);
+
+    since = m_recovery_stage_time;
+    aborts = sim_mqtt.abort;
+    connects = sim_mqtt.connect;
+    CHECK(run_until_stage(RECOVERY_STAGE_TCP, 60000));
+    check_stage_time(since, RECOVERY_TCP_TIMEOUT_MS);
+    CHECK_EQ(m_recovery_count[RECOVERY_STAGE_TCP] - counts[RECOVERY_STAGE_TCP], 1);
+    CHECK_EQ(sim_mqtt.abort - aborts, 1);
+    CHECK_EQ(sim_mqtt.connect - connects, 1);
+
+    /* The medium stage drops the link instead of entering connectable mode under it. */
+    since = m_recovery_stage_time;
+    aborts = sim_mqtt.abort;
+    ble_disconnects = sim_ble_disconnect_count;
+    CHECK(run_until_stage(RECOVERY_STAGE_MEDIUM, 60000));
+    check_stage_time(since, RECOVERY_MEDIUM_TIMEOUT_MS);
+    CHECK_EQ(m_recovery_count[RECOVERY_STAGE_MEDIUM] - counts[RECOVERY_STAGE_MEDIUM], 1);
+    CHECK_EQ(sim_mqtt.abort - aborts, 1);
+    CHECK_EQ(sim_ble_disconnect_count - ble_disconnects, 1);
+    CHECK_EQ(sim_connectable_count, connectable);
+
+    /* The SoftDevice reports the link down; CONN_DOWN enters connectable mode. */
+    nrf_driver_interface_down(&fl_interface);
+    fl_medium_evt(IPV6_MEDIUM_EVT_CONN_DOWN);
+    CHECK_EQ(sim_connectable_count - connectable, 1);
+    CHECK(sim_ble_advertising);
+    CHECK_EQ(m_conn_handle, BLE_CONN_HANDLE_INVALID);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_IDLE);
+
+    /* No central comes back: the chip is reset, once. */
+    since = m_recovery_stage_time;
+    resets = sim_reset_count;
+    CHECK(run_until_stage(RECOVERY_STAGE_RESET, 120000));
+    check_stage_time(since, RECOVERY_RESET_TIMEOUT_MS);
+    CHECK_EQ(sim_reset_count - resets, 1);
+    sim_run_ms(RECOVERY_RESET_TIMEOUT_MS);
+    CHECK_EQ(sim_reset_count - resets, 1);
+
+    /* A subscription starts the ladder over. */
+    disconnects = sim_mqtt.disconnect;
+    link_up_and_subscribe();
+    CHECK_EQ(sim_mqtt.disconnect, disconnects);
+    CHECK_EQ(sim_app_error_count, errors);
+}
+
+/* The medium stage with the link already down. */
+static void test_medium_without_link(bool advertising)
+{
+    uint32_t errors = sim_app_error_count;
+    uint32_t ble_disconnects = sim_ble_disconnect_count;
+    uint32_t connectable;
+
+    nrf_driver_interface_down(&fl_interface);
+    fl_medium_evt(IPV6_MEDIUM_EVT_CONN_DOWN);
+    CHECK(sim_ble_advertising);
+    CHECK(run_until_stage(RECOVERY_STAGE_TCP, 60000));
+
+    /* Advertising may have stopped by itself in the meantime. */
+    sim_ble_advertising = advertising;
+    connectable = sim_connectable_count;
+    CHECK(run_until_stage(RECOVERY_STAGE_MEDIUM, 60000));
+    CHECK_EQ(sim_connectable_count - connectable, 1);
+    CHECK(sim_ble_advertising);
+    CHECK_EQ(sim_ble_disconnect_count, ble_disconnects);
+    CHECK_EQ(sim_app_error_count, errors);
+
+    link_up_and_subscribe();
+}
+
+/* A broker blip: the connection drops and the broker answers the next connect. */
+static void test_blip(void)
+{
+    uint32_t counts[RECOVERY_STAGE_COUNT];
+    uint32_t connects = sim_mqtt.connect;
+    uint32_t start = sim_now_ms();
+
+    memcpy(counts, m_recovery_count, sizeof(counts));
+    sim_run_ms(RECONNECT_RESET_STABLE_MS);
+    start = sim_now_ms();
+    fl_evt(MQTT_EVT_DISCONNECT, 0);
+    while (sim_mqtt.connect == connects && sim_now_ms() - start < 60000)
+        sim_run_ms(10);
+    fl_connack(0, MQTT_CONNECTION_ACCEPTED);
+    fl_evt(MQTT_EVT_SUBACK, NRF_SUCCESS);
+    uint32_t back = sim_now_ms() - start;
+
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    CHECK(back <= AUTOCONNECT_TIMER_INTERVAL_MS + 2 * IOT_TIMER_RESOLUTION_IN_MS);
+    CHECK(memcmp(counts, m_recovery_count, sizeof(counts)) == 0);
+
+    if (unit_bench)
+        printf("broker blip: subscribed again after %u ms, no recovery stage taken "
+               "(ladder: %u/%u/%u/%u s to the MQTT, TCP, medium and reset stages)\n", back,
+               RECOVERY_MQTT_TIMEOUT_MS / 1000,
+               (RECOVERY_MQTT_TIMEOUT_MS + RECOVERY_TCP_TIMEOUT_MS) / 1000,
+               (RECOVERY_MQTT_TIMEOUT_MS + RECOVERY_TCP_TIMEOUT_MS + RECOVERY_MEDIUM_TIMEOUT_MS) / 1000,
+               (RECOVERY_MQTT_TIMEOUT_MS + RECOVERY_TCP_TIMEOUT_MS + RECOVERY_MEDIUM_TIMEOUT_MS +
+                RECOVERY_RESET_TIMEOUT_MS) / 1000);
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    fl_broker = true;
+    link_up_and_subscribe();
+    CHECK_EQ(m_conn_handle, FL_CONN_HANDLE);
+    test_ladder();
+    test_medium_without_link(true);
+    test_medium_without_link(false);
+    test_blip();
+    return unit_done("test_recovery");
+}
@@ -0,0 +1,222 @@
+/*
+ * Bounded retry of failed publishes and acks (user-004).
+ *
+ * mqtt_publish and mqtt_publish_ack are made to fail for a number of attempts or for a stretch of
+ * time. The checks cover the backoff delays, the retry budget, the retry and drop counters, and
+ * the bound on the retry queue. The simulation compares a congested episode with the old
+ * behaviour: the failed operation re-posted itself to the scheduler, so the main loop ran it on
+ * every pass and never reached sd_app_evt_wait.
+ */
+#include "farlock_test.h"
+
+/* Attempt times are read from the IoT Timer wall clock, the clock the backoff is computed on. */
+static uint32_t m_attempt_ms[32];
+static uint32_t m_attempts;
+static uint32_t m_fail_until_ms;
+
+/* Records every publish attempt, and fails it while the link is congested. */
+static uint32_t congested_publish(const mqtt_publish_param_t * p_param)
+{
+    iot_timer_time_in_ms_t now;
+
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+    if (m_attempts < ARRAY_SIZE(m_attempt_ms))
+        m_attempt_ms[m_attempts] = now;
+    m_attempts++;
+    return ((int32_t)(now - m_fail_until_ms) < 0) ? NRF_ERROR_NO_MEM : NRF_SUCCESS;
+}
+
+static void congestion_start(uint32_t duration_ms)
+{
+    iot_timer_time_in_ms_t now;
+
+    wall_clock_sync();
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+    m_attempts = 0;
+    m_fail_until_ms = now + duration_ms;
+    sim_publish_hook = congested_publish;
+}
+
+static void congestion_end(void)
+{
+    sim_publish_hook = NULL;
+}
+
+static void test_backoff(void)
+{
+    uint32_t retries = m_retry_count;
+    uint32_t publishes = sim_mqtt.publish;
+
+    /* Fails at 0, 200 and 600 ms; the attempt at 1400 ms gets through. */
+    congestion_start(1000);
+    queue_state_publish(NULL);
+    fl_loop();
+    sim_run_ms(5000);
+    congestion_end();
+    fl_puback(sim_mqtt.last_message_id);
+
+    CHECK_EQ(m_attempts, 4);
+    CHECK_EQ(m_retry_count - retries, 3);
+    CHECK_EQ(sim_mqtt.publish - publishes, 1);
+    for (uint32_t i = 1; i < 4 && i < m_attempts; i++)
+    {
+        uint32_t gap = m_attempt_ms[i] - m_attempt_ms[i - 1];
+        uint32_t expected = RETRY_BASE_DELAY_MS << (i - 1);
+        CHECK(gap >= expected && gap <= expected + 2 * IOT_TIMER_RESOLUTION_IN_MS);
+    }
+}
+
+static void test_budget(void)
+{
+    uint32_t drops = m_retry_drop_count;
+    uint32_t publishes = sim_mqtt.publish;
+
+    /* The delay is capped at RETRY_MAX_DELAY_MS and the operation dropped after the budget. */
+    congestion_start(INT32_MAX);
+    queue_state_publish(NULL);
+    fl_loop();
+    sim_run_ms(60000);
+    congestion_end();
+
+    CHECK_EQ(m_attempts, 1 + RETRY_MAX_ATTEMPTS);
+    CHECK_EQ(m_retry_drop_count - drops, 1);
+    CHECK_EQ(sim_mqtt.publish - publishes, 0);
+    for (uint32_t i = 1; i < m_attempts; i++)
+        CHECK(m_attempt_ms[i] - m_attempt_ms[i - 1] <= RETRY_MAX_DELAY_MS + 2 * IOT_TIMER_RESOLUTION_IN_MS);
+    for (uint32_t i = 0; i < RETRY_QUEUE_SIZE; i++)
+        CHECK_EQ(m_retry_queue[i].in_use, 0);
+}
+
+static void test_ack(void)
+{
+    uint32_t acks = sim_mqtt.publish_ack;
+    uint32_t retries = m_retry_count;
+
+    sim_mqtt.fail_ack = 2;
+    fl_publish_in("4f0102030405ff/i/lock/state", "1", 1, 77);
+    sim_run_ms(2000);
+
+    CHECK_EQ(sim_mqtt.fail_ack, 0);
+    CHECK_EQ(sim_mqtt.publish_ack - acks, 1);
+    CHECK_EQ(m_retry_count - retries, 2);
+}
+
+static uint32_t retry_queue_occupancy(void)
+{
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < RETRY_QUEUE_SIZE; i++)
+        used += m_retry_queue[i].in_use;
+    return used;
+}
+
+/*
+ * A burst of inbound QoS 1 publishes while acks cannot be sent. Every ack fails, so the retry
+ * queue fills; what does not fit is dropped and counted instead of piling up in the scheduler.
+ */
+static void test_queue_bound(void)
+{
+    const uint32_t burst = 3 * RETRY_QUEUE_SIZE;
+    uint32_t drops = m_retry_drop_count;
+    uint32_t occupancy = 0;
+
+    sim_sched_high_water = 0;
+    sim_mqtt.fail_ack = UINT32_MAX;
+    for (uint32_t i = 0; i < burst; i++)
+    {
+        fl_publish_in("4f0102030405ff/i/lock/state", "1", 1, 100 + i);
+        occupancy = MAX(occupancy, retry_queue_occupancy());
+    }
+    for (uint32_t t = 0; t < 60000; t += 100)
+    {
+        sim_run_ms(100);
+        occupancy = MAX(occupancy, retry_queue_occupancy());
+    }
+    sim_mqtt.fail_ack = 0;
+
+    CHECK_EQ(occupancy, RETRY_QUEUE_SIZE);
+    CHECK_EQ(retry_queue_occupancy(), 0);
+    CHECK_EQ(m_retry_drop_count - drops, burst);
+    CHECK(sim_sched_high_water <= RETRY_QUEUE_SIZE);
+
+    if (unit_bench)
+        printf("%u acks failing for 60 s: retry queue peak %u of %u, scheduler queue peak %u of %u, %u dropped\n",
+               burst, occupancy, RETRY_QUEUE_SIZE, sim_sched_high_water, SCHED_QUEUE_SIZE,
+               m_retry_drop_count - drops);
+}
+
+/* The old publish_state: retry by re-posting to the scheduler straight away. */
+
+static uint32_t m_ref_runs;
+static double   m_ref_end;
+
+static uint32_t ref_congested_publish(const mqtt_publish_param_t * p_param)
+{
+    return (unit_seconds() < m_ref_end) ? NRF_ERROR_NO_MEM : NRF_SUCCESS;
+}
+
+static void ref_publish_state(void * p_event_data, uint16_t event_size)
+{
+    mqtt_publish_param_t param;
+
+    memset(&param, 0, sizeof(param));
+    param.message.topic.topic.p_utf_str = (uint8_t *)m_identity.device_id;
+    param.message.topic.topic.utf_strlen = device_id_strlen;
+    param.message.payload.p_bin_str = (uint8_t *)state_locked_str;
+    param.message.payload.bin_strlen = 1;
+
+    m_ref_runs++;
+    if (mqtt_publish(m_subscriber.p_client, &param) != NRF_SUCCESS)
+        app_sched_event_put(p_event_data, event_size, ref_publish_state);
+}
+
+/*
+ * One congested episode of a given length, old and new. The old path kept the CPU in the main
+ * loop for the whole episode, re-running the handler on every pass; its run count is measured on
+ * the host, so it only gives the order of magnitude. The new path sleeps between attempts, and
+ * its wakeups are all the timer expiries the simulation delivers, keepalive and LwIP included.
+ */
+static void bench_congestion(void)
+{
+    const uint32_t episodes_ms[] = { 100, 500, 2000, 10000 };
+
+    printf("mqtt_publish failing for a while: attempts and CPU wakeups per episode\n");
+    for (uint32_t e = 0; e < ARRAY_SIZE(episodes_ms); e++)
+    {
+        worker_pub_param_t pub_param = { .p_worker = &m_subscriber };
+        uint32_t duration = episodes_ms[e];
+
+        /* Old: the host clock stands in for the link, and the scheduler spins until it clears. */
+        m_ref_end = unit_seconds() + duration / 1000.0;
+        m_ref_runs = 0;
+        sim_publish_hook = ref_congested_publish;
+        app_sched_event_put(&pub_param, sizeof(pub_param), ref_publish_state);
+        app_sched_execute();
+        sim_publish_hook = NULL;
+
+        /* New. */
+        uint32_t wakeups = sim_wakeups;
+        congestion_start(duration);
+        queue_state_publish(NULL);
+        fl_loop();
+        sim_run_ms(duration + RETRY_MAX_DELAY_MS);
+        congestion_end();
+        fl_puback(sim_mqtt.last_message_id);
+
+        printf("  %5u ms  old %9u attempts, never sleeps   new %2u attempts, %3u wakeups in %u ms\n",
+               duration, m_ref_runs, m_attempts, sim_wakeups - wakeups, duration + RETRY_MAX_DELAY_MS);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    fl_subscribe();
+    test_backoff();
+    test_budget();
+    test_ack();
+    test_queue_bound();
+    if (unit_bench)
+        bench_congestion();
+    return unit_done("test_retry");
+}
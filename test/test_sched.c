@@ -0,0 +1,227 @@
+/*
+ * Priority lanes over app_scheduler (user-006).
+ *
+ * Checks that the high lane runs ahead of a normal lane backlog, that the lane high-water marks
+ * are kept, and that puts from interrupt context cannot corrupt a lane while the main loop puts
+ * or pumps. The benchmark measures the queueing delay of a lock command acknowledgement behind a
+ * synthetic backlog of state publishes, against the old single FIFO.
+ */
+#include "farlock_test.h"
+
+static char     m_order[64];
+static uint32_t m_order_len;
+
+static void mark(void * p_event_data, uint16_t event_size)
+{
+    if (m_order_len < sizeof(m_order) - 1)
+        m_order[m_order_len++] = *(char *)p_event_data;
+    m_order[m_order_len] = '\0';
+}
+
+static void order_reset(void)
+{
+    m_order_len = 0;
+    m_order[0] = '\0';
+}
+
+static void test_lanes(void)
+{
+    const char normal[] = "abcdef";
+
+    order_reset();
+    m_sched_lanes[SCHED_PRIO_NORMAL].high_water = 0;
+    m_sched_lanes[SCHED_PRIO_HIGH].high_water = 0;
+
+    for (int i = 0; normal[i] != '\0'; i++)
+        CHECK_EQ(prio_sched_event_put(SCHED_PRIO_NORMAL, &normal[i], 1, mark), NRF_SUCCESS);
+    CHECK_EQ(prio_sched_event_put(SCHED_PRIO_HIGH, "X", 1, mark), NRF_SUCCESS);
+    CHECK_EQ(prio_sched_event_put(SCHED_PRIO_HIGH, "Y", 1, mark), NRF_SUCCESS);
+    app_sched_execute();
+
+    CHECK_STR(m_order, "XYabcdef");
+    CHECK_EQ(m_sched_lanes[SCHED_PRIO_NORMAL].high_water, 6);
+    CHECK_EQ(m_sched_lanes[SCHED_PRIO_HIGH].high_water, 2);
+
+    /* A full lane refuses the put and leaves its events alone. */
+    order_reset();
+    for (int i = 0; i < SCHED_NORMAL_QUEUE_SIZE; i++)
+        CHECK_EQ(prio_sched_event_put(SCHED_PRIO_NORMAL, "n", 1, mark), NRF_SUCCESS);
+    CHECK_EQ(prio_sched_event_put(SCHED_PRIO_NORMAL, "!", 1, mark), NRF_ERROR_NO_MEM);
+    app_sched_execute();
+    CHECK_EQ(m_order_len, SCHED_NORMAL_QUEUE_SIZE);
+    CHECK(strchr(m_order, '!') == NULL);
+}
+
+/* An MQTT event putting into the normal lane, raised while the main loop is in the middle of a put. */
+
+static uint32_t m_irq_puts_ok;
+
+static void irq_put(void)
+{
+    if (prio_sched_event_put(SCHED_PRIO_NORMAL, "i", 1, mark) == NRF_SUCCESS)
+        m_irq_puts_ok++;
+}
+
+static bool m_irq_armed;
+
+static void raise_on_put(app_sched_event_handler_t handler)
+{
+    if (m_irq_armed)
+    {
+        m_irq_armed = false;
+        sim_irq_raise(irq_put);
+    }
+}
+
+static void test_irq_during_put(void)
+{
+    /* Room for one more event; the interrupt and the main loop race for it. */
+    for (int fill = 0; fill < SCHED_NORMAL_QUEUE_SIZE; fill++)
+    {
+        uint32_t main_ok = 0;
+
+        order_reset();
+        m_irq_puts_ok = 0;
+        for (int i = 0; i < fill; i++)
+            CHECK_EQ(prio_sched_event_put(SCHED_PRIO_NORMAL, "n", 1, mark), NRF_SUCCESS);
+
+        m_irq_armed = true;
+        sim_sched_put_hook = raise_on_put;
+        if (prio_sched_event_put(SCHED_PRIO_NORMAL, "m", 1, mark) == NRF_SUCCESS)
+            main_ok++;
+        sim_sched_put_hook = NULL;
+        CHECK(m_sched_lanes[SCHED_PRIO_NORMAL].count <= SCHED_NORMAL_QUEUE_SIZE);
+
+        app_sched_execute();
+
+        /* Every accepted event ran exactly once, the earlier ones first and untouched. */
+        CHECK_EQ(m_order_len, fill + main_ok + m_irq_puts_ok);
+        CHECK_EQ(strspn(m_order, "n"), fill);
+        CHECK_EQ(strchr(m_order, 'm') != NULL, main_ok);
+        CHECK_EQ(strchr(m_order, 'i') != NULL, m_irq_puts_ok);
+        CHECK_EQ(m_sched_lanes[SCHED_PRIO_NORMAL].count, 0);
+    }
+}
+
+/* An MQTT event raised while the pump takes an event out of the lane. */
+
+static void put_and_raise(void * p_event_data, uint16_t event_size)
+{
+    mark(p_event_data, event_size);
+    sim_irq_raise(irq_put);
+}
+
+static void test_irq_during_pump(void)
+{
+    order_reset();
+    m_irq_puts_ok = 0;
+    for (int i = 0; i < 4; i++)
+        CHECK_EQ(prio_sched_event_put(SCHED_PRIO_NORMAL, "p", 1, put_and_raise), NRF_SUCCESS);
+    app_sched_execute();
+
+    CHECK_EQ(m_irq_puts_ok, 4);
+    CHECK_STR(m_order, "pppp" "iiii");
+    CHECK_EQ(m_sched_lanes[SCHED_PRIO_NORMAL].count, 0);
+}
+
+/*
+ * Queueing delay of a command acknowledgement. A backlog of state publishes is queued, then a
+ * QoS 1 command arrives. The delay is the number of handlers that run before the PUBACK goes out,
+ * and the time they take. The old path put everything in one FIFO.
+ */
+
+static uint32_t m_handlers_run;
+static uint32_t m_handlers_before_ack;
+static uint64_t m_ack_cycles;
+
+static void backlog_publish(void * p_event_data, uint16_t event_size)
+{
+    m_handlers_run++;
+    UNUSED_VARIABLE(publish_send(&m_subscriber, p_event_data, (uint8_t *)state_locked_str, 1, 0));
+}
+
+static void ref_acknowledge_message(void * p_event_data, uint16_t event_size)
+{
+    worker_ack_param_t ack_param = *((worker_ack_param_t *)p_event_data);
+
+    m_ack_cycles = unit_cycles();
+    m_handlers_before_ack = m_handlers_run;
+    UNUSED_VARIABLE(mqtt_publish_ack(ack_param.p_worker->p_client, (mqtt_puback_param_t *)&ack_param.message_id));
+}
+
+static void measure(bool prioritized, uint32_t backlog, uint32_t * p_before, double * p_cycles)
+{
+    uint8_t uuid[16] = { 0x5a };
+    worker_ack_param_t ack_param = { .p_worker = &m_subscriber, .message_id = 9 };
+    uint32_t acks = sim_mqtt.publish_ack;
+
+    m_handlers_run = 0;
+    for (uint32_t i = 0; i < backlog; i++)
+    {
+        if (prioritized)
+            UNUSED_VARIABLE(prio_sched_event_put(SCHED_PRIO_NORMAL, uuid, sizeof(uuid), backlog_publish));
+        else
+            UNUSED_VARIABLE(app_sched_event_put(uuid, sizeof(uuid), backlog_publish));
+    }
+
+    uint64_t t0 = unit_cycles();
+    if (prioritized)
+    {
+        /* What MQTT_EVT_PUBLISH does for a QoS 1 command. */
+        UNUSED_VARIABLE(prio_sched_event_put(SCHED_PRIO_HIGH, &ack_param, sizeof(ack_param), ref_acknowledge_message));
+    }
+    else
+    {
+        UNUSED_VARIABLE(app_sched_event_put(&ack_param, sizeof(ack_param), ref_acknowledge_message));
+    }
+    app_sched_execute();
+
+    CHECK_EQ(sim_mqtt.publish_ack - acks, 1);
+    CHECK_EQ(m_handlers_run, backlog);
+    *p_before = m_handlers_before_ack;
+    *p_cycles = (double)(m_ack_cycles - t0);
+}
+
+static void test_queueing_delay(void)
+{
+    const uint32_t backlogs[] = { 0, 1, 4, 8, 16 };
+
+    if (unit_bench)
+        printf("command ack behind a backlog of state publishes: handlers run first, %s until the ack\n",
+               UNIT_CYCLES_UNIT);
+
+    for (uint32_t b = 0; b < ARRAY_SIZE(backlogs); b++)
+    {
+        uint32_t before_old, before_new;
+        double cycles_old = 0, cycles_new = 0;
+        const int rounds = 200;
+
+        for (int r = 0; r < rounds; r++)
+        {
+            double c;
+            measure(false, backlogs[b], &before_old, &c);
+            cycles_old += c;
+            measure(true, backlogs[b], &before_new, &c);
+            cycles_new += c;
+        }
+
+        CHECK_EQ(before_old, backlogs[b]);
+        CHECK_EQ(before_new, 0);
+
+        if (unit_bench)
+            printf("  backlog %2u  old %2u handlers %7.0f   new %2u handlers %7.0f\n", backlogs[b],
+                   before_old, cycles_old / rounds, before_new, cycles_new / rounds);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    fl_subscribe();
+    test_lanes();
+    test_irq_during_put();
+    test_irq_during_pump();
+    test_queueing_delay();
+    return unit_done("test_sched");
+}
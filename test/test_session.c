@@ -0,0 +1,147 @@
+/*
+ * Persistent MQTT session (user-021).
+ *
+ * A stub broker keeps the session of a client that connects with clean_session = 0, with its
+ * subscription and the QoS 1 commands published while the client was away, and reports the
+ * session in CONNACK. The checks cover both session-present outcomes: a resumed session skips
+ * the SUBSCRIBE and runs the queued commands, a lost one, or a device that does not know its
+ * subscription is held, subscribes again. The benchmark counts the broker round trips of a run
+ * of reconnects, against the old clean session that subscribed on every one.
+ */
+#include "farlock_test.h"
+
+typedef struct
+{
+    bool     session;                   /**< The broker holds a session for the client. */
+    bool     subscribed;                /**< The session holds the subscription. */
+    uint32_t queued;                    /**< lock/state commands queued for the client. */
+} broker_t;
+
+static broker_t m_broker;
+static char     m_cmd_topic[64];
+
+typedef struct
+{
+    bool     session_present;
+    uint32_t subscribes;
+    uint32_t round_trips;
+    uint32_t commands;
+    uint32_t acks;
+} reconnect_t;
+
+/* Drops the connection, waits for the reconnect and answers as the broker would. */
+static reconnect_t reconnect(void)
+{
+    reconnect_t r = { 0 };
+    uint32_t connects = sim_mqtt.connect;
+    uint32_t subscribes = sim_mqtt.subscribe;
+    uint32_t commands = m_cmd_dispatch_count[0];
+    uint32_t acks = sim_mqtt.publish_ack;
+
+    if (m_subscriber.state != APP_MQTT_STATE_IDLE)
+        fl_evt(MQTT_EVT_DISCONNECT, 0);
+    for (int i = 0; i < 6000 && sim_mqtt.connect == connects; i++)
+        sim_run_ms(10);
+    CHECK(sim_mqtt.connect != connects);
+
+    if (sim_mqtt.p_last_connect->clean_session)
+        m_broker = (broker_t){ 0 };
+    r.session_present = m_broker.session;
+    m_broker.session = !sim_mqtt.p_last_connect->clean_session;
+
+    fl_connack(r.session_present, MQTT_CONNECTION_ACCEPTED);
+    r.round_trips++;
+
+    /* The broker delivers what it queued as soon as the session is back. */
+    if (m_broker.subscribed)
+    {
+        for (; m_broker.queued > 0; m_broker.queued--)
+            fl_publish_in(m_cmd_topic, "1", 1, (uint16_t)(100 + m_broker.queued));
+    }
+
+    if (sim_mqtt.subscribe != subscribes)
+    {
+        m_broker.subscribed = true;
+        fl_evt(MQTT_EVT_SUBACK, NRF_SUCCESS);
+        r.round_trips++;
+    }
+    fl_loop();
+
+    r.subscribes = sim_mqtt.subscribe - subscribes;
+    r.commands = m_cmd_dispatch_count[0] - commands;
+    r.acks = sim_mqtt.publish_ack - acks;
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    return r;
+}
+
+static void test_outcomes(void)
+{
+    reconnect_t r;
+    uint32_t resumes = m_session_resume_count;
+
+    /* First connect: no session yet, so it subscribes. */
+    fl_link_up();
+    CHECK_EQ(sim_mqtt.p_last_connect->clean_session, 0);
+    r = reconnect();
+    CHECK(!r.session_present);
+    CHECK_EQ(r.subscribes, 1);
+    CHECK(m_session_subscribed);
+
+    /* Session present: no SUBSCRIBE, and the commands queued offline run and are acknowledged. */
+    m_broker.queued = 2;
+    r = reconnect();
+    CHECK(r.session_present);
+    CHECK_EQ(r.subscribes, 0);
+    CHECK_EQ(r.round_trips, 1);
+    CHECK_EQ(r.commands, 2);
+    CHECK_EQ(r.acks, 2);
+    CHECK_EQ(m_session_resume_count - resumes, 1);
+
+    /* The broker lost the session: subscribe again. */
+    m_broker = (broker_t){ 0 };
+    r = reconnect();
+    CHECK(!r.session_present);
+    CHECK_EQ(r.subscribes, 1);
+    CHECK(m_session_subscribed);
+
+    /* After a reboot the device cannot tell the subscription is held, so it subscribes even
+       though the broker reports a session. The queued command still arrives. */
+    m_session_subscribed = false;
+    m_broker.queued = 1;
+    r = reconnect();
+    CHECK(r.session_present);
+    CHECK_EQ(r.subscribes, 1);
+    CHECK_EQ(r.commands, 1);
+    CHECK_EQ(m_session_resume_count - resumes, 1);
+
+    /* And the reconnect after it resumes. */
+    r = reconnect();
+    CHECK(r.session_present);
+    CHECK_EQ(r.subscribes, 0);
+    CHECK_EQ(m_session_resume_count - resumes, 2);
+}
+
+static void test_round_trips(void)
+{
+    enum { RECONNECTS = 100 };
+    uint32_t round_trips = 0;
+
+    for (int i = 0; i < RECONNECTS; i++)
+        round_trips += reconnect().round_trips;
+    CHECK_EQ(round_trips, RECONNECTS);
+
+    if (unit_bench)
+        printf("%d reconnects: %u broker round trips (old clean session: %d, %d saved)\n",
+               RECONNECTS, round_trips, 2 * RECONNECTS, 2 * RECONNECTS - round_trips);
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    fl_broker = true;
+    snprintf(m_cmd_topic, sizeof(m_cmd_topic), "%s/i/lock/state", m_identity.device_id);
+    test_outcomes();
+    test_round_trips();
+    return unit_done("test_session");
+}
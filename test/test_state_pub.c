@@ -0,0 +1,184 @@
+/*
+ * Coalesced state publishes (user-005).
+ *
+ * Bursts of lock position switch bounces within one scheduler pass must cost one publish carrying
+ * the final state. Requester replies get one publish per distinct UUID, requests made while a
+ * publish is in progress are not lost, and requests made while a failed flush waits for its retry
+ * do not hand it a fresh retry budget.
+ */
+#include "farlock_test.h"
+
+static const uint8_t m_requesters[STATE_PUB_SLOT_COUNT][16] =
+{
+    { 0x01 }, { 0x02 }, { 0x03 }, { 0x04 },
+};
+
+/* Answers the PUBACK of the last publish, so the in-flight table does not retransmit it. */
+static void ack_last(void)
+{
+    if (sim_mqtt.last_message_id != 0)
+        fl_puback(sim_mqtt.last_message_id);
+}
+
+/* Edges of the lock position switch, alternating from one call to the next. */
+static void bounce(uint32_t edges)
+{
+    static bool pushed;
+
+    for (uint32_t i = 0; i < edges; i++)
+    {
+        pushed = !pushed;
+        button_event_handler(SW_LOCK_POS, pushed ? APP_BUTTON_PUSH : APP_BUTTON_RELEASE);
+    }
+}
+
+static void test_bounce_burst(void)
+{
+    if (unit_bench)
+        printf("switch bounces within one scheduler pass: publishes sent\n");
+
+    for (uint32_t edges = 1; edges <= 9; edges++)
+    {
+        uint32_t publishes = sim_mqtt.publish;
+        uint32_t coalesced = m_state_pub_coalesced_count;
+
+        bounce(edges);
+        fl_loop();
+        ack_last();
+
+        CHECK_EQ(sim_mqtt.publish - publishes, 1);
+        CHECK_EQ(m_state_pub_coalesced_count - coalesced, edges - 1);
+        CHECK_STR(sim_mqtt.last_payload, (char *)get_lock_state_str());
+
+        if (unit_bench)
+            printf("  %u edges  old %u  new %u\n", edges, edges, sim_mqtt.publish - publishes);
+    }
+}
+
+static void test_requesters(void)
+{
+    uint32_t publishes = sim_mqtt.publish;
+    uint32_t drops = m_state_pub_drop_count;
+
+    /* One publish per distinct requester, the state topic slot is separate. */
+    for (int round = 0; round < 3; round++)
+        for (int r = 0; r < STATE_PUB_SLOT_COUNT - 1; r++)
+            queue_state_publish(m_requesters[r]);
+    queue_state_publish(NULL);
+    queue_state_publish(m_requesters[STATE_PUB_SLOT_COUNT - 1]);
+    fl_loop();
+
+    CHECK_EQ(sim_mqtt.publish - publishes, STATE_PUB_SLOT_COUNT);
+    CHECK_EQ(m_state_pub_drop_count - drops, 1);
+    for (int i = 0; i < STATE_PUB_SLOT_COUNT; i++)
+        CHECK_EQ(m_state_pub_slots[i].dirty, 0);
+    for (int i = 0; i < STATE_PUB_SLOT_COUNT; i++)
+        fl_puback(sim_mqtt.last_message_id - i);
+}
+
+static void test_offline(void)
+{
+    uint32_t publishes = sim_mqtt.publish;
+
+    m_subscriber.state = APP_MQTT_STATE_CONNECTING;
+    bounce(3);
+    fl_loop();
+    sim_run_ms(1000);
+    CHECK_EQ(sim_mqtt.publish - publishes, 0);
+    CHECK_EQ(m_state_pub_slots[0].dirty, 1);
+    CHECK_EQ(m_state_pub_flush_queued, false);
+
+    m_subscriber.state = APP_MQTT_STATE_SUBSCRIBED;
+    queue_state_publish(NULL);
+    fl_loop();
+    ack_last();
+    CHECK_EQ(sim_mqtt.publish - publishes, 1);
+    CHECK_EQ(m_state_pub_slots[0].dirty, 0);
+}
+
+/* A request from interrupt context that lands while its slot is being published. */
+
+static uint32_t m_interrupts;
+
+static uint32_t interrupting_publish(const mqtt_publish_param_t * p_param)
+{
+    if (m_interrupts > 0)
+    {
+        m_interrupts--;
+        queue_state_publish(NULL);
+    }
+    return NRF_SUCCESS;
+}
+
+static void test_request_during_publish(void)
+{
+    uint32_t publishes = sim_mqtt.publish;
+
+    m_interrupts = 1;
+    sim_publish_hook = interrupting_publish;
+    queue_state_publish(NULL);
+    fl_loop();
+    sim_publish_hook = NULL;
+    ack_last();
+
+    /* The request merged during the first publish gets a publish of its own. */
+    CHECK_EQ(sim_mqtt.publish - publishes, 2);
+    CHECK_EQ(m_state_pub_slots[0].dirty, 0);
+    CHECK_EQ(m_state_pub_flush_queued, false);
+}
+
+/* Requests arriving while a failed flush waits for its retry. */
+
+static uint32_t m_attempts;
+
+static uint32_t failing_publish(const mqtt_publish_param_t * p_param)
+{
+    m_attempts++;
+    return NRF_ERROR_NO_MEM;
+}
+
+static void test_retry_budget_kept(void)
+{
+    uint32_t drops = m_retry_drop_count;
+
+    m_attempts = 0;
+    sim_publish_hook = failing_publish;
+    queue_state_publish(NULL);
+    fl_loop();
+    for (int i = 0; i < 600 && m_retry_drop_count == drops; i++)
+    {
+        bounce(1);
+        sim_run_ms(100);
+    }
+    sim_publish_hook = NULL;
+
+    /* One flush, its retries, then a drop; the bounces did not restart it. */
+    CHECK_EQ(m_attempts, 1 + RETRY_MAX_ATTEMPTS);
+    CHECK_EQ(m_retry_drop_count - drops, 1);
+    CHECK_EQ(m_state_pub_flush_queued, false);
+    CHECK_EQ(m_state_pub_slots[0].dirty, 1);
+
+    /* The next request starts a new flush, which sends the pending state. */
+    uint32_t publishes = sim_mqtt.publish;
+    queue_state_publish(NULL);
+    fl_loop();
+    ack_last();
+    CHECK_EQ(sim_mqtt.publish - publishes, 1);
+    CHECK_EQ(m_state_pub_slots[0].dirty, 0);
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    fl_subscribe();
+    bounce(1);
+    fl_loop();
+    ack_last();
+    test_bounce_burst();
+    test_requesters();
+    test_offline();
+    test_request_during_publish();
+    test_retry_budget_kept();
+    return unit_done("test_state_pub");
+}
@@ -0,0 +1,165 @@
+/*
+ * Connect, subscribe and first publish driven by the MQTT events (user-010).
+ *
+ * CONNACK queues the SUBSCRIBE and SUBACK the initial state publish, from the scheduler since the
+ * events run in interrupt context. The autoconnect tick only steps in when that did not happen.
+ * The simulation answers CONNACK and SUBACK after a broker round trip and reports the time from
+ * the link coming up to the first state publish, against the old path that waited for a tick
+ * after each of them.
+ */
+#include "farlock_test.h"
+
+#define BROKER_RTT_MS   40
+
+static void evt_irq(mqtt_evt_id_t id, uint8_t session_present)
+{
+    mqtt_evt_t evt;
+    memset(&evt, 0, sizeof(evt));
+    evt.id = id;
+    evt.param.connack.session_present_flag = session_present;
+    app_mqtt_evt_handler(m_subscriber.p_client, &evt);
+}
+
+static void wait_connect(void)
+{
+    uint32_t connects = sim_mqtt.connect;
+    for (int i = 0; i < 6000 && sim_mqtt.connect == connects; i++)
+        sim_run_ms(10);
+    CHECK(sim_mqtt.connect != connects);
+}
+
+static void test_deferred(void)
+{
+    uint32_t subscribes = sim_mqtt.subscribe;
+    uint32_t publishes = sim_mqtt.publish;
+
+    fl_link_up();
+
+    /* CONNACK: the SUBSCRIBE goes out from the scheduler. */
+    evt_irq(MQTT_EVT_CONNACK, 0);
+    CHECK_EQ(sim_mqtt.subscribe, subscribes);
+    app_sched_execute();
+    CHECK_EQ(sim_mqtt.subscribe - subscribes, 1);
+
+    /* SUBACK: the session starts from the scheduler. */
+    evt_irq(MQTT_EVT_SUBACK, 0);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    CHECK_EQ(stable_start_time, 0);
+    CHECK_EQ(sim_mqtt.publish, publishes);
+    app_sched_execute();
+    CHECK(stable_start_time != 0);
+    CHECK_EQ(sim_mqtt.publish - publishes, 1);
+    fl_puback(sim_mqtt.last_message_id);
+}
+
+static void test_resumed(void)
+{
+    uint32_t subscribes = sim_mqtt.subscribe;
+    uint32_t publishes = sim_mqtt.publish;
+    uint32_t resumes = m_session_resume_count;
+
+    fl_evt(MQTT_EVT_DISCONNECT, 0);
+    wait_connect();
+    CHECK_EQ(stable_start_time, 0);
+
+    evt_irq(MQTT_EVT_CONNACK, 1);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    CHECK_EQ(stable_start_time, 0);
+    app_sched_execute();
+    CHECK(stable_start_time != 0);
+    CHECK_EQ(sim_mqtt.subscribe, subscribes);
+    CHECK_EQ(sim_mqtt.publish - publishes, 1);
+    CHECK_EQ(m_session_resume_count - resumes, 1);
+    fl_puback(sim_mqtt.last_message_id);
+}
+
+/* A session that drops before the scheduler runs is not started. */
+static void test_stale(void)
+{
+    uint32_t publishes = sim_mqtt.publish;
+
+    fl_evt(MQTT_EVT_DISCONNECT, 0);
+    wait_connect();
+    evt_irq(MQTT_EVT_CONNACK, 1);
+    evt_irq(MQTT_EVT_DISCONNECT, 0);
+    app_sched_execute();
+    CHECK_EQ(stable_start_time, 0);
+    CHECK_EQ(sim_mqtt.publish, publishes);
+}
+
+/* Link up to first state publish, the broker answering after BROKER_RTT_MS. */
+static uint32_t time_to_publish(uint32_t phase_ms)
+{
+    uint32_t connects, subscribes, publishes;
+    uint32_t connack_at = 0, suback_at = 0;
+
+    fl_evt(MQTT_EVT_DISCONNECT, 0);
+    nrf_driver_interface_down(&fl_interface);
+    m_ipv6_state = APP_IPV6_IF_DOWN;
+    m_reconnect_wait = false;
+    fl_loop();
+    sim_run_ms(1000 + phase_ms);
+
+    connects = sim_mqtt.connect;
+    subscribes = sim_mqtt.subscribe;
+    publishes = sim_mqtt.publish;
+    uint32_t start = sim_now_ms();
+    m_ipv6_state = APP_IPV6_IF_UP;
+    nrf_driver_interface_up(&fl_interface);
+    fl_loop();
+
+    while (sim_mqtt.publish == publishes && sim_now_ms() - start < 10000)
+    {
+        sim_run_ms(1);
+        if (connack_at == 0 && sim_mqtt.connect != connects)
+            connack_at = sim_now_ms() + BROKER_RTT_MS;
+        if (connack_at != 0 && connack_at != UINT32_MAX && sim_now_ms() >= connack_at)
+        {
+            connack_at = UINT32_MAX;
+            fl_connack(0, MQTT_CONNECTION_ACCEPTED);
+        }
+        if (suback_at == 0 && sim_mqtt.subscribe != subscribes)
+            suback_at = sim_now_ms() + BROKER_RTT_MS;
+        if (suback_at != 0 && suback_at != UINT32_MAX && sim_now_ms() >= suback_at)
+        {
+            suback_at = UINT32_MAX;
+            fl_evt(MQTT_EVT_SUBACK, NRF_SUCCESS);
+        }
+    }
+    CHECK(sim_mqtt.publish != publishes);
+    fl_puback(sim_mqtt.last_message_id);
+    return sim_now_ms() - start;
+}
+
+static void test_time_to_publish(void)
+{
+    uint32_t total = 0, worst = 0, runs = 0;
+
+    for (uint32_t phase = 0; phase < 1000; phase += 37)
+    {
+        uint32_t t = time_to_publish(phase);
+        total += t;
+        worst = MAX(worst, t);
+        runs++;
+    }
+
+    /* The connect waits for one tick; the two round trips follow without waiting for more. */
+    CHECK(worst <= AUTOCONNECT_TIMER_INTERVAL_MS + 2 * BROKER_RTT_MS + 2 * IOT_TIMER_RESOLUTION_IN_MS);
+
+    if (unit_bench)
+        printf("link up to first state publish, %u ms broker round trip: mean %u ms, worst %u ms "
+               "(old: a further tick after CONNACK and after SUBACK, up to %u ms more)\n",
+               BROKER_RTT_MS, total / runs, worst, 2 * AUTOCONNECT_TIMER_INTERVAL_MS);
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    fl_broker = true;
+    test_deferred();
+    test_resumed();
+    test_stale();
+    test_time_to_publish();
+    return unit_done("test_subscribe");
+}
@@ -0,0 +1,198 @@
+/*
+ * Software timers on a deadline min-heap (user-008).
+ *
+ * Built with SW_TIMER_MAX at 256. Checks the heap invariant under random start and stop, that
+ * timers expire once each, in deadline order and never early, that periodic timers keep their
+ * rate, and that starting one timer too many is reported. The benchmark measures the cost of
+ * starting, stopping and expiring a timer with 16 to 256 timers running.
+ */
+#include "farlock_test.h"
+
+static uint32_t m_fired;
+static iot_timer_time_in_ms_t m_last_fire;
+static bool m_in_order;
+
+static void count_handler(iot_timer_time_in_ms_t wall_clock_value)
+{
+    m_fired++;
+    m_in_order &= ((int32_t)(wall_clock_value - m_last_fire) >= 0);
+    m_last_fire = wall_clock_value;
+}
+
+static sw_timer_t m_timers[SW_TIMER_MAX];
+
+static bool heap_valid(void)
+{
+    for (uint16_t i = 0; i < m_sw_timer_count; i++)
+    {
+        if (m_sw_timer_heap[i]->heap_index != i)
+            return false;
+        if (i > 0 && sw_timer_before(m_sw_timer_heap[i], m_sw_timer_heap[(i - 1) / 2]))
+            return false;
+    }
+    return true;
+}
+
+/* Stops the firmware's own timers and resets the test timers. The main loop of the simulation
+ * restarts the LwIP service timer, so it may come back while time runs. */
+static void heap_clear(void)
+{
+    while (m_sw_timer_count > 0)
+        sw_timer_stop(m_sw_timer_heap[0]);
+    for (int i = 0; i < SW_TIMER_MAX; i++)
+    {
+        m_timers[i].handler = count_handler;
+        m_timers[i].heap_index = -1;
+    }
+}
+
+static void test_random_ops(void)
+{
+    heap_clear();
+    for (int n = 0; n < 200000; n++)
+    {
+        sw_timer_t * p_timer = &m_timers[rand() % SW_TIMER_MAX];
+
+        if (rand() % 3 != 0)
+            sw_timer_start(p_timer, rand() % 100000, 0);
+        else
+            sw_timer_stop(p_timer);
+        if ((n % 97) == 0)
+            CHECK(heap_valid());
+    }
+    CHECK(heap_valid());
+
+    uint16_t running = 0;
+    for (int i = 0; i < SW_TIMER_MAX; i++)
+        running += sw_timer_is_running(&m_timers[i]);
+    CHECK_EQ(running, m_sw_timer_count);
+}
+
+static void test_expiry_order(void)
+{
+    iot_timer_time_in_ms_t now;
+
+    heap_clear();
+    wall_clock_sync();
+    UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+    for (int i = 0; i < SW_TIMER_MAX; i++)
+        sw_timer_start(&m_timers[i], 10 + rand() % 60000, 0);
+
+    m_fired = 0;
+    m_last_fire = now;
+    m_in_order = true;
+    for (int s = 0; s < 61; s++)
+    {
+        sim_run_ms(1000);
+        /* A timer still running is not yet due; one that fired was due. */
+        wall_clock_sync();
+        UNUSED_VARIABLE(iot_timer_wall_clock_get(&now));
+        for (int i = 0; i < SW_TIMER_MAX; i++)
+            if (sw_timer_is_running(&m_timers[i]))
+                CHECK((int32_t)(m_timers[i].due_time - now) > 0);
+    }
+    CHECK_EQ(m_fired, SW_TIMER_MAX);
+    CHECK(m_in_order);
+    for (int i = 0; i < SW_TIMER_MAX; i++)
+        CHECK(!sw_timer_is_running(&m_timers[i]));
+}
+
+static void test_periodic(void)
+{
+    heap_clear();
+    m_fired = 0;
+    sw_timer_start(&m_timers[0], 70, 70);
+    sw_timer_start(&m_timers[1], 1000, 0);
+    sim_run_ms(60000);
+
+    /* The wall clock runs ROUNDED_DIV(10 * 1024, 1000) ticks per 10 ms, a little fast. */
+    uint32_t wall_ms = 60000 * 1024 / 1000 / 10 * 10;
+    CHECK(m_fired >= wall_ms / 70 && m_fired <= wall_ms / 70 + 2);
+    CHECK(sw_timer_is_running(&m_timers[0]));
+    CHECK(!sw_timer_is_running(&m_timers[1]));
+    sw_timer_stop(&m_timers[0]);
+}
+
+static void test_overflow(void)
+{
+    static sw_timer_t extra = { .handler = count_handler, .heap_index = -1 };
+    uint32_t errors = sim_app_error_count;
+
+    heap_clear();
+    for (int i = 0; i < SW_TIMER_MAX; i++)
+        sw_timer_start(&m_timers[i], 1000, 0);
+    sw_timer_start(&extra, 1000, 0);
+    CHECK_EQ(sim_app_error_count - errors, 1);
+    CHECK(!sw_timer_is_running(&extra));
+    CHECK(heap_valid());
+    heap_clear();
+}
+
+/* Cost of one start, one stop and one expiry with n timers running. */
+static void bench_size(uint16_t n)
+{
+    const int rounds = 100000;
+    uint64_t start_cycles = 0, stop_cycles = 0, expire_cycles = 0;
+    uint32_t expired = 0;
+
+    heap_clear();
+    for (uint16_t i = 0; i < n; i++)
+        sw_timer_start(&m_timers[i], 1000 + rand() % 100000, 0);
+
+    for (int r = 0; r < rounds; r++)
+    {
+        sw_timer_t * p_timer = &m_timers[rand() % n];
+        uint32_t delay = 1000 + rand() % 100000;
+
+        uint64_t t0 = unit_cycles();
+        sw_timer_stop(p_timer);
+        uint64_t t1 = unit_cycles();
+        sw_timer_start(p_timer, delay, 0);
+        uint64_t t2 = unit_cycles();
+
+        stop_cycles += t1 - t0;
+        start_cycles += t2 - t1;
+    }
+
+    /* n timers due within a second, expired a tick at a time. */
+    for (int r = 0; r < 20; r++)
+    {
+        heap_clear();
+        for (uint16_t i = 0; i < n; i++)
+            sw_timer_start(&m_timers[i], 10 + rand() % 1000, 0);
+
+        while (m_sw_timer_count > 0)
+        {
+            uint32_t due;
+            if (!sim_timer_pending(&due))
+                break;
+            sim_rtc = due;
+            uint32_t before = m_sw_timer_count;
+            uint64_t t0 = unit_cycles();
+            sw_timer_tick_callback(NULL);
+            expire_cycles += unit_cycles() - t0;
+            expired += before - m_sw_timer_count;
+        }
+    }
+
+    printf("  %3u timers   start %5.0f   stop %5.0f   expire %5.0f\n", n,
+           (double)start_cycles / rounds, (double)stop_cycles / rounds,
+           (double)expire_cycles / expired);
+}
+
+int main(int argc, char ** argv)
+{
+    unit_init(argc, argv);
+    fl_boot();
+    test_random_ops();
+    test_expiry_order();
+    test_periodic();
+    test_overflow();
+    if (unit_bench)
+    {
+        printf("software timer cost, %s per operation (API calls, tick source re-arm included)\n", UNIT_CYCLES_UNIT);
+        for (uint16_t n = 16; n <= SW_TIMER_MAX; n *= 2)
+            bench_size(n);
+    }
+    return unit_done("test_sw_timer");
+}
@@ -0,0 +1,84 @@
+/*
+ * Tickless LwIP and MQTT servicing (user-007).
+ *
+ * Runs an hour of virtual time in a few link states and counts the CPU wakeups, the
+ * sys_check_timeouts calls and the pings, MQTT_KEEPALIVE ones from mqtt_live included. The old periodic mode serviced LwIP and mqtt_live on
+ * every LWIP_SYS_TICK_MS tick of the IoT Timer, so it woke 100 times a second in every state:
+ * 360000 wakeups per hour. The checks make sure the tickless mode still services a periodic LwIP
+ * timeout on time, and never lets the MQTT connection go MQTT_KEEPALIVE without sending.
+ */
+#include "farlock_test.h"
+
+#define HOUR_MS             (3600u * 1000u)
+#define PERIODIC_PER_HOUR   (HOUR_MS / 10)
+
+typedef struct
+{
+    uint32_t wakeups;
+    uint32_t checks;
+    uint32_t pings;
+} hour_t;
+
+static hour_t run_hour(void)
+{
+    hour_t h;
+    uint32_t wakeups = sim_wakeups;
+    uint32_t checks = sim_lwip_checks;
+    uint32_t pings = sim_mqtt.ping + sim_mqtt.live_ping;
+
+    sim_mqtt.max_idle_ms = 0;
+
+    for (uint32_t t = 0; t < HOUR_MS; t += 1000)
+        sim_run_ms(1000);
+
+    h.wakeups = sim_wakeups - wakeups;
+    h.checks = sim_lwip_checks - checks;
+    h.pings = sim_mqtt.ping + sim_mqtt.live_ping - pings;
+    return h;
+}
+
+static void report(const char * p_state, hour_t h)
+{
+    if (unit_bench)
+        printf("  %-34s %7u wakeups  %7u LwIP checks  %4u pings   (periodic: %u)\n",
+               p_state, h.wakeups, h.checks, h.pings, PERIODIC_PER_HOUR);
+}
+
+int main(int argc, char ** argv)
+{
+    hour_t h;
+
+    unit_init(argc, argv);
+    fl_boot();
+
+    if (unit_bench)
+        printf("one hour of virtual time\n");
+
+    /* No BLE link: nothing for LwIP or MQTT to do. */
+    h = run_hour();
+    CHECK(h.wakeups * 10 <= PERIODIC_PER_HOUR);
+    report("BLE down, idle", h);
+
+    /* Subscribed, no LwIP timeout pending: only the keepalive and the state publishes. */
+    fl_broker = true;
+    fl_subscribe();
+    h = run_hour();
+    CHECK(h.wakeups * 10 <= PERIODIC_PER_HOUR);
+    CHECK(sim_mqtt.max_idle_ms < MQTT_KEEPALIVE * 1000);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    report("subscribed, LwIP idle", h);
+
+    /* Subscribed with a 250 ms TCP timer running: it must be serviced on time. */
+    sim_lwip_period_ms = 250;
+    sim_lwip_late_max_ms = 0;
+    h = run_hour();
+    CHECK(h.checks >= HOUR_MS / 250);
+    CHECK(sim_lwip_late_max_ms <= IOT_TIMER_RESOLUTION_IN_MS);
+    CHECK(h.wakeups * 10 <= PERIODIC_PER_HOUR * 2);
+    CHECK(sim_mqtt.max_idle_ms < MQTT_KEEPALIVE * 1000);
+    CHECK_EQ(m_subscriber.state, APP_MQTT_STATE_SUBSCRIBED);
+    report("subscribed, 250 ms LwIP timer", h);
+    sim_lwip_period_ms = 0;
+
+    return unit_done("test_tickless");
+}
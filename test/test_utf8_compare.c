@@ -0,0 +1,347 @@
+/*
+ * Byte-wise slice compare and MQTT topic matching (user-019).
+ *
+ * u8_cmp, u8_ncmp, u8_has_prefix and u8_has_suffix are compared with references that decode to
+ * code points, on random strings over small alphabets of one to four byte characters so that
+ * long common prefixes and differences inside a multi-byte character are frequent. u8_topic_match
+ * is compared with a reference that splits filter and topic into levels, on topics whose levels
+ * are multi-byte and filters derived from them with "+" and "#". The benchmark compares the cost
+ * of a compare with the old path, which decoded both strings and compared the code points.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include "unit.h"
+#include "../utf8.h"
+#include "ref_utf8.h"
+
+static int sign(int v)
+{
+    return (v > 0) - (v < 0);
+}
+
+/* Code point order of the first n characters, n < 0 for all of them. */
+static int ref_ncmp(char *a, size_t alen, char *b, size_t blen, int n)
+{
+    static u_int32_t ua[512], ub[512];
+    int na = ref_u8_toucs(ua, 512, a, alen);
+    int nb = ref_u8_toucs(ub, 512, b, blen);
+
+    if (n >= 0)
+    {
+        na = (na < n) ? na : n;
+        nb = (nb < n) ? nb : n;
+    }
+    for (int i = 0; i < na && i < nb; i++)
+        if (ua[i] != ub[i])
+            return (ua[i] < ub[i]) ? -1 : 1;
+    return (na > nb) - (na < nb);
+}
+
+static u_int32_t pick(void)
+{
+    int k = rand() % 8;
+
+    if (k < 3) return 1 + rand() % 0x7F;
+    if (k < 4) return 0x80 + rand() % 0x780;
+    if (k < 6) return 0x800 + rand() % 0xD000;
+    if (k < 7) return 0xE000 + rand() % 0x2000;
+    return 0x10000 + rand() % 0x100;
+}
+
+static int random_string(char *s, int chars, u_int32_t *letters, int alpha)
+{
+    int n = 0;
+
+    for (int j = 0; j < chars; j++)
+        n += u8_wc_toutf8(s + n, letters[rand() % alpha]);
+    return n;
+}
+
+static void test_compare(void)
+{
+    static char a[512], b[512];
+    unsigned long mismatches = 0;
+
+    for (int it = 0; it < 500000; it++)
+    {
+        u_int32_t letters[4];
+        int alpha = 1 + rand() % 4;
+        int na, nb, n;
+
+        for (int j = 0; j < alpha; j++)
+            letters[j] = pick();
+        na = random_string(a, rand() % 60, letters, alpha);
+
+        /* b is a, a prefix of a, a with one character changed, or a with more appended. */
+        memcpy(b, a, na);
+        nb = na;
+        switch (rand() % 4)
+        {
+            case 0:
+                break;
+            case 1:
+                nb = u8_memoffset(a, na, rand() % (u8_memlen(a, na) + 1));
+                break;
+            case 2:
+                if (na > 0)
+                {
+                    int c = u8_memoffset(a, na, rand() % u8_memlen(a, na));
+                    int old_len = u8_seqlen(a + c);
+                    char ch[4];
+                    int new_len = u8_wc_toutf8(ch, pick());
+                    memcpy(b + c + new_len, a + c + old_len, na - c - old_len);
+                    memcpy(b + c, ch, new_len);
+                    nb = na - old_len + new_len;
+                }
+                break;
+            default:
+                nb += random_string(b + nb, 1 + rand() % 8, letters, alpha);
+                break;
+        }
+        /* Either way round. */
+        char *x = a, *y = b;
+        if (rand() % 2)
+        {
+            x = b; y = a;
+            n = na; na = nb; nb = n;
+        }
+
+        n = rand() % 70;
+        if (sign(u8_cmp(x, na, y, nb)) != ref_ncmp(x, na, y, nb, -1))
+            mismatches++;
+        if (sign(u8_ncmp(x, na, y, nb, n)) != ref_ncmp(x, na, y, nb, n))
+            mismatches++;
+        if (u8_has_prefix(x, na, y, nb) != (nb <= na && memcmp(x, y, nb) == 0))
+            mismatches++;
+        if (u8_has_suffix(x, na, y, nb) != (nb <= na && memcmp(x + na - nb, y, nb) == 0))
+            mismatches++;
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+static void test_compare_cases(void)
+{
+    /* U+00FF < U+0100 < U+20AC < U+1F512, the lead bytes order them. */
+    CHECK(u8_cmp("\xc3\xbf", 2, "\xc4\x80", 2) < 0);
+    CHECK(u8_cmp("\xe2\x82\xac", 3, "\xc4\x80", 2) > 0);
+    CHECK(u8_cmp("\xf0\x9f\x94\x92", 4, "\xef\xbf\xbd", 3) > 0);
+    CHECK(u8_cmp("lock/st\xc3\xa4te", 10, "lock/st\xc3\xa4te", 10) == 0);
+    CHECK(u8_cmp("lock/state", 10, "lock/stat", 9) > 0);
+    CHECK(u8_cmp("", 0, "", 0) == 0);
+    CHECK(u8_ncmp("\xe2\x82\xac" "a", 4, "\xe2\x82\xac" "b", 4, 1) == 0);
+    CHECK(u8_ncmp("\xe2\x82\xac" "a", 4, "\xe2\x82\xac" "b", 4, 2) < 0);
+    CHECK(u8_has_prefix("\xe2\x82\xac/i/lock", 10, "\xe2\x82\xac/i/", 6));
+    CHECK(!u8_has_prefix("\xe2\x82\xac/i/lock", 10, "\xe2\x82\xad/i/", 6));
+    CHECK(u8_has_suffix("lock/\xf0\x9f\x94\x92", 9, "/\xf0\x9f\x94\x92", 5));
+    CHECK(!u8_has_suffix("\x92", 1, "\xf0\x9f\x94\x92", 4));
+}
+
+/* Splits s[0..sz) at '/', returning the number of levels. */
+static int levels(char *s, size_t sz, char **p_level, size_t *p_len)
+{
+    int n = 0;
+    size_t start = 0;
+
+    for (size_t i = 0; i <= sz; i++)
+    {
+        if (i == sz || s[i] == '/')
+        {
+            p_level[n] = s + start;
+            p_len[n++] = i - start;
+            start = i + 1;
+        }
+    }
+    return n;
+}
+
+static int ref_topic_match(char *filter, size_t flen, char *topic, size_t tlen)
+{
+    char *fl[128], *tl[128];
+    size_t fn[128], tn[128];
+    int nf = levels(filter, flen, fl, fn);
+    int nt = levels(topic, tlen, tl, tn);
+    int i, j = 0;
+
+    for (i = 0; i < nf; i++)
+    {
+        bool wild = memchr(fl[i], '+', fn[i]) || memchr(fl[i], '#', fn[i]);
+        if (wild && (fn[i] != 1 || (fl[i][0] == '#' && i != nf - 1)))
+            return 0;
+    }
+    if ((fl[0][0] == '+' || fl[0][0] == '#') && fn[0] == 1 && tlen > 0 && topic[0] == '$')
+        return 0;
+
+    for (i = 0; i < nf; i++, j++)
+    {
+        if (fn[i] == 1 && fl[i][0] == '#')
+            return 1;
+        if (j == nt)
+            return 0;
+        if (fn[i] == 1 && fl[i][0] == '+')
+            continue;
+        if (fn[i] != tn[j] || memcmp(fl[i], tl[j], fn[i]) != 0)
+            return 0;
+    }
+    return j == nt;
+}
+
+static const char *m_tokens[] =
+{
+    "a", "b", "ab", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x94\x92", "a\xc3\xa9", "$", "", "i",
+};
+
+static int random_topic(char *s)
+{
+    int n = 0, nl = 1 + rand() % 5;
+
+    for (int l = 0; l < nl; l++)
+    {
+        if (l > 0)
+            s[n++] = '/';
+        for (int k = rand() % 3; k >= 0; k--)
+        {
+            const char *t = m_tokens[rand() % (sizeof(m_tokens) / sizeof(m_tokens[0]))];
+            memcpy(s + n, t, strlen(t));
+            n += strlen(t);
+        }
+    }
+    return n;
+}
+
+static void test_topic_match(void)
+{
+    static char topic[256], filter[256];
+    unsigned long mismatches = 0, matches = 0;
+
+    for (int it = 0; it < 500000; it++)
+    {
+        int tlen = random_topic(topic), flen = 0;
+        char *tl[128];
+        size_t tn[128];
+        int nt = levels(topic, tlen, tl, tn);
+
+        if (rand() % 4 == 0)
+        {
+            /* An unrelated filter, with wildcards anywhere. */
+            flen = random_topic(filter);
+            for (int k = rand() % 3; k > 0 && flen > 0; k--)
+                filter[rand() % flen] = "+#/"[rand() % 3];
+        }
+        else
+        {
+            /* The topic's levels, some replaced with "+", perhaps cut short by "#". */
+            int cut = (rand() % 3 == 0) ? rand() % (nt + 1) : nt;
+            for (int l = 0; l < cut; l++)
+            {
+                if (l > 0)
+                    filter[flen++] = '/';
+                if (rand() % 4 == 0)
+                    filter[flen++] = '+';
+                else
+                {
+                    memcpy(filter + flen, tl[l], tn[l]);
+                    flen += tn[l];
+                }
+            }
+            if (cut < nt || rand() % 8 == 0)
+            {
+                if (cut > 0)
+                    filter[flen++] = '/';
+                filter[flen++] = '#';
+            }
+            /* Now and then one byte changed, inside a multi-byte character or not. */
+            if (rand() % 8 == 0 && flen > 0)
+                filter[rand() % flen] ^= 1 << (rand() % 8);
+        }
+
+        int got = u8_topic_match(filter, flen, topic, tlen);
+        if (got != ref_topic_match(filter, flen, topic, tlen))
+            mismatches++;
+        matches += got;
+    }
+    CHECK_EQ(mismatches, 0);
+    CHECK(matches > 100000);
+}
+
+static void test_topic_cases(void)
+{
+    char f[] = "4f0102030405ff/i/#";
+
+    CHECK(u8_topic_match(f, strlen(f), "4f0102030405ff/i/lock/state", 27));
+    CHECK(u8_topic_match(f, strlen(f), "4f0102030405ff/i", 16));
+    CHECK(!u8_topic_match(f, strlen(f), "4f0102030405ff/o/lock/state", 27));
+    CHECK(u8_topic_match("+/\xe2\x82\xac/+", 7, "a/\xe2\x82\xac/\xf0\x9f\x94\x92", 10));
+    CHECK(!u8_topic_match("+/\xe2\x82\xac/+", 7, "a/\xe2\x82\xad/\xf0\x9f\x94\x92", 10));
+    CHECK(!u8_topic_match("+/\xe2\x82\xac", 5, "a/\xe2\x82\xac/b", 6));
+    CHECK(!u8_topic_match("#", 1, "$SYS/x", 6));
+    CHECK(!u8_topic_match("+/x", 3, "$SYS/x", 6));
+    CHECK(u8_topic_match("$SYS/#", 6, "$SYS/x", 6));
+    CHECK(!u8_topic_match("a/b#", 4, "a/b", 3));
+    CHECK(!u8_topic_match("a/#/b", 5, "a/x/b", 5));
+    CHECK(!u8_topic_match("a+/b", 4, "a+/b", 4));
+}
+
+/* The old path: both strings decoded, then the code points compared. */
+static int old_cmp(char *a, size_t alen, char *b, size_t blen)
+{
+    u_int32_t ua[128], ub[128];
+    int na = ref_u8_toucs(ua, 128, a, alen);
+    int nb = ref_u8_toucs(ub, 128, b, blen);
+
+    for (int i = 0; i < na && i < nb; i++)
+        if (ua[i] != ub[i])
+            return (ua[i] < ub[i]) ? -1 : 1;
+    return (na > nb) - (na < nb);
+}
+
+static void bench(void)
+{
+    static char a[128], b[128];
+    const int reps = 1000000;
+    int n = 0;
+
+    n += snprintf(a, sizeof(a), "4f0102030405ff/i/lock/\xc3\xa9tat/\xe2\x82\xac/\xf0\x9f\x94\x92/state");
+    memcpy(b, a, n);
+
+    printf("compare of a %d byte topic, %s per call\n", n, UNIT_CYCLES_UNIT);
+    for (int d = 0; d < 3; d++)
+    {
+        static const char *names[] = { "equal", "differ at byte 20", "differ at the end" };
+        int at = (d == 0) ? -1 : (d == 1) ? 20 : n - 1;
+        uint64_t t0, t1, t2;
+
+        memcpy(b, a, n);
+        if (at >= 0)
+            b[at] ^= 1;
+
+        t0 = unit_cycles();
+        for (int r = 0; r < reps; r++) unit_sink += old_cmp(a, n, b, n);
+        t1 = unit_cycles();
+        for (int r = 0; r < reps; r++) unit_sink += u8_cmp(a, n, b, n);
+        t2 = unit_cycles();
+        printf("  %-18s old %6.1f   u8_cmp %6.1f\n", names[d],
+               (double)(t1 - t0) / reps, (double)(t2 - t1) / reps);
+    }
+
+    char f[] = "4f0102030405ff/i/#", g[] = "+/i/+/+/+/+/+/state";
+    uint64_t t0 = unit_cycles();
+    for (int r = 0; r < reps; r++) unit_sink += u8_topic_match(f, strlen(f), a, n);
+    uint64_t t1 = unit_cycles();
+    for (int r = 0; r < reps; r++) unit_sink += u8_topic_match(g, strlen(g), a, n);
+    uint64_t t2 = unit_cycles();
+    printf("  u8_topic_match  \"%s\" %6.1f   \"%s\" %6.1f\n", f, (double)(t1 - t0) / reps,
+           g, (double)(t2 - t1) / reps);
+}
+
+int main(int argc, char **argv)
+{
+    unit_init(argc, argv);
+    srand(19);
+    test_compare();
+    test_compare_cases();
+    test_topic_match();
+    test_topic_cases();
+    if (unit_bench)
+        bench();
+    return unit_done("test_utf8_compare");
+}
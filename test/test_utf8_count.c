@@ -0,0 +1,167 @@
+/*
+ * Word-at-a-time character counting (user-012).
+ *
+ * u8_strlen, u8_offset and u8_charnum and their length-bounded u8_mem* forms are compared with
+ * the old functions on random strings at every alignment: valid UTF-8, and arbitrary bytes with
+ * at most three continuation bytes in a row, which the old code steps over the same way. The
+ * benchmark runs old and new over ASCII, mixed and CJK text.
+ */
+#include <stdlib.h>
+#include "unit.h"
+#include "../utf8.h"
+#include "ref_utf8.h"
+
+/* Random valid UTF-8 without NUL, up to max - 4 bytes. */
+static int gen_valid(char *b, int max)
+{
+    int n = 0;
+    while (n < max - 4 && rand() % 50 != 0)
+    {
+        int k = rand() % 8;
+        u_int32_t c;
+
+        if (k < 4)
+            c = 1 + rand() % 0x7F;
+        else if (k < 5)
+            c = 0x80 + rand() % 0x780;
+        else if (k < 7)
+            do c = 0x800 + rand() % 0xF800; while (c >= 0xD800 && c < 0xE000);
+        else
+            c = 0x10000 + rand() % 0x100000;
+        n += u8_wc_toutf8(b + n, c);
+    }
+    b[n] = '\0';
+    return n;
+}
+
+static int gen_bytes(char *b, int max)
+{
+    int n = rand() % max, run = 0;
+    for (int i = 0; i < n; i++)
+    {
+        b[i] = 1 + rand() % 255;
+        if (((unsigned char)b[i] & 0xC0) == 0x80)
+        {
+            if (++run > 3)
+            {
+                b[i] = 'a';
+                run = 0;
+            }
+        }
+        else
+        {
+            run = 0;
+        }
+    }
+    b[n] = '\0';
+    return n;
+}
+
+static void test_random(void)
+{
+    static char store[512];
+    unsigned long mismatches = 0;
+
+    for (int it = 0; it < 500000; it++)
+    {
+        char *b = store + rand() % 16;
+        int valid = (it % 4) != 0;
+        int n;
+
+        memset(store, 0, sizeof(store));
+        n = valid ? gen_valid(b, 1 + rand() % 300) : gen_bytes(b, 200);
+
+        /* The old u8_strlen decodes, so it only counts the same on valid input. */
+        if (valid && u8_strlen(b) != ref_u8_strlen(b))
+            mismatches++;
+        if (u8_memlen(b, n) != (n ? ref_u8_charnum(b, n) : 0))
+            mismatches++;
+
+        for (int q = 0; q < 4; q++)
+        {
+            int k = rand() % (n + 3) - 1;
+
+            if (u8_offset(b, k) != ref_u8_offset(b, k))
+                mismatches++;
+            if (u8_charnum(b, k) != ref_u8_charnum(b, k))
+                mismatches++;
+            if (u8_memoffset(b, n, k) != ref_u8_offset(b, k))
+                mismatches++;
+            if (u8_memcharnum(b, n, k) != ref_u8_charnum(b, k))
+                mismatches++;
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+/* The bounded forms stop at the size given, NUL or not. */
+static void test_bounded(void)
+{
+    char b[] = "h\xc3\xa9llo\0w\xc3\xb6rld";
+
+    CHECK_EQ(u8_memlen(b, sizeof(b) - 1), 11);
+    CHECK_EQ(u8_memlen(b, 3), 2);
+    CHECK_EQ(u8_memlen(b, 2), 2);
+    CHECK_EQ(u8_memoffset(b, sizeof(b) - 1, 8), 10);
+    CHECK_EQ(u8_memoffset(b, 4, 100), 4);
+    CHECK_EQ(u8_memcharnum(b, sizeof(b) - 1, 9), 8);
+    CHECK_EQ(u8_memcharnum(b, 4, 100), 3);
+}
+
+static char m_text[1 << 16];
+
+static void text_fill(const char *unit)
+{
+    int l = strlen(unit), i = 0;
+    while (i + l < (int)sizeof(m_text))
+    {
+        memcpy(m_text + i, unit, l);
+        i += l;
+    }
+    m_text[i] = '\0';
+}
+
+static void bench_text(const char *name, const char *unit)
+{
+    const int reps = 2000;
+    double t[7];
+    int n;
+
+    text_fill(unit);
+    n = strlen(m_text);
+
+    t[0] = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += ref_u8_strlen(m_text);
+    t[1] = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += u8_strlen(m_text);
+    t[2] = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += ref_u8_offset(m_text, n);
+    t[3] = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += u8_offset(m_text, n);
+    t[4] = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += ref_u8_charnum(m_text, n);
+    t[5] = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += u8_charnum(m_text, n);
+    t[6] = unit_seconds();
+
+    double mb = (double)n * reps / 1e6;
+    printf("  %-6s u8_strlen %5.0f -> %5.0f   u8_offset %5.0f -> %5.0f   u8_charnum %5.0f -> %5.0f\n",
+           name, mb / (t[1] - t[0]), mb / (t[2] - t[1]), mb / (t[3] - t[2]),
+           mb / (t[4] - t[3]), mb / (t[5] - t[4]), mb / (t[6] - t[5]));
+}
+
+int main(int argc, char **argv)
+{
+    unit_init(argc, argv);
+    srand(12);
+    test_random();
+    test_bounded();
+    if (unit_bench)
+    {
+        printf("counting characters in 64 kB, old -> new MB/s\n");
+        bench_text("ascii", "lock/getstate/0123-abcd ");
+        bench_text("mixed", "door \xc3\xa9t\xc3\xa9 \xe2\x82\xac ok ");
+        bench_text("cjk", "\xe9\x8e\x96\xe7\x8a\xb6\xe6\x85\x8b\xe9\x96\x8b\xe9\x96\x89");
+    }
+    return unit_done("test_utf8_count");
+}
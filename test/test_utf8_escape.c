@@ -0,0 +1,179 @@
+/*
+ * Table-driven escaping (user-016).
+ *
+ * u8_escape_wchar is compared with the old function for every code point and small buffer.
+ * u8_escape and u8_unescape are compared on random strings built from plain and escaped pieces,
+ * with random buffer sizes so truncation is covered. The checks also cover in-place unescaping,
+ * the round trip, and the deliberate differences from the old code. The benchmark runs
+ * escape-heavy and escape-free input through old and new.
+ */
+#include <stdlib.h>
+#include "unit.h"
+#include "../utf8.h"
+#include "ref_utf8.h"
+
+static const char *m_pieces[] =
+{
+    "a", "Z", " ", "\"", "\\", "\n", "\t", "\r", "\b", "\f", "\v", "\a", "\x01", "\x1b", "\x7f",
+    "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x94\x92", "\xef\xbf\xbf", "\xc2\x80",
+};
+
+/* Unnamed control characters escape to \xNN, which reads back together with a hex digit that
+   follows it, so the round trip leaves them out. */
+#define ROUND_TRIP_PIECE(i) ((i) < 12 || (i) > 14)
+
+static const char *m_escaped[] =
+{
+    "a", "\\n", "\\t", "\\r", "\\b", "\\f", "\\v", "\\a", "\\\\", "\\\"", "\\x", "\\x4", "\\x41",
+    "\\x414", "\\xFg", "\\u", "\\u20ac", "\\u20", "\\U0001F512", "\\UFFFFFFFF", "\\U0011ffff",
+    "\\0", "\\7", "\\12", "\\377", "\\1234", "\\8", "\\q", "\\u00e9x", "z", "\\xff", "\\x80",
+};
+
+static void test_escape_wchar(void)
+{
+    unsigned long mismatches = 0;
+    char o1[20], o2[20];
+
+    for (u_int32_t ch = 0; ch < 0x120000; ch++)
+        for (int sz = 0; sz < 12; sz++)
+        {
+            memset(o1, '#', sizeof(o1));
+            memset(o2, '#', sizeof(o2));
+            if (u8_escape_wchar(o1, sz, ch) != ref_u8_escape_wchar(o2, sz, ch) ||
+                memcmp(o1, o2, sizeof(o1)) != 0)
+                mismatches++;
+        }
+    CHECK_EQ(mismatches, 0);
+}
+
+static void test_random(void)
+{
+    static char o1[600], o2[600], src[400], in_place[400];
+    unsigned long mismatches = 0;
+
+    for (int it = 0; it < 300000; it++)
+    {
+        int k, sz, quotes, r1, r2;
+
+        src[0] = '\0';
+        k = rand() % 30;
+        for (int j = 0; j < k; j++)
+            strcat(src, m_pieces[rand() % (int)(sizeof(m_pieces) / sizeof(m_pieces[0]))]);
+        sz = rand() % 200;
+        quotes = rand() % 2;
+        memset(o1, '#', sizeof(o1));
+        memset(o2, '#', sizeof(o2));
+        r1 = u8_escape(o1, sz, src, quotes);
+        r2 = ref_u8_escape(o2, sz, src, quotes);
+        if (r1 != r2 || memcmp(o1, o2, sizeof(o1)) != 0)
+            mismatches++;
+
+        src[0] = '\0';
+        k = rand() % 20;
+        for (int j = 0; j < k; j++)
+            strcat(src, m_escaped[rand() % (int)(sizeof(m_escaped) / sizeof(m_escaped[0]))]);
+        sz = rand() % 120;
+        memset(o1, '#', sizeof(o1));
+        memset(o2, '#', sizeof(o2));
+        r1 = u8_unescape(o1, sz, src);
+        r2 = ref_u8_unescape(o2, sz, src);
+        if (r1 != r2 || memcmp(o1, o2, sizeof(o1)) != 0)
+            mismatches++;
+
+        /* In place, into the buffer it reads. */
+        strcpy(in_place, src);
+        r1 = u8_unescape_inplace(in_place);
+        r2 = ref_u8_unescape(o2, sizeof(o2), src);
+        if (r1 != r2 || memcmp(in_place, o2, r2 + 1) != 0)
+            mismatches++;
+
+        /* Escaping then unescaping gives the text back. */
+        src[0] = '\0';
+        k = rand() % 20;
+        for (int j = 0; j < k; j++)
+        {
+            int i = rand() % (int)(sizeof(m_pieces) / sizeof(m_pieces[0]));
+            strcat(src, m_pieces[ROUND_TRIP_PIECE(i) ? i : 0]);
+        }
+        u8_escape(o1, sizeof(o1), src, 1);
+        u8_unescape_inplace(o1);
+        if (strcmp(o1, src) != 0)
+            mismatches++;
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+/* Where the new functions differ from the old ones on purpose. */
+static void test_differences(void)
+{
+    char out[32];
+    char tail[] = "ab\\";
+
+    /* UTF-8 source bytes pass through unescape as they are. */
+    CHECK_EQ(u8_unescape(out, sizeof(out), "\xc3\xa9\\n"), 3);
+    CHECK_STR(out, "\xc3\xa9\n");
+
+    /* A backslash at the end does not read past the NUL. */
+    CHECK_EQ(u8_unescape_inplace(tail), 2);
+    CHECK_STR(tail, "ab");
+}
+
+static char m_heavy[1 << 16], m_plain[1 << 16], m_out[1 << 19], m_unheavy[1 << 18];
+
+static void bench(void)
+{
+    const int reps = 200;
+    double t0, t1, t2;
+    int len;
+
+    for (size_t i = 0; i + 4 < sizeof(m_heavy); i += 4)
+        memcpy(m_heavy + i, "\xe2\x82\xac\n", 4);
+    for (size_t i = 0; i + 1 < sizeof(m_plain); i++)
+        m_plain[i] = 'a' + i % 26;
+
+    printf("64 kB, old -> new MB/s\n");
+    t0 = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += ref_u8_escape(m_out, sizeof(m_out), m_heavy, 1);
+    t1 = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += u8_escape(m_out, sizeof(m_out), m_heavy, 1);
+    t2 = unit_seconds();
+    len = strlen(m_heavy);
+    printf("  u8_escape   escape-heavy %5.0f -> %5.0f\n", (double)len * reps / 1e6 / (t1 - t0), (double)len * reps / 1e6 / (t2 - t1));
+
+    t0 = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += ref_u8_escape(m_out, sizeof(m_out), m_plain, 1);
+    t1 = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += u8_escape(m_out, sizeof(m_out), m_plain, 1);
+    t2 = unit_seconds();
+    len = strlen(m_plain);
+    printf("  u8_escape   escape-free  %5.0f -> %5.0f\n", (double)len * reps / 1e6 / (t1 - t0), (double)len * reps / 1e6 / (t2 - t1));
+
+    u8_escape(m_unheavy, sizeof(m_unheavy), m_heavy, 1);
+    len = strlen(m_unheavy);
+    t0 = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += ref_u8_unescape(m_out, sizeof(m_out), m_unheavy);
+    t1 = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += u8_unescape(m_out, sizeof(m_out), m_unheavy);
+    t2 = unit_seconds();
+    printf("  u8_unescape escape-heavy %5.0f -> %5.0f\n", (double)len * reps / 1e6 / (t1 - t0), (double)len * reps / 1e6 / (t2 - t1));
+
+    len = strlen(m_plain);
+    t0 = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += ref_u8_unescape(m_out, sizeof(m_out), m_plain);
+    t1 = unit_seconds();
+    for (int r = 0; r < reps; r++) unit_sink += u8_unescape(m_out, sizeof(m_out), m_plain);
+    t2 = unit_seconds();
+    printf("  u8_unescape escape-free  %5.0f -> %5.0f\n", (double)len * reps / 1e6 / (t1 - t0), (double)len * reps / 1e6 / (t2 - t1));
+}
+
+int main(int argc, char **argv)
+{
+    unit_init(argc, argv);
+    srand(16);
+    test_escape_wchar();
+    test_random();
+    test_differences();
+    if (unit_bench)
+        bench();
+    return unit_done("test_utf8_escape");
+}
@@ -0,0 +1,183 @@
+/*
+ * Word kernels of utf8.c (user-013).
+ *
+ * Includes utf8.c to reach its static kernels, and is built twice: with the portable kernels the
+ * firmware uses by default, and with UTF8_USE_DSP over the host emulation of the Cortex-M4 SIMD
+ * intrinsics in stubs/arm_acle.h. The kernels are compared with a byte at a time reference, and
+ * the functions built on them with the old utf8.c. The benchmark gives cycles per byte; built
+ * for the target, unit_cycles reads the DWT cycle counter, so the same code measures both kernel
+ * sets there.
+ */
+#include <stdlib.h>
+#include "unit.h"
+#include "../utf8.c"
+#include "ref_utf8.h"
+
+#if UTF8_USE_DSP
+#define KERNELS "dsp"
+#else
+#define KERNELS "portable"
+#endif
+
+static unsigned long m_mismatches;
+
+static void check_word32(u_int32_t w)
+{
+    int ascii = 1, ascii_nz = 1;
+
+    for (int k = 0; k < 4; k++)
+    {
+        unsigned b = (w >> (8 * k)) & 0xFF;
+        if (b & 0x80)
+            ascii = ascii_nz = 0;
+        if (b == 0)
+            ascii_nz = 0;
+    }
+    if (!u8_word32_isascii(w) != !ascii || !u8_word32_isascii_nz(w) != !ascii_nz)
+        m_mismatches++;
+}
+
+static void check_word(u8_word_t w)
+{
+    size_t starts = 0;
+
+    for (size_t k = 0; k < sizeof(w); k++)
+        starts += (((w >> (8 * k)) & 0xC0) != 0x80);
+    if (u8_word_starts(w) != starts)
+        m_mismatches++;
+}
+
+/* Byte values at the edges of what the kernels test for. */
+static const unsigned char m_edges[] = { 0x00, 0x01, 0x7F, 0x80, 0x81, 0xBF, 0xC0, 0xFF };
+
+static void test_words(void)
+{
+    u8_word_t w;
+
+    for (u_int32_t i = 0; i < 4096; i++)
+    {
+        u_int32_t w32 = 0;
+        for (int k = 0; k < 4; k++)
+            w32 |= (u_int32_t)m_edges[(i >> (3 * k)) & 7] << (8 * k);
+        check_word32(w32);
+        w = 0;
+        for (size_t k = 0; k < sizeof(w); k++)
+            w |= (u8_word_t)m_edges[(i >> (3 * (k % 4))) & 7] << (8 * k);
+        check_word(w);
+    }
+    for (int i = 0; i < 4000000; i++)
+    {
+        u_int32_t r = (u_int32_t)rand() ^ ((u_int32_t)rand() << 16);
+        check_word32(r);
+        w = r;
+        if (sizeof(w) > 4)
+            w = (w << 16 << 16) | ((u_int32_t)rand() ^ ((u_int32_t)rand() << 16));
+        check_word(w);
+    }
+    CHECK_EQ(m_mismatches, 0);
+}
+
+/* Random valid UTF-8 without NUL, mostly ASCII runs so the block paths are taken. */
+static int gen(char *b, int max)
+{
+    int n = 0;
+    while (n < max - 4 && rand() % 64 != 0)
+    {
+        u_int32_t c;
+        switch (rand() % 8)
+        {
+            case 0:  c = 0x80 + rand() % 0x780; break;
+            case 1:  c = 0x4E00 + rand() % 0x5000; break;
+            case 2:  c = 0x10000 + rand() % 0x100000; break;
+            default: c = 0x20 + rand() % 0x5F; break;
+        }
+        n += u8_wc_toutf8(b + n, c);
+    }
+    b[n] = '\0';
+    return n;
+}
+
+static void test_functions(void)
+{
+    static char store[512];
+    static u_int32_t ucs[512], ref_ucs[512];
+    static char utf8[2048], ref_utf8[2048];
+    unsigned long mismatches = 0;
+
+    for (int it = 0; it < 200000; it++)
+    {
+        char *b = store + rand() % 8;
+        int n;
+
+        /* The old u8_nextchar reads past a NUL followed by continuation bytes. */
+        memset(store, 0, sizeof(store));
+        n = gen(b, 1 + rand() % 400);
+        int sz = 1 + rand() % 500;
+        int srcsz = (it & 1) ? -1 : n;
+
+        if (u8_strlen(b) != ref_u8_strlen(b) || u8_memlen(b, n) != ref_u8_strlen(b))
+            mismatches++;
+
+        int got = u8_toucs(ucs, sz, b, srcsz);
+        int ref = ref_u8_toucs(ref_ucs, sz, b, srcsz);
+        if (got != ref || memcmp(ucs, ref_ucs, (got + 1) * sizeof(u_int32_t)) != 0)
+            mismatches++;
+
+        int usz = 1 + rand() % 1500;
+        int n_ucs = ref_u8_toucs(ref_ucs, 512, b, -1);
+        memset(utf8, 0x55, sizeof(utf8));
+        memset(ref_utf8, 0x55, sizeof(ref_utf8));
+        got = u8_toutf8(utf8, usz, ref_ucs, (it & 2) ? -1 : n_ucs);
+        ref = ref_u8_toutf8(ref_utf8, usz, ref_ucs, (it & 2) ? -1 : n_ucs);
+        if (got != ref || memcmp(utf8, ref_utf8, sizeof(utf8)) != 0)
+            mismatches++;
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+static char m_text[1 << 14];
+static u_int32_t m_ucs[(1 << 14) + 1];
+static char m_out[1 << 14];
+
+static void bench(void)
+{
+    const int reps = 200;
+    uint64_t t[7];
+    int n, n_ucs;
+
+    memset(m_text, 'a', sizeof(m_text) - 1);
+    m_text[sizeof(m_text) - 1] = '\0';
+    n = sizeof(m_text) - 1;
+    n_ucs = u8_toucs(m_ucs, n + 1, m_text, n);
+
+    t[0] = unit_cycles();
+    for (int r = 0; r < reps; r++) unit_sink += ref_u8_strlen(m_text);
+    t[1] = unit_cycles();
+    for (int r = 0; r < reps; r++) unit_sink += u8_strlen(m_text);
+    t[2] = unit_cycles();
+    for (int r = 0; r < reps; r++) unit_sink += ref_u8_toucs(m_ucs, n + 1, m_text, n);
+    t[3] = unit_cycles();
+    for (int r = 0; r < reps; r++) unit_sink += u8_toucs(m_ucs, n + 1, m_text, n);
+    t[4] = unit_cycles();
+    for (int r = 0; r < reps; r++) unit_sink += ref_u8_toutf8(m_out, n, m_ucs, n_ucs);
+    t[5] = unit_cycles();
+    for (int r = 0; r < reps; r++) unit_sink += u8_toutf8(m_out, n, m_ucs, n_ucs);
+    t[6] = unit_cycles();
+
+    double bytes = (double)n * reps;
+    printf("ASCII text, %s kernels, %s per byte, old -> new\n", KERNELS, UNIT_CYCLES_UNIT);
+    printf("  u8_strlen %.2f -> %.2f   u8_toucs %.2f -> %.2f   u8_toutf8 %.2f -> %.2f\n",
+           (t[1] - t[0]) / bytes, (t[2] - t[1]) / bytes, (t[3] - t[2]) / bytes,
+           (t[4] - t[3]) / bytes, (t[5] - t[4]) / bytes, (t[6] - t[5]) / bytes);
+}
+
+int main(int argc, char **argv)
+{
+    unit_init(argc, argv);
+    srand(13);
+    test_words();
+    test_functions();
+    if (unit_bench)
+        bench();
+    return unit_done("test_utf8_kernels (" KERNELS ")");
+}
@@ -0,0 +1,163 @@
+/*
+ * Exact conversion sizes (user-018).
+ *
+ * u8_measure is checked against what u8_toutf8 writes, and u8_ucs_measure against what u8_toucs
+ * returns, on random strings at every alignment, 0-terminated and with a length: UCS with 1 to 4
+ * byte and out-of-range characters, and valid UTF-8 cut off at any byte. A buffer of the measured
+ * size plus the terminator must hold the whole conversion, and one byte less must not. The
+ * benchmark compares measuring with converting.
+ */
+#include <stdlib.h>
+#include "unit.h"
+#include "../utf8.h"
+
+#define MAX_CHARS   256
+
+/* Random UCS without NUL, up to max - 1 characters, some of them above U+10FFFF. */
+static int gen_ucs(u_int32_t *s, int max)
+{
+    int n = 0;
+    while (n < max - 1 && rand() % 40 != 0)
+    {
+        int k = rand() % 16;
+
+        if (k < 7)
+            s[n++] = 1 + rand() % 0x7F;
+        else if (k < 10)
+            s[n++] = 0x80 + rand() % 0x780;
+        else if (k < 13)
+            s[n++] = 0x800 + rand() % 0xF800;
+        else if (k < 15)
+            s[n++] = 0x10000 + rand() % 0x100000;
+        else
+            s[n++] = 0x110000 + rand() % 0x1000;
+    }
+    s[n] = 0;
+    return n;
+}
+
+/* Random valid UTF-8 without NUL, up to max - 4 bytes. */
+static int gen_utf8(char *b, int max)
+{
+    int n = 0;
+    while (n < max - 4 && rand() % 40 != 0)
+    {
+        int k = rand() % 8;
+        u_int32_t c;
+
+        if (k < 4)
+            c = 1 + rand() % 0x7F;
+        else if (k < 5)
+            c = 0x80 + rand() % 0x780;
+        else if (k < 7)
+            do c = 0x800 + rand() % 0xF800; while (c >= 0xD800 && c < 0xE000);
+        else
+            c = 0x10000 + rand() % 0x100000;
+        n += u8_wc_toutf8(b + n, c);
+    }
+    b[n] = '\0';
+    return n;
+}
+
+static unsigned long m_mismatches;
+
+static void test_measure(void)
+{
+    static u_int32_t src_buf[MAX_CHARS + 4];
+    static char dest[MAX_CHARS * 4 + 8];
+
+    m_mismatches = 0;
+    for (int it = 0; it < 200000; it++)
+    {
+        u_int32_t *src = src_buf + it % 4;
+        int n = gen_ucs(src, MAX_CHARS);
+        int srcsz = (it & 4) ? -1 : n;
+        int m = u8_measure(src, srcsz);
+
+        /* The measured size plus the terminator holds it all... */
+        memset(dest, 0x55, sizeof(dest));
+        if (u8_toutf8(dest, m + 1, src, srcsz) != n || dest[m] != 0 || (int)strlen(dest) != m)
+            m_mismatches++;
+
+        /* ...and one byte less cannot take the terminator. */
+        memset(dest, 0x55, sizeof(dest));
+        if (u8_toutf8(dest, m, src, srcsz) == n && dest[m] != 0x55)
+            m_mismatches++;
+    }
+    CHECK_EQ(m_mismatches, 0);
+
+    u_int32_t edge[] = { 'a', 0x7F, 0x80, 0x7FF, 0x800, 0xFFFF, 0x10000, 0x10FFFF, 0x110000, 0 };
+    CHECK_EQ(u8_measure(edge, -1), 1 + 1 + 2 + 2 + 3 + 3 + 4 + 4);
+    CHECK_EQ(u8_measure(edge, 3), 4);
+    CHECK_EQ(u8_measure(edge, 0), 0);
+}
+
+static void test_ucs_measure(void)
+{
+    static char src_buf[MAX_CHARS + 4];
+    static u_int32_t dest[MAX_CHARS + 1];
+
+    m_mismatches = 0;
+    for (int it = 0; it < 200000; it++)
+    {
+        char *src = src_buf + it % 4;
+        int n = gen_utf8(src, MAX_CHARS);
+
+        if (u8_ucs_measure(src, -1) != u8_toucs(dest, MAX_CHARS + 1, src, -1))
+            m_mismatches++;
+
+        /* Every length, so the last sequence is cut off at every byte. */
+        for (int len = n; len >= 0 && len > n - 8; len--)
+            if (u8_ucs_measure(src, len) != u8_toucs(dest, MAX_CHARS + 1, src, len))
+                m_mismatches++;
+    }
+    CHECK_EQ(m_mismatches, 0);
+
+    CHECK_EQ(u8_ucs_measure("", -1), 0);
+    CHECK_EQ(u8_ucs_measure("\xf0\x9f\x94\x92", 3), 0);
+    CHECK_EQ(u8_ucs_measure("a\xe2\x82\xac", 4), 2);
+    CHECK_EQ(u8_ucs_measure("a\xe2\x82\xac", 3), 1);
+}
+
+static void bench(void)
+{
+    enum { REPS = 200 };
+    static u_int32_t ucs[1 << 16];
+    static char utf8[1 << 18];
+    int n = sizeof(ucs) / sizeof(ucs[0]) - 1, bytes;
+    double t0, t1, t2, t3, t4;
+
+    for (int i = 0; i < (int)(sizeof(ucs) / sizeof(ucs[0])) - 1; i++)
+        ucs[i] = (i % 5 == 4) ? 0xE9 + (i % 3) * 0x2000 : 'a' + i % 26;
+    ucs[n] = 0;
+
+    t0 = unit_seconds();
+    for (int r = 0; r < REPS; r++)
+        unit_sink += u8_measure(ucs, n);
+    t1 = unit_seconds();
+    for (int r = 0; r < REPS; r++)
+        unit_sink += u8_toutf8(utf8, sizeof(utf8), ucs, n);
+    t2 = unit_seconds();
+    bytes = u8_measure(ucs, n);
+    for (int r = 0; r < REPS; r++)
+        unit_sink += u8_ucs_measure(utf8, bytes);
+    t3 = unit_seconds();
+    for (int r = 0; r < REPS; r++)
+        unit_sink += u8_toucs(ucs, sizeof(ucs) / sizeof(ucs[0]), utf8, bytes);
+    t4 = unit_seconds();
+
+    printf("%d characters, 1 in 5 not ASCII, ns per character\n", n);
+    printf("  to UTF-8  u8_measure %5.2f  u8_toutf8 %5.2f\n", (t1 - t0) * 1e9 / REPS / n, (t2 - t1) * 1e9 / REPS / n);
+    printf("  to UCS    u8_ucs_measure %5.2f  u8_toucs %5.2f\n", (t3 - t2) * 1e9 / REPS / n, (t4 - t3) * 1e9 / REPS / n);
+}
+
+int main(int argc, char **argv)
+{
+    unit_init(argc, argv);
+    srand(18);
+    test_measure();
+    test_ucs_measure();
+    if (unit_bench)
+        bench();
+    return unit_done("test_utf8_measure");
+}
@@ -0,0 +1,266 @@
+/*
+ * Formatted output to a sink (user-015).
+ *
+ * u8_printf_sink is compared with vsnprintf over a list of formats and over random numeric
+ * conversions, including ones longer than U8_PRINTF_CHUNK. Wide characters, the character count,
+ * %n and a failing sink are checked on their own. The peak stack use is measured for short and
+ * long output, which must not grow with the width or with the precision of an integer, and the
+ * benchmark formats a log line with both.
+ */
+#include <stdarg.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include "unit.h"
+#include "../utf8.h"
+
+typedef struct
+{
+    char buf[4096];
+    int len;
+    int fail_at;    /* fail the call that would take the output past this many bytes, if not 0 */
+} sink_t;
+
+static int collect(void *ctx, const char *buf, int len)
+{
+    sink_t *s = ctx;
+
+    if (s->fail_at != 0 && s->len + len > s->fail_at)
+        return -1;
+    if (s->len + len >= (int)sizeof(s->buf))
+        return -1;
+    memcpy(s->buf + s->len, buf, len);
+    s->len += len;
+    s->buf[s->len] = '\0';
+    return 0;
+}
+
+static unsigned long m_mismatches;
+
+/* Formats with both and counts a mismatch in the bytes or in the character count. */
+static void same(char *fmt, ...)
+{
+    static char expected[4096];
+    sink_t s = { .len = 0 };
+    va_list ap, ap2;
+    int n, cnt;
+
+    va_start(ap, fmt);
+    va_copy(ap2, ap);
+    n = vsnprintf(expected, sizeof(expected), fmt, ap);
+    cnt = u8_vprintf_sink(collect, &s, fmt, ap2);
+    va_end(ap2);
+    va_end(ap);
+
+    if (s.len != n || memcmp(s.buf, expected, n) != 0 || cnt != u8_memlen(expected, n))
+    {
+        if (m_mismatches++ < 10)
+            printf("  \"%s\": \"%.*s\" != \"%s\"\n", fmt, s.len, s.buf, expected);
+    }
+}
+
+static void test_formats(void)
+{
+    m_mismatches = 0;
+
+    same("plain text");
+    same("%d %i %u %x %X %o %%", -42, 42, 42u, 0xbeefu, 0xbeefu, 8u);
+    same("%5d|%-5d|%05d|%+d|% d|%#x|%#o", 42, 42, 42, 42, 42, 255u, 8u);
+    same("%hhd %hd %ld %lld %jd %zd %td", 300, 70000, -5L, -6LL, (intmax_t)-7, (size_t)8, (ptrdiff_t)-9);
+    same("%hhu %hu %lu %llu %zu", 300u, 70000u, 5UL, 6ULL, (size_t)8);
+    same("%*d|%-*d|%.*d|%*.*d", 6, 1, 6, 2, 4, 3, -8, 3, 4);
+    same("%s|%10s|%-10s|%.3s|%10.3s|%s", "abc", "abc", "abc", "abcdef", "abcdef", (char *)"h\xc3\xa9");
+    same("%c%c%5c%-5c|", 'a', 'b', 'c', 'd');
+    same("%e %E %f %F %g %G %a", 1.5, -2.5e-10, 3.25, 1e10, 1e-5, 123456789.0, 0.5);
+    same("%10.3f|%-10.3e|%+.2g|%010.2f", 3.14159, 2.71828, 1.0 / 3, -2.5);
+    same("%Lf %Le %Lg", 1.5L, 2.5L, 3.5L);
+    same("%p", (void *)&m_mismatches);
+
+    /* Conversions longer than the chunk. */
+    same("%.40d|%040d|%-40d|%40d", 7, -7, 7, 7);
+    same("%.60x|%#50o|%-45u|%+044lld", 0xabcu, 8u, 9u, 12345LL);
+    same("%f|%.35f|%e|%.50e", 1e25, 1.0 / 3, 1e300, 1.0 / 7);
+    same("%f", 1e308);
+    same("%100.90f|%-100g|%0100.3f", 2.5, 1.25, -1.5);
+    same("%Lf", 1e300L);
+    same("%*d|%.*f", 200, 1, 70, 0.1);
+    same("%.1000d|%0*x|%-*.*o|%#.300x", -7, 900, 0xabcu, 1200, 800, 8u, 0u);
+    same("%0*.2f|%-*a|%0*g|%*f", 1000, -2.5, 500, 0.75, 300, 1.0 / 0.0, 200, 0.0 / 0.0);
+
+    CHECK_EQ(m_mismatches, 0);
+}
+
+/* Random numeric conversions: flags, width and precision around the chunk size. */
+static void test_random(void)
+{
+    static const char convs[] = "diuxXoeEfFgGaA";
+    char fmt[64];
+
+    m_mismatches = 0;
+    for (int it = 0; it < 200000; it++)
+    {
+        char *p = fmt;
+        char conv = convs[rand() % (sizeof(convs) - 1)];
+        int w = rand() % 3 ? rand() % 64 : 0, pr = rand() % 3 ? rand() % 64 : -1;
+
+        *p++ = '%';
+        if (rand() % 4 == 0) *p++ = '-';
+        if (rand() % 4 == 0) *p++ = '+';
+        if (rand() % 4 == 0) *p++ = ' ';
+        if (rand() % 4 == 0) *p++ = '#';
+        if (rand() % 4 == 0) *p++ = '0';
+        if (w > 0)
+            p += sprintf(p, "%d", w);
+        if (pr >= 0)
+            p += sprintf(p, ".%d", pr);
+        if (strchr("di", conv))
+        {
+            strcpy(p, "lld");
+            p[2] = conv;
+            same(fmt, (long long)rand() * (rand() % 2 ? 1 : -1) * rand());
+        }
+        else if (strchr("uxXo", conv))
+        {
+            strcpy(p, "llu");
+            p[2] = conv;
+            same(fmt, (unsigned long long)rand() * rand() * rand());
+        }
+        else
+        {
+            double d = (double)rand() / (1 + rand() % 1000) * ((rand() % 2) ? 1 : -1);
+            if (rand() % 8 == 0)
+                d *= 1e30;
+            p[0] = conv;
+            p[1] = '\0';
+            same(fmt, d);
+        }
+    }
+    CHECK_EQ(m_mismatches, 0);
+}
+
+static void test_wide_and_count(void)
+{
+    sink_t s = { .len = 0 };
+    int n;
+
+    CHECK_EQ(u8_printf_sink(collect, &s, "%lc|%ls|%5ls|%-4lc|", (wint_t)0xE9, L"\x20ac" L"x", L"\x4e2d", (wint_t)'a'), 14);
+    CHECK_STR(s.buf, "\xc3\xa9|\xe2\x82\xacx|  \xe4\xb8\xad|a   |");
+
+    s.len = 0;
+    CHECK_EQ(u8_printf_sink(collect, &s, "%.3ls|%ls", L"\x20ac" L"ab", (wchar_t *)NULL), 8);
+    CHECK_STR(s.buf, "\xe2\x82\xac|(null)");
+
+    s.len = 0;
+    CHECK_EQ(u8_printf_sink(collect, &s, "\xc3\xa9%d%n", 12345, &n), 6);
+    CHECK_EQ(n, 7);
+
+    /* An unknown or unfinished conversion is printed as it was written. */
+    s.len = 0;
+    CHECK_EQ(u8_printf_sink(collect, &s, "%q|%5", 1), 5);
+    CHECK_STR(s.buf, "%q|%5");
+
+    /* A failing sink stops the formatting. */
+    s.len = 0;
+    s.fail_at = 8;
+    CHECK_EQ(u8_printf_sink(collect, &s, "%s %.40d %s", "first", 1, "last"), -1);
+    CHECK(s.len <= 8);
+}
+
+/* Peak stack use, which must not depend on the width or on the precision of an integer. */
+
+typedef struct
+{
+    char *fmt;
+    int width;
+    double value;                       /* passed as an int if fmt ends in d */
+} stack_arg_t;
+
+static int discard(void *ctx, const char *buf, int len)
+{
+    (void)ctx;
+    unit_sink += buf[0] + len;
+    return 0;
+}
+
+static void format_call(void *arg)
+{
+    stack_arg_t *a = arg;
+
+    if (a->fmt[strlen(a->fmt) - 1] == 'd')
+        unit_sink += u8_printf_sink(discard, NULL, a->fmt, a->width, (int)a->value);
+    else
+        unit_sink += u8_printf_sink(discard, NULL, a->fmt, a->width, a->value);
+}
+
+static void test_stack(void)
+{
+    static const int widths[] = { 40, 2000, 10000 };
+    static char *fmts[] = { "lock %*f", "lock %0*f", "lock %-*e", "lock %0*d", "lock %.*d", "lock %-*d" };
+    static char text[2001];
+    stack_arg_t a = { "lock %*f", 10, -1.5 };
+    int peak_short = unit_stack_peak(format_call, &a);
+    int peak_text, peak_long;
+
+    for (size_t f = 0; f < sizeof(fmts) / sizeof(fmts[0]); f++)
+    {
+        stack_arg_t narrow = { fmts[f], 10, -1.5 };
+        int peak = unit_stack_peak(format_call, &narrow);
+
+        for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+        {
+            stack_arg_t wide = { fmts[f], widths[w], -1.5 };
+            CHECK_EQ(unit_stack_peak(format_call, &wide), peak);
+        }
+    }
+
+    /* A long string is handed to the sink as it is. */
+    memset(text, 'x', sizeof(text) - 1);
+    a.fmt = text;
+    peak_text = unit_stack_peak(format_call, &a);
+    CHECK(peak_text <= peak_short);
+
+    /* Only a floating point conversion longer than the chunk takes a buffer, of fixed size, and
+       one longer than that buffer fails the call. What snprintf takes for it is up to the C
+       library, so only the width is checked. */
+    a.fmt = "lock %*f";
+    a.value = 1e308;
+    peak_long = unit_stack_peak(format_call, &a);
+    a.width = 10000;
+    CHECK_EQ(unit_stack_peak(format_call, &a), peak_long);
+    CHECK_EQ(u8_printf_sink(discard, NULL, "%.1000f", 1.5), -1);
+
+    if (unit_bench)
+        printf("peak stack, snprintf included: %d bytes for a short line, the same with a width up to %d, "
+               "%d with a 2000 byte string, %d for %%f of 1e308\n", peak_short,
+               widths[sizeof(widths) / sizeof(widths[0]) - 1], peak_text, peak_long);
+}
+
+static void bench(void)
+{
+    const int reps = 200000;
+    char line[128];
+    double t0, t1, t2;
+
+    t0 = unit_seconds();
+    for (int r = 0; r < reps; r++)
+        unit_sink += snprintf(line, sizeof(line), "[APPL]: >> %s lock %d state %s at %lu ms", "SUB", r, "locked", 123456UL);
+    t1 = unit_seconds();
+    for (int r = 0; r < reps; r++)
+        unit_sink += u8_printf_sink(discard, NULL, "[APPL]: >> %s lock %d state %s at %lu ms", "SUB", r, "locked", 123456UL);
+    t2 = unit_seconds();
+
+    printf("log line: snprintf %.0f ns, u8_printf_sink %.0f ns\n",
+           (t1 - t0) * 1e9 / reps, (t2 - t1) * 1e9 / reps);
+}
+
+int main(int argc, char **argv)
+{
+    unit_init(argc, argv);
+    srand(15);
+    test_formats();
+    test_random();
+    test_wide_and_count();
+    test_stack();
+    if (unit_bench)
+        bench();
+    return unit_done("test_utf8_printf");
+}
@@ -0,0 +1,136 @@
+/*
+ * Character search on the encoded needle (user-017).
+ *
+ * u8_strchr and u8_memchr are compared with the old decoding search on random strings over small
+ * alphabets of one to four byte characters, so hits are frequent and partial matches of
+ * multi-byte needles common. Some strings carry an embedded NUL, and u8_memchr gets sizes that
+ * end inside the string. The benchmark searches 64 kB for a needle of each width that is not
+ * there.
+ */
+#include <stdlib.h>
+#include "unit.h"
+#include "../utf8.h"
+#include "ref_utf8.h"
+
+static u_int32_t pick(void)
+{
+    int k = rand() % 8;
+
+    if (k < 3) return 1 + rand() % 0x7F;
+    if (k < 4) return 0x80 + rand() % 0x780;
+    if (k < 6) return 0x800 + rand() % 0xD000;
+    if (k < 7) return 0xE000 + rand() % 0x2000;
+    return 0x10000 + rand() % 0x100;
+}
+
+static void test_random(void)
+{
+    static char store[1200];
+    unsigned long mismatches = 0;
+
+    for (int it = 0; it < 1000000; it++)
+    {
+        char *b = store + rand() % 16;
+        int n = 0, m = rand() % 200, alpha = 1 + rand() % 6;
+        u_int32_t letters[6], ch;
+        char *p1, *p2;
+        int c1, c2;
+        size_t sz;
+
+        memset(store, 0, sizeof(store));
+        for (int j = 0; j < alpha; j++)
+            letters[j] = pick();
+        for (int j = 0; j < m; j++)
+            n += u8_wc_toutf8(b + n, letters[rand() % alpha]);
+
+        /* A NUL in place of a character. The old u8_nextchar reads on through continuation
+           bytes after a NUL, so those are overwritten too. */
+        if (rand() % 4 == 0 && n > 0)
+        {
+            int z = rand() % n;
+            while (z > 0 && ((unsigned char)b[z] & 0xC0) == 0x80)
+                z--;
+            int len = u8_seqlen(b + z);
+            b[z] = '\0';
+            memset(b + z + 1, 1, len - 1);
+        }
+
+        ch = (rand() % 5) ? letters[rand() % alpha] : ((rand() % 3) ? pick() : 0);
+
+        p1 = u8_strchr(b, ch, &c1);
+        p2 = ref_u8_strchr(b, ch, &c2);
+        if (p1 != p2 || c1 != c2)
+            mismatches++;
+
+        sz = rand() % (n + 1);
+        while ((int)sz < n && ((unsigned char)b[sz] & 0xC0) == 0x80)
+            sz--;
+        p1 = u8_memchr(b, ch, sz, &c1);
+        p2 = ref_u8_memchr(b, ch, sz, &c2);
+        if (p1 != p2 || c1 != c2)
+            mismatches++;
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+static void test_cases(void)
+{
+    char s[] = "a/\xc3\xa9/\xe2\x82\xac/\xf0\x9f\x94\x92/\xe2\x82\xad";
+    int charn;
+
+    CHECK(u8_strchr(s, 0x20AC, &charn) == s + 5);
+    CHECK_EQ(charn, 4);
+    CHECK(u8_strchr(s, 0x1F512, &charn) == s + 9);
+    CHECK_EQ(charn, 6);
+    CHECK(u8_strchr(s, 0x20AD, &charn) == s + 14);
+    CHECK_EQ(charn, 8);
+    CHECK(u8_strchr(s, 'z', &charn) == NULL);
+    CHECK(u8_memchr(s, 0x20AD, 14, &charn) == NULL);
+    CHECK(u8_memchr(s, '/', sizeof(s) - 1, &charn) == s + 1);
+    CHECK_EQ(charn, 1);
+}
+
+static char m_hay[1 << 16];
+
+static void bench(void)
+{
+    static const u_int32_t needles[] = { '~', 0x7FF, 0x20AC, 0x1F512 };
+    static const char *names[] = { "1 byte", "2 bytes", "3 bytes", "4 bytes" };
+    const int reps = 300;
+    int n = 0, c;
+
+    while (n < (int)sizeof(m_hay) - 8)
+        n += u8_wc_toutf8(m_hay + n, (rand() % 3) ? 'a' + rand() % 26 : 0x400 + rand() % 0x100);
+    m_hay[n] = '\0';
+
+    printf("needle not in 64 kB of Latin and Cyrillic text, old -> new MB/s\n");
+    for (int k = 0; k < 4; k++)
+    {
+        double t[5];
+
+        t[0] = unit_seconds();
+        for (int r = 0; r < reps; r++) unit_sink += (uintptr_t)ref_u8_strchr(m_hay, needles[k], &c) + c;
+        t[1] = unit_seconds();
+        for (int r = 0; r < reps; r++) unit_sink += (uintptr_t)u8_strchr(m_hay, needles[k], &c) + c;
+        t[2] = unit_seconds();
+        for (int r = 0; r < reps; r++) unit_sink += (uintptr_t)ref_u8_memchr(m_hay, needles[k], n, &c) + c;
+        t[3] = unit_seconds();
+        for (int r = 0; r < reps; r++) unit_sink += (uintptr_t)u8_memchr(m_hay, needles[k], n, &c) + c;
+        t[4] = unit_seconds();
+
+        double mb = (double)n * reps / 1e6;
+        printf("  %-8s u8_strchr %5.0f -> %5.0f   u8_memchr %5.0f -> %5.0f\n", names[k],
+               mb / (t[1] - t[0]), mb / (t[2] - t[1]), mb / (t[3] - t[2]), mb / (t[4] - t[3]));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unit_init(argc, argv);
+    srand(17);
+    test_random();
+    test_cases();
+    if (unit_bench)
+        bench();
+    return unit_done("test_utf8_search");
+}
@@ -0,0 +1,284 @@
+/*
+ * Streaming UTF-8 decoder (user-014).
+ *
+ * Every corpus is fed to u8_decoder_feed split at every byte boundary into two pieces, at every
+ * pair of boundaries into three, and one byte at a time, so each multi-byte sequence is cut at
+ * each of its inner boundaries. The result must match decoding the whole buffer with
+ * u8_toucs_checked and u8_validate: the same characters for valid input, the failure for
+ * ill-formed or truncated input, and the characters decoded before it. Random input covers the
+ * same with arbitrary splits, and a full dest is resumed one character at a time. The benchmark
+ * feeds 1 MB in 64-byte segments, like a pbuf chain, against the contiguous decoders.
+ */
+#include <stdlib.h>
+#include "unit.h"
+#include "../utf8.h"
+
+#define MAX_CHARS   256
+#define SEG_LEN(s, n)   (((n) - (s)) < SEGMENT ? ((n) - (s)) : SEGMENT)
+
+static const char * const m_corpora[] =
+{
+    "",
+    "lock/state",
+    "caf\xc3\xa9",
+    "\xe2\x82\xac 5",
+    "\xf0\x9f\x94\x92 locked \xf0\x9f\x94\x93",
+    "\xc2\x80\xdf\xbf\xe0\xa0\x80\xef\xbf\xbf\xf0\x90\x80\x80\xf4\x8f\xbf\xbf",
+    "\xe9\x8e\x96\xe7\x8a\xb6\xe6\x85\x8b",
+    "0123456789abcdef\xc3\xa9" "0123456789abcdef",
+    /* Ill-formed: truncated, overlong, surrogate, above U+10FFFF, stray continuation. */
+    "ab\xe2\x82",
+    "\xf0\x9f\x94",
+    "\xc0\xaf",
+    "x\xe0\x80\x80y",
+    "\xed\xa0\x80",
+    "\xf4\x90\x80\x80",
+    "ok\x80ok",
+    "\xc3\xa9\xc3",
+    "\xe2\x82\xac\xe2\x28\xa1",
+    "\xf5\x80\x80\x80",
+};
+
+typedef struct
+{
+    int      ok;                        /**< Valid and ending on a character boundary. */
+    int      nchars;                    /**< Characters decoded, before the failure if there was one. */
+    u_int32_t chars[MAX_CHARS];
+} result_t;
+
+/* Feeds src in pieces ending at cuts[0..ncuts-1], the last piece ending at n. */
+static void feed_pieces(result_t *r, const char *src, int n, const int *cuts, int ncuts, int validate_only)
+{
+    u8_decoder_t d;
+    int start = 0;
+
+    memset(r, 0, sizeof(*r));
+    u8_decoder_init(&d);
+    for (int p = 0; p <= ncuts; p++)
+    {
+        int end = (p < ncuts) ? cuts[p] : n;
+        int nchars = 0;
+        int used = u8_decoder_feed(&d, validate_only ? NULL : r->chars + r->nchars,
+                                   MAX_CHARS - r->nchars, &nchars, (char *)src + start, end - start);
+
+        r->nchars += nchars;
+        if (used < 0)
+        {
+            /* Failed for good. */
+            CHECK_EQ(u8_decoder_feed(&d, NULL, 0, NULL, "a", 1), -1);
+            CHECK(!u8_decoder_done(&d));
+            return;
+        }
+        CHECK_EQ(used, end - start);
+        start = end;
+    }
+    r->ok = u8_decoder_done(&d);
+}
+
+static unsigned long m_mismatches;
+
+static void compare(const result_t *whole, const result_t *r)
+{
+    if (r->ok != whole->ok || r->nchars != whole->nchars ||
+        memcmp(r->chars, whole->chars, r->nchars * sizeof(u_int32_t)) != 0)
+        m_mismatches++;
+}
+
+/* The whole buffer, checked against the contiguous decoders. */
+static void decode_whole(result_t *whole, const char *src, int n)
+{
+    u_int32_t dest[MAX_CHARS + 1];
+    int got = u8_toucs_checked(dest, MAX_CHARS + 1, (char *)src, n);
+
+    feed_pieces(whole, src, n, NULL, 0, 0);
+    CHECK_EQ(whole->ok, u8_validate((char *)src, n) != 0);
+    CHECK_EQ(whole->ok, got >= 0);
+    if (got >= 0)
+    {
+        CHECK_EQ(whole->nchars, got);
+        CHECK(memcmp(whole->chars, dest, got * sizeof(u_int32_t)) == 0);
+    }
+}
+
+static void check_splits(const char *src, int n)
+{
+    result_t whole, r;
+    int cuts[MAX_CHARS * 4];
+
+    decode_whole(&whole, src, n);
+
+    for (int i = 0; i <= n; i++)
+    {
+        cuts[0] = i;
+        feed_pieces(&r, src, n, cuts, 1, 0);
+        compare(&whole, &r);
+        feed_pieces(&r, src, n, cuts, 1, 1);
+        if (r.ok != whole.ok)
+            m_mismatches++;
+
+        for (int j = i; j <= n; j++)
+        {
+            cuts[1] = j;
+            feed_pieces(&r, src, n, cuts, 2, 0);
+            compare(&whole, &r);
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        cuts[i] = i + 1;
+    feed_pieces(&r, src, n, cuts, n > 0 ? n - 1 : 0, 0);
+    compare(&whole, &r);
+}
+
+static void test_corpora(void)
+{
+    for (size_t c = 0; c < sizeof(m_corpora) / sizeof(m_corpora[0]); c++)
+        check_splits(m_corpora[c], strlen(m_corpora[c]));
+    CHECK_EQ(m_mismatches, 0);
+}
+
+/* Mostly well-formed text with random bytes mixed in, cut at random places. */
+static int random_input(char *s, int max)
+{
+    int n = 0;
+
+    while (n < max - 4)
+    {
+        switch (rand() % 6)
+        {
+            case 0:  s[n++] = (char)(rand() % 256); break;
+            case 1:  n += u8_wc_toutf8(s + n, 0x10000 + rand() % 0x100000); break;
+            case 2:  n += u8_wc_toutf8(s + n, 0x800 + rand() % 0xD000); break;
+            case 3:  n += u8_wc_toutf8(s + n, 0x80 + rand() % 0x780); break;
+            default: s[n++] = 'a' + rand() % 26; break;
+        }
+    }
+    return n;
+}
+
+static void test_random(void)
+{
+    static char src[MAX_CHARS];
+    result_t whole, r;
+    int cuts[16];
+
+    for (int it = 0; it < 200000; it++)
+    {
+        int n = random_input(src, 8 + rand() % (MAX_CHARS - 8));
+        int ncuts = rand() % 16;
+
+        for (int k = 0; k < ncuts; k++)
+            cuts[k] = rand() % (n + 1);
+        for (int a = 1; a < ncuts; a++)
+            for (int b = a; b > 0 && cuts[b - 1] > cuts[b]; b--)
+            {
+                int t = cuts[b];
+                cuts[b] = cuts[b - 1];
+                cuts[b - 1] = t;
+            }
+
+        decode_whole(&whole, src, n);
+        feed_pieces(&r, src, n, cuts, ncuts, 0);
+        compare(&whole, &r);
+    }
+    CHECK_EQ(m_mismatches, 0);
+}
+
+/* A full dest stops the feed; the rest of the piece is fed again and picks up where it stopped. */
+static void test_dest_full(void)
+{
+    const char *src = "\xc3\xa9t\xc3\xa9 \xe2\x82\xac \xf0\x9f\x94\x92!";
+    int n = strlen(src);
+    u_int32_t chars[16];
+    int total = 0, nchars, used;
+    u8_decoder_t d;
+
+    u8_decoder_init(&d);
+    for (int start = 0; start < n; start += used)
+    {
+        used = u8_decoder_feed(&d, chars + total, 1, &nchars, (char *)src + start, n - start);
+        CHECK(used > 0);
+        CHECK_EQ(nchars, 1);
+        total += nchars;
+    }
+    CHECK(u8_decoder_done(&d));
+    CHECK_EQ(total, 8);
+    CHECK_EQ(chars[0], 0xE9);
+    CHECK_EQ(chars[4], 0x20AC);
+    CHECK_EQ(chars[6], 0x1F512);
+
+    /* A sequence cut by the end of the input is not done until it is completed. */
+    u8_decoder_init(&d);
+    CHECK_EQ(u8_decoder_feed(&d, NULL, 0, NULL, "\xf0\x9f", 2), 2);
+    CHECK(!u8_decoder_done(&d));
+    CHECK_EQ(u8_decoder_feed(&d, chars, 16, &nchars, "\x94\x92", 2), 2);
+    CHECK(u8_decoder_done(&d));
+    CHECK_EQ(nchars, 1);
+    CHECK_EQ(chars[0], 0x1F512);
+}
+
+static char m_corpus[1 << 20];
+static u_int32_t m_out[(1 << 20) + 1];
+
+static void bench_corpus(const char *name, const char *unit)
+{
+    enum { SEGMENT = 64, REPS = 50 };
+    int l = strlen(unit), n = 0, nchars;
+    double t0, t1, t2, t3, t4;
+    u8_decoder_t d;
+
+    while (n + l < (int)sizeof(m_corpus))
+    {
+        memcpy(m_corpus + n, unit, l);
+        n += l;
+    }
+
+    t0 = unit_seconds();
+    for (int r = 0; r < REPS; r++)
+        unit_sink += u8_toucs_checked(m_out, sizeof(m_out) / sizeof(m_out[0]), m_corpus, n);
+    t1 = unit_seconds();
+    for (int r = 0; r < REPS; r++)
+    {
+        int total = 0;
+        u8_decoder_init(&d);
+        for (int s = 0; s < n; s += SEGMENT)
+        {
+            unit_sink += u8_decoder_feed(&d, m_out + total, (1 << 20) - total, &nchars, m_corpus + s, SEG_LEN(s, n));
+            total += nchars;
+        }
+        unit_sink += u8_decoder_done(&d);
+    }
+    t2 = unit_seconds();
+    for (int r = 0; r < REPS; r++)
+        unit_sink += u8_validate(m_corpus, n);
+    t3 = unit_seconds();
+    for (int r = 0; r < REPS; r++)
+    {
+        u8_decoder_init(&d);
+        for (int s = 0; s < n; s += SEGMENT)
+            unit_sink += u8_decoder_feed(&d, NULL, 0, NULL, m_corpus + s, SEG_LEN(s, n));
+        unit_sink += u8_decoder_done(&d);
+    }
+    t4 = unit_seconds();
+
+    double mb = (double)n * REPS / 1e6;
+    printf("  %-6s decode: contiguous %6.0f MB/s  streamed %6.0f MB/s   validate: contiguous %6.0f MB/s  streamed %6.0f MB/s\n",
+           name, mb / (t1 - t0), mb / (t2 - t1), mb / (t3 - t2), mb / (t4 - t3));
+}
+
+int main(int argc, char **argv)
+{
+    unit_init(argc, argv);
+    srand(14);
+    test_corpora();
+    test_random();
+    test_dest_full();
+    if (unit_bench)
+    {
+        printf("1 MB in 64-byte segments, against u8_toucs_checked and u8_validate on the whole buffer\n");
+        bench_corpus("ascii", "lock/getstate/0123-abcd ");
+        bench_corpus("mixed", "door \xc3\xa9t\xc3\xa9 \xe2\x82\xac ok ");
+        bench_corpus("cjk", "\xe9\x8e\x96\xe7\x8a\xb6\xe6\x85\x8b\xe9\x96\x8b\xe9\x96\x89");
+    }
+    return unit_done("test_utf8_stream");
+}
@@ -0,0 +1,138 @@
+/*
+ * Compact sequence length tables of utf8.c (user-020).
+ *
+ * Includes utf8.c to reach u8_trailing and u8_seqoffset, and is built once for each
+ * UTF8_COMPACT_TABLES mode: the 256-byte table, the 16-entry nibble table and the CLZ count. The
+ * lengths and offsets are checked on every lead byte, and u8_seqlen, u8_toucs and u8_nextchar
+ * are compared with the old utf8.c on random malformed input. The benchmark decodes mixed text
+ * and walks it with u8_seqlen, and prints the bytes of table data the mode keeps; "make sizes"
+ * reports the size of utf8.o in each mode.
+ */
+#include <stdlib.h>
+#include "unit.h"
+#include "../utf8.c"
+#include "ref_utf8.h"
+
+#if UTF8_COMPACT_TABLES == 1
+#define TABLE_BYTES (sizeof(trailingBytesForNibble) + sizeof(offsetsFromUTF8))
+#elif UTF8_COMPACT_TABLES == 2
+#define TABLE_BYTES (sizeof(offsetsFromUTF8))
+#else
+#define TABLE_BYTES (sizeof(trailingBytesForUTF8) + sizeof(offsetsFromUTF8))
+#endif
+
+static const u_int32_t m_offsets[6] =
+{
+    0x00000000UL, 0x00003080UL, 0x000E2080UL, 0x03C82080UL, 0xFA082080UL, 0x82082080UL
+};
+
+static void test_lead_bytes(void)
+{
+    for (int c = 0; c < 256; c++)
+    {
+        char s[2] = { (char)c, 0 };
+        CHECK_EQ(u8_seqlen(s), ref_u8_seqlen(s));
+    }
+    for (int nb = 0; nb < 6; nb++)
+        CHECK_EQ(u8_seqoffset(nb), m_offsets[nb]);
+}
+
+/* Mostly well-formed text with random bytes mixed in. Continuation runs are kept to five bytes,
+   the longest the old u8_nextchar decodes without reading past its offsets table. */
+static int random_input(char *s, int max)
+{
+    int n = 0, run = 0;
+
+    while (n < max - 4)
+    {
+        if (rand() % 4 == 0)
+            s[n++] = (char)(rand() % 256);
+        else
+            n += u8_wc_toutf8(s + n, (rand() % 2) ? 1 + rand() % 0x7FF : 0x800 + rand() % 0x10000);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        run = isutf(s[i]) ? 0 : run + 1;
+        if (run > 5)
+        {
+            s[i] = 'a';
+            run = 0;
+        }
+    }
+    s[n] = '\0';
+    return n;
+}
+
+static void test_random(void)
+{
+    static char src[256];
+    static u_int32_t d1[256], d2[256];
+    unsigned long mismatches = 0;
+
+    for (int it = 0; it < 300000; it++)
+    {
+        int n = random_input(src, 1 + rand() % 200);
+        int sz = 1 + rand() % 256;
+        int srcsz = (rand() % 4 == 0) ? -1 : rand() % (n + 1);
+        int c1, c2;
+
+        memset(d1, 0xA5, sizeof(d1));
+        memset(d2, 0xA5, sizeof(d2));
+        c1 = u8_toucs(d1, sz, src, srcsz);
+        c2 = ref_u8_toucs(d2, sz, src, srcsz);
+        if (c1 != c2 || memcmp(d1, d2, sizeof(d1)) != 0)
+            mismatches++;
+
+        for (int i = 0, j = 0; src[i] != '\0';)
+            if (u8_nextchar(src, &i) != ref_u8_nextchar(src, &j) || i != j)
+            {
+                mismatches++;
+                break;
+            }
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+static void bench(void)
+{
+    enum { TEXT = 4096, REPS = 20000 };
+    static char text[TEXT + 8];
+    static u_int32_t ucs[TEXT];
+    int n = 0;
+    double t0, t1, t2;
+
+    while (n < TEXT - 4)
+    {
+        int k = rand() % 4;
+        n += u8_wc_toutf8(text + n, k < 2 ? 'a' + rand() % 26 : k < 3 ? 0x400 + rand() % 0x100 : 0x4E00 + rand() % 0x1000);
+    }
+    text[n] = '\0';
+
+    t0 = unit_seconds();
+    for (int r = 0; r < REPS; r++)
+        unit_sink += u8_toucs(ucs, TEXT, text, n) + ucs[r % 64];
+    t1 = unit_seconds();
+    for (int r = 0; r < REPS; r++)
+        for (int i = 0; i < n; i += u8_seqlen(text + i))
+            unit_sink++;
+    t2 = unit_seconds();
+
+    printf("UTF8_COMPACT_TABLES=%d, %zu bytes of tables: %d x %d bytes of mixed text\n",
+           UTF8_COMPACT_TABLES, TABLE_BYTES, REPS, n);
+    printf("  u8_toucs %6.0f MB/s   u8_seqlen walk %6.0f MB/s\n",
+           (double)n * REPS / 1e6 / (t1 - t0), (double)n * REPS / 1e6 / (t2 - t1));
+}
+
+int main(int argc, char **argv)
+{
+    char name[32];
+
+    unit_init(argc, argv);
+    srand(20);
+    test_lead_bytes();
+    test_random();
+    if (unit_bench)
+        bench();
+    snprintf(name, sizeof(name), "test_utf8_tables (%d)", UTF8_COMPACT_TABLES);
+    return unit_done(name);
+}
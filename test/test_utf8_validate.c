@@ -0,0 +1,218 @@
+/*
+ * Validating UTF-8 decoder (user-011).
+ *
+ * u8_validate and u8_toucs_checked are compared with a rule-by-rule reference of the Unicode
+ * well-formedness table over every sequence of one to three bytes, and over every four byte
+ * sequence whose lead byte can start one. The other four byte sequences are covered through one
+ * byte of each class. Valid input must decode to what the old u8_toucs gives. The benchmark runs
+ * the old u8_toucs and the new functions over ASCII, mixed and CJK text.
+ */
+#include <stdlib.h>
+#include "unit.h"
+#include "../utf8.h"
+#include "ref_utf8.h"
+
+/* One well-formed scalar taking exactly n bytes. */
+static int scalar(const unsigned char *b, int n, u_int32_t *p_cp)
+{
+    int len;
+    u_int32_t c, min;
+
+    if (b[0] < 0x80)                { len = 1; c = b[0];        min = 0; }
+    else if ((b[0] & 0xE0) == 0xC0) { len = 2; c = b[0] & 0x1F; min = 0x80; }
+    else if ((b[0] & 0xF0) == 0xE0) { len = 3; c = b[0] & 0x0F; min = 0x800; }
+    else if ((b[0] & 0xF8) == 0xF0) { len = 4; c = b[0] & 0x07; min = 0x10000; }
+    else return 0;
+
+    if (len != n)
+        return 0;
+    for (int i = 1; i < len; i++)
+    {
+        if ((b[i] & 0xC0) != 0x80)
+            return 0;
+        c = (c << 6) | (b[i] & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+        return 0;
+    *p_cp = c;
+    return 1;
+}
+
+/* Well-formed string of n bytes: the scalars split uniquely, shortest first. */
+static int well_formed(const unsigned char *b, int n)
+{
+    int i = 0;
+    while (i < n)
+    {
+        int l;
+        u_int32_t c;
+        for (l = 1; l <= 4 && i + l <= n; l++)
+            if (scalar(b + i, l, &c))
+                break;
+        if (l > 4 || i + l > n)
+            return 0;
+        i += l;
+    }
+    return 1;
+}
+
+static unsigned long m_mismatches;
+static unsigned long m_scalars;
+
+static void check_sequence(const unsigned char *b, int n)
+{
+    u_int32_t dest[8], ref[8], cp;
+    int valid = well_formed(b, n);
+    int got = u8_toucs_checked(dest, 8, (char *)b, n);
+
+    if (valid != (u8_validate((char *)b, n) != 0) || valid != (got >= 0))
+        m_mismatches++;
+    if (valid)
+    {
+        int ref_got = ref_u8_toucs(ref, 8, (char *)b, n);
+        if (got != ref_got || memcmp(dest, ref, (got + 1) * sizeof(u_int32_t)) != 0)
+            m_mismatches++;
+    }
+    if (scalar(b, n, &cp))
+    {
+        m_scalars++;
+        if (got != 1 || dest[0] != cp)
+            m_mismatches++;
+    }
+}
+
+/* One byte of each class the decoder tells apart, and the edges of each class. */
+static const unsigned char m_classes[] =
+{
+    0x00, 0x41, 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xC1, 0xC2, 0xDF, 0xE0,
+    0xE1, 0xEC, 0xED, 0xEE, 0xEF, 0xF0, 0xF1, 0xF3, 0xF4, 0xF5, 0xF7, 0xF8, 0xFE, 0xFF,
+};
+
+static void test_exhaustive(void)
+{
+    unsigned char b[4];
+
+    for (int n = 1; n <= 3; n++)
+        for (u_int32_t v = 0; v < (1u << (8 * n)); v++)
+        {
+            for (int k = 0; k < n; k++)
+                b[k] = v >> (8 * (n - 1 - k));
+            check_sequence(b, n);
+        }
+
+    /* Every sequence led by F0 to F4, where all three continuation bytes matter. */
+    for (u_int32_t lead = 0xF0; lead <= 0xF4; lead++)
+        for (u_int32_t v = 0; v < (1u << 24); v++)
+        {
+            b[0] = lead;
+            b[1] = v >> 16;
+            b[2] = v >> 8;
+            b[3] = v;
+            check_sequence(b, 4);
+        }
+
+    /* Every scalar value but the surrogates has been seen once. */
+    CHECK_EQ(m_scalars, 0x110000 - 0x800);
+
+    /* The rest through the byte classes. */
+    for (size_t i = 0; i < sizeof(m_classes); i++)
+        for (size_t j = 0; j < sizeof(m_classes); j++)
+            for (size_t k = 0; k < sizeof(m_classes); k++)
+                for (size_t l = 0; l < sizeof(m_classes); l++)
+                {
+                    b[0] = m_classes[i];
+                    b[1] = m_classes[j];
+                    b[2] = m_classes[k];
+                    b[3] = m_classes[l];
+                    check_sequence(b, 4);
+                }
+
+    CHECK_EQ(m_mismatches, 0);
+}
+
+/* Strings: NUL termination, truncation at the end, and the ASCII shortcut around errors. */
+static void test_strings(void)
+{
+    u_int32_t dest[64];
+    char buf[64];
+
+    CHECK(u8_validate("lock/state", -1));
+    CHECK(u8_validate("", -1));
+    CHECK(u8_validate("\xe2\x82\xac", -1));
+    CHECK(!u8_validate("\xe2\x82", -1));
+    CHECK(!u8_validate("\xe2\x82\xac", 2));
+    CHECK(!u8_validate("\xed\xa0\x80", -1));
+    CHECK(!u8_validate("\xc0\xaf", -1));
+    CHECK(!u8_validate("\xf4\x90\x80\x80", -1));
+
+    /* An error at every position of a long ASCII run, which the word shortcut must not skip. */
+    for (int len = 1; len < 40; len++)
+        for (int at = 0; at < len; at++)
+        {
+            memset(buf, 'a', len);
+            buf[len] = '\0';
+            buf[at] = (char)0x80;
+            CHECK(!u8_validate(buf, len));
+            CHECK(!u8_validate(buf + (at & 1), -1));
+            CHECK_EQ(u8_toucs_checked(dest, 64, buf, len), -1);
+            CHECK_EQ(dest[at], 0);
+        }
+
+    CHECK_EQ(u8_toucs_checked(dest, 64, "a\xc3\xa9z", -1), 3);
+    CHECK_EQ(dest[1], 0xE9);
+    CHECK_EQ(dest[3], 0);
+}
+
+static char m_corpus[1 << 20];
+static u_int32_t m_out[(1 << 20) + 1];
+
+static void corpus_fill(const char *unit)
+{
+    int l = strlen(unit), i = 0;
+    while (i + l < (int)sizeof(m_corpus))
+    {
+        memcpy(m_corpus + i, unit, l);
+        i += l;
+    }
+    m_corpus[i] = '\0';
+}
+
+static void bench_corpus(const char *name, const char *unit)
+{
+    const int reps = 50;
+    double t0, t1, t2, t3;
+    int n;
+
+    corpus_fill(unit);
+    n = strlen(m_corpus);
+
+    t0 = unit_seconds();
+    for (int r = 0; r < reps; r++)
+        unit_sink += ref_u8_toucs(m_out, sizeof(m_out) / sizeof(m_out[0]), m_corpus, n);
+    t1 = unit_seconds();
+    for (int r = 0; r < reps; r++)
+        unit_sink += u8_toucs_checked(m_out, sizeof(m_out) / sizeof(m_out[0]), m_corpus, n);
+    t2 = unit_seconds();
+    for (int r = 0; r < reps; r++)
+        unit_sink += u8_validate(m_corpus, n);
+    t3 = unit_seconds();
+
+    double mb = (double)n * reps / 1e6;
+    printf("  %-6s old u8_toucs %6.0f MB/s   u8_toucs_checked %6.0f MB/s   u8_validate %6.0f MB/s\n",
+           name, mb / (t1 - t0), mb / (t2 - t1), mb / (t3 - t2));
+}
+
+int main(int argc, char **argv)
+{
+    unit_init(argc, argv);
+    test_exhaustive();
+    test_strings();
+    if (unit_bench)
+    {
+        printf("decoding 1 MB\n");
+        bench_corpus("ascii", "lock/getstate/0123-abcd ");
+        bench_corpus("mixed", "door \xc3\xa9t\xc3\xa9 \xe2\x82\xac ok ");
+        bench_corpus("cjk", "\xe9\x8e\x96\xe7\x8a\xb6\xe6\x85\x8b\xe9\x96\x8b\xe9\x96\x89");
+    }
+    return unit_done("test_utf8_validate");
+}
@@ -0,0 +1,131 @@
+/*
+ * Minimal check and benchmark helpers shared by the host tests.
+ *
+ * A test is a program that returns non-zero when a CHECK failed. Run with the argument "bench",
+ * it also prints its benchmark figures; "make bench" does that for every test.
+ */
+#ifndef UNIT_H__
+#define UNIT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+static int unit_failures;
+static int unit_checks;
+static int unit_bench;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        unit_checks++;                                                      \
+        if (!(cond)) {                                                      \
+            unit_failures++;                                                \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                                   \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                      \
+    do {                                                                    \
+        long long unit_a = (long long)(a), unit_b = (long long)(b);         \
+        unit_checks++;                                                      \
+        if (unit_a != unit_b) {                                             \
+            unit_failures++;                                                \
+            printf("%s:%d: check failed: %s == %s (%lld != %lld)\n",        \
+                   __FILE__, __LINE__, #a, #b, unit_a, unit_b);             \
+        }                                                                   \
+    } while (0)
+
+#define CHECK_STR(a, b)                                                     \
+    do {                                                                    \
+        const char *unit_a = (a), *unit_b = (b);                            \
+        unit_checks++;                                                      \
+        if (strcmp(unit_a, unit_b) != 0) {                                  \
+            unit_failures++;                                                \
+            printf("%s:%d: check failed: %s == %s (\"%s\" != \"%s\")\n",    \
+                   __FILE__, __LINE__, #a, #b, unit_a, unit_b);             \
+        }                                                                   \
+    } while (0)
+
+static inline void unit_init(int argc, char **argv)
+{
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    unit_bench = (argc > 1 && strcmp(argv[1], "bench") == 0);
+}
+
+static inline int unit_done(const char *name)
+{
+    printf("%s: %d checks, %d failed\n", name, unit_checks, unit_failures);
+    return unit_failures != 0;
+}
+
+/* Cycle counter: DWT on Cortex-M4 (enabled by the caller), the TSC on x86, otherwise ns. */
+#if defined(__ARM_ARCH_7EM__)
+#define UNIT_CYCLES_UNIT "cycles"
+static inline uint32_t unit_cycles(void)
+{
+    return *(volatile uint32_t *)0xE0001004;    /* DWT->CYCCNT */
+}
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define UNIT_CYCLES_UNIT "TSC cycles"
+static inline uint64_t unit_cycles(void)
+{
+    return __rdtsc();
+}
+#else
+#define UNIT_CYCLES_UNIT "ns"
+static inline uint64_t unit_cycles(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+}
+#endif
+
+static inline double unit_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Keeps the optimizer from discarding a benchmarked result. */
+static volatile uintptr_t unit_sink;
+
+/*
+ * Peak stack use of a call, callees included. The stack below the caller is painted, the call is
+ * made from the same depth, and the bytes it overwrote are counted.
+ */
+#define UNIT_STACK_PROBE    16384
+#define UNIT_STACK_PAINT    0xA5
+
+static __attribute__((noinline)) void unit_stack_paint(void)
+{
+    volatile uint8_t area[UNIT_STACK_PROBE];
+    for (int i = 0; i < UNIT_STACK_PROBE; i++)
+        area[i] = UNIT_STACK_PAINT;
+    (void)area[0];
+}
+
+/* Reads what unit_stack_paint and the measured call left in the same stack area. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+static __attribute__((noinline)) int unit_stack_scan(void)
+{
+    volatile uint8_t area[UNIT_STACK_PROBE];
+    int i = 0;
+    while (i < UNIT_STACK_PROBE && area[i] == UNIT_STACK_PAINT)
+        i++;
+    return UNIT_STACK_PROBE - i;
+}
+#pragma GCC diagnostic pop
+
+static __attribute__((noinline)) int unit_stack_peak(void (*fn)(void *), void *arg)
+{
+    unit_stack_paint();
+    fn(arg);
+    return unit_stack_scan();
+}
+
+#endif // UNIT_H__
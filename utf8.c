@@ -12,22 +12,75 @@
   valid.
 */
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
-#ifdef WIN32
-#include <malloc.h>
-#else
-#include <alloca.h>
-#endif
+#include <stddef.h>
+#include <wchar.h>
 
 #include "utf8.h"
 
+/* table layout
+
+   UTF8_COMPACT_TABLES selects how the length of a sequence is found from
+   its lead byte:
+     0  the 256-byte trailingBytesForUTF8 table
+     1  a 16-entry table indexed by the high nibble
+     2  a count of the leading 1 bits with CLZ, no table at all
+   1 and 2 also drop the offsets of the 5- and 6-byte forms from
+   offsetsFromUTF8; those two values are still produced, from immediates,
+   so malformed input decodes exactly as with the full tables.
+*/
+#ifndef UTF8_COMPACT_TABLES
+#define UTF8_COMPACT_TABLES 0
+#endif
+
+#if UTF8_COMPACT_TABLES
+static const u_int32_t offsetsFromUTF8[4] = {
+    0x00000000UL, 0x00003080UL, 0x000E2080UL, 0x03C82080UL
+};
+
+static u_int32_t u8_seqoffset(int nb)
+{
+    if (nb < 4)
+        return offsetsFromUTF8[nb];
+    return nb == 4 ? 0xFA082080UL : 0x82082080UL;
+}
+#else
 static const u_int32_t offsetsFromUTF8[6] = {
     0x00000000UL, 0x00003080UL, 0x000E2080UL,
     0x03C82080UL, 0xFA082080UL, 0x82082080UL
 };
 
+static u_int32_t u8_seqoffset(int nb)
+{
+    return offsetsFromUTF8[nb < 5 ? nb : 5];
+}
+#endif
+
+#if UTF8_COMPACT_TABLES == 1
+static const unsigned char trailingBytesForNibble[16] = {
+    0,0,0,0,0,0,0,0,0,0,0,0,1,1,2,3
+};
+
+/* F8..FB and FC..FF share the F nibble with the 4-byte leads */
+static int u8_trailing(unsigned char c)
+{
+    return trailingBytesForNibble[c >> 4] + (c >= 0xF8) + (c >= 0xFC);
+}
+#elif UTF8_COMPACT_TABLES == 2
+/* a lead byte with n leading 1 bits has n-1 trailing bytes; ASCII and
+   continuation bytes count as 0, FE and FF as 5 */
+static int u8_trailing(unsigned char c)
+{
+    int ones = __builtin_clz(~((u_int32_t)c << 24));
+
+    if (ones < 2)
+        return 0;
+    return ones > 6 ? 5 : ones - 1;
+}
+#else
 static const char trailingBytesForUTF8[256] = {
     0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
     0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
@@ -39,10 +92,91 @@ static const char trailingBytesForUTF8[256] = {
     2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, 3,3,3,3,3,3,3,3,4,4,4,4,5,5,5,5
 };
 
+static int u8_trailing(unsigned char c)
+{
+    return trailingBytesForUTF8[c];
+}
+#endif
+
 /* returns length of next utf-8 sequence */
 int u8_seqlen(char *s)
 {
-    return trailingBytesForUTF8[(unsigned int)(unsigned char)s[0]] + 1;
+    return u8_trailing((unsigned char)s[0]) + 1;
+}
+
+/* word kernels
+
+   small tests on a machine word of text, used by the scanning and
+   converting loops below. with UTF8_USE_DSP they are built from the
+   Cortex-M4 SIMD instructions, which work on the 4 bytes of a word in
+   parallel and set a per-byte GE flag that SEL can select on. otherwise
+   portable bit tricks are used on a native word: 4 bytes on Cortex-M,
+   8 on 64-bit hosts. UTF8_USE_DSP defaults to 0; set it to 1 only on
+   a build with the SIMD32 extension (-mcpu=cortex-m4), after measuring
+   the kernels there with test/test_utf8_kernels.c.
+*/
+#ifndef UTF8_USE_DSP
+#define UTF8_USE_DSP 0
+#endif
+
+#if UTF8_USE_DSP
+#include <arm_acle.h>
+typedef u_int32_t u8_word_t;
+#else
+typedef unsigned long u8_word_t;
+#endif
+
+#define U8_WORD_ONES  ((u8_word_t)-1 / 0xFF)
+#define U8_WORD_HIGHS (U8_WORD_ONES * 0x80)
+#define U8_WORD_HASZERO(w) (((w) - U8_WORD_ONES) & ~(w) & U8_WORD_HIGHS)
+
+static u_int32_t u8_load32(const void *p)
+{
+    u_int32_t w;
+
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+/* nonzero if all 4 bytes of w are ASCII */
+static int u8_word32_isascii(u_int32_t w)
+{
+#if UTF8_USE_DSP
+    return __uqsub8(w, 0x7F7F7F7FUL) == 0;
+#else
+    return (w & 0x80808080UL) == 0;
+#endif
+}
+
+/* nonzero if all 4 bytes of w are ASCII and none is NUL */
+static int u8_word32_isascii_nz(u_int32_t w)
+{
+#if UTF8_USE_DSP
+    (void)__usub8(w, 0x01010101UL);
+    return (__sel(w, 0x80808080UL) & 0x80808080UL) == 0;
+#else
+    return ((w - 0x01010101UL) | w) & 0x80808080UL ? 0 : 1;
+#endif
+}
+
+/* number of bytes of w that start a character, i.e. are not
+   continuation bytes 0x80..0xBF */
+static size_t u8_word_starts(u8_word_t w)
+{
+#if UTF8_USE_DSP
+    u_int32_t ge80, gec0;
+
+    (void)__usub8(w, 0x80808080UL);
+    ge80 = __sel(0x01010101UL, 0);
+    (void)__usub8(w, 0xC0C0C0C0UL);
+    gec0 = __sel(0x01010101UL, 0);
+    return 4 - __usad8(ge80 - gec0, 0);
+#else
+    u8_word_t cont = (w & ~(w << 1) & U8_WORD_HIGHS) >> 7;
+
+    return sizeof(u8_word_t) -
+        (size_t)((cont * U8_WORD_ONES) >> (8 * (sizeof(u8_word_t) - 1)));
+#endif
 }
 
 /* conversions without error checking
@@ -63,7 +197,22 @@ int u8_toucs(u_int32_t *dest, int sz, char *src, int srcsz)
     int i=0;
 
     while (i < sz-1) {
-        nb = trailingBytesForUTF8[(unsigned char)*src];
+        /* runs of ASCII are copied 4 bytes at a time. a 0-terminated
+           source is only read in aligned words, so the NUL check cannot
+           fault past the end of the string */
+        while (i < sz-4 &&
+               (srcsz == -1 ?
+                ((uintptr_t)src & 3) == 0 && u8_word32_isascii_nz(u8_load32(src)) :
+                src_end - src >= 4 && u8_word32_isascii(u8_load32(src)))) {
+            dest[i++] = (unsigned char)src[0];
+            dest[i++] = (unsigned char)src[1];
+            dest[i++] = (unsigned char)src[2];
+            dest[i++] = (unsigned char)src[3];
+            src += 4;
+        }
+        if (i >= sz-1)
+            break;
+        nb = u8_trailing((unsigned char)*src);
         if (srcsz == -1) {
             if (*src == 0)
                 goto done_toucs;
@@ -80,7 +229,7 @@ int u8_toucs(u_int32_t *dest, int sz, char *src, int srcsz)
         case 1: ch += (unsigned char)*src++; ch <<= 6;
         case 0: ch += (unsigned char)*src++;
         }
-        ch -= offsetsFromUTF8[nb];
+        ch -= u8_seqoffset(nb);
         dest[i++] = ch;
     }
  done_toucs:
@@ -88,6 +237,204 @@ int u8_toucs(u_int32_t *dest, int sz, char *src, int srcsz)
     return i;
 }
 
+/* validating decoder
+
+   a DFA over byte classes. the class of each byte selects the next state
+   and the payload bits it contributes, so overlong forms, surrogates,
+   code points above 0x10FFFF, stray continuation bytes and truncated
+   sequences are all caught by the one table lookup per byte. runs of
+   ASCII are skipped a word at a time while the decoder is between
+   characters.
+*/
+#define UTF8_ACCEPT 0
+#define UTF8_REJECT 12
+
+static const unsigned char utf8ByteClass[256] = {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+    3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
+    4,4,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+    6,7,7,7,7,7,7,7,7,7,7,7,7,8,7,7, 9,10,10,10,11,4,4,4,4,4,4,4,4,4,4,4
+};
+
+/* classes: 0 ascii, 1 80..8F, 2 90..9F, 3 A0..BF, 4 invalid lead,
+   5 C2..DF, 6 E0, 7 E1..EC EE..EF, 8 ED, 9 F0, 10 F1..F3, 11 F4.
+   states are premultiplied by the number of classes. */
+static const unsigned char utf8Transition[108] = {
+/* ACCEPT */  0,12,12,12,12,24,60,36,72,84,48,96,
+/* REJECT */ 12,12,12,12,12,12,12,12,12,12,12,12,
+/* 1 left */ 12, 0, 0, 0,12,12,12,12,12,12,12,12,
+/* 2 left */ 12,24,24,24,12,12,12,12,12,12,12,12,
+/* 3 left */ 12,36,36,36,12,12,12,12,12,12,12,12,
+/* E0     */ 12,12,12,24,12,12,12,12,12,12,12,12,
+/* ED     */ 12,24,24,12,12,12,12,12,12,12,12,12,
+/* F0     */ 12,12,36,36,12,12,12,12,12,12,12,12,
+/* F4     */ 12,36,12,12,12,12,12,12,12,12,12,12
+};
+
+/* payload bits of a lead byte, by class */
+static const unsigned char utf8LeadMask[12] = {
+    0x7F, 0, 0, 0, 0, 0x1F, 0x0F, 0x0F, 0x0F, 0x07, 0x07, 0x07
+};
+
+static u_int32_t u8_decode_step(u_int32_t *state, u_int32_t *ch,
+                                unsigned char b)
+{
+    u_int32_t cls = utf8ByteClass[b];
+
+    *ch = (*state != UTF8_ACCEPT) ? (*ch << 6) | (b & 0x3F) :
+        (u_int32_t)(b & utf8LeadMask[cls]);
+    *state = utf8Transition[*state + cls];
+    return *state;
+}
+
+int u8_validate(char *src, int srcsz)
+{
+    const unsigned char *s = (const unsigned char*)src;
+    const unsigned char *s_end;
+    u_int32_t state = UTF8_ACCEPT;
+
+    if (srcsz < 0)
+        srcsz = strlen(src);
+    s_end = s + srcsz;
+
+    while (s < s_end) {
+        if (state == UTF8_ACCEPT) {
+            while (s_end - s >= 8 && u8_word32_isascii(u8_load32(s)) &&
+                   u8_word32_isascii(u8_load32(s + 4)))
+                s += 8;
+            if (s == s_end)
+                break;
+        }
+        state = utf8Transition[state + utf8ByteClass[*s++]];
+        if (state == UTF8_REJECT)
+            return 0;
+    }
+    return state == UTF8_ACCEPT;
+}
+
+int u8_toucs_checked(u_int32_t *dest, int sz, char *src, int srcsz)
+{
+    const unsigned char *s = (const unsigned char*)src;
+    const unsigned char *s_end;
+    u_int32_t state = UTF8_ACCEPT;
+    u_int32_t ch = 0;
+    int i=0;
+
+    if (srcsz < 0)
+        srcsz = strlen(src);
+    s_end = s + srcsz;
+
+    while (i < sz-1 && s < s_end) {
+        if (state == UTF8_ACCEPT) {
+            while (sz-1 - i >= 4 && s_end - s >= 4 &&
+                   u8_word32_isascii(u8_load32(s))) {
+                dest[i++] = s[0];
+                dest[i++] = s[1];
+                dest[i++] = s[2];
+                dest[i++] = s[3];
+                s += 4;
+            }
+            if (i >= sz-1 || s == s_end)
+                break;
+        }
+        switch (u8_decode_step(&state, &ch, *s++)) {
+        case UTF8_ACCEPT:
+            dest[i++] = ch;
+            break;
+        case UTF8_REJECT:
+            dest[i] = 0;
+            return -1;
+        }
+    }
+    dest[i] = 0;
+    /* a sequence cut off by the end of the input is an error, one cut
+       off by the end of dest is not */
+    if (state != UTF8_ACCEPT && s == s_end)
+        return -1;
+    return i;
+}
+
+/* streaming decoder
+
+   the DFA state and the partly decoded character live in a u8_decoder_t,
+   so input can be fed in pieces, e.g. straight from the segments of a
+   pbuf chain, and a sequence split across two pieces is picked up where
+   it left off.
+*/
+void u8_decoder_init(u8_decoder_t *d)
+{
+    d->state = UTF8_ACCEPT;
+    d->ch = 0;
+}
+
+int u8_decoder_feed(u8_decoder_t *d, u_int32_t *dest, int sz, int *nchars,
+                    char *src, int srcsz)
+{
+    const unsigned char *s = (const unsigned char*)src;
+    const unsigned char *s_end = s + srcsz;
+    u_int32_t state = d->state;
+    u_int32_t ch = d->ch;
+    int i=0;
+
+    if (state == UTF8_REJECT)
+        goto error_feed;
+
+    while (s < s_end) {
+        if (dest != NULL && i == sz)
+            break;
+        if (state == UTF8_ACCEPT) {
+            if (dest == NULL) {
+                while (s_end - s >= 8 && u8_word32_isascii(u8_load32(s)) &&
+                       u8_word32_isascii(u8_load32(s + 4)))
+                    s += 8;
+            }
+            else {
+                while (sz - i >= 4 && s_end - s >= 4 &&
+                       u8_word32_isascii(u8_load32(s))) {
+                    dest[i++] = s[0];
+                    dest[i++] = s[1];
+                    dest[i++] = s[2];
+                    dest[i++] = s[3];
+                    s += 4;
+                }
+                if (i == sz)
+                    break;
+            }
+            if (s == s_end)
+                break;
+        }
+        switch (u8_decode_step(&state, &ch, *s++)) {
+        case UTF8_ACCEPT:
+            if (dest != NULL)
+                dest[i] = ch;
+            i++;
+            break;
+        case UTF8_REJECT:
+            goto error_feed;
+        }
+    }
+    d->state = state;
+    d->ch = ch;
+    if (nchars != NULL)
+        *nchars = i;
+    return (char*)s - src;
+
+ error_feed:
+    d->state = UTF8_REJECT;
+    if (nchars != NULL)
+        *nchars = i;
+    return -1;
+}
+
+int u8_decoder_done(u8_decoder_t *d)
+{
+    return d->state == UTF8_ACCEPT;
+}
+
 /* srcsz = number of source characters, or -1 if 0-terminated
    sz = size of dest buffer in bytes
 
@@ -107,6 +454,20 @@ int u8_toutf8(char *dest, int sz, u_int32_t *src, int srcsz)
     char *dest_end = dest + sz;
 
     while (srcsz<0 ? src[i]!=0 : i < srcsz) {
+        /* 4 ASCII characters in a row are stored as one block. each is
+           checked in turn, so a 0-terminated source is not read past its
+           end */
+        if (dest_end - dest >= 4 && (srcsz < 0 || srcsz - i >= 4) &&
+            src[i] - 1 < 0x7F && src[i+1] - 1 < 0x7F &&
+            src[i+2] - 1 < 0x7F && src[i+3] - 1 < 0x7F) {
+            dest[0] = (char)src[i];
+            dest[1] = (char)src[i+1];
+            dest[2] = (char)src[i+2];
+            dest[3] = (char)src[i+3];
+            dest += 4;
+            i += 4;
+            continue;
+        }
         ch = src[i];
         if (ch < 0x80) {
             if (dest >= dest_end)
@@ -168,42 +529,170 @@ int u8_wc_toutf8(char *dest, u_int32_t ch)
     return 0;
 }
 
+/* word-at-a-time scanning
+
+   the byte at offset 0 always counts as the start of a character, and
+   every other character starts at a byte that is not a continuation
+   byte. loads are aligned, so a scan for the terminating NUL never reads
+   across a page boundary.
+*/
+
+/* counts character starts in s[0..n), stopping at a NUL if nul_ends is
+   set, or in front of the start following the first maxc ones.
+   the number of bytes scanned is stored in *pos. */
+static size_t u8_scan(const char *s, size_t n, int nul_ends, size_t maxc,
+                      size_t *pos)
+{
+    size_t i = 0, c = 0, k;
+    u8_word_t w;
+
+    while (i < n && ((uintptr_t)(s + i) & (sizeof(u8_word_t) - 1))) {
+        if (nul_ends && s[i] == 0)
+            goto done_scan;
+        if (isutf(s[i])) {
+            if (c == maxc)
+                goto done_scan;
+            c++;
+        }
+        i++;
+    }
+    while (n - i >= sizeof(u8_word_t)) {
+        memcpy(&w, s + i, sizeof(w));
+        if (nul_ends && U8_WORD_HASZERO(w))
+            break;
+        k = u8_word_starts(w);
+        if (k > maxc - c)
+            break;
+        c += k;
+        i += sizeof(u8_word_t);
+    }
+    while (i < n) {
+        if (nul_ends && s[i] == 0)
+            break;
+        if (isutf(s[i])) {
+            if (c == maxc)
+                break;
+            c++;
+        }
+        i++;
+    }
+ done_scan:
+    *pos = i;
+    return c;
+}
+
 /* charnum => byte offset */
 int u8_offset(char *str, int charnum)
 {
-    int offs=0;
+    size_t pos;
 
-    while (charnum > 0 && str[offs]) {
-        (void)(isutf(str[++offs]) || isutf(str[++offs]) ||
-               isutf(str[++offs]) || ++offs);
-        charnum--;
-    }
-    return offs;
+    if (charnum <= 0 || str[0] == 0)
+        return 0;
+    u8_scan(str + 1, (size_t)-1, 1, charnum - 1, &pos);
+    return pos + 1;
 }
 
 /* byte offset => charnum */
 int u8_charnum(char *s, int offset)
 {
-    int charnum = 0, offs=0;
+    size_t pos;
 
-    while (offs < offset && s[offs]) {
-        (void)(isutf(s[++offs]) || isutf(s[++offs]) ||
-               isutf(s[++offs]) || ++offs);
-        charnum++;
-    }
-    return charnum;
+    if (offset <= 0 || s[0] == 0)
+        return 0;
+    return u8_scan(s + 1, offset - 1, 1, (size_t)-1, &pos) + 1;
 }
 
 /* number of characters */
 int u8_strlen(char *s)
 {
-    int count = 0;
-    int i = 0;
+    size_t pos;
+
+    if (s[0] == 0)
+        return 0;
+    return u8_scan(s + 1, (size_t)-1, 1, (size_t)-1, &pos) + 1;
+}
+
+int u8_memoffset(char *s, size_t sz, int charnum)
+{
+    size_t pos;
+
+    if (charnum <= 0 || sz == 0)
+        return 0;
+    u8_scan(s + 1, sz - 1, 0, charnum - 1, &pos);
+    return pos + 1;
+}
+
+int u8_memcharnum(char *s, size_t sz, int offset)
+{
+    size_t pos;
+
+    if (offset <= 0 || sz == 0)
+        return 0;
+    if ((size_t)offset < sz)
+        sz = offset;
+    return u8_scan(s + 1, sz - 1, 0, (size_t)-1, &pos) + 1;
+}
+
+int u8_memlen(char *s, size_t sz)
+{
+    size_t pos;
+
+    if (sz == 0)
+        return 0;
+    return u8_scan(s + 1, sz - 1, 0, (size_t)-1, &pos) + 1;
+}
 
-    while (u8_nextchar(s, &i) != 0)
-        count++;
+/* measuring
 
-    return count;
+   the exact number of bytes u8_toutf8 writes and the number of
+   characters u8_toucs writes, without the terminator, found with the
+   same ASCII fast paths the converters use and without writing anything.
+*/
+int u8_measure(u_int32_t *src, int srcsz)
+{
+    u_int32_t ch;
+    int i = 0, n = 0;
+
+    while (srcsz<0 ? src[i]!=0 : i < srcsz) {
+        if ((srcsz < 0 || srcsz - i >= 4) &&
+            src[i] - 1 < 0x7F && src[i+1] - 1 < 0x7F &&
+            src[i+2] - 1 < 0x7F && src[i+3] - 1 < 0x7F) {
+            n += 4;
+            i += 4;
+            continue;
+        }
+        ch = src[i++];
+        if (ch < 0x80)
+            n += 1;
+        else if (ch < 0x800)
+            n += 2;
+        else if (ch < 0x10000)
+            n += 3;
+        else if (ch < 0x110000)
+            n += 4;
+    }
+    return n;
+}
+
+int u8_ucs_measure(char *src, int srcsz)
+{
+    size_t pos, last;
+    int n;
+
+    if (srcsz < 0) {
+        if (src[0] == 0)
+            return 0;
+        return u8_scan(src + 1, (size_t)-1, 1, (size_t)-1, &pos) + 1;
+    }
+    if (srcsz == 0)
+        return 0;
+    n = u8_scan(src + 1, srcsz - 1, 0, (size_t)-1, &pos) + 1;
+    /* u8_toucs drops a last sequence that is cut off by the end */
+    for (last = srcsz - 1; last > 0 && !isutf(src[last]); last--)
+        ;
+    if (last + u8_seqlen(src + last) > (size_t)srcsz)
+        n--;
+    return n;
 }
 
 /* reads the next utf-8 sequence out of a string, updating an index */
@@ -217,7 +706,7 @@ u_int32_t u8_nextchar(char *s, int *i)
         ch += (unsigned char)s[(*i)++];
         sz++;
     } while (s[*i] && !isutf(s[*i]));
-    ch -= offsetsFromUTF8[sz-1];
+    ch -= u8_seqoffset(sz-1);
 
     return ch;
 }
@@ -234,6 +723,54 @@ void u8_dec(char *s, int *i)
            isutf(s[--(*i)]) || --(*i));
 }
 
+/* escaping
+
+   hexValue maps a byte to its value as a hex digit, or 0xFF.
+   escapeClass maps a byte of UTF-8 text to how u8_escape writes it:
+   0 as itself, a letter for a named escape such as \n, 'x' for a \x
+   escape, 'u' for the lead byte of a multi-byte character, which is
+   written as \u or \U, and '"' for the quote.
+*/
+static const unsigned char hexValue[256] = {
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+      0,  1,  2,  3,  4,  5,  6,  7,  8,  9,255,255,255,255,255,255,
+    255, 10, 11, 12, 13, 14, 15,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255, 10, 11, 12, 13, 14, 15,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+    255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255
+};
+
+static const char escapeClass[256] = {
+    'x','x','x','x','x','x','x','a','b','t','n','v','f','r','x','x',
+    'x','x','x','x','x','x','x','x','x','x','x','x','x','x','x','x',
+      0,  0,'"',  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,'\\', 0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,'x',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u'
+};
+
+static const char hexDigits[16] = "0123456789ABCDEF";
+
 int octal_digit(char c)
 {
     return (c >= '0' && c <= '7');
@@ -241,9 +778,7 @@ int octal_digit(char c)
 
 int hex_digit(char c)
 {
-    return ((c >= '0' && c <= '9') ||
-            (c >= 'A' && c <= 'F') ||
-            (c >= 'a' && c <= 'f'));
+    return hexValue[(unsigned char)c] != 255;
 }
 
 /* assumes that src points to the character after a backslash
@@ -251,51 +786,39 @@ int hex_digit(char c)
 int u8_read_escape_sequence(char *str, u_int32_t *dest)
 {
     u_int32_t ch;
-    char digs[9]="\0\0\0\0\0\0\0\0";
-    int dno=0, i=1;
+    int dno=0, i=1, max=0;
 
     ch = (u_int32_t)str[0];    /* take literal character */
-    if (str[0] == 'n')
-        ch = L'\n';
-    else if (str[0] == 't')
-        ch = L'\t';
-    else if (str[0] == 'r')
-        ch = L'\r';
-    else if (str[0] == 'b')
-        ch = L'\b';
-    else if (str[0] == 'f')
-        ch = L'\f';
-    else if (str[0] == 'v')
-        ch = L'\v';
-    else if (str[0] == 'a')
-        ch = L'\a';
-    else if (octal_digit(str[0])) {
-        i = 0;
-        do {
-            digs[dno++] = str[i++];
-        } while (octal_digit(str[i]) && dno < 3);
-        ch = strtol(digs, NULL, 8);
-    }
-    else if (str[0] == 'x') {
-        while (hex_digit(str[i]) && dno < 2) {
-            digs[dno++] = str[i++];
-        }
-        if (dno > 0)
-            ch = strtol(digs, NULL, 16);
-    }
-    else if (str[0] == 'u') {
-        while (hex_digit(str[i]) && dno < 4) {
-            digs[dno++] = str[i++];
+    switch (str[0]) {
+    case 'n': ch = L'\n'; break;
+    case 't': ch = L'\t'; break;
+    case 'r': ch = L'\r'; break;
+    case 'b': ch = L'\b'; break;
+    case 'f': ch = L'\f'; break;
+    case 'v': ch = L'\v'; break;
+    case 'a': ch = L'\a'; break;
+    case 'x': max = 2; break;
+    case 'u': max = 4; break;
+    case 'U': max = 8; break;
+    default:
+        if (octal_digit(str[0])) {
+            ch = 0;
+            i = 0;
+            do {
+                ch = (ch << 3) | (str[i++] - '0');
+            } while (octal_digit(str[i]) && ++dno < 3);
         }
-        if (dno > 0)
-            ch = strtol(digs, NULL, 16);
+        break;
     }
-    else if (str[0] == 'U') {
-        while (hex_digit(str[i]) && dno < 8) {
-            digs[dno++] = str[i++];
+    if (max > 0) {
+        u_int32_t v = 0;
+
+        while (dno < max && hexValue[(unsigned char)str[i]] != 255) {
+            v = (v << 4) | hexValue[(unsigned char)str[i++]];
+            dno++;
         }
         if (dno > 0)
-            ch = strtol(digs, NULL, 16);
+            ch = v;
     }
     *dest = ch;
 
@@ -304,7 +827,8 @@ int u8_read_escape_sequence(char *str, u_int32_t *dest)
 
 /* convert a string with literal \uxxxx or \Uxxxxxxxx characters to UTF-8
    example: u8_unescape(mybuf, 256, "hello\\u220e")
-   note the double backslash is needed if called on a C string literal */
+   note the double backslash is needed if called on a C string literal.
+   the output is never longer than the input, so buf may be src */
 int u8_unescape(char *buf, int sz, char *src)
 {
     int c=0, amt;
@@ -312,15 +836,27 @@ int u8_unescape(char *buf, int sz, char *src)
     char temp[4];
 
     while (*src && c < sz) {
-        if (*src == '\\') {
-            src++;
-            amt = u8_read_escape_sequence(src, &ch);
-        }
-        else {
-            ch = (u_int32_t)*src;
+        if (*src != '\\') {
+            /* copy a run of plain text, keeping multi-byte characters
+               whole */
             amt = 1;
+            if ((unsigned char)*src >= 0xC0) {
+                while (amt < 4 && (src[amt] & 0xC0) == 0x80)
+                    amt++;
+            }
+            if (amt > sz-c)
+                break;
+            memmove(&buf[c], src, amt);
+            src += amt;
+            c += amt;
+            continue;
         }
-        src += amt;
+        src++;
+        if (*src == 0)
+            break;
+        if ((unsigned char)*src >= 0x80)
+            continue;           /* escaped UTF-8 character, copy it as is */
+        src += u8_read_escape_sequence(src, &ch);
         amt = u8_wc_toutf8(temp, ch);
         if (amt > sz-c)
             break;
@@ -332,96 +868,278 @@ int u8_unescape(char *buf, int sz, char *src)
     return c;
 }
 
+int u8_unescape_inplace(char *s)
+{
+    return u8_unescape(s, strlen(s) + 1, s);
+}
+
+/* writes the escape for ch to out, which must hold 10 bytes, and returns
+   its length */
+static int u8_escape_seq(char *out, u_int32_t ch)
+{
+    int cls = (ch < 0x80) ? escapeClass[ch] : 'u';
+    int i, n;
+
+    switch (cls) {
+    case 0:
+    case '"':
+        out[0] = (char)ch;
+        return 1;
+    case 'x':
+        out[0] = '\\';
+        out[1] = 'x';
+        if (ch < 0x10) {
+            out[2] = hexDigits[ch];
+            return 3;
+        }
+        out[2] = hexDigits[ch >> 4];
+        out[3] = hexDigits[ch & 0xF];
+        return 4;
+    case 'u':
+        out[0] = '\\';
+        out[1] = (ch > 0xFFFF) ? 'U' : 'u';
+        n = (ch > 0xFFFF) ? 8 : 4;
+        for (i = 0; i < n; i++)
+            out[2+i] = hexDigits[(ch >> (4*(n-1-i))) & 0xF];
+        return n + 2;
+    default:
+        out[0] = '\\';
+        out[1] = (char)cls;
+        return 2;
+    }
+}
+
+/* stores the amt bytes of s in buf the way snprintf would with a buffer
+   of room bytes: truncated and 0-terminated if they do not fit */
+static int u8_put(char *buf, int room, const char *s, int amt)
+{
+    int n;
+
+    if (room <= 0)
+        return amt;
+    n = (amt < room) ? amt : room - 1;
+    memcpy(buf, s, n);
+    buf[n] = '\0';
+    return amt;
+}
+
 int u8_escape_wchar(char *buf, int sz, u_int32_t ch)
 {
-    if (ch == L'\n')
-        return snprintf(buf, sz, "\\n");
-    else if (ch == L'\t')
-        return snprintf(buf, sz, "\\t");
-    else if (ch == L'\r')
-        return snprintf(buf, sz, "\\r");
-    else if (ch == L'\b')
-        return snprintf(buf, sz, "\\b");
-    else if (ch == L'\f')
-        return snprintf(buf, sz, "\\f");
-    else if (ch == L'\v')
-        return snprintf(buf, sz, "\\v");
-    else if (ch == L'\a')
-        return snprintf(buf, sz, "\\a");
-    else if (ch == L'\\')
-        return snprintf(buf, sz, "\\\\");
-    else if (ch < 32 || ch == 0x7f)
-        return snprintf(buf, sz, "\\x%hhX", (unsigned char)ch);
-    else if (ch > 0xFFFF)
-        return snprintf(buf, sz, "\\U%.8X", (u_int32_t)ch);
-    else if (ch >= 0x80 && ch <= 0xFFFF)
-        return snprintf(buf, sz, "\\u%.4hX", (unsigned short)ch);
-
-    return snprintf(buf, sz, "%c", (char)ch);
+    char temp[10];
+
+    return u8_put(buf, sz, temp, u8_escape_seq(temp, ch));
 }
 
 int u8_escape(char *buf, int sz, char *src, int escape_quotes)
 {
     int c=0, i=0, amt;
+    char temp[10];
+    unsigned char b;
 
     while (src[i] && c < sz) {
-        if (escape_quotes && src[i] == '"') {
-            amt = snprintf(buf, sz - c, "\\\"");
+        b = (unsigned char)src[i];
+        if (escapeClass[b] == 0 || (escapeClass[b] == '"' && !escape_quotes)) {
+            /* plain characters are copied, a 0 after the last one is
+               written below or by the next escape */
+            if (sz - c == 1) {
+                buf[c] = '\0';
+                c++;
+                break;
+            }
+            buf[c++] = (char)b;
+            i++;
+            continue;
+        }
+        if (escapeClass[b] == '"') {
+            temp[0] = '\\';
+            temp[1] = '"';
+            amt = 2;
             i++;
         }
         else {
-            amt = u8_escape_wchar(buf, sz - c, u8_nextchar(src, &i));
+            amt = u8_escape_seq(temp, u8_nextchar(src, &i));
         }
-        c += amt;
-        buf += amt;
+        c += u8_put(&buf[c], sz - c, temp, amt);
     }
     if (c < sz)
-        *buf = '\0';
+        buf[c] = '\0';
     return c;
 }
 
+/* searching
+
+   the character searched for is encoded to UTF-8 once and matched as
+   bytes, which for valid UTF-8 finds the same character a decoding
+   comparison would. its first byte is found a word at a time, and the
+   character index is only counted for the result.
+*/
+
+/* first occurrence of byte b in s[0..n), stopping at a NUL if nul_ends */
+static char *u8_scan_byte(char *s, size_t n, int nul_ends, unsigned char b)
+{
+    u8_word_t pattern = U8_WORD_ONES * b;
+    size_t i = 0;
+    u8_word_t w;
+
+    while (i < n && ((uintptr_t)(s + i) & (sizeof(u8_word_t) - 1))) {
+        if ((unsigned char)s[i] == b)
+            return s + i;
+        if (nul_ends && s[i] == 0)
+            return NULL;
+        i++;
+    }
+    while (n - i >= sizeof(u8_word_t)) {
+        memcpy(&w, s + i, sizeof(w));
+        if (U8_WORD_HASZERO(w ^ pattern) || (nul_ends && U8_WORD_HASZERO(w)))
+            break;
+        i += sizeof(u8_word_t);
+    }
+    for (; i < n; i++) {
+        if ((unsigned char)s[i] == b)
+            return s + i;
+        if (nul_ends && s[i] == 0)
+            return NULL;
+    }
+    return NULL;
+}
+
 char *u8_strchr(char *s, u_int32_t ch, int *charn)
 {
-    int i = 0, lasti=0;
-    u_int32_t c;
+    char enc[4];
+    int len = u8_wc_toutf8(enc, ch);
+    int k;
+    char *p = s;
 
-    *charn = 0;
-    while (s[i]) {
-        c = u8_nextchar(s, &i);
-        if (c == ch) {
-            return &s[lasti];
+    if (ch != 0 && len > 0) {
+        while ((p = u8_scan_byte(p, (size_t)-1, 1, enc[0])) != NULL) {
+            for (k = 1; k < len && p[k] == enc[k]; k++)
+                ;
+            if (k == len) {
+                *charn = u8_charnum(s, p - s);
+                return p;
+            }
+            p++;
         }
-        lasti = i;
-        (*charn)++;
     }
+    *charn = u8_strlen(s);
     return NULL;
 }
 
 char *u8_memchr(char *s, u_int32_t ch, size_t sz, int *charn)
 {
-    int i = 0, lasti=0;
-    u_int32_t c;
-    int csz;
-
-    *charn = 0;
-    while (i < sz) {
-        c = csz = 0;
-        do {
-            c <<= 6;
-            c += (unsigned char)s[i++];
-            csz++;
-        } while (i < sz && !isutf(s[i]));
-        c -= offsetsFromUTF8[csz-1];
+    char enc[4];
+    int len = u8_wc_toutf8(enc, ch);
+    char *p = s, *end = s + sz;
 
-        if (c == ch) {
-            return &s[lasti];
+    if (len > 0) {
+        while ((p = u8_scan_byte(p, end - p, 0, enc[0])) != NULL) {
+            if (end - p >= len && memcmp(p + 1, enc + 1, len - 1) == 0) {
+                *charn = u8_memcharnum(s, sz, p - s);
+                return p;
+            }
+            p++;
         }
-        lasti = i;
-        (*charn)++;
     }
+    *charn = u8_memlen(s, sz);
     return NULL;
 }
 
+/* comparing
+
+   UTF-8 sorts in code point order when compared as unsigned bytes, and a
+   valid sequence can only match at a character boundary, so slices are
+   compared without decoding, a word at a time.
+*/
+
+/* length of the common prefix of a and b, at most n bytes */
+static size_t u8_common(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+    u8_word_t wa, wb;
+
+    while (n - i >= sizeof(u8_word_t)) {
+        memcpy(&wa, a + i, sizeof(wa));
+        memcpy(&wb, b + i, sizeof(wb));
+        if (wa != wb)
+            break;
+        i += sizeof(u8_word_t);
+    }
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+int u8_cmp(char *a, size_t alen, char *b, size_t blen)
+{
+    size_t n = (alen < blen) ? alen : blen;
+    size_t k = u8_common(a, b, n);
+
+    if (k < n)
+        return (int)(unsigned char)a[k] - (int)(unsigned char)b[k];
+    return (alen > blen) - (alen < blen);
+}
+
+int u8_ncmp(char *a, size_t alen, char *b, size_t blen, int n)
+{
+    return u8_cmp(a, u8_memoffset(a, alen, n), b, u8_memoffset(b, blen, n));
+}
+
+int u8_has_prefix(char *s, size_t sz, char *prefix, size_t plen)
+{
+    return plen <= sz && u8_common(s, prefix, plen) == plen;
+}
+
+int u8_has_suffix(char *s, size_t sz, char *suffix, size_t slen)
+{
+    return slen <= sz && u8_common(s + sz - slen, suffix, slen) == slen;
+}
+
+/* end of the topic level starting at s[0] */
+static size_t u8_level_end(char *s, size_t sz)
+{
+    char *p = u8_scan_byte(s, sz, 0, '/');
+
+    return p ? (size_t)(p - s) : sz;
+}
+
+int u8_topic_match(char *filter, size_t flen, char *topic, size_t tlen)
+{
+    size_t f = 0, t = 0, fe, te;
+
+    /* wildcards do not match topics starting with '$' */
+    if (flen > 0 && (filter[0] == '+' || filter[0] == '#') &&
+        tlen > 0 && topic[0] == '$')
+        return 0;
+
+    for (;;) {
+        if (f < flen && filter[f] == '#')
+            return f + 1 == flen;
+        if (f < flen && filter[f] == '+') {
+            if (f + 1 < flen && filter[f+1] != '/')
+                return 0;
+            f++;
+            t += u8_level_end(topic + t, tlen - t);
+        }
+        else {
+            for (fe = f; fe < flen && filter[fe] != '/'; fe++) {
+                if (filter[fe] == '+' || filter[fe] == '#')
+                    return 0;
+            }
+            te = t + u8_level_end(topic + t, tlen - t);
+            if (fe - f != te - t || u8_common(filter + f, topic + t, fe - f) != fe - f)
+                return 0;
+            f = fe;
+            t = te;
+        }
+        if (f == flen)
+            return t == tlen;
+        if (t == tlen)
+            return flen - f == 2 && filter[f+1] == '#';  /* "a/#" matches "a" */
+        f++;
+        t++;
+    }
+}
+
 int u8_is_locale_utf8(char *locale)
 {
     /* this code based on libutf8 */
@@ -441,27 +1159,384 @@ int u8_is_locale_utf8(char *locale)
     return 0;
 }
 
-int u8_vprintf(char *fmt, va_list ap)
+/* formatted output to a sink
+
+   the format is parsed here and the output handed to the sink a piece at
+   a time: literal text straight from fmt, strings straight from their
+   arguments, and every other conversion formatted on its own into a
+   U8_PRINTF_CHUNK byte buffer. wide characters for %lc and %ls are
+   encoded as UTF-8 on the way, so nothing is converted to wide characters.
+   the width, and the precision of an integer, are not passed to snprintf:
+   the padding and the leading zeros are written from a fixed buffer, so
+   %0*d or %.1000d take no more stack than %d. only a floating point
+   conversion can still be longer than the chunk, such as %f of a large
+   value or %.40f; it is formatted into a U8_PRINTF_LONG byte buffer, and
+   one longer than that fails the call.
+*/
+#ifndef U8_PRINTF_CHUNK
+#define U8_PRINTF_CHUNK 32
+#endif
+#ifndef U8_PRINTF_LONG
+#define U8_PRINTF_LONG 320      /* %f of DBL_MAX */
+#endif
+
+typedef struct {
+    u8_sink_t sink;
+    void *ctx;
+    int nbytes;
+    int nchars;
+    int failed;
+} u8_out_t;
+
+static void u8_out(u8_out_t *o, const char *buf, int len)
+{
+    size_t pos;
+
+    if (len <= 0 || o->failed)
+        return;
+    if (o->sink(o->ctx, buf, len) != 0) {
+        o->failed = 1;
+        return;
+    }
+    o->nbytes += len;
+    o->nchars += u8_scan(buf, len, 0, (size_t)-1, &pos);
+}
+
+static void u8_out_pad(u8_out_t *o, char c, int n)
+{
+    static const char fill[2][9] = { "        ", "00000000" };
+
+    while (n > 0) {
+        u8_out(o, fill[c == '0'], n < 8 ? n : 8);
+        n -= 8;
+    }
+}
+
+static char *u8_put_int(char *p, int n)
+{
+    char digs[12];
+    int i = 0;
+
+    do {
+        digs[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    while (i > 0)
+        *p++ = digs[--i];
+    return p;
+}
+
+enum { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_J, LEN_Z, LEN_T, LEN_BIGL };
+
+/* a numeric argument, read once so it can be formatted twice */
+typedef union {
+    long long i;
+    unsigned long long u;
+    void *p;
+    double d;
+    long double ld;
+} u8_arg_t;
+
+enum { ARG_INT, ARG_UINT, ARG_PTR, ARG_DOUBLE, ARG_LDOUBLE };
+
+static int u8_format(char *buf, size_t sz, const char *spec, int type,
+                     const u8_arg_t *v)
+{
+    switch (type) {
+    case ARG_INT:     return snprintf(buf, sz, spec, v->i);
+    case ARG_UINT:    return snprintf(buf, sz, spec, v->u);
+    case ARG_PTR:     return snprintf(buf, sz, spec, v->p);
+    case ARG_DOUBLE:  return snprintf(buf, sz, spec, v->d);
+    default:          return snprintf(buf, sz, spec, v->ld);
+    }
+}
+
+/* a numeric conversion of n bytes, with the zeros for the precision of an
+   integer or for the 0 flag put between its sign or 0x and its digits, and
+   the padding up to width around it */
+static void u8_out_number(u8_out_t *o, const char *body, int n, char conv,
+                          int prec, int zero, int left, int width)
+{
+    int pre = 0, zeros = 0;
+
+    if (n > 0 && (body[0] == '-' || body[0] == '+' || body[0] == ' '))
+        pre = 1;
+    if (n > pre + 1 && body[pre] == '0' && (body[pre+1] == 'x' || body[pre+1] == 'X'))
+        pre += 2;
+    if (strchr("diuoxX", conv) && prec >= 0) {
+        if (prec > n - pre)
+            zeros = prec - (n - pre);
+    }
+    else if (zero && !left && conv != 'p' && n > pre && !strchr("iInN", body[pre])) {
+        /* not for inf or nan */
+        if (width > n)
+            zeros = width - n;
+    }
+    if (!left)
+        u8_out_pad(o, ' ', width - n - zeros);
+    u8_out(o, body, pre);
+    u8_out_pad(o, '0', zeros);
+    u8_out(o, body + pre, n - pre);
+    if (left)
+        u8_out_pad(o, ' ', width - n - zeros);
+}
+
+/* a conversion that did not fit the chunk: n bytes long */
+static void u8_out_long(u8_out_t *o, int n, const char *spec, int type,
+                        const u8_arg_t *v, char conv, int zero, int left,
+                        int width)
+{
+    char big[U8_PRINTF_LONG];
+
+    if (n >= (int)sizeof(big)) {
+        o->failed = 1;
+        return;
+    }
+    u8_format(big, sizeof(big), spec, type, v);
+    u8_out_number(o, big, n, conv, -1, zero, left, width);
+}
+
+int u8_vprintf_sink(u8_sink_t sink, void *ctx, char *fmt, va_list ap)
+{
+    u8_out_t o;
+    char buf[U8_PRINTF_CHUNK];
+    char spec[48];
+    char *p, *start, *sp;
+    int left, zero, width, prec, len, n, type;
+    char conv;
+    u8_arg_t v;
+    va_list args;
+
+    o.sink = sink;
+    o.ctx = ctx;
+    o.nbytes = o.nchars = o.failed = 0;
+    va_copy(args, ap);
+
+    while (*fmt && !o.failed) {
+        for (p = fmt; *p && *p != '%'; p++)
+            ;
+        u8_out(&o, fmt, p - fmt);
+        if (*p == 0)
+            break;
+        start = p++;
+        if (*p == '%') {
+            u8_out(&o, "%", 1);
+            fmt = p + 1;
+            continue;
+        }
+
+        /* flags, width, precision and length, with '*' resolved */
+        sp = spec;
+        *sp++ = '%';
+        left = zero = 0;
+        for (; *p && strchr("-+ #0", *p); p++) {
+            if (*p == '-')
+                left = 1;
+            else if (*p == '0')
+                zero = 1;
+            else if (!memchr(spec, *p, sp - spec))
+                *sp++ = *p;
+        }
+        width = 0;
+        if (*p == '*') {
+            width = va_arg(args, int);
+            if (width < 0) {
+                left = 1;
+                width = -width;
+            }
+            p++;
+        }
+        else {
+            while (*p >= '0' && *p <= '9')
+                width = width*10 + (*p++ - '0');
+        }
+        prec = -1;
+        if (*p == '.') {
+            p++;
+            prec = 0;
+            if (*p == '*') {
+                prec = va_arg(args, int);
+                if (prec < 0)
+                    prec = -1;
+                p++;
+            }
+            else {
+                while (*p >= '0' && *p <= '9')
+                    prec = prec*10 + (*p++ - '0');
+            }
+        }
+        len = LEN_NONE;
+        switch (*p) {
+        case 'h': len = (p[1] == 'h') ? LEN_HH : LEN_H; break;
+        case 'l': len = (p[1] == 'l') ? LEN_LL : LEN_L; break;
+        case 'j': len = LEN_J; break;
+        case 'z': len = LEN_Z; break;
+        case 't': len = LEN_T; break;
+        case 'L': len = LEN_BIGL; break;
+        }
+        if (len == LEN_HH || len == LEN_LL)
+            p += 2;
+        else if (len != LEN_NONE)
+            p++;
+        conv = *p;
+        if (conv == 0) {
+            u8_out(&o, start, p - start);
+            break;
+        }
+        fmt = p + 1;
+
+        if (conv == 's' && len == LEN_L) {
+            /* wide string, encoded a character at a time */
+            wchar_t *ws = va_arg(args, wchar_t*);
+            int chars = 0, bytes = 0;
+
+            if (ws == NULL)
+                ws = L"(null)";
+            for (n = 0; ws[n] && (prec < 0 || bytes + u8_wc_toutf8(buf, ws[n]) <= prec); n++) {
+                bytes += u8_wc_toutf8(buf, ws[n]);
+                chars++;
+            }
+            if (!left)
+                u8_out_pad(&o, ' ', width - bytes);
+            for (n = 0; n < chars; n++)
+                u8_out(&o, buf, u8_wc_toutf8(buf, ws[n]));
+            if (left)
+                u8_out_pad(&o, ' ', width - bytes);
+            continue;
+        }
+        if (conv == 's' || conv == 'c') {
+            const char *str = buf;
+
+            if (conv == 's') {
+                str = va_arg(args, char*);
+                if (str == NULL)
+                    str = "(null)";
+                if (prec < 0) {
+                    n = strlen(str);
+                }
+                else {
+                    const char *e = memchr(str, 0, prec);
+                    n = e ? e - str : prec;
+                }
+            }
+            else if (len == LEN_L) {
+                n = u8_wc_toutf8(buf, (u_int32_t)va_arg(args, wint_t));
+            }
+            else {
+                buf[0] = (char)va_arg(args, int);
+                n = 1;
+            }
+            if (!left)
+                u8_out_pad(&o, ' ', width - n);
+            u8_out(&o, str, n);
+            if (left)
+                u8_out_pad(&o, ' ', width - n);
+            continue;
+        }
+        if (conv == 'n') {
+            switch (len) {
+            case LEN_HH: *va_arg(args, signed char*) = o.nbytes; break;
+            case LEN_H:  *va_arg(args, short*) = o.nbytes; break;
+            case LEN_L:  *va_arg(args, long*) = o.nbytes; break;
+            case LEN_LL: *va_arg(args, long long*) = o.nbytes; break;
+            default:     *va_arg(args, int*) = o.nbytes; break;
+            }
+            continue;
+        }
+
+        /* everything else goes through snprintf one conversion at a time,
+           without the width, and without the precision of an integer
+           unless it is 0, which prints nothing for a 0 */
+        if (prec >= 0 && !(prec > 0 && strchr("diuoxX", conv))) {
+            *sp++ = '.';
+            sp = u8_put_int(sp, prec);
+        }
+        switch (conv) {
+        case 'd': case 'i':
+            switch (len) {
+            case LEN_HH: v.i = (signed char)va_arg(args, int); break;
+            case LEN_H:  v.i = (short)va_arg(args, int); break;
+            case LEN_L:  v.i = va_arg(args, long); break;
+            case LEN_LL: v.i = va_arg(args, long long); break;
+            case LEN_J:  v.i = va_arg(args, intmax_t); break;
+            case LEN_Z:  v.i = va_arg(args, size_t); break;
+            case LEN_T:  v.i = va_arg(args, ptrdiff_t); break;
+            default:     v.i = va_arg(args, int); break;
+            }
+            memcpy(sp, "lld", 4);
+            type = ARG_INT;
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            switch (len) {
+            case LEN_HH: v.u = (unsigned char)va_arg(args, unsigned int); break;
+            case LEN_H:  v.u = (unsigned short)va_arg(args, unsigned int); break;
+            case LEN_L:  v.u = va_arg(args, unsigned long); break;
+            case LEN_LL: v.u = va_arg(args, unsigned long long); break;
+            case LEN_J:  v.u = va_arg(args, uintmax_t); break;
+            case LEN_Z:  v.u = va_arg(args, size_t); break;
+            case LEN_T:  v.u = va_arg(args, ptrdiff_t); break;
+            default:     v.u = va_arg(args, unsigned int); break;
+            }
+            sp[0] = 'l'; sp[1] = 'l'; sp[2] = conv; sp[3] = 0;
+            type = ARG_UINT;
+            break;
+        case 'p':
+            sp[0] = 'p'; sp[1] = 0;
+            v.p = va_arg(args, void*);
+            type = ARG_PTR;
+            break;
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A':
+            if (len == LEN_BIGL) {
+                sp[0] = 'L'; sp[1] = conv; sp[2] = 0;
+                v.ld = va_arg(args, long double);
+                type = ARG_LDOUBLE;
+            }
+            else {
+                sp[0] = conv; sp[1] = 0;
+                v.d = va_arg(args, double);
+                type = ARG_DOUBLE;
+            }
+            break;
+        default:
+            /* unknown conversion, print it as it was written */
+            u8_out(&o, start, fmt - start);
+            continue;
+        }
+        n = u8_format(buf, sizeof(buf), spec, type, &v);
+        if (n < (int)sizeof(buf))
+            u8_out_number(&o, buf, n, conv, strchr("diuoxX", conv) ? prec : -1, zero, left, width);
+        else
+            u8_out_long(&o, n, spec, type, &v, conv, zero, left, width);
+    }
+    va_end(args);
+    return o.failed ? -1 : o.nchars;
+}
+
+int u8_printf_sink(u8_sink_t sink, void *ctx, char *fmt, ...)
 {
-    int cnt, sz=0;
-    char *buf;
-    u_int32_t *wcs;
-
-    sz = 512;
-    buf = (char*)alloca(sz);
- try_print:
-    cnt = vsnprintf(buf, sz, fmt, ap);
-    if (cnt >= sz) {
-        buf = (char*)alloca(cnt - sz + 1);
-        sz = cnt + 1;
-        goto try_print;
-    }
-    wcs = (u_int32_t*)alloca((cnt+1) * sizeof(u_int32_t));
-    cnt = u8_toucs(wcs, cnt+1, buf, cnt);
-    printf("%ls", (wchar_t*)wcs);
+    int cnt;
+    va_list args;
+
+    va_start(args, fmt);
+
+    cnt = u8_vprintf_sink(sink, ctx, fmt, args);
+
+    va_end(args);
     return cnt;
 }
 
+static int u8_stdout_sink(void *ctx, const char *buf, int len)
+{
+    (void)ctx;
+    return fwrite(buf, 1, len, stdout) == (size_t)len ? 0 : -1;
+}
+
+int u8_vprintf(char *fmt, va_list ap)
+{
+    return u8_vprintf_sink(u8_stdout_sink, NULL, fmt, ap);
+}
+
 int u8_printf(char *fmt, ...)
 {
     int cnt;
@@ -6,9 +6,49 @@
 /* convert UTF-8 data to wide character */
 int u8_toucs(u_int32_t *dest, int sz, char *src, int srcsz);
 
+/* nonzero if src is well-formed UTF-8: no overlong forms, surrogates,
+   code points above 0x10FFFF or truncated sequences.
+   srcsz = source size in bytes, or -1 if 0-terminated */
+int u8_validate(char *src, int srcsz);
+
+/* same as u8_toucs, but validates the input as it is converted.
+   returns -1 at the first ill-formed sequence, with dest 0-terminated after
+   the characters decoded before it */
+int u8_toucs_checked(u_int32_t *dest, int sz, char *src, int srcsz);
+
+/* incremental decoder, for UTF-8 that arrives in several pieces */
+typedef struct {
+    u_int32_t state;
+    u_int32_t ch;
+} u8_decoder_t;
+
+void u8_decoder_init(u8_decoder_t *d);
+
+/* decode srcsz bytes of src into at most sz characters of dest,
+   continuing any sequence left unfinished by the previous call. dest may
+   be NULL to only validate. returns the number of bytes consumed, which
+   is less than srcsz only when dest is full, or -1 at the first
+   ill-formed sequence, after which the decoder stays failed until it is
+   reinitialized. the number of characters decoded is stored in *nchars
+   if nchars is not NULL. */
+int u8_decoder_feed(u8_decoder_t *d, u_int32_t *dest, int sz, int *nchars,
+                    char *src, int srcsz);
+
+/* nonzero if the input fed so far is valid and ends on a character
+   boundary */
+int u8_decoder_done(u8_decoder_t *d);
+
 /* the opposite conversion */
 int u8_toutf8(char *dest, int sz, u_int32_t *src, int srcsz);
 
+/* number of bytes u8_toutf8 produces for src, not counting the
+   terminator. srcsz = number of source characters, or -1 if 0-terminated */
+int u8_measure(u_int32_t *src, int srcsz);
+
+/* number of characters u8_toucs produces for src, not counting the
+   terminator. srcsz = source size in bytes, or -1 if 0-terminated */
+int u8_ucs_measure(char *src, int srcsz);
+
 /* single character to UTF-8 */
 int u8_wc_toutf8(char *dest, u_int32_t ch);
 
@@ -39,9 +79,14 @@ int u8_read_escape_sequence(char *src, u_int32_t *dest);
    buf, where buf is "sz" bytes. returns the number of characters output. */
 int u8_escape_wchar(char *buf, int sz, u_int32_t ch);
 
-/* convert a string "src" containing escape sequences to UTF-8 */
+/* convert a string "src" containing escape sequences to UTF-8.
+   buf may be the same as src */
 int u8_unescape(char *buf, int sz, char *src);
 
+/* same as the above, converting the 0-terminated string s in place.
+   returns the new length */
+int u8_unescape_inplace(char *s);
+
 /* convert UTF-8 "src" to ASCII with escape sequences.
    if escape_quotes is nonzero, quote characters will be preceded by
    backslashes as well. */
@@ -62,10 +107,40 @@ char *u8_memchr(char *s, u_int32_t ch, size_t sz, int *charn);
 /* count the number of characters in a UTF-8 string */
 int u8_strlen(char *s);
 
+/* same as u8_offset, u8_charnum and u8_strlen, but work on a buffer of a
+   given size instead of a NUL-terminated string. */
+int u8_memoffset(char *s, size_t sz, int charnum);
+int u8_memcharnum(char *s, size_t sz, int offset);
+int u8_memlen(char *s, size_t sz);
+
+/* compare two UTF-8 slices in code point order, returning <0, 0 or >0
+   like memcmp. u8_ncmp compares at most the first n characters. */
+int u8_cmp(char *a, size_t alen, char *b, size_t blen);
+int u8_ncmp(char *a, size_t alen, char *b, size_t blen, int n);
+
+/* nonzero if s[0..sz) starts or ends with the given slice */
+int u8_has_prefix(char *s, size_t sz, char *prefix, size_t plen);
+int u8_has_suffix(char *s, size_t sz, char *suffix, size_t slen);
+
+/* nonzero if an MQTT topic name matches a subscription filter, where
+   "+" matches one topic level and a trailing "#" matches any number of
+   levels, including none. a filter with a misplaced wildcard matches
+   nothing. */
+int u8_topic_match(char *filter, size_t flen, char *topic, size_t tlen);
+
 int u8_is_locale_utf8(char *locale);
 
+/* receives formatted output a piece at a time. a nonzero return stops
+   the formatting */
+typedef int (*u8_sink_t)(void *ctx, const char *buf, int len);
+
+/* printf that writes UTF-8 to a sink instead of building the output in
+   memory. %lc and %ls take wide characters and write them as UTF-8.
+   returns the number of characters written, or -1 if the sink failed. */
+int u8_vprintf_sink(u8_sink_t sink, void *ctx, char *fmt, va_list ap);
+int u8_printf_sink(u8_sink_t sink, void *ctx, char *fmt, ...);
+
 /* printf where the format string and arguments may be in UTF-8.
-   you can avoid this function and just use ordinary printf() if the current
-   locale is UTF-8. */
+   output goes to stdout as UTF-8. */
 int u8_vprintf(char *fmt, va_list ap);
 int u8_printf(char *fmt, ...);